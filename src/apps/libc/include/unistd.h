@@ -27,6 +27,7 @@ typedef long ssize_t;
 #define SYSCALL_READV       19
 #define SYSCALL_WRITEV      20
 #define SYSCALL_ACCESS      21
+#define SYSCALL_MSYNC       26
 #define SYSCALL_DUP         32
 #define SYSCALL_DUP2        33
 #define SYSCALL_FCNTL       72
@@ -43,6 +44,8 @@ typedef long ssize_t;
 /* Process scheduling */
 #define SYSCALL_YIELD       24
 #define SYSCALL_NANOSLEEP   35
+#define SYSCALL_CLOCK_GETTIME   228
+#define SYSCALL_CLOCK_NANOSLEEP 230
 
 /* Process lifecycle */
 #define SYSCALL_CLONE       56
@@ -122,6 +125,11 @@ struct stat {
     int64_t  __unused[3];
 } __attribute__((packed));
 
+struct timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
 struct iovec {
     void  *iov_base;
     size_t iov_len;
@@ -214,6 +222,13 @@ struct sockaddr {
 #define WNOHANG   1
 #define WUNTRACED 2
 
+/* Clocks; both count from boot until there is an RTC */
+#define CLOCK_REALTIME   0
+#define CLOCK_MONOTONIC  1
+
+/* clock_nanosleep() flags */
+#define TIMER_ABSTIME  1
+
 /* kill() signals */
 #define SIGKILL  9
 #define SIGTERM 15
@@ -279,11 +294,28 @@ uint64_t create(const char *path, bool is_dir);
  * Memory
  * ========================================================================= */
 
+#define PROT_NONE      0x0
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define PROT_EXEC      0x4
+
+#define MAP_SHARED     0x01
+#define MAP_PRIVATE    0x02
+#define MAP_FIXED      0x10
+#define MAP_ANONYMOUS  0x20
+#define MAP_ANON       MAP_ANONYMOUS
+#define MAP_FAILED     ((void *)-1)
+
+#define MS_ASYNC       0x1
+#define MS_INVALIDATE  0x2
+#define MS_SYNC        0x4
+
 uint64_t brk(uint64_t addr);
 void    *mmap(void *addr, size_t length, int prot, int flags,
               int fd, uint64_t offset);
 int      munmap(void *addr, size_t length);
 int      mprotect(void *addr, size_t length, int prot);
+int      msync(void *addr, size_t length, int flags);
 
 /* =========================================================================
  * Process lifecycle
@@ -300,6 +332,12 @@ int      wait4(int pid, int *wstatus, int options);
 int      waitpid(uint64_t pid);
 int      kill(int pid, int sig);
 void     yield(void);
+int      nanosleep(const struct timespec *req, struct timespec *rem);
+int      clock_nanosleep(int clockid, int flags,
+                         const struct timespec *req, struct timespec *rem);
+int      clock_gettime(int clockid, struct timespec *tp);
+unsigned sleep(unsigned seconds);
+int      usleep(uint64_t usec);
 uint64_t binrun(const char *path);
 
 /* =========================================================================
@@ -167,10 +167,14 @@ uint64_t brk(uint64_t addr)
 
 void *mmap(void *addr, size_t length, int prot, int flags, int fd, uint64_t offset)
 {
-    return (void *)syscall6(SYSCALL_MMAP,
+    uint64_t ret = syscall6(SYSCALL_MMAP,
                             (uint64_t)addr, (uint64_t)length,
                             (uint64_t)prot, (uint64_t)flags,
                             (uint64_t)fd,   offset);
+    /* The kernel returns -errno on failure */
+    if (ret > (uint64_t)-4096)
+        return MAP_FAILED;
+    return (void *)ret;
 }
 
 int munmap(void *addr, size_t length)
@@ -183,6 +187,11 @@ int mprotect(void *addr, size_t length, int prot)
     return (int)syscall6(SYSCALL_MPROTECT, (uint64_t)addr, (uint64_t)length, (uint64_t)prot, 0, 0, 0);
 }
 
+int msync(void *addr, size_t length, int flags)
+{
+    return (int)syscall6(SYSCALL_MSYNC, (uint64_t)addr, (uint64_t)length, (uint64_t)flags, 0, 0, 0);
+}
+
 /* =========================================================================
  * Process lifecycle
  * ========================================================================= */
@@ -246,6 +255,37 @@ void yield(void)
     syscall6(SYSCALL_YIELD, 0, 0, 0, 0, 0, 0);
 }
 
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    return (int)syscall6(SYSCALL_NANOSLEEP, (uint64_t)req, (uint64_t)rem, 0, 0, 0, 0);
+}
+
+int clock_nanosleep(int clockid, int flags,
+                    const struct timespec *req, struct timespec *rem)
+{
+    return (int)syscall6(SYSCALL_CLOCK_NANOSLEEP,
+                         (uint64_t)clockid, (uint64_t)flags,
+                         (uint64_t)req, (uint64_t)rem, 0, 0);
+}
+
+int clock_gettime(int clockid, struct timespec *tp)
+{
+    return (int)syscall6(SYSCALL_CLOCK_GETTIME, (uint64_t)clockid, (uint64_t)tp, 0, 0, 0, 0);
+}
+
+unsigned sleep(unsigned seconds)
+{
+    struct timespec ts = { seconds, 0 };
+    nanosleep(&ts, NULL);
+    return 0;
+}
+
+int usleep(uint64_t usec)
+{
+    struct timespec ts = { (int64_t)(usec / 1000000), (int64_t)(usec % 1000000) * 1000 };
+    return nanosleep(&ts, NULL);
+}
+
 uint64_t binrun(const char *path)
 {
     return syscall6(SYSCALL_BINRUN, (uint64_t)path, (uint64_t)10, 0, 0, 0, 0);
@@ -23,7 +23,25 @@
 %define REG_RSP       160
 %define REG_SS        168
 
+extern kernel_unlock
+
 global resume_kernel_context
+global resume_context_on
+
+; void resume_context_on(Registers *ctx, uint64_t stack, int unlock)
+; Leave the current stack for `stack`, drop the kernel lock if asked to,
+; then resume ctx. For callers whose stack may be reused once the lock
+; is released
+resume_context_on:
+    mov rsp, rsi
+    test edx, edx
+    jz resume_kernel_context
+    push rdi
+    sub rsp, 8
+    call kernel_unlock
+    add rsp, 8
+    pop rdi
+    ; fall through
 
 resume_kernel_context:
     ; rdi = Registers*
@@ -40,6 +58,12 @@ resume_kernel_context:
     mov rax, [rdi + REG_RIP]
     push rax
 
+    ; Resuming user mode: give GS back to it
+    test qword [rdi + REG_CS], 3
+    jz .kernel
+    swapgs
+.kernel:
+
     ; Restore GPRs (restore rdi last since it holds our struct pointer)
     mov r15, [rdi + REG_R15]
     mov r14, [rdi + REG_R14]
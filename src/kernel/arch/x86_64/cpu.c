@@ -0,0 +1,32 @@
+#include "cpu.h"
+#include <memory.h>
+
+#define MSR_GS_BASE         0xC0000101
+#define MSR_KERNEL_GS_BASE  0xC0000102
+
+cpu_t    cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+
+static uint8_t bsp_stack[CPU_STACK_SIZE] __attribute__((aligned(16)));
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)val),
+                                "d"((uint32_t)(val >> 32)));
+}
+
+void cpu_load(cpu_t* cpu) {
+    cpu->self = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void cpu_init_bsp(void) {
+    cpu_t* cpu = &cpus[0];
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->id        = 0;
+    cpu->proc      = -1;
+    cpu->idle_proc = -1;
+    cpu->stack_top = (uint64_t)(bsp_stack + CPU_STACK_SIZE);
+    cpu->online    = true;
+    cpu_load(cpu);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "isr.h"
+
+#define MAX_CPUS        32
+#define CPU_STACK_SIZE  16384
+
+// IST slot of the scheduler vector; see x86_64_GDT_Initialize()
+#define CPU_SCHED_IST   1
+
+struct address_space;
+
+// Per-CPU area, reached through the GS base while in the kernel. User
+// code runs with its own GS base, swapped in and out with swapgs on
+// every kernel entry and exit
+typedef struct cpu {
+    // syscalls.asm depends on the offsets of these three
+    struct cpu* self;               // gs:0
+    uint64_t    kernel_stack;       // gs:8, stack for syscall entry
+    uint64_t    user_rsp;           // gs:16, syscall entry scratch
+
+    uint32_t    id;                 // Index into cpus[], 0 is the BSP
+    uint32_t    lapic_id;
+    uint64_t    stack_top;          // Private stack; see CPU_SCHED_IST
+    volatile bool online;           // Takes interrupts and IPIs
+
+    // Scheduler state
+    int         proc;               // Running process slot, -1 for none
+    int         idle_proc;
+    bool        switch_locked;      // Whether the context being resumed holds the kernel lock
+    volatile bool need_resched;     // Switch at the next tick or SMP_RESCHED_VECTOR
+    Registers*  syscall_frame;
+    uint64_t    timer_deadline;     // When the LAPIC timer fires, 0 if disarmed
+    uint32_t    lock_depth;         // Spinlocks held; see spin_lock_irqsave()
+
+    struct address_space* space;    // Loaded in CR3
+
+    // Pending TLB shootdown; see smp_tlb_shootdown()
+    volatile uint64_t tlb_flush;
+} cpu_t;
+
+extern cpu_t    cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+
+static inline cpu_t* cpu_self(void) {
+    cpu_t* cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t cpu_id(void) {
+    return cpu_self()->id;
+}
+
+// Point GS at a CPU's area. The kernel GS base (the user one while in
+// the kernel) starts out zero
+void cpu_load(cpu_t* cpu);
+
+// Set up the BSP's area; must run before anything uses cpu_self()
+void cpu_init_bsp(void);
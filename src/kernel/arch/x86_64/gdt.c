@@ -2,6 +2,9 @@
 #include <stdint.h>
 #include <string.h>
 #include "syscalls.h"
+#include "cpu.h"
+
+#define MSR_GS_BASE 0xC0000101
 
 typedef struct
 {
@@ -88,14 +91,15 @@ typedef enum
     GDT_BASE_HIGH(base)                                             \
 }
 
-// TSS instance
-static TSS g_TSS = {0};
-
-// GDT with space for TSS descriptor (16 bytes = 2 entries)
-static struct {
+typedef struct
+{
     GDTEntry entries[5];        // NULL, Kernel Code, Kernel Data, User Code, User Data
     TSSDescriptor tss;          // TSS (16 bytes)
-} __attribute__((packed)) g_GDT = {
+} __attribute__((packed)) GDT;
+
+// Each CPU gets a copy of this GDT with its own TSS descriptor, since
+// loading a TSS marks its descriptor busy
+static const GDT g_GDTTemplate = {
     .entries = {
         // NULL descriptor
         GDT_ENTRY(0, 0, 0, 0),
@@ -123,34 +127,60 @@ static struct {
                     GDT_FLAG_64BIT | GDT_FLAG_GRANULARITY_4K),
 
     },
-    .tss = {0}  // Will be initialized in x86_64_GDT_Initialize
+    .tss = {0}  // Filled in per CPU by x86_64_GDT_Initialize
 };
 
-GDTDescriptor g_GDTDescriptor = { sizeof(g_GDT) - 1, &g_GDT };
+static GDT g_GDT[MAX_CPUS];
+static TSS g_TSS[MAX_CPUS];
+static GDTDescriptor g_GDTDescriptor[MAX_CPUS];
 
 void x86_64_GDT_Load(GDTDescriptor* descriptor, uint16_t codeSegment, uint16_t dataSegment);
 
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val)
+{
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
 void x86_64_GDT_Initialize()
 {
-    // Initialize TSS
-    memset(&g_TSS, 0, sizeof(TSS));
-    g_TSS.IOPBOffset = sizeof(TSS);  // No I/O permission bitmap
+    cpu_t* cpu = cpu_self();
+    GDT* gdt = &g_GDT[cpu->id];
+    TSS* tss = &g_TSS[cpu->id];
+
+    // Initialize TSS. The scheduler vector runs on the CPU's own stack,
+    // never on the stack of the process it switches away from
+    memset(tss, 0, sizeof(TSS));
+    tss->IOPBOffset = sizeof(TSS);  // No I/O permission bitmap
+    tss->IST[CPU_SCHED_IST - 1] = cpu->stack_top;
     
     // Set up TSS descriptor
-    uint64_t tss_base = (uint64_t)&g_TSS;
+    uint64_t tss_base = (uint64_t)tss;
     uint64_t tss_limit = sizeof(TSS) - 1;
     
-    g_GDT.tss.LimitLow = tss_limit & 0xFFFF;
-    g_GDT.tss.BaseLow = tss_base & 0xFFFF;
-    g_GDT.tss.BaseMiddle = (tss_base >> 16) & 0xFF;
-    g_GDT.tss.Access = GDT_ACCESS_PRESENT | GDT_ACCESS_RING0 | GDT_ACCESS_DESCRIPTOR_TSS;
-    g_GDT.tss.FlagsLimitHi = ((tss_limit >> 16) & 0x0F);  // No granularity flag for TSS
-    g_GDT.tss.BaseHigh = (tss_base >> 24) & 0xFF;
-    g_GDT.tss.BaseUpper = (tss_base >> 32) & 0xFFFFFFFF;
-    g_GDT.tss.Reserved = 0;
+    *gdt = g_GDTTemplate;
+    gdt->tss.LimitLow = tss_limit & 0xFFFF;
+    gdt->tss.BaseLow = tss_base & 0xFFFF;
+    gdt->tss.BaseMiddle = (tss_base >> 16) & 0xFF;
+    gdt->tss.Access = GDT_ACCESS_PRESENT | GDT_ACCESS_RING0 | GDT_ACCESS_DESCRIPTOR_TSS;
+    gdt->tss.FlagsLimitHi = ((tss_limit >> 16) & 0x0F);  // No granularity flag for TSS
+    gdt->tss.BaseHigh = (tss_base >> 24) & 0xFF;
+    gdt->tss.BaseUpper = (tss_base >> 32) & 0xFFFFFFFF;
+    gdt->tss.Reserved = 0;
+    
+    g_GDTDescriptor[cpu->id].Limit = sizeof(GDT) - 1;
+    g_GDTDescriptor[cpu->id].Ptr = gdt;
     
-    // Load GDT
-    x86_64_GDT_Load(&g_GDTDescriptor, x86_64_GDT_CODE_SEGMENT, x86_64_GDT_DATA_SEGMENT);
+    // Load GDT. Reloading GS clears its base, which holds the CPU area
+    uint64_t gs_base = rdmsr(MSR_GS_BASE);
+    x86_64_GDT_Load(&g_GDTDescriptor[cpu->id], x86_64_GDT_CODE_SEGMENT, x86_64_GDT_DATA_SEGMENT);
+    wrmsr(MSR_GS_BASE, gs_base);
     
     // Load TSS
     __asm__ volatile("ltr %0" : : "r"((uint16_t)x86_64_GDT_TSS_SEGMENT));
@@ -159,6 +189,6 @@ void x86_64_GDT_Initialize()
 // Set kernel stack for privilege level 0 (used when entering kernel from user mode)
 void x86_64_TSS_SetKernelStack(uint64_t stack)
 {
-    g_TSS.RSP0 = stack;
+    g_TSS[cpu_id()].RSP0 = stack;
     x86_64_Syscall_SetKernelStack(stack);
-}
\ No newline at end of file
+}
@@ -51,6 +51,11 @@ void x86_64_IDT_SetGateWithIST(int interrupt, void* base, uint16_t segmentDescri
     g_IDT[interrupt].Reserved = 0;
 }
 
+void x86_64_IDT_SetIST(int interrupt, uint8_t ist)
+{
+    g_IDT[interrupt].IST = ist & 0x07;
+}
+
 void x86_64_IDT_EnableGate(int interrupt)
 {
     FLAG_SET(g_IDT[interrupt].Flags, IDT_FLAG_PRESENT);
@@ -19,4 +19,7 @@ void x86_64_IDT_Initialize();
 void x86_64_IDT_DisableGate(int interrupt);
 void x86_64_IDT_EnableGate(int interrupt);
 void x86_64_IDT_SetGate(int interrupt, void* base, uint16_t segmentDescriptor, uint8_t flags);
-void x86_64_IDT_SetGateWithIST(int interrupt, void* base, uint16_t segmentDescriptor, uint8_t flags, uint8_t ist);
\ No newline at end of file
+void x86_64_IDT_SetGateWithIST(int interrupt, void* base, uint16_t segmentDescriptor, uint8_t flags, uint8_t ist);
+
+// Run an existing gate on the given Interrupt Stack Table entry (0 = none)
+void x86_64_IDT_SetIST(int interrupt, uint8_t ist);
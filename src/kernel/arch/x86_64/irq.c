@@ -93,7 +93,7 @@ void x86_64_IRQ_EOI(void) {
 }
 
 #define VECTOR_ALLOC_BASE   0x30
-#define VECTOR_ALLOC_MAX    0xEF   // leave 0xEF-0xFF for LAPIC timer/spurious/error
+#define VECTOR_ALLOC_MAX    0xEE   // leave 0xEE-0xFF for resched/LAPIC timer/IPIs/spurious
 
 static uint8_t g_next_vector = VECTOR_ALLOC_BASE;
 
@@ -24,6 +24,13 @@ x86_64_ISR%1:
 isr_common:
     cld
 
+    ; Coming from user mode: switch to the CPU area. [rsp + 24] is the
+    ; CS pushed by the CPU
+    test qword [rsp + 24], 3
+    jz .from_kernel
+    swapgs
+.from_kernel:
+
     push r15
     push r14
     push r13
@@ -62,4 +69,10 @@ isr_common:
     pop r15
 
     add rsp, 16        ; error code + interrupt number
+
+    ; The frame may now belong to another process; check its CS
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
@@ -1,6 +1,8 @@
 #include "isr.h"
 #include "idt.h"
 #include "gdt.h"
+#include "cpu.h"
+#include "smp.h"
 #include "io.h"
 #include <panic/panic.h>
 #include <stdio.h>
@@ -57,7 +59,7 @@ void x86_64_ISR_Initialize()
     x86_64_IDT_DisableGate(0x80);
 }
 
-void x86_64_ISR_Handler(Registers* regs)
+static void isr_dispatch(Registers* regs)
 {
     if (g_ISRHandlers[regs->interrupt] != NULL)
         g_ISRHandlers[regs->interrupt](regs);
@@ -85,6 +87,32 @@ void x86_64_ISR_Handler(Registers* regs)
     }
 }
 
+void x86_64_ISR_Handler(Registers* regs)
+{
+    if (regs->interrupt >= SMP_IPI_VECTOR_BASE)
+    {
+        isr_dispatch(regs);
+        return;
+    }
+
+    // The scheduler may switch to a context with a different lock state;
+    // it reports that through switch_locked
+    cpu_t* cpu = cpu_self();
+    bool held = kernel_lock_held();
+    if (!held)
+        kernel_lock();
+
+    bool outer = cpu->switch_locked;
+    cpu->switch_locked = held;
+
+    isr_dispatch(regs);
+
+    bool keep = cpu->switch_locked;
+    cpu->switch_locked = outer;
+    if (!keep)
+        kernel_unlock();
+}
+
 void x86_64_ISR_RegisterHandler(int interrupt, ISRHandler handler)
 {
     g_ISRHandlers[interrupt] = handler;
@@ -18,28 +18,32 @@ static inline uint64_t read_cr2(void) {
     return cr2;
 }
 
-static bool try_demand_page(uint64_t faulting_address, uint64_t err)
+// Write to a page shared with a forked process
+static bool try_cow_fault(uint64_t faulting_address, uint64_t err)
 {
     int present = err & 0x1;
-    int user    = err & 0x4;
+    int write   = err & 0x2;
 
-    if (present || !user)
+    // Kernel writes into user buffers land here too
+    if (!present || !write || faulting_address >= USER_SPACE_END)
         return false;
 
-    if (!proc_is_valid_demand_addr(faulting_address))
-        return false;
+    return vmm_resolve_cow(vmm_get_current_space(), (void*)faulting_address);
+}
 
-    uint64_t page_vaddr = faulting_address & ~((uint64_t)PAGE_SIZE - 1);
+static bool try_demand_page(uint64_t faulting_address, uint64_t err)
+{
+    int present = err & 0x1;
+    int write   = err & 0x2;
 
-    address_space_t* kspace = vmm_get_kernel_space();
-    void* mapped = vmm_alloc_page(kspace, (void*)page_vaddr, VMM_USER_PAGE);
-    if (!mapped) {
-        log_err(MODULE, "OOM: cannot satisfy demand page at 0x%lx", faulting_address);
+    // Kernel accesses to lazily mapped user buffers are resolved as well
+    if (present || faulting_address >= USER_SPACE_END)
         return false;
-    }
 
-    memset((void*)page_vaddr, 0, PAGE_SIZE);
+    if (!proc_demand_fault(faulting_address, write))
+        return false;
 
+    uint64_t page_vaddr = faulting_address & ~((uint64_t)PAGE_SIZE - 1);
     log_debug(MODULE, "Demand page mapped: virt=0x%lx", page_vaddr);
     return true;
 }
@@ -49,6 +53,9 @@ void x86_64_PageFault_Handler(Registers* regs)
     uint64_t faulting_address = read_cr2();
     uint64_t err = regs->error;
 
+    if (try_cow_fault(faulting_address, err))
+        return;
+
     if (try_demand_page(faulting_address, err))
         return;
 
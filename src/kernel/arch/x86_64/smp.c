@@ -0,0 +1,221 @@
+#include "smp.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "irq.h"
+#include "syscalls.h"
+#include <limine/limine.h>
+#include <drivers/apic/lapic.h>
+#include <hal/hal.h>
+#include <mem/vmm.h>
+#include <proc/proc.h>
+#include <heap.h>
+#include <memory.h>
+#include <debug.h>
+
+#define SMP_MODULE "SMP"
+
+// How long the BSP waits for an AP to report in
+#define AP_START_TIMEOUT 100000000ULL
+
+// A pending shootdown other than a full flush is the page-aligned start
+// address with the page count in the low bits
+#define TLB_FLUSH_COUNT_MASK 0xFFFULL
+
+extern struct limine_mp_response* mp_info;
+
+static volatile uint64_t online_mask = 1;
+
+// CPU id + 1 of the holder, 0 when free
+static volatile uint32_t kernel_lock_owner = 0;
+
+void kernel_lock(void) {
+    uint32_t self = cpu_id() + 1;
+    uint32_t expected = 0;
+    while (!__atomic_compare_exchange_n(&kernel_lock_owner, &expected, self, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        expected = 0;
+        // Interrupts are off while we wait, and the holder may be waiting
+        // for us to drop a TLB entry
+        smp_handle_tlb();
+        __asm__ volatile("pause");
+    }
+}
+
+bool kernel_trylock(void) {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&kernel_lock_owner, &expected, cpu_id() + 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void kernel_unlock(void) {
+    __atomic_store_n(&kernel_lock_owner, 0, __ATOMIC_RELEASE);
+}
+
+bool kernel_lock_held(void) {
+    return kernel_lock_owner == cpu_id() + 1;
+}
+
+uint64_t smp_online_mask(void) {
+    return online_mask;
+}
+
+void smp_send_resched(uint32_t cpu) {
+    if (cpu < cpu_count && cpus[cpu].online)
+        lapic_send_ipi(cpus[cpu].lapic_id, SMP_RESCHED_VECTOR);
+}
+
+void smp_handle_tlb(void) {
+    cpu_t* cpu = cpu_self();
+    uint64_t req = cpu->tlb_flush;
+
+    while (req) {
+        if (req == SMP_TLB_FLUSH_ALL) {
+            vmm_flush_tlb_all();
+        } else {
+            uint64_t addr = req & ~TLB_FLUSH_COUNT_MASK;
+            for (uint64_t n = req & TLB_FLUSH_COUNT_MASK; n; n--, addr += PAGE_SIZE)
+                vmm_invlpg((void*)addr);
+        }
+
+        // Another request may have been merged in meanwhile
+        if (__atomic_compare_exchange_n(&cpu->tlb_flush, &req, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+}
+
+void smp_tlb_shootdown(uint64_t mask, uint64_t addr) {
+    smp_tlb_shootdown_range(mask, addr, 1);
+}
+
+void smp_tlb_shootdown_range(uint64_t mask, uint64_t addr, size_t pages) {
+    uint32_t self = cpu_id();
+    mask &= online_mask & ~(1ULL << self);
+    if (!mask || !pages)
+        return;
+
+    uint64_t req = (addr == SMP_TLB_FLUSH_ALL || pages > SMP_TLB_RANGE_MAX)
+        ? SMP_TLB_FLUSH_ALL
+        : (addr & PAGE_MASK) | pages;
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!(mask & (1ULL << i)))
+            continue;
+
+        // Two different pages pending on one CPU become a full flush
+        uint64_t old = cpus[i].tlb_flush;
+        uint64_t merged;
+        do {
+            merged = (!old || old == req) ? req : SMP_TLB_FLUSH_ALL;
+        } while (!__atomic_compare_exchange_n(&cpus[i].tlb_flush, &old, merged, 0,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        lapic_send_ipi(cpus[i].lapic_id, SMP_TLB_VECTOR);
+    }
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!(mask & (1ULL << i)))
+            continue;
+        while (cpus[i].tlb_flush) {
+            smp_handle_tlb();
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static void resched_handler(Registers* regs) {
+    proc_resched_interrupt(regs);
+}
+
+static void tlb_handler(Registers* regs) {
+    (void)regs;
+    smp_handle_tlb();
+}
+
+__attribute__((noreturn))
+static void ap_main(cpu_t* cpu) {
+    cpu_load(cpu);
+    cpu_enable_sse();
+    vmm_init_cpu();
+    x86_64_GDT_Initialize();
+    x86_64_IDT_Initialize();
+    x86_64_Syscall_Initialize();
+    lapic_init_ap();
+
+    __atomic_or_fetch(&online_mask, 1ULL << cpu->id, __ATOMIC_SEQ_CST);
+    cpu->online = true;
+
+    // Wait here until the BSP is done booting
+    kernel_lock();
+    log_ok(SMP_MODULE, "CPU %u online (APIC ID %u)", cpu->id, cpu->lapic_id);
+
+    proc_run_idle();
+}
+
+// Limine drops APs here on their own stack and page tables, both of
+// which go back to the PMM in limine_release()
+__attribute__((noreturn))
+static void ap_entry(struct limine_mp_info* info) {
+    cpu_t* cpu = (cpu_t*)info->extra_argument;
+    __asm__ volatile(
+        "mov %0, %%rsp\n"
+        "call *%1\n"
+        :: "r"(cpu->stack_top), "r"(ap_main), "D"(cpu)
+        : "memory");
+    __builtin_unreachable();
+}
+
+void smp_init(void) {
+    cpus[0].lapic_id = lapic_id();
+
+    x86_64_IRQ_RegisterVector(SMP_RESCHED_VECTOR, resched_handler);
+    x86_64_IRQ_RegisterVector(SMP_TLB_VECTOR, tlb_handler);
+
+    if (!mp_info || mp_info->cpu_count < 2) {
+        log_info(SMP_MODULE, "Single CPU system");
+        return;
+    }
+
+    for (uint64_t i = 0; i < mp_info->cpu_count; i++) {
+        struct limine_mp_info* info = mp_info->cpus[i];
+        if (info->lapic_id == mp_info->bsp_lapic_id)
+            continue;
+
+        if (cpu_count == MAX_CPUS) {
+            log_warn(SMP_MODULE, "Only %u CPUs are supported", MAX_CPUS);
+            break;
+        }
+
+        uint8_t* stack = kmalloc(CPU_STACK_SIZE);
+        if (!stack) {
+            log_err(SMP_MODULE, "No memory for the stack of APIC ID %u", info->lapic_id);
+            break;
+        }
+
+        cpu_t* cpu = &cpus[cpu_count];
+        memset(cpu, 0, sizeof(*cpu));
+        cpu->id        = cpu_count;
+        cpu->lapic_id  = info->lapic_id;
+        cpu->proc      = -1;
+        cpu->stack_top = (uint64_t)(stack + CPU_STACK_SIZE) & ~0xFULL;
+        cpu->idle_proc = proc_create_idle(cpu->id);
+        if (cpu->idle_proc < 0) {
+            log_err(SMP_MODULE, "No idle process for APIC ID %u", info->lapic_id);
+            kfree(stack);
+            break;
+        }
+        cpu_count++;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+
+        uint64_t spin = 0;
+        while (!cpu->online && spin++ < AP_START_TIMEOUT)
+            __asm__ volatile("pause");
+        if (!cpu->online)
+            log_err(SMP_MODULE, "APIC ID %u did not come up", info->lapic_id);
+    }
+
+    log_ok(SMP_MODULE, "%u of %llu CPUs started", cpu_count, mp_info->cpu_count);
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Vectors from SMP_IPI_VECTOR_BASE up are handled without the kernel
+// lock, so they get through while another CPU holds it
+#define SMP_IPI_VECTOR_BASE  0xF0
+#define SMP_TLB_VECTOR       0xF1
+
+// Runs the scheduler, so it takes the kernel lock and the scheduler's
+// IST stack like the timer. proc_yield() raises it too
+#define SMP_RESCHED_VECTOR   0xEE
+
+// smp_tlb_shootdown() address that flushes everything, globals included
+#define SMP_TLB_FLUSH_ALL    (~0ULL)
+
+// Start the APs Limine reported. Each one comes up on its own GDT, TSS,
+// LAPIC and idle process, and starts scheduling once the BSP
+// drops the kernel lock. Must run before limine_release()
+void smp_init(void);
+
+uint64_t smp_online_mask(void);
+
+// Make a CPU, possibly this one, run the scheduler if its need_resched
+// is set
+void smp_send_resched(uint32_t cpu);
+
+// Invalidate `addr` (or SMP_TLB_FLUSH_ALL) on the CPUs in `mask` other
+// than this one, and wait until they have
+void smp_tlb_shootdown(uint64_t mask, uint64_t addr);
+
+// The same for `pages` pages from `addr` in one round of IPIs. Ranges
+// longer than SMP_TLB_RANGE_MAX pages flush everything instead
+#define SMP_TLB_RANGE_MAX  32
+void smp_tlb_shootdown_range(uint64_t mask, uint64_t addr, size_t pages);
+
+// Carry out a shootdown pending for this CPU
+void smp_handle_tlb(void);
+
+// The kernel lock serialises all kernel code except the idle loop and
+// the IPI handlers. It is taken on every entry from user mode or idle
+// and belongs to a context rather than a CPU: a process switched out
+// while holding it gets it back when it is switched in again
+void kernel_lock(void);
+bool kernel_trylock(void);
+void kernel_unlock(void);
+bool kernel_lock_held(void);
@@ -1,27 +1,29 @@
 [bits 64]
 
 extern x86_64_Syscall_Dispatch
-extern x86_64_Syscall_KernelStack
 
 global x86_64_Syscall_Entry
 
-section .data
-align 8
-saved_user_rsp: dq 0
+; Per-CPU area offsets, see cpu.h
+%define CPU_KERNEL_STACK 8
+%define CPU_USER_RSP     16
 
 section .text
 
 x86_64_Syscall_Entry:
 
+    ; Switch to the CPU area
+    swapgs
+
     ; Save user RSP
-    mov [rel saved_user_rsp], rsp
+    mov [gs:CPU_USER_RSP], rsp
 
     ; Switch to kernel stack
-    mov rsp, [rel x86_64_Syscall_KernelStack]
+    mov rsp, [gs:CPU_KERNEL_STACK]
 
     ; Build IRET frame
     push 0x1B                      ; SS (user data)
-    push qword [rel saved_user_rsp]
+    push qword [gs:CPU_USER_RSP]
     push r11                       ; RFLAGS
     push 0x23                      ; CS (user code)
     push rcx                       ; RIP
@@ -58,4 +60,5 @@ x86_64_Syscall_Entry:
     pop rbp
 
     ; Return to user
+    swapgs
     iretq
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <proc/proc.h>
 #include "io.h"
+#include "cpu.h"
+#include "smp.h"
 
 #define MSR_EFER    0xC0000080u   /* Extended Feature Enable Register      */
 #define MSR_STAR    0xC0000081u   /* Syscall Target Address (segment bases) */
@@ -13,8 +15,6 @@
 
 static SyscallHandler g_SyscallHandlers[SYSCALL_MAX_COUNT];
 
-uint64_t x86_64_Syscall_KernelStack = 0;
-
 static inline void wrmsr(uint32_t msr, uint64_t value)
 {
     __asm__ volatile (
@@ -49,7 +49,7 @@ void x86_64_Syscall_Initialize(void)
 
 void x86_64_Syscall_SetKernelStack(uint64_t rsp)
 {
-    x86_64_Syscall_KernelStack = rsp;
+    cpu_self()->kernel_stack = rsp;
 }
 
 void x86_64_Syscall_RegisterHandler(uint64_t number, SyscallHandler handler)
@@ -64,9 +64,13 @@ uint64_t x86_64_Syscall_Dispatch(uint64_t number,
 {
     if (number < SYSCALL_MAX_COUNT && g_SyscallHandlers[number] != NULL)
     {
+        // The process may block and come back on another CPU, which then
+        // holds the lock in its place
+        kernel_lock();
         proc_enter_syscall();
         uint64_t r = g_SyscallHandlers[number](arg1, arg2, arg3, arg4, arg5, arg6);
         proc_exit_syscall();
+        kernel_unlock();
         return r;
     }
     
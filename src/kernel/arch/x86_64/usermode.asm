@@ -8,6 +8,9 @@ enter_usermode:
     
     cli                          ; Disable interrupts during setup
     
+    ; Hand the CPU area to KERNEL_GS_BASE before GS is reloaded
+    swapgs
+    
     ; Set up stack for iretq
     ; Stack layout (from top to bottom):
     ; SS, RSP, RFLAGS, CS, RIP
@@ -1,11 +1,27 @@
 #include <block/block.h>
 #include <heap.h>
+#include <mem/slab.h>
 #include <string.h>
 #include <debug.h>
 
 #define MAX_BLOCK_DEVICES 16
 
 static block_device_t* devices[MAX_BLOCK_DEVICES];
+static kmem_cache_t* device_cache = NULL;
+
+block_device_t* block_alloc_device(void) {
+    if (!device_cache) {
+        device_cache = kmem_cache_create("block_device", sizeof(block_device_t), 0, NULL);
+        if (!device_cache)
+            return NULL;
+    }
+    return kmem_cache_alloc(device_cache);
+}
+
+void block_free_device(block_device_t* dev) {
+    if (dev)
+        kmem_cache_free(device_cache, dev);
+}
 
 bool block_register(block_device_t* dev) {
     for (int i = 0; i < MAX_BLOCK_DEVICES; i++) {
@@ -34,5 +34,9 @@ struct block_device {
     void* lock;              // future mutex
 };
 
+// Allocate/free a zeroed block_device_t from the block device slab cache
+block_device_t* block_alloc_device(void);
+void block_free_device(block_device_t* dev);
+
 bool block_register(block_device_t* dev);
 block_device_t* block_get(const char* name);
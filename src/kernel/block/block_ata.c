@@ -1,6 +1,6 @@
 #include <block/block.h>
 #include <drivers/disk/ata.h>
-#include <heap.h>
+#include <mem/slab.h>
 #include <stddef.h>
 
 typedef struct {
@@ -8,6 +8,8 @@ typedef struct {
     uint8_t drive;
 } ata_ctx_t;
 
+static kmem_cache_t* ata_ctx_cache = NULL;
+
 static bool ata_read(block_device_t* dev, uint64_t lba, uint32_t count, void* buf) {
     ata_ctx_t* ctx = dev->driver_data;
     return ata_read_sectors(ctx->bus, ctx->drive,
@@ -26,8 +28,17 @@ block_device_t* ata_create_blockdev(
     uint8_t drive,
     uint64_t sectors
 ) {
-    block_device_t* dev = kmalloc(sizeof(block_device_t));
-    ata_ctx_t* ctx = kmalloc(sizeof(ata_ctx_t));
+    if (!ata_ctx_cache)
+        ata_ctx_cache = kmem_cache_create("ata_ctx", sizeof(ata_ctx_t), 0, NULL);
+
+    block_device_t* dev = block_alloc_device();
+    ata_ctx_t* ctx = kmem_cache_alloc(ata_ctx_cache);
+
+    if (!dev || !ctx) {
+        block_free_device(dev);
+        kmem_cache_free(ata_ctx_cache, ctx);
+        return NULL;
+    }
 
     ctx->bus = bus;
     ctx->drive = drive;
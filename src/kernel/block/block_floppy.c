@@ -41,7 +41,7 @@ static bool floppy_block_write(block_device_t* dev, uint64_t lba, uint32_t count
 }
 
 block_device_t* floppy_create_blockdev(const char* name, uint8_t drive) {
-    block_device_t* dev = kmalloc(sizeof(block_device_t));
+    block_device_t* dev = block_alloc_device();
     floppy_ctx_t* ctx = kmalloc(sizeof(floppy_ctx_t));
 
     ctx->drive = drive;
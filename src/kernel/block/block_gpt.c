@@ -1,7 +1,9 @@
 #include "block_gpt.h"
 #include <block/block.h>
+#include <mem/swap.h>
 #include <heap.h>
 #include <string.h>
+#include <memory.h>
 #include <debug.h>
 #include <stddef.h>
 
@@ -13,6 +15,16 @@ static bool guid_is_zero(const gpt_guid_t* g) {
     return true;
 }
 
+// Linux swap, 0657FD6D-A4AB-43C4-84E5-0933C84B4F4F in on-disk byte order
+static const gpt_guid_t linux_swap_guid = { {
+    0x6D, 0xFD, 0x57, 0x06, 0xAB, 0xA4, 0xC4, 0x43,
+    0x84, 0xE5, 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F
+} };
+
+static bool guid_equal(const gpt_guid_t* a, const gpt_guid_t* b) {
+    return memcmp(a->data, b->data, sizeof(a->data)) == 0;
+}
+
 static char* make_partition_name(const char* base, int index) {
     int base_len = strlen(base);
     char* name = kmalloc(base_len + 32);
@@ -86,7 +98,7 @@ bool gpt_register_partitions(block_device_t* dev) {
         if (entry.start_lba == 0 || entry.end_lba < entry.start_lba)
             continue;
 
-        block_device_t* part = kmalloc(sizeof(block_device_t));
+        block_device_t* part = block_alloc_device();
 
         part->name         = make_partition_name(dev->name, i);
         part->sector_size  = dev->sector_size;
@@ -103,10 +115,13 @@ bool gpt_register_partitions(block_device_t* dev) {
                 (unsigned long long)entry.start_lba,
                 (unsigned long long)part->sector_count);
             registered++;
+
+            if (guid_equal(&entry.type_guid, &linux_swap_guid))
+                swap_add_device(part);
         } else {
             log_err("GPT", "Failed to register partition %s", part->name);
             kfree((void*)part->name);
-            kfree(part);
+            block_free_device(part);
         }
     }
 
@@ -55,7 +55,7 @@ block_device_t* image_create_blockdev(const char* name, const char* mod_name)
         return NULL;
     }
 
-    block_device_t* dev = kmalloc(sizeof(block_device_t));
+    block_device_t* dev = block_alloc_device();
     image_ctx_t*    ctx = kmalloc(sizeof(image_ctx_t));
 
     ctx->base       = (uint8_t*)base;
@@ -55,7 +55,7 @@ bool mbr_register_partitions(block_device_t* dev) {
             continue;
         }
 
-        block_device_t* part = kmalloc(sizeof(block_device_t));
+        block_device_t* part = block_alloc_device();
 
         part->name         = make_partition_name(dev->name, i);
         part->sector_size  = dev->sector_size;
@@ -73,7 +73,7 @@ bool mbr_register_partitions(block_device_t* dev) {
         } else {
             log_err("MBR", "Failed to register partition %s", part->name);
             kfree((void*)part->name);
-            kfree(part);
+            block_free_device(part);
         }
     }
 
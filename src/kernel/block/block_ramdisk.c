@@ -1,6 +1,7 @@
 #include "block_ramdisk.h"
 #include <block/block.h>
 #include <heap.h>
+#include <mem/vmalloc.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -50,26 +51,26 @@ block_device_t* ramdisk_create_blockdev(const char* name, uint64_t size_bytes)
         return NULL;
     }
 
-    uint8_t* data = kmalloc(size_bytes);
+    // Backed by scattered pages; vmalloc memory is already zeroed
+    uint8_t* data = vmalloc(size_bytes);
     if (!data) {
         log_err("RAMDISK", "Failed to allocate %llu bytes for ramdisk %s",
                 (unsigned long long)size_bytes, name);
         return NULL;
     }
-    memset(data, 0, size_bytes);
 
     ramdisk_ctx_t* ctx = kmalloc(sizeof(ramdisk_ctx_t));
     if (!ctx) {
-        kfree(data);
+        vfree(data);
         log_err("RAMDISK", "Failed to allocate context for ramdisk %s", name);
         return NULL;
     }
     ctx->data       = data;
     ctx->size_bytes = size_bytes;
 
-    block_device_t* dev = kmalloc(sizeof(block_device_t));
+    block_device_t* dev = block_alloc_device();
     if (!dev) {
-        kfree(data);
+        vfree(data);
         kfree(ctx);
         log_err("RAMDISK", "Failed to allocate block_device_t for ramdisk %s", name);
         return NULL;
@@ -99,9 +100,9 @@ void ramdisk_destroy_blockdev(block_device_t* dev)
 
     ramdisk_ctx_t* ctx = (ramdisk_ctx_t*)dev->driver_data;
     if (ctx) {
-        kfree(ctx->data);
+        vfree(ctx->data);
         kfree(ctx);
     }
 
-    kfree(dev);
+    block_free_device(dev);
 }
\ No newline at end of file
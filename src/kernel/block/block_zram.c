@@ -0,0 +1,371 @@
+#include "block_zram.h"
+#include <block/block.h>
+#include <heap.h>
+#include <mem/pmm.h>
+#include <mem/slab.h>
+#include <mem/vmalloc.h>
+#include <memory.h>
+#include <util/lz4.h>
+#include <util/spinlock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <debug.h>
+
+#define ZRAM_MODULE "ZRAM"
+
+#define ZRAM_PAGE_SIZE      4096
+#define ZRAM_SECTOR_SIZE    512
+
+// Compressed pages live in slab caches of 128-byte size classes. Pages
+// that do not shrink below ZRAM_MAX_COMPRESSED are kept as they are, in
+// a whole page straight from the PMM
+#define ZRAM_CLASS_STEP     128
+#define ZRAM_MAX_COMPRESSED 3072
+#define ZRAM_CLASSES        (ZRAM_MAX_COMPRESSED / ZRAM_CLASS_STEP)
+
+#define ZRAM_PAGE_SAME      0x01
+
+typedef struct {
+    union {
+        void*    data;
+        uint64_t fill;      // No data: every word of the page
+    };
+    uint16_t size;          // Bytes at data; ZRAM_PAGE_SIZE when raw
+    uint8_t  class;         // Slab class; unused when raw
+    uint8_t  flags;
+} zram_page_t;
+
+typedef struct {
+    zram_page_t* pages;
+    uint64_t     page_count;
+    uint64_t     size_bytes;
+
+    // Scratch for partial pages and compressor output, under lock
+    uint8_t*     page_buf;
+    uint8_t*     comp_buf;
+    uint16_t*    table;
+
+    spinlock_t   lock;
+    zram_stats_t stats;
+} zram_ctx_t;
+
+// Shared by all zram devices
+static kmem_cache_t* class_caches[ZRAM_CLASSES];
+static spinlock_t    class_lock = { 0 };
+
+static inline size_t class_size(unsigned cls) {
+    return (cls + 1) * ZRAM_CLASS_STEP;
+}
+
+static inline unsigned class_for(size_t size) {
+    return (unsigned)((size - 1) / ZRAM_CLASS_STEP);
+}
+
+// Memory actually backing a stored page
+static inline size_t page_footprint(const zram_page_t* p) {
+    return p->size == ZRAM_PAGE_SIZE ? ZRAM_PAGE_SIZE : class_size(p->class);
+}
+
+static kmem_cache_t* class_cache(unsigned cls) {
+    if (class_caches[cls])
+        return class_caches[cls];
+
+    // "zram_<size>"
+    char name[KMEM_CACHE_NAME_LEN] = "zram_";
+    size_t size = class_size(cls);
+    int digits = size >= 1000 ? 4 : 3;
+    for (int d = digits - 1; d >= 0; d--) {
+        name[5 + d] = '0' + size % 10;
+        size /= 10;
+    }
+
+    kmem_cache_t* cache = kmem_cache_create(name, class_size(cls), 0, NULL);
+    if (!cache)
+        return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&class_lock);
+    if (class_caches[cls]) {
+        spin_unlock_irqrestore(&class_lock, flags);
+        kmem_cache_destroy(cache);
+        return class_caches[cls];
+    }
+    class_caches[cls] = cache;
+    spin_unlock_irqrestore(&class_lock, flags);
+    return cache;
+}
+
+// Drop whatever a page holds; it reads as zeroes afterwards (ctx locked)
+static void page_release(zram_ctx_t* ctx, zram_page_t* p) {
+    if (p->size) {
+        ctx->stats.pages_stored--;
+        ctx->stats.orig_bytes -= ZRAM_PAGE_SIZE;
+        ctx->stats.compr_bytes -= p->size;
+        ctx->stats.mem_used -= page_footprint(p);
+        if (p->size == ZRAM_PAGE_SIZE)
+            pmm_free((void*)virt_to_phys(p->data));
+        else
+            kmem_cache_free(class_caches[p->class], p->data);
+    } else if (p->flags & ZRAM_PAGE_SAME) {
+        ctx->stats.same_pages--;
+    }
+
+    p->fill = 0;
+    p->size = 0;
+    p->flags = 0;
+}
+
+static bool page_load(zram_ctx_t* ctx, uint64_t idx, uint8_t* out) {
+    zram_page_t* p = &ctx->pages[idx];
+
+    if (!p->size) {
+        uint64_t* words = (uint64_t*)out;
+        for (size_t i = 0; i < ZRAM_PAGE_SIZE / sizeof(uint64_t); i++)
+            words[i] = p->fill;
+        return true;
+    }
+
+    if (p->size == ZRAM_PAGE_SIZE) {
+        memcpy(out, p->data, ZRAM_PAGE_SIZE);
+        return true;
+    }
+
+    if (lz4_decompress(p->data, p->size, out, ZRAM_PAGE_SIZE) != ZRAM_PAGE_SIZE) {
+        log_err(ZRAM_MODULE, "Page %llu is corrupt", (unsigned long long)idx);
+        return false;
+    }
+    return true;
+}
+
+static bool page_store(zram_ctx_t* ctx, uint64_t idx, const uint8_t* src) {
+    zram_page_t* p = &ctx->pages[idx];
+
+    const uint64_t* words = (const uint64_t*)src;
+    size_t i = 1;
+    while (i < ZRAM_PAGE_SIZE / sizeof(uint64_t) && words[i] == words[0])
+        i++;
+
+    if (i == ZRAM_PAGE_SIZE / sizeof(uint64_t)) {
+        page_release(ctx, p);
+        p->fill = words[0];
+        p->flags = ZRAM_PAGE_SAME;
+        ctx->stats.same_pages++;
+        return true;
+    }
+
+    const void* data = ctx->comp_buf;
+    size_t size = lz4_compress(src, ZRAM_PAGE_SIZE, ctx->comp_buf, ZRAM_MAX_COMPRESSED, ctx->table);
+    if (!size) {
+        data = src;
+        size = ZRAM_PAGE_SIZE;
+    }
+
+    // Allocate before dropping the old copy so a failed write changes nothing
+    unsigned cls = 0;
+    void* obj;
+    if (size == ZRAM_PAGE_SIZE) {
+        void* page = pmm_alloc_nozero();
+        obj = page ? kmap_phys(page) : NULL;
+    } else {
+        cls = class_for(size);
+        kmem_cache_t* cache = class_cache(cls);
+        obj = cache ? kmem_cache_alloc(cache) : NULL;
+    }
+    if (!obj) {
+        log_err(ZRAM_MODULE, "Out of memory storing page %llu", (unsigned long long)idx);
+        return false;
+    }
+    memcpy(obj, data, size);
+
+    page_release(ctx, p);
+    p->data = obj;
+    p->size = (uint16_t)size;
+    p->class = (uint8_t)cls;
+
+    ctx->stats.pages_stored++;
+    ctx->stats.orig_bytes += ZRAM_PAGE_SIZE;
+    ctx->stats.compr_bytes += size;
+    ctx->stats.mem_used += page_footprint(p);
+    return true;
+}
+
+static bool zram_read(block_device_t* dev,
+                      uint64_t        lba,
+                      uint32_t        count,
+                      void*           buf)
+{
+    zram_ctx_t* ctx        = (zram_ctx_t*)dev->driver_data;
+    uint64_t    byte_off   = (dev->lba_offset + lba) * dev->sector_size;
+    uint64_t    byte_count = (uint64_t)count * dev->sector_size;
+    uint8_t*    out        = (uint8_t*)buf;
+    bool        ok         = true;
+
+    if (byte_off + byte_count > ctx->size_bytes)
+        return false;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    while (ok && byte_count) {
+        uint64_t idx   = byte_off / ZRAM_PAGE_SIZE;
+        size_t   off   = byte_off % ZRAM_PAGE_SIZE;
+        size_t   chunk = ZRAM_PAGE_SIZE - off;
+        if (chunk > byte_count)
+            chunk = byte_count;
+
+        if (chunk == ZRAM_PAGE_SIZE) {
+            ok = page_load(ctx, idx, out);
+        } else {
+            ok = page_load(ctx, idx, ctx->page_buf);
+            memcpy(out, ctx->page_buf + off, chunk);
+        }
+
+        out        += chunk;
+        byte_off   += chunk;
+        byte_count -= chunk;
+    }
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    return ok;
+}
+
+static bool zram_write(block_device_t* dev,
+                       uint64_t        lba,
+                       uint32_t        count,
+                       const void*     buf)
+{
+    zram_ctx_t*    ctx        = (zram_ctx_t*)dev->driver_data;
+    uint64_t       byte_off   = (dev->lba_offset + lba) * dev->sector_size;
+    uint64_t       byte_count = (uint64_t)count * dev->sector_size;
+    const uint8_t* in         = (const uint8_t*)buf;
+    bool           ok         = true;
+
+    if (byte_off + byte_count > ctx->size_bytes)
+        return false;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    while (ok && byte_count) {
+        uint64_t idx   = byte_off / ZRAM_PAGE_SIZE;
+        size_t   off   = byte_off % ZRAM_PAGE_SIZE;
+        size_t   chunk = ZRAM_PAGE_SIZE - off;
+        if (chunk > byte_count)
+            chunk = byte_count;
+
+        // Partial pages are merged into the current contents
+        if (chunk == ZRAM_PAGE_SIZE) {
+            ok = page_store(ctx, idx, in);
+        } else {
+            ok = page_load(ctx, idx, ctx->page_buf);
+            if (ok) {
+                memcpy(ctx->page_buf + off, in, chunk);
+                ok = page_store(ctx, idx, ctx->page_buf);
+            }
+        }
+
+        in         += chunk;
+        byte_off   += chunk;
+        byte_count -= chunk;
+    }
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    return ok;
+}
+
+static void zram_free_ctx(zram_ctx_t* ctx)
+{
+    if (ctx->pages) {
+        for (uint64_t i = 0; i < ctx->page_count; i++)
+            page_release(ctx, &ctx->pages[i]);
+        kvfree(ctx->pages);
+    }
+    if (ctx->page_buf)
+        kfree(ctx->page_buf);
+    if (ctx->comp_buf)
+        kfree(ctx->comp_buf);
+    if (ctx->table)
+        kfree(ctx->table);
+    kfree(ctx);
+}
+
+block_device_t* zram_create_blockdev(const char* name, uint64_t size_bytes)
+{
+    if (size_bytes == 0 || (size_bytes % ZRAM_SECTOR_SIZE) != 0) {
+        log_err(ZRAM_MODULE, "size_bytes must be a non-zero multiple of 512");
+        return NULL;
+    }
+
+    zram_ctx_t* ctx = kmalloc(sizeof(zram_ctx_t));
+    if (!ctx) {
+        log_err(ZRAM_MODULE, "Failed to allocate context for %s", name);
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(zram_ctx_t));
+
+    ctx->size_bytes = size_bytes;
+    ctx->page_count = (size_bytes + ZRAM_PAGE_SIZE - 1) / ZRAM_PAGE_SIZE;
+    ctx->pages      = kvmalloc(ctx->page_count * sizeof(zram_page_t));
+    ctx->page_buf   = kmalloc(ZRAM_PAGE_SIZE);
+    ctx->comp_buf   = kmalloc(ZRAM_MAX_COMPRESSED);
+    ctx->table      = kmalloc(LZ4_TABLE_SIZE);
+
+    // Every page starts out as zeroes
+    if (ctx->pages)
+        memset(ctx->pages, 0, ctx->page_count * sizeof(zram_page_t));
+
+    if (!ctx->pages || !ctx->page_buf || !ctx->comp_buf || !ctx->table) {
+        zram_free_ctx(ctx);
+        log_err(ZRAM_MODULE, "Failed to allocate buffers for %s", name);
+        return NULL;
+    }
+
+    block_device_t* dev = block_alloc_device();
+    if (!dev) {
+        zram_free_ctx(ctx);
+        log_err(ZRAM_MODULE, "Failed to allocate block_device_t for %s", name);
+        return NULL;
+    }
+
+    dev->name         = name;
+    dev->sector_size  = ZRAM_SECTOR_SIZE;
+    dev->sector_count = size_bytes / ZRAM_SECTOR_SIZE;
+    dev->lba_offset   = 0;
+    dev->driver_data  = ctx;
+    dev->read         = zram_read;
+    dev->write        = zram_write;
+    dev->lock         = NULL;
+
+    log_ok(ZRAM_MODULE, "Created compressed ramdisk %s (%llu bytes, %llu sectors)",
+           name,
+           (unsigned long long)size_bytes,
+           (unsigned long long)dev->sector_count);
+
+    return dev;
+}
+
+void zram_destroy_blockdev(block_device_t* dev)
+{
+    if (!dev)
+        return;
+
+    zram_ctx_t* ctx = (zram_ctx_t*)dev->driver_data;
+    if (ctx)
+        zram_free_ctx(ctx);
+
+    block_free_device(dev);
+}
+
+void zram_get_stats(block_device_t* dev, zram_stats_t* stats)
+{
+    zram_ctx_t* ctx = (zram_ctx_t*)dev->driver_data;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    *stats = ctx->stats;
+    spin_unlock_irqrestore(&ctx->lock, flags);
+}
+
+uint64_t zram_get_ratio(block_device_t* dev)
+{
+    zram_stats_t stats;
+    zram_get_stats(dev, &stats);
+
+    if (!stats.compr_bytes)
+        return 0;
+    return stats.orig_bytes * 100 / stats.compr_bytes;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <block/block.h>
+#include <stdint.h>
+
+// RAM-backed block device that keeps every 4KB page LZ4-compressed.
+// Pages filled with one repeated 64-bit word (zeroes, mostly) are kept
+// as that word alone, so untouched space costs nothing.
+
+typedef struct {
+    uint64_t pages_stored;      // Pages holding compressed or raw data
+    uint64_t same_pages;        // Pages stored as a repeated word
+    uint64_t orig_bytes;        // Uncompressed size of pages_stored
+    uint64_t compr_bytes;       // Their compressed size
+    uint64_t mem_used;          // Arena memory backing them
+} zram_stats_t;
+
+block_device_t* zram_create_blockdev(const char* name, uint64_t size_bytes);
+void            zram_destroy_blockdev(block_device_t* dev);
+
+void zram_get_stats(block_device_t* dev, zram_stats_t* stats);
+
+// Compression ratio of the stored data, times 100
+uint64_t zram_get_ratio(block_device_t* dev);
@@ -1,5 +1,6 @@
 #include "console.h"
 #include <proc/proc.h>
+#include <proc/wait.h>
 #include <debug.h>
 #include <device/tty/device_tty.h>
 #include <util/rgb.h>
@@ -8,6 +9,9 @@ static InputManager *input = NULL;
 
 vector waitingProcesses;
 
+// Readers in waitingProcesses sleep here until their line is delivered
+static wait_queue_t input_wait = { .interactive = true };
+
 static uint32_t fg_color = 0xFFFFFF;
 static uint32_t bg_color = 0x000000;
 
@@ -104,11 +108,11 @@ void console_set_current_c(char c)
                 }
             }
 
-            proc_unblock(wp->pid);
             kfree(wp);
         }
 
         vector_clear(&waitingProcesses);
+        wake_up_all(&input_wait);
     }
 }
 
@@ -222,8 +226,21 @@ void console_register_proc(int pid, void *buf, size_t buf_size)
     wp->active   = true;
 
     vector_push(&waitingProcesses, &wp);
+}
 
-    proc_block(pid);
+static bool console_is_waiting(int pid)
+{
+    for (int i = 0; i < waitingProcesses.size; i++) {
+        WaitingProc **wp_ptr = vector_get(&waitingProcesses, i);
+        if (*wp_ptr && (*wp_ptr)->pid == pid)
+            return true;
+    }
+    return false;
+}
+
+void console_wait_input(int pid)
+{
+    wait_event(&input_wait, !console_is_waiting(pid));
 }
 
 void console_unregister_proc(int pid)
@@ -351,11 +368,11 @@ void console_clear(void)
             }
         }
 
-        proc_unblock(wp->pid);
         kfree(wp);
     }
 
     vector_clear(&waitingProcesses);
+    wake_up_all(&input_wait);
     input->length = 0;
 }
 
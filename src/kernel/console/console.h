@@ -147,6 +147,8 @@ bool console_rmchar(void);
 void console_clear(void);
 size_t console_get_length(void);
 void console_register_proc(int pid, void* buf, size_t buffer_size);
+// Sleep until the input a process registered for has been delivered
+void console_wait_input(int pid);
 void console_backspace();
 void console_user_put_c(char c);
 void console_unregister_proc(int pid);
@@ -62,10 +62,7 @@ static int read(size_t count, void* buf)
         return serror(ESRCH);
 
     console_register_proc(pid, (void*)buf, count);
-
-    x86_64_EnableInterrupts();
-
-    proc_yield();
+    console_wait_input(pid);
 
     return count;
 }
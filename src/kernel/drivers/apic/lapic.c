@@ -3,6 +3,7 @@
 #include <timer/timer.h>
 #include <debug.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define MSR_APIC_BASE       0x0000001B
 #define MSR_X2APIC_ID       0x00000802
@@ -19,6 +20,7 @@
 #define MSR_X2APIC_TIMER_ICR   0x00000838   // initial count
 #define MSR_X2APIC_TIMER_CCR   0x00000839   // current count (RO)
 #define MSR_X2APIC_TIMER_DCR   0x0000083E   // divide config
+#define MSR_TSC_DEADLINE       0x000006E0
 
 #define APIC_BASE_BSP       (1 << 8)   // bootstrap processor flag
 #define APIC_BASE_EXTD      (1 << 10)  // x2APIC enable
@@ -29,6 +31,7 @@
 #define LVT_MASKED          (1 << 16)
 #define LVT_TIMER_PERIODIC  (1 << 17)
 #define LVT_TIMER_ONESHOT   (0 << 17)
+#define LVT_TIMER_DEADLINE  (2 << 17)
 
 #define ICR_DELIV_FIXED     (0 << 8)
 #define ICR_LEVEL_ASSERT    (1 << 14)
@@ -47,7 +50,7 @@ static inline void wrmsr(uint32_t msr, uint64_t val) {
                                 "d"((uint32_t)(val >> 32)));
 }
 
-static int cpuid_has_x2apic(void) {
+static uint32_t cpuid_1_ecx(void) {
     uint32_t ecx = 0;
     __asm__ volatile(
         "cpuid"
@@ -55,11 +58,18 @@ static int cpuid_has_x2apic(void) {
         : "a"(1), "c"(0)
         : "ebx", "edx"
     );
-    return (ecx >> 21) & 1;  // ECX bit 21 = x2APIC support
+    return ecx;
+}
+
+static int cpuid_has_x2apic(void) {
+    return (cpuid_1_ecx() >> 21) & 1;  // ECX bit 21 = x2APIC support
 }
 
 static uint32_t lapic_ticks_per_ms = 0;  // calibrated against PIT
 
+// The timer can fire at a TSC value instead of counting down
+static bool tsc_deadline = false;
+
 #define CALIB_MS 10
 
 static void lapic_calibrate(void) {
@@ -71,7 +81,7 @@ static void lapic_calibrate(void) {
     wrmsr(MSR_X2APIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VECTOR);
 
     // Let the PIT sleep for CALIB_MS
-    timer_sleep_ms(CALIB_MS);
+    timer_delay_us(CALIB_MS * 1000);
 
     // Read remaining ticks
     uint32_t remaining = (uint32_t)rdmsr(MSR_X2APIC_TIMER_CCR);
@@ -86,10 +96,10 @@ static void lapic_calibrate(void) {
              lapic_ticks_per_ms, elapsed, CALIB_MS);
 }
 
-void lapic_init(void) {
+static bool lapic_enable(void) {
     if (!cpuid_has_x2apic()) {
         log_crit("LAPIC", "x2APIC not supported by CPU");
-        return;
+        return false;
     }
 
     // Enable x2APIC mode: set EN + EXTD in IA32_APIC_BASE
@@ -117,13 +127,28 @@ void lapic_init(void) {
     wrmsr(MSR_X2APIC_SVR, SVR_APIC_ENABLE | LAPIC_SPURIOUS_VECTOR);
     log_ok("LAPIC", "LAPIC enabled, spurious vector: 0x%x",
            LAPIC_SPURIOUS_VECTOR);
+    return true;
+}
+
+void lapic_init(void) {
+    if (!lapic_enable())
+        return;
 
     // Calibrate timer against PIT
     lapic_calibrate();
 
+    tsc_deadline = (cpuid_1_ecx() >> 24) & 1;  // ECX bit 24 = TSC-deadline
+    log_info("LAPIC", "One-shot timer uses %s",
+             tsc_deadline ? "TSC deadline" : "the initial count");
+
     log_ok("LAPIC", "Init complete on CPU %u", lapic_id());
 }
 
+void lapic_init_ap(void) {
+    // All LAPICs tick at the bus clock, so the BSP's calibration holds
+    lapic_enable();
+}
+
 void lapic_eoi(void) {
     // Writing 0 to EOI MSR signals end-of-interrupt
     wrmsr(MSR_X2APIC_EOI, 0);
@@ -161,6 +186,38 @@ void lapic_timer_stop(void) {
     log_info("LAPIC", "Timer stopped");
 }
 
+void lapic_timer_arm(uint64_t deadline_us) {
+    if (tsc_deadline) {
+        wrmsr(MSR_X2APIC_LVT_TIMER, LVT_TIMER_DEADLINE | LAPIC_TIMER_VECTOR);
+        // Orders the LVT write before the deadline write
+        __asm__ volatile("mfence" ::: "memory");
+        wrmsr(MSR_TSC_DEADLINE, timer_us_to_tsc(deadline_us));
+        return;
+    }
+
+    uint64_t now   = timer_now_us();
+    uint64_t delta = deadline_us > now ? deadline_us - now : 0;
+    uint64_t count = delta * lapic_ticks_per_ms / 1000;
+
+    // Zero would stop the timer; past the counter's range it fires early
+    // and gets armed again
+    if (count == 0)
+        count = 1;
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+
+    wrmsr(MSR_X2APIC_TIMER_DCR, TIMER_DIVIDE_BY_16);
+    wrmsr(MSR_X2APIC_LVT_TIMER, LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    wrmsr(MSR_X2APIC_TIMER_ICR, count);
+}
+
+void lapic_timer_disarm(void) {
+    if (tsc_deadline)
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    else
+        wrmsr(MSR_X2APIC_TIMER_ICR, 0);
+}
+
 void lapic_send_ipi(uint32_t dest_apic_id, uint8_t vector) {
     // x2APIC ICR is a single 64-bit MSR write (atomic, no need for two writes)
     // High 32 bits = destination, low 32 bits = delivery info
@@ -170,7 +227,6 @@ void lapic_send_ipi(uint32_t dest_apic_id, uint8_t vector) {
                    ICR_DELIV_FIXED        |
                    vector;
     wrmsr(MSR_X2APIC_ICR, icr);
-    log_info("LAPIC", "IPI → APIC %u vector 0x%x", dest_apic_id, vector);
 }
 
 void lapic_timer_handler(Registers* regs) {
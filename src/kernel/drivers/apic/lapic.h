@@ -17,6 +17,9 @@ typedef enum {
 
 void lapic_init(void);
 
+// Enable the calling AP's LAPIC, reusing the BSP's timer calibration
+void lapic_init_ap(void);
+
 // Send EOI — call at END of every LAPIC-sourced interrupt handler
 void lapic_eoi(void);
 
@@ -27,6 +30,11 @@ uint32_t lapic_id(void);
 void lapic_timer_start(LAPICTimerMode mode, uint32_t ms);
 void lapic_timer_stop(void);
 
+// One-shot expiry at `deadline_us` on the timer_now_us() clock, in
+// TSC-deadline mode where the CPU has it. Replaces any earlier one
+void lapic_timer_arm(uint64_t deadline_us);
+void lapic_timer_disarm(void);
+
 // Send an IPI (fixed delivery, physical destination)
 void lapic_send_ipi(uint32_t dest_apic_id, uint8_t vector);
 
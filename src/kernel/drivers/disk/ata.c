@@ -3,6 +3,7 @@
 #include <debug.h>
 #include <drivers/disk/ata.h>
 #include <arch/x86_64/io.h>
+#include <timer/timer.h>
 #include <block/block.h>
 #include <block/block_ata.h>
 
@@ -89,15 +90,15 @@ static bool ata_check_error(ata_device_t* dev);
 static void ata_400ns_delay(ata_device_t* dev);
 static bool ata_identify(ata_device_t* dev);
 
-extern volatile uint32_t g_pit_ticks;
-
-static uint32_t get_tick_count() {
-    return g_pit_ticks;
-}
-
-static void ata_delay_ms(uint32_t ms) {
-    uint32_t start = get_tick_count();
-    while (get_tick_count() - start < ms);
+// Commands run start to finish under the kernel lock. Neither the channel
+// nor the filesystem above it can take a second command slipping in while
+// this one sleeps, so the status is polled without giving the CPU away.
+// False once timeout_ms has passed since `start`
+static bool ata_poll_wait(uint64_t start, uint32_t timeout_ms) {
+    if (timer_now_us() - start > (uint64_t)timeout_ms * 1000)
+        return false;
+    __asm__ volatile("pause");
+    return true;
 }
 
 static void ata_400ns_delay(ata_device_t* dev) {
@@ -107,9 +108,9 @@ static void ata_400ns_delay(ata_device_t* dev) {
 }
 
 static bool ata_wait_busy(ata_device_t* dev, uint32_t timeout_ms) {
-    uint32_t start = get_tick_count();
+    uint64_t start = timer_now_us();
     while (x86_64_inb(dev->io_base + ATA_REG_CMD_STATUS) & ATA_SR_BSY) {
-        if (get_tick_count() - start > timeout_ms) {
+        if (!ata_poll_wait(start, timeout_ms)) {
             log_err("ATA", "Timeout waiting for BSY to clear");
             return false;
         }
@@ -118,14 +119,14 @@ static bool ata_wait_busy(ata_device_t* dev, uint32_t timeout_ms) {
 }
 
 static bool ata_wait_drq(ata_device_t* dev, uint32_t timeout_ms) {
-    uint32_t start = get_tick_count();
+    uint64_t start = timer_now_us();
     uint8_t status;
     while (!((status = x86_64_inb(dev->io_base + ATA_REG_CMD_STATUS)) & ATA_SR_DRQ)) {
         if (status & ATA_SR_ERR) {
             ata_check_error(dev);
             return false;
         }
-        if (get_tick_count() - start > timeout_ms) {
+        if (!ata_poll_wait(start, timeout_ms)) {
             log_err("ATA", "Timeout waiting for DRQ");
             return false;
         }
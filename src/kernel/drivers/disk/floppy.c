@@ -2,6 +2,7 @@
 #include <debug.h>
 #include <string.h>
 #include <arch/x86_64/irq.h>
+#include <proc/wait.h>
 
 // FDC I/O Ports
 #define FDC_DOR  0x3F2  // Digital Output Register
@@ -40,6 +41,10 @@
 #define DOR_MOTC   0x40
 #define DOR_MOTD   0x80
 
+// How long to wait for the IRQ ending a command
+#define FDC_SEEK_TIMEOUT_MS     50
+#define FDC_TRANSFER_TIMEOUT_MS 500
+
 // 1.44MB geometry
 static floppy_geometry_t g_geometry = {
     .heads = 2,
@@ -51,6 +56,7 @@ static floppy_geometry_t g_geometry = {
 // DMA buffer (must be in lower 16MB and not cross 64KB boundary)
 static uint8_t __attribute__((aligned(0x8000))) g_dma_buffer[512 * 18];
 static volatile bool g_irq_received = false;
+static wait_queue_t g_irq_wait = WAIT_QUEUE_INIT;
 
 extern void x86_64_outb(uint16_t port, uint8_t value);
 extern uint8_t x86_64_inb(uint16_t port);
@@ -112,6 +118,11 @@ static void fdc_motor(uint8_t drive, bool on) {
     }
 }
 
+// Wait for the controller's IRQ; returns false on timeout
+static bool fdc_wait_irq(uint32_t timeout_ms) {
+    return wait_event_timeout(&g_irq_wait, g_irq_received, timeout_ms);
+}
+
 // Reset controller
 static bool fdc_reset(void) {
     log_info("FDC", "Resetting controller");
@@ -121,7 +132,7 @@ static bool fdc_reset(void) {
     x86_64_outb(FDC_DOR, DOR_DMAEN);
     
     // Wait for interrupt
-    for (volatile int i = 0; i < 100000 && !g_irq_received; i++);
+    fdc_wait_irq(FDC_SEEK_TIMEOUT_MS);
     g_irq_received = false;
     
     // Sense interrupt for all drives
@@ -154,8 +165,7 @@ static bool fdc_calibrate(uint8_t drive) {
         fdc_write_byte(CMD_RECALIBRATE);
         fdc_write_byte(drive);
         
-        // Wait for IRQ
-        for (volatile int i = 0; i < 100000 && !g_irq_received; i++);
+        fdc_wait_irq(FDC_SEEK_TIMEOUT_MS);
         
         fdc_write_byte(CMD_SENSE_INTERRUPT);
         uint8_t st0, cyl;
@@ -180,8 +190,7 @@ static bool fdc_seek(uint8_t drive, uint8_t cylinder, uint8_t head) {
     fdc_write_byte((head << 2) | drive);
     fdc_write_byte(cylinder);
     
-    // Wait for IRQ
-    for (volatile int i = 0; i < 100000 && !g_irq_received; i++);
+    fdc_wait_irq(FDC_SEEK_TIMEOUT_MS);
     
     fdc_write_byte(CMD_SENSE_INTERRUPT);
     uint8_t st0, cyl;
@@ -224,10 +233,7 @@ static bool fdc_rw_operation(uint8_t drive, uint8_t cyl, uint8_t head,
     fdc_write_byte(0x1B); // GAP3 length
     fdc_write_byte(0xFF); // Data length (unused)
     
-    // Wait for IRQ
-    for (volatile int i = 0; i < 1000000 && !g_irq_received; i++);
-    
-    if (!g_irq_received) {
+    if (!fdc_wait_irq(FDC_TRANSFER_TIMEOUT_MS)) {
         log_err("FDC", "Timeout waiting for transfer completion");
         fdc_motor(drive, false);
         return false;
@@ -255,6 +261,7 @@ static bool fdc_rw_operation(uint8_t drive, uint8_t cyl, uint8_t head,
 
 void floppy_irq_handler(Registers* regs) {
     g_irq_received = true;
+    wake_up(&g_irq_wait);
 }
 
 // Initialize driver
@@ -1,11 +1,23 @@
 #include "ext2.h"
+#include "ext2_pcache.h"
 #include <block/block.h>
 #include <heap.h>
+#include <mem/slab.h>
+#include <mem/pmm.h>
+#include <mem/shrinker.h>
+#include <mem/vmalloc.h>
 #include <memory.h>
 #include <string.h>
+#include <util/spinlock.h>
 
-// Cache configuration
-#define EXT2_CACHE_SIZE 64
+// Cache configuration. Unused blocks are given back under memory
+// pressure, so the limit can be generous
+#define EXT2_CACHE_SIZE 256
+
+// Block buffers come from one slab cache per block size below a page (1K,
+// 2K). Page-sized blocks take whole pages from the PMM, as a slab of them
+// would waste a page on its header; larger sizes fall back to kmalloc
+#define EXT2_SLAB_BLOCK_SIZES 2
 
 // Helper macros
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -29,6 +41,118 @@ static int ext2_add_dir_entry(ext2_fs_t* fs, uint32_t dir_inode, const char* nam
 static int ext2_remove_dir_entry(ext2_fs_t* fs, uint32_t dir_inode, const char* name);
 static int ext2_resolve_path(ext2_fs_t* fs, const char* path, uint32_t* inode_num, char* last_component);
 
+static kmem_cache_t* ext2_entry_cache = NULL;
+static kmem_cache_t* ext2_file_cache = NULL;
+static kmem_cache_t* ext2_iter_cache = NULL;
+static kmem_cache_t* ext2_block_caches[EXT2_SLAB_BLOCK_SIZES];
+
+static const char* ext2_block_cache_names[EXT2_SLAB_BLOCK_SIZES] = {
+    "ext2_block_1k", "ext2_block_2k"
+};
+
+// Mounted filesystems, for the block cache shrinker. The shrinker walks
+// the list from reclaim, so mount and unmount change it under mount_lock
+static ext2_fs_t* mounted_fs = NULL;
+static spinlock_t mount_lock = { 0 };
+
+static uint64_t ext2_cache_count(void);
+static uint64_t ext2_cache_shrink(uint64_t pages);
+
+// Evicting may write dirty blocks back, so only from background reclaim
+static shrinker_t ext2_block_shrinker = {
+    .name   = "ext2_block",
+    .count  = ext2_cache_count,
+    .scan   = ext2_cache_shrink,
+    .cost   = SHRINKER_COST_CACHE,
+    .atomic = false,
+};
+
+static void ext2_slab_init(void) {
+    if (!ext2_entry_cache) {
+        shrinker_register(&ext2_block_shrinker);
+        ext2_entry_cache = kmem_cache_create("ext2_cache_entry", sizeof(ext2_cache_entry_t), 0, NULL);
+    }
+    if (!ext2_file_cache) {
+        ext2_file_cache = kmem_cache_create("ext2_file", sizeof(ext2_file_t), 0, NULL);
+    }
+    if (!ext2_iter_cache) {
+        ext2_iter_cache = kmem_cache_create("ext2_dir_iter", sizeof(ext2_dir_iter_t), 0, NULL);
+    }
+}
+
+static kmem_cache_t* ext2_block_cache(ext2_fs_t* fs) {
+    uint32_t log = fs->superblock.s_log_block_size;
+    if (log >= EXT2_SLAB_BLOCK_SIZES) {
+        return NULL;
+    }
+    
+    if (!ext2_block_caches[log]) {
+        ext2_block_caches[log] = kmem_cache_create(ext2_block_cache_names[log], fs->block_size, 64, NULL);
+    }
+    return ext2_block_caches[log];
+}
+
+static ext2_cache_entry_t* ext2_cache_entry_alloc(ext2_fs_t* fs) {
+    ext2_cache_entry_t* entry = (ext2_cache_entry_t*)kmem_cache_alloc(ext2_entry_cache);
+    if (!entry) {
+        return NULL;
+    }
+    
+    kmem_cache_t* bc = ext2_block_cache(fs);
+    if (bc) {
+        entry->data = (uint8_t*)kmem_cache_alloc(bc);
+    } else if (fs->block_size == PAGE_SIZE) {
+        void* page = pmm_alloc_nozero();
+        entry->data = page ? (uint8_t*)kmap_phys(page) : NULL;
+    } else {
+        entry->data = (uint8_t*)kmalloc(fs->block_size);
+    }
+    if (!entry->data) {
+        kmem_cache_free(ext2_entry_cache, entry);
+        return NULL;
+    }
+    
+    return entry;
+}
+
+static void ext2_cache_entry_free(ext2_fs_t* fs, ext2_cache_entry_t* entry) {
+    kmem_cache_t* bc = ext2_block_cache(fs);
+    if (bc) {
+        kmem_cache_free(bc, entry->data);
+    } else if (fs->block_size == PAGE_SIZE) {
+        pmm_free((void*)virt_to_phys(entry->data));
+    } else {
+        kfree(entry->data);
+    }
+    kmem_cache_free(ext2_entry_cache, entry);
+}
+
+static int ext2_cache_evict(ext2_fs_t* fs);
+
+static uint64_t ext2_cache_count(void) {
+    uint64_t bytes = 0;
+    uint64_t flags = spin_lock_irqsave(&mount_lock);
+    for (ext2_fs_t* fs = mounted_fs; fs; fs = fs->next_mounted) {
+        bytes += (uint64_t)fs->cache_size * fs->block_size;
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+    return bytes / EXT2_PAGE_SIZE;
+}
+
+// Holds mount_lock across eviction so no filesystem goes away under it;
+// write-back of dirty blocks then polls rather than sleeps
+static uint64_t ext2_cache_shrink(uint64_t pages) {
+    uint64_t bytes = 0;
+    uint64_t flags = spin_lock_irqsave(&mount_lock);
+    for (ext2_fs_t* fs = mounted_fs; fs && bytes < pages * EXT2_PAGE_SIZE; fs = fs->next_mounted) {
+        while (bytes < pages * EXT2_PAGE_SIZE && ext2_cache_evict(fs) == EXT2_SUCCESS) {
+            bytes += fs->block_size;
+        }
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+    return bytes / EXT2_PAGE_SIZE;
+}
+
 static ext2_cache_entry_t* ext2_cache_find(ext2_fs_t* fs, uint32_t block_num) {
     ext2_cache_entry_t* entry = fs->cache_head;
     while (entry) {
@@ -103,8 +227,7 @@ static int ext2_cache_evict(ext2_fs_t* fs) {
             }
             
             ext2_cache_remove(fs, entry);
-            kfree(entry->data);
-            kfree(entry);
+            ext2_cache_entry_free(fs, entry);
             return EXT2_SUCCESS;
         }
         entry = entry->prev;
@@ -151,20 +274,13 @@ static uint8_t* ext2_get_block(ext2_fs_t* fs, uint32_t block_num) {
         }
     }
     
-    entry = (ext2_cache_entry_t*)kmalloc(sizeof(ext2_cache_entry_t));
+    entry = ext2_cache_entry_alloc(fs);
     if (!entry) {
         return NULL;
     }
     
-    entry->data = (uint8_t*)kmalloc(fs->block_size);
-    if (!entry->data) {
-        kfree(entry);
-        return NULL;
-    }
-    
     if (ext2_read_block(fs, block_num, entry->data) != EXT2_SUCCESS) {
-        kfree(entry->data);
-        kfree(entry);
+        ext2_cache_entry_free(fs, entry);
         return NULL;
     }
     
@@ -270,6 +386,19 @@ static int ext2_write_inode(ext2_fs_t* fs, uint32_t inode_num, const ext2_inode_
     return EXT2_SUCCESS;
 }
 
+// The descriptor table may span several blocks after the superblock
+static void ext2_write_group_desc(ext2_fs_t* fs, uint32_t group) {
+    uint32_t offset = group * sizeof(ext2_group_desc_t);
+    uint32_t gd_block = fs->first_data_block + 1 + offset / fs->block_size;
+    
+    uint8_t* gd_data = ext2_get_block(fs, gd_block);
+    if (gd_data) {
+        memcpy(gd_data + offset % fs->block_size,
+              &fs->group_desc[group], sizeof(ext2_group_desc_t));
+        ext2_put_block(fs, gd_data, true);
+    }
+}
+
 static int ext2_alloc_block(ext2_fs_t* fs, uint32_t* block_num) {
     for (uint32_t group = 0; group < fs->num_groups; group++) {
         if (fs->group_desc[group].bg_free_blocks_count == 0) {
@@ -300,13 +429,7 @@ static int ext2_alloc_block(ext2_fs_t* fs, uint32_t* block_num) {
                 fs->superblock.s_free_blocks_count--;
                 
                 // Write updated group descriptor
-                uint32_t gd_block = fs->first_data_block + 1;
-                uint8_t* gd_data = ext2_get_block(fs, gd_block);
-                if (gd_data) {
-                    memcpy(gd_data + group * sizeof(ext2_group_desc_t),
-                          &fs->group_desc[group], sizeof(ext2_group_desc_t));
-                    ext2_put_block(fs, gd_data, true);
-                }
+                ext2_write_group_desc(fs, group);
                 
                 return EXT2_SUCCESS;
             }
@@ -340,13 +463,7 @@ static int ext2_free_block(ext2_fs_t* fs, uint32_t block_num) {
     fs->superblock.s_free_blocks_count++;
     
     // Write updated group descriptor
-    uint32_t gd_block = fs->first_data_block + 1;
-    uint8_t* gd_data = ext2_get_block(fs, gd_block);
-    if (gd_data) {
-        memcpy(gd_data + group * sizeof(ext2_group_desc_t),
-              &fs->group_desc[group], sizeof(ext2_group_desc_t));
-        ext2_put_block(fs, gd_data, true);
-    }
+    ext2_write_group_desc(fs, group);
     
     return EXT2_SUCCESS;
 }
@@ -385,13 +502,7 @@ static int ext2_alloc_inode(ext2_fs_t* fs, uint32_t parent_inode, bool is_dir, u
                 }
                 
                 // Write updated group descriptor
-                uint32_t gd_block = fs->first_data_block + 1;
-                uint8_t* gd_data = ext2_get_block(fs, gd_block);
-                if (gd_data) {
-                    memcpy(gd_data + group * sizeof(ext2_group_desc_t),
-                          &fs->group_desc[group], sizeof(ext2_group_desc_t));
-                    ext2_put_block(fs, gd_data, true);
-                }
+                ext2_write_group_desc(fs, group);
                 
                 return EXT2_SUCCESS;
             }
@@ -435,13 +546,7 @@ static int ext2_free_inode(ext2_fs_t* fs, uint32_t inode_num) {
     }
     
     // Write updated group descriptor
-    uint32_t gd_block = fs->first_data_block + 1;
-    uint8_t* gd_data = ext2_get_block(fs, gd_block);
-    if (gd_data) {
-        memcpy(gd_data + group * sizeof(ext2_group_desc_t),
-              &fs->group_desc[group], sizeof(ext2_group_desc_t));
-        ext2_put_block(fs, gd_data, true);
-    }
+    ext2_write_group_desc(fs, group);
     
     return EXT2_SUCCESS;
 }
@@ -943,6 +1048,8 @@ ext2_fs_t* ext2_mount(block_device_t* device) {
         return NULL;
     }
     
+    ext2_slab_init();
+    
     memset(fs, 0, sizeof(ext2_fs_t));
     fs->device = device;
     fs->max_cache_entries = EXT2_CACHE_SIZE;
@@ -981,31 +1088,30 @@ ext2_fs_t* ext2_mount(block_device_t* device) {
                      fs->superblock.s_blocks_per_group;
     fs->first_data_block = fs->superblock.s_first_data_block;
     
-    // Read group descriptors
+    // Read group descriptors straight into the table; large filesystems
+    // have tables spanning many blocks, so back it with kvmalloc
     uint32_t gd_size = fs->num_groups * sizeof(ext2_group_desc_t);
-    fs->group_desc = (ext2_group_desc_t*)kmalloc(gd_size);
+    uint32_t gd_blocks = (gd_size + fs->block_size - 1) / fs->block_size;
+    fs->group_desc = (ext2_group_desc_t*)kvmalloc(gd_blocks * fs->block_size);
     if (!fs->group_desc) {
         kfree(fs);
         return NULL;
     }
     
     uint32_t gd_block = fs->first_data_block + 1;
-    uint8_t* gd_buffer = (uint8_t*)kmalloc(fs->block_size);
-    if (!gd_buffer) {
-        kfree(fs->group_desc);
-        kfree(fs);
-        return NULL;
-    }
-    
-    if (ext2_read_block(fs, gd_block, gd_buffer) != EXT2_SUCCESS) {
-        kfree(gd_buffer);
-        kfree(fs->group_desc);
-        kfree(fs);
-        return NULL;
+    for (uint32_t i = 0; i < gd_blocks; i++) {
+        if (ext2_read_block(fs, gd_block + i,
+                            (uint8_t*)fs->group_desc + i * fs->block_size) != EXT2_SUCCESS) {
+            kvfree(fs->group_desc);
+            kfree(fs);
+            return NULL;
+        }
     }
     
-    memcpy(fs->group_desc, gd_buffer, gd_size);
-    kfree(gd_buffer);
+    uint64_t flags = spin_lock_irqsave(&mount_lock);
+    fs->next_mounted = mounted_fs;
+    mounted_fs = fs;
+    spin_unlock_irqrestore(&mount_lock, flags);
     
     return fs;
 }
@@ -1015,6 +1121,15 @@ int ext2_unmount(ext2_fs_t* fs) {
         return EXT2_ERROR_INVALID;
     }
     
+    uint64_t flags = spin_lock_irqsave(&mount_lock);
+    for (ext2_fs_t** pp = &mounted_fs; *pp; pp = &(*pp)->next_mounted) {
+        if (*pp == fs) {
+            *pp = fs->next_mounted;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+    
     // Flush all cached blocks
     ext2_flush_cache(fs);
     
@@ -1022,13 +1137,12 @@ int ext2_unmount(ext2_fs_t* fs) {
     ext2_cache_entry_t* entry = fs->cache_head;
     while (entry) {
         ext2_cache_entry_t* next = entry->next;
-        kfree(entry->data);
-        kfree(entry);
+        ext2_cache_entry_free(fs, entry);
         entry = next;
     }
     
     // Free group descriptors
-    kfree(fs->group_desc);
+    kvfree(fs->group_desc);
     
     // Free filesystem structure
     kfree(fs);
@@ -1046,13 +1160,13 @@ ext2_file_t* ext2_open(ext2_fs_t* fs, const char* path) {
         return NULL;
     }
     
-    ext2_file_t* file = (ext2_file_t*)kmalloc(sizeof(ext2_file_t));
+    ext2_file_t* file = (ext2_file_t*)kmem_cache_alloc(ext2_file_cache);
     if (!file) {
         return NULL;
     }
     
     if (ext2_read_inode(fs, inode_num, &file->inode) != EXT2_SUCCESS) {
-        kfree(file);
+        kmem_cache_free(ext2_file_cache, file);
         return NULL;
     }
     
@@ -1072,7 +1186,7 @@ int ext2_close(ext2_file_t* file) {
     // Write back inode if modified
     ext2_write_inode(file->fs, file->inode_num, &file->inode);
     
-    kfree(file);
+    kmem_cache_free(ext2_file_cache, file);
     return EXT2_SUCCESS;
 }
 
@@ -1130,6 +1244,7 @@ int ext2_write(ext2_file_t* file, const void* buffer, uint32_t size) {
     }
     
     uint32_t bytes_written = 0;
+    uint64_t start_pos = file->position;
     
     while (bytes_written < size) {
         uint32_t block_index = file->position / file->fs->block_size;
@@ -1161,6 +1276,9 @@ int ext2_write(ext2_file_t* file, const void* buffer, uint32_t size) {
     // Update inode
     ext2_write_inode(file->fs, file->inode_num, &file->inode);
     
+    // Keep mmapped copies of the file in step
+    ext2_pcache_update(file->fs, file->inode_num, start_pos, buffer, bytes_written);
+    
     return bytes_written;
 }
 
@@ -1207,6 +1325,96 @@ uint64_t ext2_size(ext2_file_t* file) {
     return file->inode.i_size;
 }
 
+int ext2_read_page(ext2_fs_t* fs, uint32_t inode_num, uint64_t offset, void* page) {
+    if (!fs || !page) {
+        return EXT2_ERROR_INVALID;
+    }
+    
+    ext2_inode_t inode;
+    int result = ext2_read_inode(fs, inode_num, &inode);
+    if (result != EXT2_SUCCESS) {
+        return result;
+    }
+    
+    memset(page, 0, EXT2_PAGE_SIZE);
+    if (offset >= inode.i_size) {
+        return EXT2_SUCCESS;
+    }
+    
+    uint32_t len = (uint32_t)MIN((uint64_t)EXT2_PAGE_SIZE, inode.i_size - offset);
+    uint32_t done = 0;
+    
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t block_offset = pos % fs->block_size;
+        uint32_t chunk = MIN(len - done, fs->block_size - block_offset);
+        
+        // Holes stay zero
+        uint32_t block_num = ext2_get_block_num(fs, &inode, pos / fs->block_size, false);
+        if (block_num) {
+            uint8_t* block_data = ext2_get_block(fs, block_num);
+            if (!block_data) {
+                return EXT2_ERROR_IO;
+            }
+            memcpy((uint8_t*)page + done, block_data + block_offset, chunk);
+            ext2_put_block(fs, block_data, false);
+        }
+        
+        done += chunk;
+    }
+    
+    return EXT2_SUCCESS;
+}
+
+int ext2_write_page(ext2_fs_t* fs, uint32_t inode_num, uint64_t offset, const void* page) {
+    if (!fs || !page) {
+        return EXT2_ERROR_INVALID;
+    }
+    
+    ext2_inode_t inode;
+    int result = ext2_read_inode(fs, inode_num, &inode);
+    if (result != EXT2_SUCCESS) {
+        return result;
+    }
+    
+    // Mappings never grow the file; the tail of the last page is dropped
+    if (offset >= inode.i_size) {
+        return EXT2_SUCCESS;
+    }
+    
+    uint32_t len = (uint32_t)MIN((uint64_t)EXT2_PAGE_SIZE, inode.i_size - offset);
+    uint32_t done = 0;
+    uint32_t old_blocks[EXT2_N_BLOCKS];
+    memcpy(old_blocks, inode.i_block, sizeof(old_blocks));
+    
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t block_offset = pos % fs->block_size;
+        uint32_t chunk = MIN(len - done, fs->block_size - block_offset);
+        
+        uint32_t block_num = ext2_get_block_num(fs, &inode, pos / fs->block_size, true);
+        if (block_num == 0) {
+            return EXT2_ERROR_NO_SPACE;
+        }
+        
+        uint8_t* block_data = ext2_get_block(fs, block_num);
+        if (!block_data) {
+            return EXT2_ERROR_IO;
+        }
+        memcpy(block_data + block_offset, (const uint8_t*)page + done, chunk);
+        ext2_put_block(fs, block_data, true);
+        
+        done += chunk;
+    }
+    
+    // Filling a hole may have set new block pointers in the inode
+    if (memcmp(old_blocks, inode.i_block, sizeof(old_blocks)) != 0) {
+        ext2_write_inode(fs, inode_num, &inode);
+    }
+    
+    return EXT2_SUCCESS;
+}
+
 int ext2_create(ext2_fs_t* fs, const char* path, uint16_t mode) {
     if (!fs || !path) {
         return EXT2_ERROR_INVALID;
@@ -1306,6 +1514,8 @@ int ext2_delete(ext2_fs_t* fs, const char* path) {
     inode.i_links_count--;
     
     if (inode.i_links_count == 0) {
+        ext2_pcache_invalidate(fs, inode_num);
+        
         // Free all blocks
         for (uint32_t i = 0; i < EXT2_NDIR_BLOCKS && inode.i_block[i]; i++) {
             ext2_free_block(fs, inode.i_block[i]);
@@ -1500,7 +1710,7 @@ ext2_dir_iter_t* ext2_opendir(ext2_fs_t* fs, const char* path) {
         return NULL;
     }
     
-    ext2_dir_iter_t* iter = (ext2_dir_iter_t*)kmalloc(sizeof(ext2_dir_iter_t));
+    ext2_dir_iter_t* iter = (ext2_dir_iter_t*)kmem_cache_alloc(ext2_iter_cache);
     if (!iter) {
         ext2_close(dir);
         return NULL;
@@ -1568,7 +1778,7 @@ int ext2_closedir(ext2_dir_iter_t* iter) {
         ext2_close(iter->dir);
     }
     
-    kfree(iter);
+    kmem_cache_free(ext2_iter_cache, iter);
     return EXT2_SUCCESS;
 }
 
@@ -1586,6 +1796,14 @@ int ext2_stat(ext2_fs_t* fs, const char* path, ext2_inode_t* inode) {
     return ext2_read_inode(fs, inode_num, inode);
 }
 
+int ext2_stat_inode(ext2_fs_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
+    if (!fs || !inode) {
+        return EXT2_ERROR_INVALID;
+    }
+    
+    return ext2_read_inode(fs, inode_num, inode);
+}
+
 bool ext2_exists(ext2_fs_t* fs, const char* path) {
     if (!fs || !path) {
         return false;
@@ -204,6 +204,8 @@ struct ext2_filesystem {
     ext2_cache_entry_t* cache_tail;
     uint32_t cache_size;
     uint32_t max_cache_entries;
+    
+    struct ext2_filesystem* next_mounted;
 };
 
 // File handle structure
@@ -238,6 +240,12 @@ int ext2_seek(ext2_file_t* file, int64_t offset, int whence);
 uint64_t ext2_tell(ext2_file_t* file);
 uint64_t ext2_size(ext2_file_t* file);
 
+// Page-sized I/O by inode, used by mmap. Reads zero-fill holes and the
+// part past EOF; writes only cover the existing file size
+#define EXT2_PAGE_SIZE 4096
+int ext2_read_page(ext2_fs_t* fs, uint32_t inode_num, uint64_t offset, void* page);
+int ext2_write_page(ext2_fs_t* fs, uint32_t inode_num, uint64_t offset, const void* page);
+
 // File management
 int ext2_create(ext2_fs_t* fs, const char* path, uint16_t mode);
 int ext2_delete(ext2_fs_t* fs, const char* path);
@@ -251,6 +259,7 @@ int ext2_closedir(ext2_dir_iter_t* iter);
 
 // Utility functions
 int ext2_stat(ext2_fs_t* fs, const char* path, ext2_inode_t* inode);
+int ext2_stat_inode(ext2_fs_t* fs, uint32_t inode_num, ext2_inode_t* inode);
 bool ext2_exists(ext2_fs_t* fs, const char* path);
 
 // Permission operations
@@ -0,0 +1,263 @@
+#include "ext2_pcache.h"
+#include "ext2.h"
+#include <mem/pmm.h>
+#include <mem/slab.h>
+#include <mem/shrinker.h>
+#include <memory.h>
+#include <debug.h>
+#include <util/spinlock.h>
+
+#define PCACHE_MODULE "EXT2"
+
+#define PCACHE_HASH_BUCKETS 256
+#define PCACHE_STAMP_BUCKETS 64
+
+typedef struct pcache_page {
+    ext2_fs_t*          fs;
+    uint32_t            inode_num;
+    uint64_t            index;
+    void*               phys;
+    struct pcache_page* next;
+} pcache_page_t;
+
+// Inode version an executable's pages were cached for
+typedef struct pcache_stamp {
+    ext2_fs_t*           fs;
+    uint32_t             inode_num;
+    uint32_t             mtime;
+    uint32_t             size;
+    struct pcache_stamp* next;
+} pcache_stamp_t;
+
+static pcache_page_t* page_hash[PCACHE_HASH_BUCKETS];
+static kmem_cache_t*  page_cache = NULL;
+static spinlock_t     page_lock = { 0 };
+static uint64_t       cached_pages = 0;
+
+static pcache_stamp_t* stamp_hash[PCACHE_STAMP_BUCKETS];
+static kmem_cache_t*   stamp_cache = NULL;
+
+static shrinker_t pcache_shrinker = {
+    .name   = "ext2_pcache",
+    .count  = ext2_pcache_get_pages,
+    .scan   = ext2_pcache_shrink,
+    .cost   = SHRINKER_COST_CACHE,
+    .atomic = true,
+};
+
+static inline size_t page_hash_idx(ext2_fs_t* fs, uint32_t inode_num, uint64_t index) {
+    uint64_t h = ((uint64_t)fs >> 4) ^ ((uint64_t)inode_num * 31) ^ index;
+    return (h ^ (h >> 8)) & (PCACHE_HASH_BUCKETS - 1);
+}
+
+static pcache_page_t* page_lookup(ext2_fs_t* fs, uint32_t inode_num, uint64_t index) {
+    pcache_page_t* p = page_hash[page_hash_idx(fs, inode_num, index)];
+    for (; p; p = p->next) {
+        if (p->fs == fs && p->inode_num == inode_num && p->index == index)
+            return p;
+    }
+    return NULL;
+}
+
+void* ext2_pcache_get_page(ext2_fs_t* fs, uint32_t inode_num, uint64_t index) {
+    uint64_t flags = spin_lock_irqsave(&page_lock);
+    pcache_page_t* p = page_lookup(fs, inode_num, index);
+    if (p) {
+        pmm_page_get(p->phys);
+        spin_unlock_irqrestore(&page_lock, flags);
+        return p->phys;
+    }
+    spin_unlock_irqrestore(&page_lock, flags);
+
+    if (!page_cache) {
+        page_cache = kmem_cache_create("ext2_page", sizeof(pcache_page_t), 0, NULL);
+        if (!page_cache)
+            return NULL;
+        shrinker_register(&pcache_shrinker);
+    }
+
+    // Read outside the lock; disk I/O can take a while. Unmapped cached
+    // pages are reclaimed through the shrinker if memory is short
+    void* phys = pmm_alloc_nozero();
+    if (!phys)
+        return NULL;
+
+    if (ext2_read_page(fs, inode_num, index * EXT2_PAGE_SIZE, kmap_phys(phys)) != EXT2_SUCCESS) {
+        log_err(PCACHE_MODULE, "Failed to read page %llu of inode %u", index, inode_num);
+        pmm_free(phys);
+        return NULL;
+    }
+
+    pcache_page_t* fresh = kmem_cache_alloc(page_cache);
+    if (!fresh) {
+        pmm_free(phys);
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&page_lock);
+
+    // Someone else may have faulted the same page in meanwhile
+    p = page_lookup(fs, inode_num, index);
+    if (p) {
+        pmm_page_get(p->phys);
+        spin_unlock_irqrestore(&page_lock, flags);
+        kmem_cache_free(page_cache, fresh);
+        pmm_free(phys);
+        return p->phys;
+    }
+
+    fresh->fs = fs;
+    fresh->inode_num = inode_num;
+    fresh->index = index;
+    fresh->phys = phys;
+
+    size_t idx = page_hash_idx(fs, inode_num, index);
+    fresh->next = page_hash[idx];
+    page_hash[idx] = fresh;
+    cached_pages++;
+
+    // One reference for the cache, one for the caller
+    pmm_page_get(phys);
+    spin_unlock_irqrestore(&page_lock, flags);
+    return phys;
+}
+
+int ext2_pcache_writeback(ext2_fs_t* fs, uint32_t inode_num, uint64_t index, void* phys) {
+    return ext2_write_page(fs, inode_num, index * EXT2_PAGE_SIZE, kmap_phys(phys));
+}
+
+void ext2_pcache_update(ext2_fs_t* fs, uint32_t inode_num, uint64_t pos,
+                        const void* buffer, uint32_t size) {
+    if (!cached_pages || size == 0)
+        return;
+
+    uint64_t end = pos + size;
+    uint64_t flags = spin_lock_irqsave(&page_lock);
+
+    for (uint64_t index = pos / EXT2_PAGE_SIZE; index * EXT2_PAGE_SIZE < end; index++) {
+        pcache_page_t* p = page_lookup(fs, inode_num, index);
+        if (!p)
+            continue;
+
+        uint64_t page_start = index * EXT2_PAGE_SIZE;
+        uint64_t from = pos > page_start ? pos : page_start;
+        uint64_t to = end < page_start + EXT2_PAGE_SIZE ? end : page_start + EXT2_PAGE_SIZE;
+
+        memcpy((uint8_t*)kmap_phys(p->phys) + (from - page_start),
+               (const uint8_t*)buffer + (from - pos), to - from);
+    }
+
+    spin_unlock_irqrestore(&page_lock, flags);
+}
+
+static void stamp_drop(ext2_fs_t* fs, uint32_t inode_num) {
+    size_t idx = inode_num & (PCACHE_STAMP_BUCKETS - 1);
+    for (pcache_stamp_t** sp = &stamp_hash[idx]; *sp; sp = &(*sp)->next) {
+        if ((*sp)->fs == fs && (*sp)->inode_num == inode_num) {
+            pcache_stamp_t* st = *sp;
+            *sp = st->next;
+            kmem_cache_free(stamp_cache, st);
+            return;
+        }
+    }
+}
+
+void ext2_pcache_invalidate(ext2_fs_t* fs, uint32_t inode_num) {
+    uint64_t flags = spin_lock_irqsave(&page_lock);
+    stamp_drop(fs, inode_num);
+    spin_unlock_irqrestore(&page_lock, flags);
+
+    if (!cached_pages)
+        return;
+
+    flags = spin_lock_irqsave(&page_lock);
+    for (size_t i = 0; i < PCACHE_HASH_BUCKETS; i++) {
+        pcache_page_t** pp = &page_hash[i];
+        while (*pp) {
+            pcache_page_t* p = *pp;
+            if (p->fs == fs && p->inode_num == inode_num) {
+                *pp = p->next;
+                cached_pages--;
+                // Existing mappings keep the page alive until they go away
+                pmm_page_put(p->phys);
+                kmem_cache_free(page_cache, p);
+            } else {
+                pp = &p->next;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&page_lock, flags);
+}
+
+void ext2_pcache_revalidate(ext2_fs_t* fs, uint32_t inode_num) {
+    ext2_inode_t inode;
+    if (ext2_stat_inode(fs, inode_num, &inode) != EXT2_SUCCESS)
+        return;
+
+    if (!stamp_cache) {
+        stamp_cache = kmem_cache_create("ext2_stamp", sizeof(pcache_stamp_t), 0, NULL);
+        if (!stamp_cache)
+            return;
+    }
+
+    size_t idx = inode_num & (PCACHE_STAMP_BUCKETS - 1);
+    bool stale = true;
+
+    uint64_t flags = spin_lock_irqsave(&page_lock);
+    pcache_stamp_t* st = stamp_hash[idx];
+    for (; st; st = st->next) {
+        if (st->fs == fs && st->inode_num == inode_num)
+            break;
+    }
+    if (st && st->mtime == inode.i_mtime && st->size == inode.i_size)
+        stale = false;
+    spin_unlock_irqrestore(&page_lock, flags);
+
+    if (!stale)
+        return;
+
+    // Also clears the old stamp
+    ext2_pcache_invalidate(fs, inode_num);
+
+    pcache_stamp_t* fresh = kmem_cache_alloc(stamp_cache);
+    if (!fresh)
+        return;
+    fresh->fs = fs;
+    fresh->inode_num = inode_num;
+    fresh->mtime = inode.i_mtime;
+    fresh->size = inode.i_size;
+
+    flags = spin_lock_irqsave(&page_lock);
+    stamp_drop(fs, inode_num);
+    fresh->next = stamp_hash[idx];
+    stamp_hash[idx] = fresh;
+    spin_unlock_irqrestore(&page_lock, flags);
+}
+
+uint64_t ext2_pcache_shrink(uint64_t max) {
+    uint64_t freed = 0;
+
+    uint64_t flags = spin_lock_irqsave(&page_lock);
+    for (size_t i = 0; i < PCACHE_HASH_BUCKETS && freed < max; i++) {
+        pcache_page_t** pp = &page_hash[i];
+        while (*pp && freed < max) {
+            pcache_page_t* p = *pp;
+            if (pmm_page_refcount(p->phys) == 1) {
+                *pp = p->next;
+                cached_pages--;
+                pmm_page_put(p->phys);
+                kmem_cache_free(page_cache, p);
+                freed++;
+            } else {
+                pp = &p->next;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&page_lock, flags);
+
+    return freed;
+}
+
+uint64_t ext2_pcache_get_pages(void) {
+    return cached_pages;
+}
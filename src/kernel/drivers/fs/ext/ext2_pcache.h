@@ -0,0 +1,40 @@
+#ifndef EXT2_PCACHE_H
+#define EXT2_PCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct ext2_filesystem ext2_fs_t;
+
+// Page cache for mmapped ext2 files. Every cached page is one physical
+// page holding file bytes [index * 4096, (index + 1) * 4096); shared
+// mappings map it directly, private ones map it copy-on-write.
+//
+// The cache holds one reference on each page. A page is only evicted
+// once nobody else holds one, i.e. it is no longer mapped anywhere.
+
+// Physical address of the page, read in from disk on a miss. The caller
+// gets its own reference and drops it with pmm_page_put()
+void* ext2_pcache_get_page(ext2_fs_t* fs, uint32_t inode_num, uint64_t index);
+
+// Write a cached page back to the file
+int ext2_pcache_writeback(ext2_fs_t* fs, uint32_t inode_num, uint64_t index, void* phys);
+
+// Copy bytes written through ext2_write() into cached pages
+void ext2_pcache_update(ext2_fs_t* fs, uint32_t inode_num, uint64_t pos,
+                        const void* buffer, uint32_t size);
+
+// Drop every cached page of an inode (file deleted)
+void ext2_pcache_invalidate(ext2_fs_t* fs, uint32_t inode_num);
+
+// Called before an exec maps a binary. Cached pages are reused only when
+// the inode's mtime and size still match those seen at the last exec;
+// otherwise they are dropped so the new contents get read in
+void ext2_pcache_revalidate(ext2_fs_t* fs, uint32_t inode_num);
+
+// Evict up to max unmapped pages; returns how many were freed
+uint64_t ext2_pcache_shrink(uint64_t max);
+
+uint64_t ext2_pcache_get_pages(void);
+
+#endif // EXT2_PCACHE_H
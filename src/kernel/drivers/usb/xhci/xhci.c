@@ -38,6 +38,7 @@ static void _process_events(xhci_controller_t* hc);
 static void _parse_extended_capabilites(xhci_controller_t* hc);
 static bool _is_usb3_port(xhci_controller_t* hc, uint8_t port_num);
 static xhci_command_completion_trb_t* _send_command_trb(xhci_controller_t* hc, xhci_trb_t* cmd_trb, uint32_t timeout_ms);
+static bool _wait_completion(xhci_controller_t* hc, volatile uint8_t* flag, uint32_t timeout_ms);
 static xhci_portsc_register_t _read_portsc_reg(xhci_controller_t* hc, uint8_t port);
 static void _write_portsc_reg(xhci_controller_t* hc, xhci_portsc_register_t reg, uint8_t port);
 static int  _reset_port(xhci_controller_t* hc, uint8_t port);
@@ -190,16 +191,9 @@ int xhci_control_transfer(xhci_controller_t* hc, xhci_device_t* dev,
 
     
     
-    uint64_t elapsed_us = 0;
-    while (!dev->transfer_completed) {
-        _process_events((xhci_controller_t*)dev->hc);
-        if (dev->transfer_completed) break;
-        timer_sleep_us(100);
-        elapsed_us += 100;
-        if (elapsed_us > (uint64_t)timeout_ms * 1000) {
-            log_err(XHCI_MOD, "Control transfer timeout (slot=%d)", dev->slot_id);
-            return -1;
-        }
+    if (!_wait_completion((xhci_controller_t*)dev->hc, &dev->transfer_completed, timeout_ms)) {
+        log_err(XHCI_MOD, "Control transfer timeout (slot=%d)", dev->slot_id);
+        return -1;
     }
 
     xhci_transfer_event_trb_t* evt = (xhci_transfer_event_trb_t*)&dev->last_transfer_event;
@@ -320,16 +314,8 @@ int xhci_wait_transfer(xhci_device_t* dev, uint8_t ep_addr, uint32_t timeout_ms)
 {
     uint8_t dci = xhci_dci_from_ep_addr(ep_addr);
 
-    uint64_t elapsed_us = 0;
-    while (!dev->ep_transfer_completed[dci]) {
-        _process_events((xhci_controller_t*)dev->hc);
-        if (dev->ep_transfer_completed[dci]) break;
-        timer_sleep_us(100);
-        elapsed_us += 100;
-        if (elapsed_us > (uint64_t)timeout_ms * 1000) {
-            return -1;
-        }
-    }
+    if (!_wait_completion((xhci_controller_t*)dev->hc, &dev->ep_transfer_completed[dci], timeout_ms))
+        return -1;
 
     xhci_transfer_event_trb_t* evt =
         (xhci_transfer_event_trb_t*)&dev->ep_last_transfer_event[dci];
@@ -407,7 +393,25 @@ static void _process_events(xhci_controller_t* hc) {
         }
     }
 
-    hc->cmd_irq_completed = any_cmd_completion;
+    // Left set until the waiter clears it: a poll that finds nothing
+    // must not hide a completion the IRQ handler already took
+    if (any_cmd_completion)
+        hc->cmd_irq_completed = 1;
+
+    if (event_count)
+        wake_up_all(&hc->event_wait);
+}
+
+static bool _completion_seen(xhci_controller_t* hc, volatile uint8_t* flag) {
+    if (!*flag)
+        _process_events(hc);
+    return *flag;
+}
+
+// Wait for a completion flag set by _process_events(). The event ring is
+// polled on every wakeup as well, so a lost interrupt only costs time
+static bool _wait_completion(xhci_controller_t* hc, volatile uint8_t* flag, uint32_t timeout_ms) {
+    return wait_event_timeout(&hc->event_wait, _completion_seen(hc, flag), timeout_ms);
 }
 
 
@@ -426,17 +430,8 @@ static xhci_command_completion_trb_t* _send_command_trb(xhci_controller_t* hc,
     
     
     
-    uint64_t elapsed = 0;
-    while (!hc->cmd_irq_completed) {
-        _process_events(hc);          
-        if (hc->cmd_irq_completed) break;
-        timer_sleep_us(100);
-        elapsed += 100;
-        if (elapsed > (uint64_t)timeout_ms * 1000) {
-            log_warn(XHCI_MOD, "Timeout waiting on command completion");
-            break;
-        }
-    }
+    if (!_wait_completion(hc, &hc->cmd_irq_completed, timeout_ms))
+        log_warn(XHCI_MOD, "Timeout waiting on command completion");
 
     xhci_command_completion_trb_t* comp =
         hc->cmd_completion_events.size
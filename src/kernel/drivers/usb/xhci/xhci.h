@@ -5,6 +5,7 @@
 #include "xhci_regs.h"
 #include "xhci_device.h"
 #include <util/vector.h>
+#include <proc/wait.h>
 #include <stdbool.h>
 
 #define XHCI_MOD "xHCI"
@@ -42,6 +43,8 @@ typedef struct {
     vector                 cmd_completion_events;
     vector                 usb3_ports;
 
+    wait_queue_t           event_wait;  // Woken when the IRQ handler took events
+
     xhci_extended_capability_t ext_cap_head;
 
     xhci_device_t devices[XHCI_MAX_DEVICES];
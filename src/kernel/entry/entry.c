@@ -15,6 +15,8 @@
 #include <arch/x86_64/pagefault.h>
 #include <proc/proc.h>
 #include <arch/x86_64/syscalls.h>
+#include <arch/x86_64/cpu.h>
+#include <arch/x86_64/smp.h>
 #include <syscalls/scman.h>
 #include <arch/x86_64/io.h>
 #include <halt.h>
@@ -26,6 +28,7 @@
 #include <drivers/pci/pci.h>
 #include <panic/panic.h>
 #include <mem/dma.h>
+#include <mem/vmalloc.h>
 #include <drivers/usb/xhci/xhci.h>
 #include <drivers/usb/xhci/hid_keyboard.h>
 #include <loaders/bin_loader.h>
@@ -53,8 +56,14 @@ static void fail(const char* string) {
 void kmain(void)
 {
     memset(&__bss_start, 0, (&__bss_end) - (&__bss_start));
+
+    // Spinlocks count themselves in the per-CPU area, so it comes first
+    cpu_init_bsp();
     log_ok("Boot", "Cleared BSS");
 
+    // The BSP holds the kernel lock until proc_start_scheduling()
+    kernel_lock();
+
     limine_init();
     log_ok("Boot", "Populated limine info");
 
@@ -93,8 +102,12 @@ void kmain(void)
     log_ok("boot", "Initialized DMA Allocator");
     ok("Initialized DMA Allocator");
 
+    vmalloc_init();
+    log_ok("Boot", "Initialized vmalloc");
+    ok("Initialized vmalloc");
+
+    // The LAPIC timer is armed once scheduling starts
     timer_init();
-    lapic_timer_start(LAPIC_TIMER_PERIODIC, 100);
     log_ok("Boot", "Initialized timer");
     ok("Initialized PIT");
 
@@ -153,6 +166,12 @@ void kmain(void)
     log_ok("Kernel", "Loaded and registerd syscalls");
     ok("Loaded and registerd syscalls");
 
+    smp_init();
+    log_ok("Boot", "Started application processors");
+
+    limine_release();
+    log_ok("Boot", "Released bootloader memory");
+
     int r = bin_load_elf("/bin/misys", 10, 0);
     if (r < 0)
     {
@@ -4,8 +4,11 @@
 #include <arch/x86_64/idt.h>
 #include <arch/x86_64/isr.h>
 #include <arch/x86_64/irq.h>
+#include <arch/x86_64/cpu.h>
+#include <arch/x86_64/smp.h>
 #include <arch/x86_64/isr_handlers.h>
 #include <drivers/acpi/acpi.h>
+#include <drivers/apic/lapic.h>
 #include <timer/timer.h>
 
 void cpu_enable_sse(void)
@@ -35,6 +38,9 @@ void HAL_Initialize()
     log_ok("Boot/HAL", "Initialized IDT");
 
     x86_64_ISR_Initialize();
+    // The scheduler switches on a per-CPU stack, never the outgoing process's
+    x86_64_IDT_SetIST(LAPIC_TIMER_VECTOR, CPU_SCHED_IST);
+    x86_64_IDT_SetIST(SMP_RESCHED_VECTOR, CPU_SCHED_IST);
     log_ok("Boot/HAL", "Initialized ISR");
 
     acpi_init();
@@ -1,3 +1,6 @@
 #pragma once
 
-void HAL_Initialize();
\ No newline at end of file
+void HAL_Initialize();
+
+// Turn on SSE for the calling CPU; APs run it themselves
+void cpu_enable_sse(void);
\ No newline at end of file
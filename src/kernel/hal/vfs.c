@@ -21,6 +21,9 @@
 #include <device/stdout/device_stdout.h>
 #include <block/block_mbr.h>
 #include <block/block_ramdisk.h>
+#include <block/block_zram.h>
+#include <mem/swap.h>
+#include <util/str_to_int.h>
 #include <mkfs/ext2_format.h>
 #include <errno/errno.h>
 #include <net/unix_socket.h>
@@ -331,6 +334,30 @@ int VFS_Write(int fd, size_t count, void* buf, bool privileged)
     return result;
 }
 
+int VFS_Mmap(int fd, bool shared_write, ext2_fs_t** fs, uint32_t* inode, bool privileged)
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !open_files[fd].exists)
+        return (int)serror(EBADF);
+
+    if (!privileged && open_files[fd].pid != proc_get_current_pid())
+        return (int)serror(EACCES);
+
+    // Only regular ext2 files have pages to map
+    if (open_files[fd].is_socket || open_files[fd].is_dev || open_files[fd].is_dir ||
+        !open_files[fd].file)
+        return (int)serror(ENODEV);
+
+    const char* rel;
+    resolve_fs(open_files[fd].path, &rel);
+
+    if (shared_write && !vfs_access_ok(open_files[fd].fs, rel, ACCESS_WRITE, privileged))
+        return (int)serror(EACCES);
+
+    *fs    = open_files[fd].file->fs;
+    *inode = open_files[fd].file->inode_num;
+    return 0;
+}
+
 static void setwriteall(bool new, int fd)
 {
     open_files[fd].write_all = true;
@@ -746,11 +773,20 @@ static void create_special_files(void)
     VFS_Mount("ram0", "/dev");
     log_ok("VFS", "Created and mounted device ramdisk(/dev, ram0)");
 
-    block_device_t *tmp_ramdisk = ramdisk_create_blockdev("ram1", 4 * 1024 * 1024);
+    // Compressed, so only the data written to /tmp takes up memory
+    block_device_t *tmp_ramdisk = zram_create_blockdev("zram0", 16 * 1024 * 1024);
     block_register(tmp_ramdisk);
     ext2_format(tmp_ramdisk);
-    VFS_Mount("ram1", "/tmp");
-    log_ok("VFS", "Created and mounted tmp ramdisk(/tmp, ram1)");
+    VFS_Mount("zram0", "/tmp");
+    log_ok("VFS", "Created and mounted tmp ramdisk(/tmp, zram0)");
+
+    // Compressed swap in RAM unless a swap partition was found
+    int zswap_mb = str_to_int(config_get("zram_swap", "0"));
+    if (zswap_mb > 0 && !swap_enabled()) {
+        block_device_t *swap_ramdisk = zram_create_blockdev("zram1", (uint64_t)zswap_mb * 1024 * 1024);
+        if (swap_ramdisk && block_register(swap_ramdisk))
+            swap_add_device(swap_ramdisk);
+    }
 
     stdin_device_init("/dev/stdin");
     stdout_device_init("/dev/stdout");
@@ -77,6 +77,9 @@ int  VFS_Set_Pos(int fd, uint32_t pos, bool privileged);
 int  VFS_GetDents64(int fd, struct linux_dirent64* buf, size_t count);
 int  VFS_ioctl(int fd, uint64_t req, void* arg);
 
+// Backing inode for mmap of fd; shared_write checks write permission too
+int  VFS_Mmap(int fd, bool shared_write, ext2_fs_t** fs, uint32_t* inode, bool privileged);
+
 /* DEPRECATED */
 int  VFS_Write_old(fd_t file, uint8_t* data, size_t size);
 
@@ -1,30 +1,305 @@
 #include "heap.h"
 #include <mem/pmm.h>
 #include <mem/vmm.h>
+#include <mem/shrinker.h>
 #include <debug.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <util/spinlock.h>
 
 #define HEAP_MODULE "HEAP"
 #define HEAP_VIRTUAL_BASE 0xFFFFFFFF90000000ULL  // Kernel heap base address
-#define DEFAULT_HEAP_SIZE (16 * 1024 * 1024)     // 16MB default heap
+#define DEFAULT_HEAP_SIZE (16 * 1024 * 1024)     // 16MB mapped at boot
 #define MIN_HEAP_SIZE (4 * 1024 * 1024)          // Minimum 4MB heap
+#define HEAP_MAX_SIZE (1024ULL * 1024 * 1024)    // 1GB of reserved virtual space
+#define HEAP_GROW_CHUNK (2 * 1024 * 1024)        // Grow in 2MB (huge page) steps
+#define HEAP_TRIM_THRESHOLD (4 * 1024 * 1024)    // Unmap free tails above 4MB
 #define BLOCK_MAGIC 0xDEADBEEF
 
+// Two-level segregated fit (TLSF). The first level splits sizes by power
+// of two, the second level splits each power of two into SL_COUNT linear
+// classes. Bitmaps over both levels find a fitting free list in O(1).
+#define ALIGN_LOG2      4
+#define ALIGN_SIZE      (1ULL << ALIGN_LOG2)
+#define SL_LOG2         4
+#define SL_COUNT        (1U << SL_LOG2)
+#define FL_SHIFT        (SL_LOG2 + ALIGN_LOG2)
+#define FL_MAX          40                      // Largest block: 1TB
+#define FL_COUNT        (FL_MAX - FL_SHIFT + 1)
+#define SMALL_BLOCK     (1ULL << FL_SHIFT)
+
+#define BLOCK_FREE      0x1   // This block is free
+#define BLOCK_PREV_FREE 0x2   // The physically preceding block is free
+
+// Every block carries a boundary tag: its own size plus a pointer to the
+// physically preceding block, so kfree can coalesce in both directions
+// without walking anything. The free-list links overlap the payload and
+// are only valid while the block is free.
 typedef struct Block {
-    uint32_t magic; 
-    uint64_t size; 
-    int is_free; 
-    struct Block* next; 
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t size;                  // Payload size in bytes
+    struct Block* prev_phys;
+    uint64_t reserved;
+    struct Block* next_free;
+    struct Block* prev_free;
 } Block;
 
-static Block* free_list = NULL;
+#define BLOCK_OVERHEAD  offsetof(Block, next_free)
+#define BLOCK_MIN_SIZE  (sizeof(Block) - BLOCK_OVERHEAD)
+
+static Block* free_lists[FL_COUNT][SL_COUNT];
+static uint64_t fl_bitmap = 0;
+static uint32_t sl_bitmap[FL_COUNT];
+
+static spinlock_t heap_lock = { 0 };
 static int heap_initialized = 0;
 static uint64_t heap_start = 0;
-static uint64_t heap_size = 0;
+static uint64_t heap_size = 0;              // Currently mapped bytes
 
 static uint64_t align(uint64_t size) {
-    return (size + 15) & ~15;\
+    return (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+}
+
+static inline int fls64(uint64_t x) {
+    return 63 - __builtin_clzll(x);
+}
+
+static inline void* block_to_ptr(Block* b) {
+    return (char*)b + BLOCK_OVERHEAD;
+}
+
+static inline Block* ptr_to_block(void* ptr) {
+    return (Block*)((char*)ptr - BLOCK_OVERHEAD);
+}
+
+static inline Block* block_next(Block* b) {
+    return (Block*)((char*)b + BLOCK_OVERHEAD + b->size);
+}
+
+static void mapping_insert(uint64_t size, int* fl, int* sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size / (SMALL_BLOCK / SL_COUNT));
+    } else {
+        int f = fls64(size);
+        *sl = (int)((size >> (f - SL_LOG2)) ^ SL_COUNT);
+        *fl = f - (FL_SHIFT - 1);
+    }
+}
+
+// Round the request up to the next class so any block found there fits
+static void mapping_search(uint64_t size, int* fl, int* sl) {
+    if (size >= SMALL_BLOCK)
+        size += (1ULL << (fls64(size) - SL_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static void free_list_remove(Block* b) {
+    int fl, sl;
+    mapping_insert(b->size, &fl, &sl);
+
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else free_lists[fl][sl] = b->next_free;
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl])
+            fl_bitmap &= ~(1ULL << fl);
+    }
+}
+
+static void free_list_insert(Block* b) {
+    int fl, sl;
+    mapping_insert(b->size, &fl, &sl);
+
+    b->prev_free = NULL;
+    b->next_free = free_lists[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    free_lists[fl][sl] = b;
+
+    sl_bitmap[fl] |= 1U << sl;
+    fl_bitmap |= 1ULL << fl;
+}
+
+static Block* find_free_block(uint64_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT)
+        return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint64_t fl_map = (fl + 1 < 64) ? fl_bitmap & (~0ULL << (fl + 1)) : 0;
+        if (!fl_map)
+            return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    Block* b = free_lists[fl][sl];
+    free_list_remove(b);
+    return b;
+}
+
+static void mark_free(Block* b) {
+    b->flags |= BLOCK_FREE;
+    Block* next = block_next(b);
+    next->flags |= BLOCK_PREV_FREE;
+    next->prev_phys = b;
+}
+
+static void mark_used(Block* b) {
+    b->flags &= ~BLOCK_FREE;
+    block_next(b)->flags &= ~BLOCK_PREV_FREE;
+}
+
+// Split `b` so that it keeps `size` bytes; the remainder becomes a new free
+// block. Returns the remainder or NULL when it would be too small.
+static Block* split_block(Block* b, uint64_t size) {
+    if (b->size < size + sizeof(Block))
+        return NULL;
+
+    Block* rest = (Block*)((char*)b + BLOCK_OVERHEAD + size);
+    rest->magic = BLOCK_MAGIC;
+    rest->flags = 0;
+    rest->size = b->size - size - BLOCK_OVERHEAD;
+    rest->prev_phys = b;
+    b->size = size;
+
+    block_next(rest)->prev_phys = rest;
+    return rest;
+}
+
+// Merge `b` with its free physical neighbours; `b` must not be on a list
+static Block* coalesce(Block* b) {
+    if (b->flags & BLOCK_PREV_FREE) {
+        Block* prev = b->prev_phys;
+        free_list_remove(prev);
+        prev->size += BLOCK_OVERHEAD + b->size;
+        b->magic = 0;
+        b = prev;
+        block_next(b)->prev_phys = b;
+    }
+
+    Block* next = block_next(b);
+    if (next->flags & BLOCK_FREE) {
+        free_list_remove(next);
+        b->size += BLOCK_OVERHEAD + next->size;
+        next->magic = 0;
+        block_next(b)->prev_phys = b;
+    }
+
+    return b;
+}
+
+// Return a block (not on any list) to the free lists
+static void release_block(Block* b) {
+    b = coalesce(b);
+    mark_free(b);
+    free_list_insert(b);
+}
+
+// Give back the unused tail of an allocated block
+static void trim_block(Block* b, uint64_t size) {
+    Block* rest = split_block(b, size);
+    if (rest)
+        release_block(rest);
+}
+
+// Back `pages` pages at `virt`, preferring one contiguous run
+static bool heap_map_pages(uint64_t virt, uint64_t pages) {
+    address_space_t* ks = vmm_get_kernel_space();
+
+    if (vmm_alloc_pages(ks, (void*)virt, pages, PAGE_WRITE | PAGE_PRESENT)) {
+        return true;
+    }
+
+    for (uint64_t i = 0; i < pages; i++) {
+        if (!vmm_alloc_page(ks, (void*)(virt + i * PAGE_SIZE), PAGE_WRITE | PAGE_PRESENT)) {
+            vmm_free_pages(ks, (void*)virt, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Map more of the reserved window so a block of `size` bytes can be found.
+// The old end sentinel becomes the header of the new free space.
+static bool heap_grow(uint64_t size) {
+    uint64_t need = size + BLOCK_OVERHEAD;
+    if (size >= SMALL_BLOCK) {
+        need += 1ULL << (fls64(size) - SL_LOG2);
+    }
+    uint64_t bytes = (need + HEAP_GROW_CHUNK - 1) & ~((uint64_t)HEAP_GROW_CHUNK - 1);
+
+    if (heap_size + bytes > HEAP_MAX_SIZE) {
+        return false;
+    }
+
+    uint64_t heap_end = heap_start + heap_size;
+    if (!heap_map_pages(heap_end, bytes / PAGE_SIZE)) {
+        return false;
+    }
+
+    Block* block = (Block*)(heap_end - BLOCK_OVERHEAD);
+    block->size = bytes - BLOCK_OVERHEAD;
+
+    Block* sentinel = block_next(block);
+    sentinel->magic = BLOCK_MAGIC;
+    sentinel->flags = 0;
+    sentinel->size = 0;
+    sentinel->prev_phys = block;
+
+    heap_size += bytes;
+    release_block(block);
+    return true;
+}
+
+// Unmap the free tail ending at `block` if it has grown large, keeping
+// one grow chunk of slack and never going below the boot-time size
+static void heap_trim(Block* block) {
+    if (!(block->flags & BLOCK_FREE) || block->size < HEAP_TRIM_THRESHOLD) {
+        return;
+    }
+
+    uint64_t heap_end = heap_start + heap_size;
+    uint64_t new_end = ((uint64_t)block_to_ptr(block) + 2 * HEAP_GROW_CHUNK - 1) &
+                       ~((uint64_t)HEAP_GROW_CHUNK - 1);
+    if (new_end < heap_start + DEFAULT_HEAP_SIZE) {
+        new_end = heap_start + DEFAULT_HEAP_SIZE;
+    }
+    if (new_end >= heap_end) {
+        return;
+    }
+
+    free_list_remove(block);
+    block->size = new_end - BLOCK_OVERHEAD - (uint64_t)block_to_ptr(block);
+
+    Block* sentinel = block_next(block);
+    sentinel->magic = BLOCK_MAGIC;
+    sentinel->flags = 0;
+    sentinel->size = 0;
+    mark_free(block);
+    free_list_insert(block);
+
+    vmm_free_pages(vmm_get_kernel_space(), (void*)new_end, (heap_end - new_end) / PAGE_SIZE);
+    heap_size = new_end - heap_start;
+}
+
+// The heap could not grow: have the shrinkers free a grow chunk's worth
+// of pages (outside heap_lock, they may kfree) and allow one more try.
+// With interrupts on no spinlock is held, so the shrinkers that write to
+// disk may run as well
+static bool heap_reclaim(bool* reclaimed) {
+    if (*reclaimed) {
+        return false;
+    }
+    *reclaimed = true;
+    return shrink_memory(HEAP_GROW_CHUNK / PAGE_SIZE, !irqs_enabled()) > 0;
 }
 
 void init_heap(void) {
@@ -32,91 +307,174 @@ void init_heap(void) {
         log_warn(HEAP_MODULE, "Heap already initialized");
         return;
     }
-    
+
     log_info(HEAP_MODULE, "Initializing kernel heap...");
-    
+
     // Set heap parameters
     heap_start = HEAP_VIRTUAL_BASE;
     heap_size = DEFAULT_HEAP_SIZE;
-    
+
     // Calculate number of pages needed
     uint64_t pages_needed = (heap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    
+
     log_info(HEAP_MODULE, "Allocating %llu pages (%llu MB) at virtual address 0x%llx",
              pages_needed, heap_size / (1024 * 1024), heap_start);
-    
+
     // Allocate and map pages for the heap
-    void* result = vmm_alloc_pages(vmm_get_kernel_space(), 
-                                   (void*)heap_start, 
+    void* result = vmm_alloc_pages(vmm_get_kernel_space(),
+                                   (void*)heap_start,
                                    pages_needed,
                                    PAGE_WRITE | PAGE_PRESENT);
-    
+
     if (!result) {
         log_crit(HEAP_MODULE, "Failed to allocate virtual memory for heap");
         return;
     }
-    
-    // Initialize the free list with one large free block
-    free_list = (Block*)heap_start;
-    free_list->magic = BLOCK_MAGIC;
-    free_list->size = heap_size - sizeof(Block);
-    free_list->is_free = 1;
-    free_list->next = NULL;
-    
+
+    // One large free block followed by a zero-sized used sentinel, so
+    // every real block has a physical successor to update
+    Block* first = (Block*)heap_start;
+    first->magic = BLOCK_MAGIC;
+    first->flags = 0;
+    first->size = heap_size - 2 * BLOCK_OVERHEAD;
+    first->prev_phys = NULL;
+
+    Block* sentinel = block_next(first);
+    sentinel->magic = BLOCK_MAGIC;
+    sentinel->flags = 0;
+    sentinel->size = 0;
+    sentinel->prev_phys = first;
+
+    mark_free(first);
+    free_list_insert(first);
+
     heap_initialized = 1;
-    log_ok(HEAP_MODULE, "Heap initialized: %llu MB available at 0x%llx", 
-           heap_size / (1024 * 1024), heap_start);
+    log_ok(HEAP_MODULE, "Heap initialized: %llu MB available at 0x%llx (grows to %llu MB)",
+           heap_size / (1024 * 1024), heap_start, HEAP_MAX_SIZE / (1024 * 1024));
 }
 
-void* kmalloc(uint64_t size) {
+static int heap_ready(void) {
     if (!heap_initialized) {
         log_warn(HEAP_MODULE, "Auto-initializing heap on first allocation");
         init_heap();
     }
-    
+
     if (!heap_initialized) {
         log_crit(HEAP_MODULE, "Heap initialization failed");
+        return 0;
+    }
+    return 1;
+}
+
+void* kmalloc(uint64_t size) {
+    if (!heap_ready()) {
         return NULL;
     }
-    
+
     if (size == 0) {
         log_warn(HEAP_MODULE, "Attempted to allocate 0 bytes");
         return NULL;
     }
-    
+
     uint64_t aligned_size = align(size);
-    
-    Block* current = free_list;
-    
-    while (current) {
-        if (current->magic != BLOCK_MAGIC) {
-            log_crit(HEAP_MODULE, "Heap corruption detected at block %p", current);
-            return NULL;
+    if (aligned_size < BLOCK_MIN_SIZE) {
+        aligned_size = BLOCK_MIN_SIZE;
+    }
+
+    bool reclaimed = false;
+retry:;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    Block* block = find_free_block(aligned_size);
+    if (!block && heap_grow(aligned_size)) {
+        block = find_free_block(aligned_size);
+    }
+    if (block) {
+        mark_used(block);
+        trim_block(block, aligned_size);
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (!block && heap_reclaim(&reclaimed)) {
+        goto retry;
+    }
+
+    if (!block) {
+        log_err(HEAP_MODULE, "Out of memory: failed to allocate %llu bytes", size);
+        return NULL;
+    }
+
+    return block_to_ptr(block);
+}
+
+void* kmalloc_aligned(uint64_t size, uint64_t alignment) {
+    if (alignment <= ALIGN_SIZE) {
+        return kmalloc(size);
+    }
+
+    if (alignment & (alignment - 1)) {
+        log_err(HEAP_MODULE, "kmalloc_aligned: alignment %llu is not a power of two", alignment);
+        return NULL;
+    }
+
+    if (!heap_ready()) {
+        return NULL;
+    }
+
+    if (size == 0) {
+        log_warn(HEAP_MODULE, "Attempted to allocate 0 bytes");
+        return NULL;
+    }
+
+    uint64_t aligned_size = align(size);
+    if (aligned_size < BLOCK_MIN_SIZE) {
+        aligned_size = BLOCK_MIN_SIZE;
+    }
+
+    bool reclaimed = false;
+retry:;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    // Leave room to carve a free block off the front of whatever we find
+    uint64_t search_size = aligned_size + alignment + sizeof(Block);
+    Block* block = find_free_block(search_size);
+    if (!block && heap_grow(search_size)) {
+        block = find_free_block(search_size);
+    }
+    if (block) {
+        uint64_t ptr = (uint64_t)block_to_ptr(block);
+        uint64_t target = (ptr + alignment - 1) & ~(alignment - 1);
+
+        while (target != ptr && target - ptr < sizeof(Block)) {
+            target += alignment;
         }
-        
-        if (current->is_free && current->size >= aligned_size) {
-            // Split block if there's enough space for another block
-            if (current->size >= aligned_size + sizeof(Block) + 16) {
-                Block* new_block = (Block*)((char*)current + sizeof(Block) + aligned_size);
-                new_block->magic = BLOCK_MAGIC;
-                new_block->size = current->size - aligned_size - sizeof(Block);
-                new_block->is_free = 1;
-                new_block->next = current->next;
-                
-                current->size = aligned_size;
-                current->next = new_block;
-            }
-            
-            current->is_free = 0;
-            void* ptr = (void*)((char*)current + sizeof(Block));
-            return ptr;
+
+        if (target != ptr) {
+            // Split off the leading gap; it goes back on the free lists
+            Block* lead = block;
+            block = split_block(lead, target - ptr - BLOCK_OVERHEAD);
+            lead->flags &= ~BLOCK_FREE;
+            release_block(lead);
         }
-        
-        current = current->next;
+
+        mark_used(block);
+        trim_block(block, aligned_size);
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (!block && heap_reclaim(&reclaimed)) {
+        goto retry;
+    }
+
+    if (!block) {
+        log_err(HEAP_MODULE, "Out of memory: failed to allocate %llu bytes aligned to %llu",
+                size, alignment);
+        return NULL;
     }
-    
-    log_err(HEAP_MODULE, "Out of memory: failed to allocate %llu bytes", size);
-    return NULL;
+
+    return block_to_ptr(block);
 }
 
 void kfree(void* ptr) {
@@ -124,50 +482,42 @@ void kfree(void* ptr) {
         log_warn(HEAP_MODULE, "Attempted to free NULL pointer");
         return;
     }
-    
+
     if (!heap_initialized) {
         log_err(HEAP_MODULE, "Attempted to free before heap initialization");
         return;
     }
-    
+
     uint64_t heap_end = heap_start + heap_size;
     uint64_t ptr_addr = (uint64_t)ptr;
-    
+
     if (ptr_addr < heap_start || ptr_addr >= heap_end) {
         log_err(HEAP_MODULE, "Attempted to free pointer outside heap: %p", ptr);
         return;
     }
-    
-    Block* block = (Block*)((char*)ptr - sizeof(Block));
-    
+
+    Block* block = ptr_to_block(ptr);
+
     if (block->magic != BLOCK_MAGIC) {
         log_err(HEAP_MODULE, "Invalid block magic at %p (corruption or invalid pointer)", ptr);
         return;
     }
-    
-    if (block->is_free) {
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    if (block->flags & BLOCK_FREE) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         log_warn(HEAP_MODULE, "Double free detected at %p", ptr);
         return;
     }
-    
-    block->is_free = 1;
-    
-    // Coalesce with next block if it's free
-    if (block->next && block->next->is_free) {
-        block->size += sizeof(Block) + block->next->size;
-        block->next = block->next->next;
-    }
-    
-    // Coalesce with previous block if it's free
-    Block* current = free_list;
-    while (current && current->next != block) {
-        current = current->next;
-    }
-    
-    if (current && current->is_free) {
-        current->size += sizeof(Block) + block->size;
-        current->next = block->next;
-    }
+
+    release_block(block);
+
+    // release_block may have merged us into a neighbour; check the block
+    // that now ends the heap
+    heap_trim(((Block*)(heap_start + heap_size - BLOCK_OVERHEAD))->prev_phys);
+
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 void get_heap_stats(HeapStats* stats) {
@@ -175,29 +525,34 @@ void get_heap_stats(HeapStats* stats) {
         log_warn(HEAP_MODULE, "get_heap_stats called before heap initialization");
         return;
     }
-    
+
     if (!stats) {
         log_err(HEAP_MODULE, "get_heap_stats called with NULL stats pointer");
         return;
     }
-    
+
     stats->total_size = heap_size;
     stats->used_size = 0;
     stats->free_size = 0;
     stats->num_blocks = 0;
     stats->num_free_blocks = 0;
-    
-    Block* current = free_list;
-    while (current) {
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    // Walk blocks in address order up to the zero-sized sentinel
+    Block* current = (Block*)heap_start;
+    while (current->size) {
         stats->num_blocks++;
-        if (current->is_free) {
+        if (current->flags & BLOCK_FREE) {
             stats->num_free_blocks++;
             stats->free_size += current->size;
         } else {
             stats->used_size += current->size;
         }
-        current = current->next;
+        current = block_next(current);
     }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 void defrag_heap(void) {
@@ -205,20 +560,37 @@ void defrag_heap(void) {
         log_err(HEAP_MODULE, "defrag_heap called before heap initialization");
         return;
     }
-    
+
+    // Frees coalesce immediately, so this only verifies the block chain
+    // and repairs any adjacent free pair it finds
     int merged_count = 0;
-    Block* current = free_list;
-    while (current) {
-        if (current->is_free && current->next && current->next->is_free) {
-            current->size += sizeof(Block) + current->next->size;
-            current->next = current->next->next;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    Block* current = (Block*)heap_start;
+    while (current->size) {
+        if (current->magic != BLOCK_MAGIC) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            log_crit(HEAP_MODULE, "Heap corruption detected at block %p", current);
+            return;
+        }
+
+        Block* next = block_next(current);
+        if ((current->flags & BLOCK_FREE) && (next->flags & BLOCK_FREE)) {
+            free_list_remove(current);
+            free_list_remove(next);
+            current->size += BLOCK_OVERHEAD + next->size;
+            next->magic = 0;
+            mark_free(current);
+            free_list_insert(current);
             merged_count++;
         } else {
-            current = current->next;
+            current = next;
         }
     }
-    
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
     if (merged_count > 0) {
         log_info(HEAP_MODULE, "Defragmentation merged %d blocks", merged_count);
     }
-}
\ No newline at end of file
+}
@@ -17,6 +17,10 @@ void init_heap(void);
 // Allocate memory from heap
 void* kmalloc(uint64_t size);
 
+// Allocate memory whose address is a multiple of `alignment`
+// (a power of two, e.g. 64 for a cache line or 4096 for a page)
+void* kmalloc_aligned(uint64_t size, uint64_t alignment);
+
 // Free memory back to heap
 void kfree(void* ptr);
 
@@ -8,6 +8,10 @@
 #include <fb/framebuffer.h>
 #include <fb/textrenderer.h>
 #include <debug.h>
+#include <heap.h>
+#include <memory.h>
+#include <mem/pmm.h>
+#include <mem/vmm.h>
 
 __attribute__((used, section(".limine_requests")))
 static volatile uint64_t limine_requests_start[] =
@@ -154,3 +158,237 @@ void* limine_get_module(const char* name, uint64_t* out_size) {
 
     return NULL;
 }
+
+// Kernel-owned copies of the responses, made by limine_release()
+static struct limine_bootloader_info_response bootloader_info_copy;
+static struct limine_memmap_response memmap_copy;
+static struct limine_framebuffer_response framebuffer_copy;
+static struct limine_mp_response mp_copy;
+static struct limine_module_response modules_copy;
+static struct limine_rsdp_response rsdp_copy;
+
+// Large enough for an ACPI 2.0 XSDP
+static uint8_t rsdp_table[36];
+
+// APs nobody started are sent here before their stacks and page tables
+// are freed. They share one stack: nothing runs on it once they halt
+#define AP_PARK_TIMEOUT 100000000ULL
+
+static uint8_t ap_park_stack[256] __attribute__((aligned(16)));
+static volatile uint64_t ap_park_cr3 = 0;
+static volatile uint64_t ap_parked = 0;
+
+__attribute__((noreturn))
+static void ap_park(struct limine_mp_info* info) {
+    (void)info;
+    __asm__ volatile(
+        "mov %0, %%rsp\n"
+        "mov %1, %%cr3\n"
+        "lock incq %2\n"
+        "1: cli\n"
+        "hlt\n"
+        "jmp 1b\n"
+        :: "r"(ap_park_stack + sizeof(ap_park_stack)), "r"(ap_park_cr3), "m"(ap_parked)
+        : "memory");
+    __builtin_unreachable();
+}
+
+// Park every AP still spinning in Limine's trampoline; false if some
+// did not get there in time
+static bool park_aps(void) {
+    if (!mp_info)
+        return true;
+
+    ap_park_cr3 = (uint64_t)vmm_get_kernel_space()->pml4;
+
+    uint64_t waiting = 0;
+    for (uint64_t i = 0; i < mp_info->cpu_count; i++) {
+        struct limine_mp_info* cpu = mp_info->cpus[i];
+        if (cpu->lapic_id == mp_info->bsp_lapic_id || cpu->goto_address)
+            continue;
+        __atomic_store_n(&cpu->goto_address, ap_park, __ATOMIC_SEQ_CST);
+        waiting++;
+    }
+
+    for (uint64_t spin = 0; ap_parked < waiting; spin++) {
+        if (spin == AP_PARK_TIMEOUT) {
+            log_err("Limine", "Only %llu of %llu APs parked", ap_parked, waiting);
+            return false;
+        }
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+static bool copy_bootloader_info(void) {
+    if (!bootloader_info)
+        return true;
+
+    char* name = strdup(bootloader_info->name);
+    char* version = strdup(bootloader_info->version);
+    if (!name || !version) {
+        if (name) kfree(name);
+        if (version) kfree(version);
+        return false;
+    }
+
+    bootloader_info_copy = *bootloader_info;
+    bootloader_info_copy.name = name;
+    bootloader_info_copy.version = version;
+    bootloader_info = &bootloader_info_copy;
+    return true;
+}
+
+static bool copy_memmap(void) {
+    if (!memmap)
+        return true;
+
+    uint64_t count = memmap->entry_count;
+    struct limine_memmap_entry* entries = kmalloc(count * sizeof(*entries));
+    struct limine_memmap_entry** table = kmalloc(count * sizeof(*table));
+    if (!entries || !table) {
+        if (entries) kfree(entries);
+        if (table) kfree(table);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        entries[i] = *memmap->entries[i];
+        table[i] = &entries[i];
+    }
+
+    memmap_copy = *memmap;
+    memmap_copy.entries = table;
+    memmap = &memmap_copy;
+    return true;
+}
+
+static bool copy_modules(void) {
+    if (!modules)
+        return true;
+
+    uint64_t count = modules->module_count;
+    struct limine_file* files = kmalloc(count * sizeof(*files));
+    struct limine_file** table = kmalloc(count * sizeof(*table));
+    if (!files || !table) {
+        if (files) kfree(files);
+        if (table) kfree(table);
+        return false;
+    }
+
+    // The file contents sit in EXECUTABLE_AND_MODULES memory and stay put
+    for (uint64_t i = 0; i < count; i++) {
+        struct limine_file* mod = modules->modules[i];
+        files[i] = *mod;
+        files[i].path = strdup(mod->path);
+        files[i].string = strdup(mod->string);
+        table[i] = &files[i];
+        if ((mod->path && !files[i].path) || (mod->string && !files[i].string)) {
+            for (uint64_t j = 0; j <= i; j++) {
+                if (files[j].path) kfree(files[j].path);
+                if (files[j].string) kfree(files[j].string);
+            }
+            kfree(files);
+            kfree(table);
+            return false;
+        }
+    }
+
+    modules_copy = *modules;
+    modules_copy.modules = table;
+    modules = &modules_copy;
+    return true;
+}
+
+static bool copy_framebuffer(void) {
+    if (!framebuffer)
+        return true;
+
+    uint64_t count = framebuffer->framebuffer_count;
+    struct limine_framebuffer* fbs = kmalloc(count * sizeof(*fbs));
+    struct limine_framebuffer** table = kmalloc(count * sizeof(*table));
+    if (!fbs || !table) {
+        if (fbs) kfree(fbs);
+        if (table) kfree(table);
+        return false;
+    }
+
+    // Video modes and EDID data are only of use to a mode-setting driver,
+    // which we do not have
+    for (uint64_t i = 0; i < count; i++) {
+        fbs[i] = *framebuffer->framebuffers[i];
+        fbs[i].edid_size = 0;
+        fbs[i].edid = NULL;
+        if (framebuffer->revision >= 1) {
+            fbs[i].mode_count = 0;
+            fbs[i].modes = NULL;
+        }
+        table[i] = &fbs[i];
+    }
+
+    framebuffer_copy = *framebuffer;
+    framebuffer_copy.framebuffers = table;
+    framebuffer = &framebuffer_copy;
+    return true;
+}
+
+static bool copy_mp_info(void) {
+    if (!mp_info)
+        return true;
+
+    uint64_t count = mp_info->cpu_count;
+    struct limine_mp_info* cpus = kmalloc(count * sizeof(*cpus));
+    struct limine_mp_info** table = kmalloc(count * sizeof(*table));
+    if (!cpus || !table) {
+        if (cpus) kfree(cpus);
+        if (table) kfree(table);
+        return false;
+    }
+
+    // Only the IDs are of use from here on: writing goto_address in the
+    // copy starts nothing
+    for (uint64_t i = 0; i < count; i++) {
+        cpus[i] = *mp_info->cpus[i];
+        table[i] = &cpus[i];
+    }
+
+    mp_copy = *mp_info;
+    mp_copy.cpus = table;
+    mp_info = &mp_copy;
+    return true;
+}
+
+static void copy_rsdp(void) {
+    if (!rsdp)
+        return;
+
+    // ACPI 1.0 RSDPs are 20 bytes and have no length field
+    uint8_t* table = (uint8_t*)rsdp;
+    size_t len = table[15] >= 2 ? *(uint32_t*)(table + 20) : 20;
+    if (len > sizeof(rsdp_table))
+        len = sizeof(rsdp_table);
+    memcpy(rsdp_table, table, len);
+
+    rsdp_copy = *rsdp_res;
+    rsdp_copy.address = rsdp_table;
+    rsdp_res = &rsdp_copy;
+    rsdp = rsdp_table;
+}
+
+void limine_release(void) {
+    if (!park_aps()) {
+        log_warn("Limine", "Keeping bootloader memory, APs may still use it");
+        return;
+    }
+
+    copy_rsdp();
+
+    if (!copy_bootloader_info() || !copy_memmap() || !copy_modules() ||
+        !copy_framebuffer() || !copy_mp_info()) {
+        log_err("Limine", "Out of memory copying boot information");
+        return;
+    }
+
+    // Nothing refers to the original responses any more
+    pmm_release_bootloader_memory();
+}
@@ -10,6 +10,11 @@ void* limine_get_module(const char* name, uint64_t* out_size);
 void* limine_get_rsdp(void);
 uint64_t limine_get_hddm(void);
 
+// Copy the responses still needed into kernel memory, park APs that were
+// never started and give the BOOTLOADER_RECLAIMABLE regions to the PMM.
+// Call once early init no longer needs Limine's page tables or AP stacks
+void limine_release(void);
+
 extern volatile struct limine_bootloader_info_request bootloader_info_request;
 extern volatile struct limine_hhdm_request hhdm_request;
 extern volatile struct limine_memmap_request memmap_request;
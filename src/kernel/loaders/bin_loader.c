@@ -2,7 +2,10 @@
 
 #include <hal/vfs.h>
 #include <proc/proc.h>
+#include <proc/vma.h>
+#include <drivers/fs/ext/ext2_pcache.h>
 #include <heap.h>
+#include <mem/vmalloc.h>
 #include <memory.h>
 #include <debug.h>
 
@@ -24,6 +27,10 @@ typedef uint8_t  Elf64_Byte;
 #define EM_X86_64    62
 #define PT_LOAD      1
 
+#define PF_X         0x1
+#define PF_W         0x2
+#define PF_R         0x4
+
 typedef struct __attribute__((packed)) {
     Elf64_Byte  e_ident[EI_NIDENT];
     Elf64_Half  e_type;
@@ -55,6 +62,9 @@ typedef struct __attribute__((packed)) {
 #define BIN_MAX_IMAGE_SIZE  0x20000000ULL
 #define BIN_MAX_PHDRS       64u
 
+// elf_load_lazy() result when the file has to be loaded eagerly instead
+#define BIN_NOT_LAZY        (-2)
+
 static int elf_validate(const Elf64_Ehdr *ehdr)
 {
     if (ehdr->e_ident[0] != ELFMAG0 ||
@@ -194,13 +204,12 @@ static int elf_read_segments(int fd, const Elf64_Ehdr *ehdr,
     return 0;
 }
 
-static int elf_open_and_load(const char *path,
-                              uint8_t **out_flat_img, size_t *out_flat_size,
-                              uint64_t *out_load_base, uint64_t *out_entry)
+// Open path and read its ELF and program headers. On success the caller
+// owns fd and *out_phdrs
+static int elf_open_headers(const char *path, int *out_fd, Elf64_Ehdr *ehdr,
+                             uint8_t **out_phdrs)
 {
-    int     ret    = -1;
     uint8_t *phdrs = NULL;
-    uint8_t *flat_img = NULL;
 
     int fd = VFS_Open(path, true);
     if (fd < 0) {
@@ -208,28 +217,51 @@ static int elf_open_and_load(const char *path,
         return -1;
     }
 
-    Elf64_Ehdr ehdr;
-    if (elf_read_at(fd, 0, &ehdr, sizeof(Elf64_Ehdr)) < 0)
+    if (elf_read_at(fd, 0, ehdr, sizeof(Elf64_Ehdr)) < 0)
         goto out_close;
 
-    if (elf_validate(&ehdr) < 0)
+    if (elf_validate(ehdr) < 0)
         goto out_close;
 
-    size_t phdrs_bytes = (size_t)ehdr.e_phnum * ehdr.e_phentsize;
+    size_t phdrs_bytes = (size_t)ehdr->e_phnum * ehdr->e_phentsize;
     phdrs = (uint8_t *)kmalloc(phdrs_bytes);
     if (!phdrs) {
         log_err("BIN", "kmalloc(%d) for phdrs failed", (int)phdrs_bytes);
         goto out_close;
     }
 
-    if (ehdr.e_phoff > 0xFFFFFFFFu) {
-        log_err("BIN", "e_phoff 0x%lx exceeds 32-bit VFS limit", ehdr.e_phoff);
+    if (ehdr->e_phoff > 0xFFFFFFFFu) {
+        log_err("BIN", "e_phoff 0x%lx exceeds 32-bit VFS limit", ehdr->e_phoff);
         goto out_phdrs;
     }
 
-    if (elf_read_at(fd, (uint32_t)ehdr.e_phoff, phdrs, phdrs_bytes) < 0)
+    if (elf_read_at(fd, (uint32_t)ehdr->e_phoff, phdrs, phdrs_bytes) < 0)
         goto out_phdrs;
 
+    *out_fd    = fd;
+    *out_phdrs = phdrs;
+    return 0;
+
+out_phdrs:
+    kfree(phdrs);
+out_close:
+    VFS_Close(fd, true);
+    return -1;
+}
+
+static int elf_open_and_load(const char *path,
+                              uint8_t **out_flat_img, size_t *out_flat_size,
+                              uint64_t *out_load_base, uint64_t *out_entry)
+{
+    int     ret    = -1;
+    int     fd;
+    uint8_t *phdrs = NULL;
+    uint8_t *flat_img = NULL;
+
+    Elf64_Ehdr ehdr;
+    if (elf_open_headers(path, &fd, &ehdr, &phdrs) < 0)
+        return -1;
+
     uint64_t load_base, load_end;
     int n_load = elf_parse_load_range(phdrs, &ehdr, &load_base, &load_end);
     if (n_load < 0)
@@ -257,12 +289,12 @@ static int elf_open_and_load(const char *path,
     log_info("BIN", "Load range: 0x%lx - 0x%lx  (%d bytes, %d segment(s))",
              load_base, load_end, (int)flat_size, n_load);
 
-    flat_img = (uint8_t *)kmalloc(flat_size);
+    // vmalloc memory comes back zeroed, which covers the BSS tails
+    flat_img = (uint8_t *)vmalloc(flat_size);
     if (!flat_img) {
-        log_err("BIN", "kmalloc(%d) for flat image failed", (int)flat_size);
+        log_err("BIN", "vmalloc(%d) for flat image failed", (int)flat_size);
         goto out_phdrs;
     }
-    memset(flat_img, 0, flat_size);
 
     if (elf_read_segments(fd, &ehdr, phdrs, flat_img, flat_size, load_base) < 0)
         goto out_img;
@@ -275,10 +307,102 @@ static int elf_open_and_load(const char *path,
     goto out_phdrs;
 
 out_img:
-    kfree(flat_img);
+    vfree(flat_img);
 out_phdrs:
     kfree(phdrs);
-out_close:
+    VFS_Close(fd, true);
+    return ret;
+}
+
+// Segments can be faulted in straight from the file when each one sits at
+// the same page offset in memory and in the file, and no two of them
+// share a page. Returns the number of segments, or BIN_NOT_LAZY
+static int elf_build_segments(const Elf64_Ehdr *ehdr, const uint8_t *phdrs,
+                               proc_segment_t *segs)
+{
+    int n = 0;
+
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *ph =
+            (const Elf64_Phdr *)(phdrs + (size_t)i * ehdr->e_phentsize);
+
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0)
+            continue;
+
+        if (ph->p_filesz > ph->p_memsz ||
+            ((ph->p_vaddr ^ ph->p_offset) & (PAGE_SIZE - 1)))
+            return BIN_NOT_LAZY;
+
+        uint64_t start = ph->p_vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end   = ph->p_vaddr + ph->p_memsz;
+
+        for (int j = 0; j < n; j++) {
+            uint64_t other_start = segs[j].vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t other_end   = segs[j].vaddr + segs[j].memsz;
+            if (start < ((other_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1)) &&
+                other_start < ((end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1)))
+                return BIN_NOT_LAZY;
+        }
+
+        segs[n].vaddr  = ph->p_vaddr;
+        segs[n].memsz  = ph->p_memsz;
+        segs[n].offset = ph->p_offset;
+        segs[n].filesz = ph->p_filesz;
+        segs[n].prot   = ((ph->p_flags & PF_R) ? VMA_PROT_READ  : 0) |
+                         ((ph->p_flags & PF_W) ? VMA_PROT_WRITE : 0) |
+                         ((ph->p_flags & PF_X) ? VMA_PROT_EXEC  : 0);
+
+        log_info("BIN", "  Segment %d: vaddr=0x%lx  filesz=%lu  memsz=%lu  (on demand)",
+                 i, ph->p_vaddr,
+                 (unsigned long)ph->p_filesz,
+                 (unsigned long)ph->p_memsz);
+        n++;
+    }
+
+    if (n == 0) {
+        log_err("BIN", "ELF has no loadable PT_LOAD segments");
+        return -1;
+    }
+    return n;
+}
+
+// Map the segments of path into a new process without reading them;
+// pages come in on first touch. Returns the PID, -1 on error or
+// BIN_NOT_LAZY when the image has to be copied in with the flat loader
+static int elf_load_lazy(const char *path, uint32_t priority, uint32_t parent,
+                          int argc, const char **argv,
+                          int envc, const char **envp)
+{
+    int        fd;
+    uint8_t   *phdrs = NULL;
+    Elf64_Ehdr ehdr;
+
+    if (elf_open_headers(path, &fd, &ehdr, &phdrs) < 0)
+        return -1;
+
+    int ret = BIN_NOT_LAZY;
+
+    ext2_fs_t *fs;
+    uint32_t   inode;
+    if (VFS_Mmap(fd, false, &fs, &inode, true) < 0)
+        goto out;
+
+    proc_segment_t segs[BIN_MAX_PHDRS];
+    int nsegs = elf_build_segments(&ehdr, phdrs, segs);
+    if (nsegs < 0) {
+        ret = nsegs;
+        goto out;
+    }
+
+    // Text pages cached by an earlier exec of the same, unchanged binary
+    // are mapped as they are; only pages nobody has touched yet are read
+    ext2_pcache_revalidate(fs, inode);
+
+    ret = proc_create_user_elf_argv(fs, inode, segs, nsegs, ehdr.e_entry,
+                                    priority, parent, argc, argv, envc, envp);
+
+out:
+    kfree(phdrs);
     VFS_Close(fd, true);
     return ret;
 }
@@ -292,6 +416,16 @@ int bin_load_elf(const char *path, uint32_t priority, uint32_t parent)
 
     log_info("BIN", "Loading ELF: %s", path);
 
+    static const char *default_argv[] = { "prog" };
+    int ret = elf_load_lazy(path, priority, parent, 1, default_argv, 0, NULL);
+    if (ret != BIN_NOT_LAZY) {
+        if (ret < 0)
+            log_err("BIN", "Failed to create process for '%s'", path);
+        else
+            log_ok("BIN", "Launched '%s' -> PID %d (demand paged)", path, ret);
+        return ret;
+    }
+
     uint8_t  *flat_img  = NULL;
     size_t    flat_size = 0;
     uint64_t  load_base = 0;
@@ -300,7 +434,7 @@ int bin_load_elf(const char *path, uint32_t priority, uint32_t parent)
     if (elf_open_and_load(path, &flat_img, &flat_size, &load_base, &entry) < 0)
         return -1;
 
-    int ret = proc_create_user_image(flat_img, flat_size,
+    ret = proc_create_user_image(flat_img, flat_size,
                                      load_base, entry,
                                      priority, parent);
 
@@ -310,7 +444,7 @@ int bin_load_elf(const char *path, uint32_t priority, uint32_t parent)
         log_ok("BIN", "Launched '%s' -> PID %d  (entry=0x%lx, base=0x%lx)",
                path, ret, entry, load_base);
 
-    kfree(flat_img);
+    vfree(flat_img);
     return ret;
 }
 
@@ -325,6 +459,15 @@ int bin_load_elf_argv(const char *path, uint32_t priority, uint32_t parent,
 
     log_info("BIN", "Loading ELF: %s  (argc=%d, envc=%d)", path, argc, envc);
 
+    int ret = elf_load_lazy(path, priority, parent, argc, argv, envc, envp);
+    if (ret != BIN_NOT_LAZY) {
+        if (ret < 0)
+            log_err("BIN", "Failed to create process for '%s'", path);
+        else
+            log_ok("BIN", "Launched '%s' -> PID %d (demand paged)", path, ret);
+        return ret;
+    }
+
     uint8_t  *flat_img  = NULL;
     size_t    flat_size = 0;
     uint64_t  load_base = 0;
@@ -333,7 +476,7 @@ int bin_load_elf_argv(const char *path, uint32_t priority, uint32_t parent,
     if (elf_open_and_load(path, &flat_img, &flat_size, &load_base, &entry) < 0)
         return -1;
 
-    int ret = proc_create_user_image_argv(flat_img, flat_size,
+    ret = proc_create_user_image_argv(flat_img, flat_size,
                                           load_base, entry,
                                           priority, parent,
                                           argc, argv,
@@ -345,6 +488,6 @@ int bin_load_elf_argv(const char *path, uint32_t priority, uint32_t parent,
         log_ok("BIN", "Launched '%s' -> PID %d  (entry=0x%lx, base=0x%lx)",
                path, ret, entry, load_base);
 
-    kfree(flat_img);
+    vfree(flat_img);
     return ret;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "dma.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "slab.h"
+#include "vrange.h"
 #include <limine/limine_req.h>
 #include <memory.h>
 #include <util/spinlock.h>
@@ -8,32 +10,36 @@
 #define DMA_VIRT_BASE        0xFFFFE00000000000ULL
 #define DMA_VIRT_PAGE_COUNT  65536UL
 
+#define DMA_HUGE_PAGES       (VMM_HUGE_2M_SIZE / PAGE_SIZE)
+
 #define ISA_LIMIT_PHYS       (16ULL * 1024 * 1024)
 
 #define ISA_POOL_PAGES       64
 #define ISA_POOL_MAX_TRIES   (ISA_POOL_PAGES * 8)
 
-#define META_CAP             256
+#define META_HASH_BUCKETS    64
 
 #define SPINLOCK_INIT { 0 }
 
 #define DMA_MAP_FLAGS  (PAGE_PRESENT | PAGE_WRITE | PAGE_NOCACHE | PAGE_GLOBAL)
 
-typedef struct {
+typedef struct meta {
     void    *virt;
     uint64_t phys;
     size_t   size;
     size_t   pages;
     int      zone;
     bool     from_isa_pool;
-    bool     used;
+    struct meta *next;
 } meta_t;
 
-static uint64_t   virt_bitmap[DMA_VIRT_PAGE_COUNT / 64];
-static spinlock_t virt_lock = SPINLOCK_INIT;
+static uint64_t virt_bitmap[DMA_VIRT_PAGE_COUNT / 64];
+static vrange_t virt_space = VRANGE_INIT(DMA_VIRT_BASE, DMA_VIRT_PAGE_COUNT, virt_bitmap);
 
-static meta_t     meta[META_CAP];
-static spinlock_t meta_lock = SPINLOCK_INIT;
+// Live allocations, hashed by virtual address
+static meta_t       *meta_hash[META_HASH_BUCKETS];
+static kmem_cache_t *meta_cache = NULL;
+static spinlock_t    meta_lock = SPINLOCK_INIT;
 
 typedef struct isa_node {
     uint64_t phys;
@@ -45,37 +51,6 @@ static isa_node_t *isa_free_list = NULL;
 static int         isa_pool_size = 0;
 static spinlock_t  isa_lock = SPINLOCK_INIT;
 
-static void *virt_range_alloc(size_t pages) {
-    spin_lock(&virt_lock);
-
-    size_t run = 0, start = 0;
-    for (size_t i = 0; i < DMA_VIRT_PAGE_COUNT; i++) {
-        bool free = !(virt_bitmap[i >> 6] & (1ULL << (i & 63)));
-        if (free) {
-            if (!run) start = i;
-            if (++run == pages) {
-                for (size_t j = start; j <= i; j++)
-                    virt_bitmap[j >> 6] |= 1ULL << (j & 63);
-                spin_unlock(&virt_lock);
-                return (void *)(DMA_VIRT_BASE + start * PAGE_SIZE);
-            }
-        } else {
-            run = 0;
-        }
-    }
-
-    spin_unlock(&virt_lock);
-    return NULL;
-}
-
-static void virt_range_free(void *virt, size_t pages) {
-    size_t start = ((uintptr_t)virt - DMA_VIRT_BASE) / PAGE_SIZE;
-    spin_lock(&virt_lock);
-    for (size_t i = start; i < start + pages; i++)
-        virt_bitmap[i >> 6] &= ~(1ULL << (i & 63));
-    spin_unlock(&virt_lock);
-}
-
 static void isa_pool_init(void) {
     for (int tries = 0;
          tries < ISA_POOL_MAX_TRIES && isa_pool_size < ISA_POOL_PAGES;
@@ -121,34 +96,44 @@ static void isa_page_free(uint64_t phys) {
     pmm_free((void *)phys);
 }
 
+static inline size_t meta_hash_idx(void *virt) {
+    return ((uintptr_t)virt >> 12) & (META_HASH_BUCKETS - 1);
+}
+
 static meta_t *meta_alloc(void) {
+    return kmem_cache_alloc(meta_cache);
+}
+
+static void meta_insert(meta_t *m) {
+    size_t idx = meta_hash_idx(m->virt);
     spin_lock(&meta_lock);
-    for (int i = 0; i < META_CAP; i++) {
-        if (!meta[i].used) {
-            meta[i].used = true;
-            spin_unlock(&meta_lock);
-            return &meta[i];
-        }
-    }
+    m->next = meta_hash[idx];
+    meta_hash[idx] = m;
     spin_unlock(&meta_lock);
-    return NULL;
 }
 
-static meta_t *meta_find(void *virt) {
-    for (int i = 0; i < META_CAP; i++) {
-        if (meta[i].used && meta[i].virt == virt)
-            return &meta[i];
+// Look up and unlink the allocation that starts at virt
+static meta_t *meta_take(void *virt) {
+    size_t idx = meta_hash_idx(virt);
+    spin_lock(&meta_lock);
+    for (meta_t **pp = &meta_hash[idx]; *pp; pp = &(*pp)->next) {
+        if ((*pp)->virt == virt) {
+            meta_t *m = *pp;
+            *pp = m->next;
+            spin_unlock(&meta_lock);
+            return m;
+        }
     }
+    spin_unlock(&meta_lock);
     return NULL;
 }
 
 static void meta_free(meta_t *m) {
-    spin_lock(&meta_lock);
-    m->used = false;
-    spin_unlock(&meta_lock);
+    kmem_cache_free(meta_cache, m);
 }
 
 void dma_init(void) {
+    meta_cache = kmem_cache_create("dma_meta", sizeof(meta_t), 0, NULL);
     isa_pool_init();
 }
 
@@ -200,13 +185,16 @@ void *dma_alloc(size_t size,
                 goto retry;
         }
 
-        void *virt = virt_range_alloc(pages);
+        // Runs of 2MB or more start on a 2MB boundary so the VMM can map
+        // them with huge pages
+        void *virt = vrange_alloc(&virt_space, pages,
+                                  pages >= DMA_HUGE_PAGES ? DMA_HUGE_PAGES : 1);
         if (!virt)
             goto retry;
 
         address_space_t *ks = vmm_get_kernel_space();
         if (!vmm_map_range(ks, virt, (void *)phys, pages, DMA_MAP_FLAGS)) {
-            virt_range_free(virt, pages);
+            vrange_free(&virt_space, virt, pages);
             goto retry;
         }
 
@@ -214,9 +202,14 @@ void *dma_alloc(size_t size,
 
         meta_t *m = meta_alloc();
         if (!m) {
+            // Out of memory for bookkeeping; retrying would not help
             vmm_unmap_range(ks, virt, pages);
-            virt_range_free(virt, pages);
-            goto retry;
+            vrange_free(&virt_space, virt, pages);
+            if (from_isa_pool)
+                isa_page_free(phys);
+            else
+                pmm_free_pages((void *)phys, pages);
+            return NULL;
         }
 
         m->virt = virt;
@@ -225,6 +218,7 @@ void *dma_alloc(size_t size,
         m->pages = pages;
         m->zone = zone;
         m->from_isa_pool = from_isa_pool;
+        meta_insert(m);
 
         return virt;
 
@@ -239,13 +233,13 @@ retry:
 void dma_free(void *ptr) {
     if (!ptr) return;
 
-    meta_t *m = meta_find(ptr);
+    meta_t *m = meta_take(ptr);
     if (!m) return;
 
     address_space_t *ks = vmm_get_kernel_space();
 
     vmm_unmap_range(ks, m->virt, m->pages);
-    virt_range_free(m->virt, m->pages);
+    vrange_free(&virt_space, m->virt, m->pages);
 
     if (m->from_isa_pool)
         isa_page_free(m->phys);
@@ -2,16 +2,59 @@
 #include <limine/limine_req.h>
 #include <debug.h>
 #include <string.h>
+#include <memory.h>
+#include <util/spinlock.h>
 
-// Bitmap for tracking page allocation
-static uint8_t* bitmap = NULL;
-static uint64_t bitmap_size = 0;
+// Per-page state (one byte per physical page)
+//   PAGE_STATE_USED          - allocated or reserved
+//   PAGE_STATE_TAIL          - free, inside a larger buddy block
+//   PAGE_STATE_FREE | order  - first page of a free block of 2^order pages
+#define PAGE_STATE_TAIL  0x00
+#define PAGE_STATE_FREE  0x80
+#define PAGE_STATE_USED  0xFF
+
+// Free blocks are linked through their own first page (via the HHDM)
+typedef struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+} free_block_t;
+
+static uint8_t* page_state = NULL;
+static uint64_t page_state_size = 0;
+
+// Extra owners of a used page beyond the one that allocated it, for pages
+// shared copy-on-write between address spaces. Lives right after page_state
+static uint16_t* page_shares = NULL;
+static uint64_t meta_size = 0;
 static uint64_t total_pages = 0;
 static uint64_t used_pages = 0;
 
+// One circular list (with a sentinel head) per order
+static free_block_t free_area[PMM_NR_ORDERS];
+static uint64_t free_blocks[PMM_NR_ORDERS];
+
+static spinlock_t pmm_lock = { 0 };
+
+// Pre-zeroed single pages, refilled from the idle loop so that pmm_alloc()
+// does not have to clear memory on the fault and fork paths
+#define ZERO_POOL_SIZE      512
+#define ZERO_POOL_MIN_FREE  (4 * ZERO_POOL_SIZE)
+
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint64_t zero_pool_count = 0;
+
 // Highest usable physical address
 static uint64_t highest_addr = 0;
 
+// Shared zero page; see pmm_zero_page()
+static uint64_t zero_page_pfn = 0;
+
+// Frees pages when the free lists run dry; see pmm_set_reclaim()
+static pmm_reclaim_fn reclaim_fn = NULL;
+
+// Set once free pages drop below PMM_LOW_WATERMARK
+static volatile bool memory_pressure = false;
+
 // HHDM offset for accessing physical memory
 extern uint64_t hhdm_offset;
 extern struct limine_memmap_response* memmap;
@@ -20,22 +63,164 @@ extern struct limine_memmap_response* memmap;
 #define PHYS_TO_VIRT(addr) ((void*)((uint64_t)(addr) + hhdm_offset))
 #define VIRT_TO_PHYS(addr) ((uint64_t)(addr) - hhdm_offset)
 
+#define ORDER_PAGES(order) (1ULL << (order))
+
 // Get the end of all memory
 void* pmm_get_end_of_memory(void) {
     return (void*)highest_addr;
 }
 
-// Bitmap manipulation
-static inline void bitmap_set(uint64_t page) {
-    bitmap[page / 8] |= (1 << (page % 8));
+// Free list manipulation
+static inline free_block_t* pfn_to_block(uint64_t pfn) {
+    return (free_block_t*)PHYS_TO_VIRT(pfn * PAGE_SIZE);
+}
+
+static inline uint64_t block_to_pfn(free_block_t* block) {
+    return VIRT_TO_PHYS(block) / PAGE_SIZE;
+}
+
+static void free_block_insert(uint64_t pfn, unsigned order, bool tail) {
+    free_block_t* head = &free_area[order];
+    free_block_t* block = pfn_to_block(pfn);
+
+    if (tail) {
+        block->prev = head->prev;
+        block->next = head;
+    } else {
+        block->prev = head;
+        block->next = head->next;
+    }
+    block->prev->next = block;
+    block->next->prev = block;
+
+    page_state[pfn] = PAGE_STATE_FREE | order;
+    free_blocks[order]++;
+}
+
+static void free_block_remove(uint64_t pfn, unsigned order) {
+    free_block_t* block = pfn_to_block(pfn);
+
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+
+    page_state[pfn] = PAGE_STATE_TAIL;
+    free_blocks[order]--;
+}
+
+// Return a block to its free list, merging with its buddy as long as possible
+static void buddy_free(uint64_t pfn, unsigned order, bool tail) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ ORDER_PAGES(order);
+
+        if (buddy + ORDER_PAGES(order) > total_pages)
+            break;
+        if (page_state[buddy] != (PAGE_STATE_FREE | order))
+            break;
+
+        free_block_remove(buddy, order);
+        pfn &= ~ORDER_PAGES(order);
+        order++;
+    }
+
+    free_block_insert(pfn, order, tail);
 }
 
-static inline void bitmap_clear(uint64_t page) {
-    bitmap[page / 8] &= ~(1 << (page % 8));
+// Take a block of exactly 2^order pages off the free lists, splitting larger
+// blocks on the way down. Returns the first page number or 0 on failure.
+static uint64_t buddy_alloc(unsigned order) {
+    unsigned current = order;
+    while (current <= PMM_MAX_ORDER && free_area[current].next == &free_area[current])
+        current++;
+
+    if (current > PMM_MAX_ORDER)
+        return 0;
+
+    uint64_t pfn = block_to_pfn(free_area[current].next);
+    free_block_remove(pfn, current);
+
+    while (current > order) {
+        current--;
+        free_block_insert(pfn + ORDER_PAGES(current), current, false);
+    }
+
+    return pfn;
 }
 
-static inline bool bitmap_test(uint64_t page) {
-    return bitmap[page / 8] & (1 << (page % 8));
+// Requests above the largest order: look for physically adjacent free
+// blocks of the largest order. Rare (boot-time) path, so a list walk is fine.
+static uint64_t buddy_alloc_large(uint64_t count) {
+    uint64_t blocks = (count + ORDER_PAGES(PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+    free_block_t* head = &free_area[PMM_MAX_ORDER];
+
+    for (free_block_t* block = head->next; block != head; block = block->next) {
+        uint64_t start = block_to_pfn(block);
+        uint64_t found = 1;
+
+        while (found < blocks) {
+            uint64_t next = start + found * ORDER_PAGES(PMM_MAX_ORDER);
+            if (next >= total_pages || page_state[next] != (PAGE_STATE_FREE | PMM_MAX_ORDER))
+                break;
+            found++;
+        }
+
+        if (found == blocks) {
+            for (uint64_t i = 0; i < blocks; i++)
+                free_block_remove(start + i * ORDER_PAGES(PMM_MAX_ORDER), PMM_MAX_ORDER);
+            return start;
+        }
+    }
+
+    return 0;
+}
+
+// Hand a run of pages (currently marked used) back to the buddy lists,
+// split into the largest naturally aligned blocks that fit
+static void free_range(uint64_t pfn, uint64_t count, bool tail) {
+    memset(&page_state[pfn], PAGE_STATE_TAIL, count);
+    used_pages -= count;
+
+    while (count) {
+        unsigned order = 0;
+        while (order < PMM_MAX_ORDER &&
+               !(pfn & ORDER_PAGES(order)) &&
+               ORDER_PAGES(order + 1) <= count) {
+            order++;
+        }
+
+        buddy_free(pfn, order, tail);
+        pfn += ORDER_PAGES(order);
+        count -= ORDER_PAGES(order);
+    }
+}
+
+static unsigned order_for(uint64_t count) {
+    unsigned order = 0;
+    while (ORDER_PAGES(order) < count)
+        order++;
+    return order;
+}
+
+// Add a usable memmap range, leaving out the page-state array itself
+static void pmm_add_region(uint64_t base, uint64_t length, uint64_t meta_start, uint64_t meta_end) {
+    uint64_t start = (base + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end = (base + length) / PAGE_SIZE;
+
+    // Page 0 doubles as NULL, never hand it out
+    if (start == 0)
+        start = 1;
+    if (end > total_pages)
+        end = total_pages;
+
+    if (start < meta_end && end > meta_start) {
+        if (start < meta_start)
+            free_range(start, meta_start - start, true);
+        if (end > meta_end)
+            free_range(meta_end, end - meta_end, true);
+        return;
+    }
+
+    if (start < end)
+        free_range(start, end - start, true);
 }
 
 void pmm_init(void) {
@@ -46,199 +231,375 @@ void pmm_init(void) {
 
     log_info("PMM", "Initializing physical memory manager...");
 
-    // Find the highest usable address
+    // Find the highest address, and the highest one we will ever manage
+    uint64_t managed_top = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
         uint64_t top = entry->base + entry->length;
-        
+
         if (top > highest_addr) {
             highest_addr = top;
         }
+
+        if ((entry->type == LIMINE_MEMMAP_USABLE ||
+             entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+             entry->type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES) &&
+            top > managed_top) {
+            managed_top = top;
+        }
     }
 
-    // Calculate total pages and bitmap size
-    total_pages = highest_addr / PAGE_SIZE;
-    bitmap_size = (total_pages + 7) / 8; // Round up to nearest byte
+    // One state byte per managed page
+    total_pages = managed_top / PAGE_SIZE;
+    page_state_size = total_pages;
 
     log_info("PMM", "Total memory: %llu MB", highest_addr / (1024 * 1024));
-    log_info("PMM", "Total pages: %llu", total_pages);
-    log_info("PMM", "Bitmap size: %llu KB", bitmap_size / 1024);
+    log_info("PMM", "Managed pages: %llu", total_pages);
+    log_info("PMM", "Page state size: %llu KB", page_state_size / 1024);
+
+    uint64_t shares_off = (page_state_size + 7) & ~7ULL;
+    meta_size = shares_off + total_pages * sizeof(uint16_t);
 
-    // Find a suitable location for the bitmap in usable memory
-    bitmap = NULL;
+    // Find a suitable location for the page state array in usable memory
+    page_state = NULL;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
-        
-        // Look for usable memory that can fit the bitmap
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size) {
-            bitmap = (uint8_t*)PHYS_TO_VIRT(entry->base);
-            log_info("PMM", "Bitmap placed at physical 0x%llx", entry->base);
+
+        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= meta_size) {
+            page_state = (uint8_t*)PHYS_TO_VIRT(entry->base);
+            log_info("PMM", "Page state placed at physical 0x%llx", entry->base);
             break;
         }
     }
 
-    if (!bitmap) {
-        log_crit("PMM", "Could not find space for bitmap");
+    if (!page_state) {
+        log_crit("PMM", "Could not find space for page state");
         return;
     }
 
-    // Initialize bitmap - mark all pages as used
-    memset(bitmap, 0xFF, bitmap_size);
+    for (int order = 0; order < PMM_NR_ORDERS; order++) {
+        free_area[order].next = &free_area[order];
+        free_area[order].prev = &free_area[order];
+        free_blocks[order] = 0;
+    }
+
+    // Everything starts out used; usable regions are then freed as whole
+    // buddy blocks. Kernel, module and bootloader regions are never added.
+    memset(page_state, PAGE_STATE_USED, page_state_size);
     used_pages = total_pages;
 
-    // Mark usable memory regions as free
+    page_shares = (uint16_t*)(page_state + shares_off);
+    memset(page_shares, 0, total_pages * sizeof(uint16_t));
+
+    uint64_t meta_start = VIRT_TO_PHYS(page_state) / PAGE_SIZE;
+    uint64_t meta_end = meta_start + (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
-        
+
         if (entry->type == LIMINE_MEMMAP_USABLE) {
-            uint64_t base_page = entry->base / PAGE_SIZE;
-            uint64_t page_count = entry->length / PAGE_SIZE;
-            
-            for (uint64_t j = 0; j < page_count; j++) {
-                uint64_t page = base_page + j;
-                if (page < total_pages) {
-                    bitmap_clear(page);
-                    used_pages--;
-                }
-            }
+            pmm_add_region(entry->base, entry->length, meta_start, meta_end);
         }
     }
 
-    // Mark the bitmap itself as used
-    uint64_t bitmap_phys = VIRT_TO_PHYS((uint64_t)bitmap);
-    uint64_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    uint64_t bitmap_base_page = bitmap_phys / PAGE_SIZE;
-    
-    for (uint64_t i = 0; i < bitmap_pages; i++) {
-        uint64_t page = bitmap_base_page + i;
-        if (page < total_pages && !bitmap_test(page)) {
-            bitmap_set(page);
-            used_pages++;
-        }
+    void* zero = pmm_alloc();
+    if (zero) {
+        zero_page_pfn = (uint64_t)zero / PAGE_SIZE;
+    } else {
+        log_err("PMM", "Failed to allocate the shared zero page");
     }
 
-    // Mark kernel and module regions as used
+    log_ok("PMM", "Initialization complete");
+    log_info("PMM", "Free memory: %llu MB", pmm_get_free_memory() / (1024 * 1024));
+    log_info("PMM", "Used memory: %llu MB", pmm_get_used_memory() / (1024 * 1024));
+    log_info("PMM", "Free max-order blocks: %llu", free_blocks[PMM_MAX_ORDER]);
+}
+
+uint64_t pmm_release_bootloader_memory(void) {
+    static bool released_once = false;
+
+    if (!memmap || !page_state || released_once)
+        return 0;
+    released_once = true;
+
+    uint64_t meta_start = VIRT_TO_PHYS(page_state) / PAGE_SIZE;
+    uint64_t meta_end = meta_start + (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t before = used_pages;
+
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
-        
-        if (entry->type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES ||
-            entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
-            uint64_t base_page = entry->base / PAGE_SIZE;
-            uint64_t page_count = (entry->length + PAGE_SIZE - 1) / PAGE_SIZE;
-            
-            for (uint64_t j = 0; j < page_count; j++) {
-                uint64_t page = base_page + j;
-                if (page < total_pages && !bitmap_test(page)) {
-                    bitmap_set(page);
-                    used_pages++;
-                }
-            }
+
+        if (entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
+            pmm_add_region(entry->base, entry->length, meta_start, meta_end);
         }
     }
 
-    log_ok("PMM", "Initialization complete");
-    log_info("PMM", "Free memory: %llu MB", pmm_get_free_memory() / (1024 * 1024));
-    log_info("PMM", "Used memory: %llu MB", pmm_get_used_memory() / (1024 * 1024));
+    uint64_t released = before - used_pages;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    log_ok("PMM", "Released %llu KB of bootloader memory",
+           released * (PAGE_SIZE / 1024));
+    return released;
+}
+
+// Take a single page off the buddy lists (pmm_lock held)
+static uint64_t alloc_page_locked(void) {
+    uint64_t pfn = buddy_alloc(0);
+    if (pfn) {
+        page_state[pfn] = PAGE_STATE_USED;
+        used_pages++;
+    }
+    if (total_pages - used_pages + zero_pool_count < PMM_LOW_WATERMARK)
+        memory_pressure = true;
+    return pfn;
+}
+
+// Return every pooled page to the buddy lists so they can coalesce again
+static void zero_pool_drain_locked(void) {
+    while (zero_pool_count)
+        free_range(zero_pool[--zero_pool_count], 1, false);
+}
+
+void pmm_set_reclaim(pmm_reclaim_fn fn) {
+    reclaim_fn = fn;
+}
+
+// Let the reclaim hook free some pages; false if it freed none. Reclaim
+// itself must not recurse into it
+static bool pmm_reclaim(void) {
+    static bool reclaiming = false;
+
+    if (!reclaim_fn || reclaiming)
+        return false;
+
+    reclaiming = true;
+    uint64_t freed = reclaim_fn(PMM_RECLAIM_BATCH, true);
+    reclaiming = false;
+    return freed > 0;
+}
+
+uint64_t pmm_balance(void) {
+    if (!memory_pressure || !reclaim_fn)
+        return 0;
+
+    if (total_pages - used_pages + zero_pool_count >= PMM_HIGH_WATERMARK) {
+        memory_pressure = false;
+        return 0;
+    }
+
+    uint64_t freed = reclaim_fn(PMM_RECLAIM_BATCH, false);
+
+    // Nothing left to give; wait for the next allocation to flag it again
+    if (!freed)
+        memory_pressure = false;
+    return freed;
 }
 
 void* pmm_alloc(void) {
-    // Find first free page
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            bitmap_set(i);
-            used_pages++;
-            
-            void* page = (void*)(i * PAGE_SIZE);
-            
-            // Clear the page
-            memset(PHYS_TO_VIRT(page), 0, PAGE_SIZE);
-            
-            return page;
-        }
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    if (zero_pool_count) {
+        uint64_t pfn = zero_pool[--zero_pool_count];
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return (void*)(pfn * PAGE_SIZE);
+    }
+
+    uint64_t pfn = alloc_page_locked();
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (!pfn && pmm_reclaim()) {
+        flags = spin_lock_irqsave(&pmm_lock);
+        pfn = alloc_page_locked();
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    if (!pfn) {
+        log_crit("PMM", "Out of physical memory!");
+        return NULL;
+    }
+
+    void* page = (void*)(pfn * PAGE_SIZE);
+
+    // Clear the page
+    memset(PHYS_TO_VIRT(page), 0, PAGE_SIZE);
+
+    return page;
+}
+
+void* pmm_alloc_nozero(void) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    uint64_t pfn = alloc_page_locked();
+    if (!pfn && zero_pool_count)
+        pfn = zero_pool[--zero_pool_count];
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (!pfn && pmm_reclaim()) {
+        flags = spin_lock_irqsave(&pmm_lock);
+        pfn = alloc_page_locked();
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    if (!pfn) {
+        log_crit("PMM", "Out of physical memory!");
+        return NULL;
     }
-    
-    log_crit("PMM", "Out of physical memory!");
-    return NULL;
+
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+// Take a contiguous run of count pages off the buddy lists (pmm_lock held)
+static uint64_t alloc_pages_locked(size_t count) {
+    uint64_t pfn;
+    uint64_t block_pages;
+
+    if (count > ORDER_PAGES(PMM_MAX_ORDER)) {
+        block_pages = ((count + ORDER_PAGES(PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER) << PMM_MAX_ORDER;
+        pfn = buddy_alloc_large(count);
+    } else {
+        unsigned order = order_for(count);
+        block_pages = ORDER_PAGES(order);
+        pfn = buddy_alloc(order);
+    }
+
+    // Pooled pages may be all that keeps a block from coalescing
+    if (!pfn && zero_pool_count) {
+        zero_pool_drain_locked();
+        pfn = (count > ORDER_PAGES(PMM_MAX_ORDER))
+            ? buddy_alloc_large(count)
+            : buddy_alloc(order_for(count));
+    }
+
+    if (pfn) {
+        memset(&page_state[pfn], PAGE_STATE_USED, block_pages);
+        used_pages += block_pages;
+
+        // Give back the part of the power-of-two block we do not need
+        if (block_pages > count)
+            free_range(pfn + count, block_pages - count, false);
+    }
+
+    if (total_pages - used_pages + zero_pool_count < PMM_LOW_WATERMARK)
+        memory_pressure = true;
+    return pfn;
 }
 
 void* pmm_alloc_pages(size_t count) {
     if (count == 0) return NULL;
     if (count == 1) return pmm_alloc();
-    
-    // Find contiguous free pages
-    uint64_t found = 0;
-    uint64_t start_page = 0;
-    
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            if (found == 0) {
-                start_page = i;
-            }
-            found++;
-            
-            if (found == count) {
-                // Mark all pages as used
-                for (uint64_t j = 0; j < count; j++) {
-                    bitmap_set(start_page + j);
-                    used_pages++;
-                }
-                
-                void* page = (void*)(start_page * PAGE_SIZE);
-                
-                // Clear all pages
-                memset(PHYS_TO_VIRT(page), 0, count * PAGE_SIZE);
-                
-                return page;
-            }
-        } else {
-            found = 0;
-        }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t pfn = alloc_pages_locked(count);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (!pfn && pmm_reclaim()) {
+        flags = spin_lock_irqsave(&pmm_lock);
+        pfn = alloc_pages_locked(count);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    if (!pfn) {
+        log_crit("PMM", "Out of physical memory! (requested %llu pages)", count);
+        return NULL;
     }
-    
-    log_crit("PMM", "Out of physical memory! (requested %llu pages)", count);
-    return NULL;
+
+    void* page = (void*)(pfn * PAGE_SIZE);
+
+    // Clear all pages
+    memset(PHYS_TO_VIRT(page), 0, count * PAGE_SIZE);
+
+    return page;
 }
 
 void pmm_free(void* page) {
-    if (!page) return;
-    
-    uint64_t page_num = (uint64_t)page / PAGE_SIZE;
-    
-    if (page_num >= total_pages) {
-        log_warn("PMM", "Attempt to free invalid page: 0x%llx", (uint64_t)page);
-        return;
-    }
-    
-    if (!bitmap_test(page_num)) {
-        log_warn("PMM", "Attempt to free already free page: 0x%llx", (uint64_t)page);
-        return;
-    }
-    
-    bitmap_clear(page_num);
-    used_pages--;
+    pmm_free_pages(page, 1);
 }
 
 void pmm_free_pages(void* page, size_t count) {
     if (!page || count == 0) return;
-    
+
     uint64_t page_num = (uint64_t)page / PAGE_SIZE;
-    
+    uint64_t run_start = page_num;
+    uint64_t run_len = 0;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
     for (size_t i = 0; i < count; i++) {
         uint64_t current_page = page_num + i;
-        
+        bool valid = true;
+
         if (current_page >= total_pages) {
             log_warn("PMM", "Attempt to free invalid page: 0x%llx", current_page * PAGE_SIZE);
-            continue;
-        }
-        
-        if (!bitmap_test(current_page)) {
+            valid = false;
+        } else if (page_state[current_page] != PAGE_STATE_USED) {
             log_warn("PMM", "Attempt to free already free page: 0x%llx", current_page * PAGE_SIZE);
+            valid = false;
+        }
+
+        if (valid) {
+            if (!run_len)
+                run_start = current_page;
+            run_len++;
             continue;
         }
-        
-        bitmap_clear(current_page);
-        used_pages--;
+
+        if (run_len) {
+            free_range(run_start, run_len, false);
+            run_len = 0;
+        }
     }
+
+    if (run_len)
+        free_range(run_start, run_len, false);
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_page_get(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= total_pages || (zero_page_pfn && pfn == zero_page_pfn)) return;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (page_state[pfn] != PAGE_STATE_USED) {
+        log_warn("PMM", "Reference to free page: 0x%llx", (uint64_t)page);
+    } else if (page_shares[pfn] == UINT16_MAX) {
+        log_err("PMM", "Share count overflow on page 0x%llx", (uint64_t)page);
+    } else {
+        page_shares[pfn]++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+bool pmm_page_put(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= total_pages || (zero_page_pfn && pfn == zero_page_pfn)) return false;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (page_shares[pfn]) {
+        page_shares[pfn]--;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return false;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    pmm_free(page);
+    return true;
+}
+
+unsigned pmm_page_refcount(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= total_pages || page_state[pfn] != PAGE_STATE_USED) return 0;
+    // Always shared, so writers copy it
+    if (zero_page_pfn && pfn == zero_page_pfn) return 2;
+    return (unsigned)page_shares[pfn] + 1;
+}
+
+void* pmm_zero_page(void) {
+    return zero_page_pfn ? (void*)(zero_page_pfn * PAGE_SIZE) : NULL;
 }
 
 uint64_t pmm_get_total_memory(void) {
@@ -246,9 +607,53 @@ uint64_t pmm_get_total_memory(void) {
 }
 
 uint64_t pmm_get_used_memory(void) {
-    return used_pages * PAGE_SIZE;
+    return (used_pages - zero_pool_count) * PAGE_SIZE;
 }
 
 uint64_t pmm_get_free_memory(void) {
-    return (total_pages - used_pages) * PAGE_SIZE;
-}
\ No newline at end of file
+    return (total_pages - used_pages + zero_pool_count) * PAGE_SIZE;
+}
+
+uint64_t pmm_get_free_blocks(unsigned order) {
+    if (order > PMM_MAX_ORDER)
+        return 0;
+    return free_blocks[order];
+}
+
+uint64_t pmm_get_zeroed_pages(void) {
+    return zero_pool_count;
+}
+
+unsigned pmm_refill_zero_pool(unsigned max) {
+    unsigned added = 0;
+
+    while (added < max) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+        if (zero_pool_count >= ZERO_POOL_SIZE ||
+            total_pages - used_pages < ZERO_POOL_MIN_FREE) {
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            break;
+        }
+
+        uint64_t pfn = alloc_page_locked();
+        spin_unlock_irqrestore(&pmm_lock, flags);
+
+        if (!pfn)
+            break;
+
+        // Zero with interrupts enabled, this is the expensive part
+        memset(PHYS_TO_VIRT(pfn * PAGE_SIZE), 0, PAGE_SIZE);
+
+        flags = spin_lock_irqsave(&pmm_lock);
+        if (zero_pool_count < ZERO_POOL_SIZE) {
+            zero_pool[zero_pool_count++] = pfn;
+            added++;
+        } else {
+            free_range(pfn, 1, false);
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    return added;
+}
@@ -7,15 +7,28 @@
 
 #define PAGE_SIZE 4096
 
+// Buddy allocator orders: order n is a block of 2^n contiguous pages
+#define PMM_MAX_ORDER 10
+#define PMM_NR_ORDERS (PMM_MAX_ORDER + 1)
+
 // Get the end of all memory
 void* pmm_get_end_of_memory(void);
 
 // Initialize the physical memory manager
 void pmm_init(void);
 
+// Free the BOOTLOADER_RECLAIMABLE regions of the memory map. Only once
+// nothing refers to Limine's responses, page tables or AP stacks any
+// more; see limine_release(). Returns the pages freed
+uint64_t pmm_release_bootloader_memory(void);
+
 // Allocate a physical page (returns physical address)
 void* pmm_alloc(void);
 
+// Allocate a physical page without clearing it, for callers that
+// overwrite the whole page anyway
+void* pmm_alloc_nozero(void);
+
 // Allocate multiple contiguous physical pages
 void* pmm_alloc_pages(size_t count);
 
@@ -25,9 +38,68 @@ void pmm_free(void* page);
 // Free multiple contiguous physical pages
 void pmm_free_pages(void* page, size_t count);
 
+// Called when pmm_alloc() or pmm_alloc_nozero() finds no free page, with
+// the number of pages it would like back; returns how many it freed. The
+// allocation is retried once if any were. `atomic` is set there, since
+// the allocating caller may hold locks, and clear for pmm_balance()
+#define PMM_RECLAIM_BATCH 32
+typedef uint64_t (*pmm_reclaim_fn)(uint64_t pages, bool atomic);
+void pmm_set_reclaim(pmm_reclaim_fn fn);
+
+// Allocations that leave fewer than PMM_LOW_WATERMARK pages free flag
+// memory pressure; pmm_balance() then reclaims until PMM_HIGH_WATERMARK
+// pages are free again
+#define PMM_LOW_WATERMARK   1024
+#define PMM_HIGH_WATERMARK  2048
+
+// Reclaim one batch if memory is under pressure; returns the pages freed.
+// Called from the idle loop.
+uint64_t pmm_balance(void);
+
+// Page reference counts for pages mapped into several address spaces.
+// An allocated page starts with one reference; pmm_page_put() drops one
+// and frees the page when it was the last (returns true then)
+void pmm_page_get(void* page);
+bool pmm_page_put(void* page);
+unsigned pmm_page_refcount(void* page);
+
+// A page of zeros that read faults on untouched anonymous memory map
+// read-only. It is never freed; pmm_page_get/put ignore it and its
+// refcount always reads as shared so a write fault copies it
+void* pmm_zero_page(void);
+
+// Limine maps all physical memory at hhdm_offset, so any physical page
+// can be reached without touching page tables
+extern uint64_t hhdm_offset;
+
+static inline void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + hhdm_offset);
+}
+
+static inline uint64_t virt_to_phys(const void* virt) {
+    return (uint64_t)virt - hhdm_offset;
+}
+
+// Kernel address of a physical page. Always mapped, so there is no
+// matching unmap and no TLB work
+static inline void* kmap_phys(void* page) {
+    return phys_to_virt((uint64_t)page);
+}
+
 // Get memory statistics
 uint64_t pmm_get_total_memory(void);
 uint64_t pmm_get_used_memory(void);
 uint64_t pmm_get_free_memory(void);
 
+// Number of free blocks currently held at a given buddy order
+uint64_t pmm_get_free_blocks(unsigned order);
+
+// Pre-zeroed page pool (pmm_alloc() takes from it first)
+#define PMM_ZERO_REFILL_BATCH 16
+uint64_t pmm_get_zeroed_pages(void);
+
+// Zero up to `max` free pages into the pool; returns how many were added.
+// Called from the idle loop.
+unsigned pmm_refill_zero_pool(unsigned max);
+
 #endif // PMM_H
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "shrinker.h"
+#include "pmm.h"
+#include <debug.h>
+#include <util/spinlock.h>
+
+#define SHRINKER_MODULE "SHRINK"
+
+// Sorted by cost
+static shrinker_t* shrinkers = NULL;
+static spinlock_t  shrinker_lock = { 0 };
+
+// A shrinker that allocates must not end up back in here
+static bool shrinking = false;
+
+void shrinker_register(shrinker_t* s) {
+    if (!s || !s->scan)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+    bool first = shrinkers == NULL;
+
+    shrinker_t** pp = &shrinkers;
+    while (*pp && (*pp)->cost <= s->cost)
+        pp = &(*pp)->next;
+    s->next = *pp;
+    *pp = s;
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+
+    if (first)
+        pmm_set_reclaim(shrink_memory);
+
+    log_debug(SHRINKER_MODULE, "Registered shrinker %s", s->name);
+}
+
+void shrinker_unregister(shrinker_t* s) {
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+    for (shrinker_t** pp = &shrinkers; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            s->next = NULL;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+}
+
+uint64_t shrink_memory(uint64_t pages, bool atomic) {
+    // A shrinker's own allocation failing lands back here
+    if (__atomic_load_n(&shrinking, __ATOMIC_RELAXED))
+        return 0;
+
+    // Copy the list so the scans run without the lock; some of them
+    // write to disk and must not do it with interrupts off
+    shrinker_t* list[SHRINKER_MAX];
+    size_t n = 0;
+
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+    if (shrinking) {
+        spin_unlock_irqrestore(&shrinker_lock, flags);
+        return 0;
+    }
+    shrinking = true;
+    for (shrinker_t* s = shrinkers; s && n < SHRINKER_MAX; s = s->next) {
+        if (!atomic || s->atomic)
+            list[n++] = s;
+    }
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+
+    uint64_t freed = 0;
+    for (size_t i = 0; i < n && freed < pages; i++) {
+        shrinker_t* s = list[i];
+        if (s->count && !s->count())
+            continue;
+
+        uint64_t got = s->scan(pages - freed);
+        freed += got;
+
+        flags = spin_lock_irqsave(&shrinker_lock);
+        s->calls++;
+        s->released += got;
+        spin_unlock_irqrestore(&shrinker_lock, flags);
+    }
+
+    __atomic_store_n(&shrinking, false, __ATOMIC_RELEASE);
+
+    if (freed)
+        log_debug(SHRINKER_MODULE, "Reclaimed %llu of %llu pages%s",
+                  freed, pages, atomic ? " (direct)" : "");
+    return freed;
+}
+
+uint64_t shrinker_count_all(void) {
+    uint64_t total = 0;
+
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+    for (shrinker_t* s = shrinkers; s; s = s->next) {
+        if (s->count)
+            total += s->count();
+    }
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+
+    return total;
+}
+
+void shrinker_dump_stats(void) {
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+    for (shrinker_t* s = shrinkers; s; s = s->next) {
+        log_info(SHRINKER_MODULE, "%s: %llu reclaimable, %llu pages released in %llu calls",
+                 s->name, s->count ? s->count() : 0, s->released, s->calls);
+    }
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+}
@@ -0,0 +1,55 @@
+#ifndef SHRINKER_H
+#define SHRINKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Caches that can give memory back register a shrinker. When the PMM
+// runs short, shrinkers are asked in order of cost to release pages.
+
+// Dropping clean cached data is cheap, writing pages out is not
+#define SHRINKER_COST_CACHE 10
+#define SHRINKER_COST_SLAB  20
+#define SHRINKER_COST_SWAP  100
+
+// Most shrinkers one reclaim pass runs
+#define SHRINKER_MAX        16
+
+typedef struct shrinker {
+    const char* name;
+
+    // Pages the cache could release right now; may be an estimate
+    uint64_t (*count)(void);
+
+    // Release up to `pages` pages; returns how many were freed
+    uint64_t (*scan)(uint64_t pages);
+
+    unsigned cost;          // SHRINKER_COST_*, cheaper ones run first
+
+    // scan may run anywhere, even from an allocation made with locks
+    // held, so it must not sleep or do I/O. Other shrinkers only run
+    // from reclaim with interrupts enabled
+    bool atomic;
+
+    uint64_t released;      // Pages freed over its lifetime
+    uint64_t calls;         // scan invocations
+
+    struct shrinker* next;
+} shrinker_t;
+
+// Register a statically allocated shrinker; the first one also hooks the
+// registry into the PMM
+void shrinker_register(shrinker_t* s);
+void shrinker_unregister(shrinker_t* s);
+
+// Ask the shrinkers for `pages` pages, only the atomic ones if `atomic`.
+// Returns how many were freed
+uint64_t shrink_memory(uint64_t pages, bool atomic);
+
+// Sum of what every shrinker reports it could release
+uint64_t shrinker_count_all(void);
+
+// Log what each shrinker holds and has released
+void shrinker_dump_stats(void);
+
+#endif // SHRINKER_H
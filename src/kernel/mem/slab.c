@@ -0,0 +1,388 @@
+#include "slab.h"
+#include "pmm.h"
+#include "shrinker.h"
+#include <debug.h>
+#include <memory.h>
+#include <string.h>
+#include <stdbool.h>
+#include <util/spinlock.h>
+
+#define SLAB_MODULE "SLAB"
+
+// Slabs are naturally aligned power-of-two page blocks from the PMM,
+// accessed through the HHDM. The slab header sits at the start of the
+// block so an object's slab is found by masking its address.
+#define SLAB_MIN_OBJS   8
+#define SLAB_MAX_ORDER  3
+
+extern uint64_t hhdm_offset;
+
+#define PHYS_TO_VIRT(addr) ((void*)((uint64_t)(addr) + hhdm_offset))
+#define VIRT_TO_PHYS(addr) ((uint64_t)(addr) - hhdm_offset)
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+typedef struct kmem_slab {
+    struct kmem_slab* next;
+    struct kmem_slab* prev;
+    kmem_cache_t*     cache;
+    void*             free;     // Singly-linked list of free objects
+    uint32_t          in_use;
+} kmem_slab_t;
+
+struct kmem_cache {
+    char          name[KMEM_CACHE_NAME_LEN];
+    size_t        obj_size;
+    size_t        stride;       // Distance between objects in a slab
+    size_t        free_off;     // Offset of the free-list link in an object
+    size_t        first_off;    // Offset of the first object in a slab
+    unsigned      order;        // Slab size is 2^order pages
+    uint32_t      objs_per_slab;
+    kmem_ctor_t   ctor;
+    spinlock_t    lock;
+
+    kmem_slab_t*  partial;
+    kmem_slab_t*  full;
+    kmem_slab_t*  empty;        // At most one spare slab is kept around
+
+    uint64_t      num_slabs;
+    uint64_t      active_objs;
+    uint64_t      allocs;
+    uint64_t      frees;
+    uint64_t      failed;
+
+    struct kmem_cache* next;    // Registry link
+};
+
+// Bootstrap cache that kmem_cache_t structures are allocated from
+static kmem_cache_t cache_cache;
+static bool slab_ready = false;
+
+static kmem_cache_t* cache_list = NULL;
+static spinlock_t cache_list_lock = { 0 };
+
+static inline size_t slab_bytes(kmem_cache_t* c) {
+    return (size_t)PAGE_SIZE << c->order;
+}
+
+static inline void** free_link(kmem_cache_t* c, void* obj) {
+    return (void**)((uint8_t*)obj + c->free_off);
+}
+
+static void list_add(kmem_slab_t** head, kmem_slab_t* s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void list_del(kmem_slab_t** head, kmem_slab_t* s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static void cache_setup(kmem_cache_t* c, const char* name, size_t size,
+                        size_t align, kmem_ctor_t ctor) {
+    memset(c, 0, sizeof(*c));
+    strncpy(c->name, name, KMEM_CACHE_NAME_LEN - 1);
+
+    if (align < sizeof(void*)) align = sizeof(void*);
+
+    c->obj_size = size;
+    c->ctor = ctor;
+
+    // Constructed objects must keep their state while free, so the link
+    // lives past the end of the object instead of in its first word
+    if (ctor) {
+        c->free_off = ALIGN_UP(size, sizeof(void*));
+        c->stride = ALIGN_UP(c->free_off + sizeof(void*), align);
+    } else {
+        c->free_off = 0;
+        c->stride = ALIGN_UP(size < sizeof(void*) ? sizeof(void*) : size, align);
+    }
+
+    c->first_off = ALIGN_UP(sizeof(kmem_slab_t), align);
+
+    c->order = 0;
+    while (c->order < SLAB_MAX_ORDER &&
+           (slab_bytes(c) - c->first_off) / c->stride < SLAB_MIN_OBJS)
+        c->order++;
+
+    c->objs_per_slab = (uint32_t)((slab_bytes(c) - c->first_off) / c->stride);
+}
+
+static kmem_slab_t* slab_create(kmem_cache_t* c) {
+    void* phys = pmm_alloc_pages((size_t)1 << c->order);
+    if (!phys) return NULL;
+
+    kmem_slab_t* s = (kmem_slab_t*)PHYS_TO_VIRT(phys);
+    s->next = s->prev = NULL;
+    s->cache = c;
+    s->in_use = 0;
+    s->free = NULL;
+
+    // Build the free list back to front so objects are handed out in
+    // address order
+    uint8_t* base = (uint8_t*)s + c->first_off;
+    for (uint32_t i = c->objs_per_slab; i-- > 0;) {
+        void* obj = base + (size_t)i * c->stride;
+        if (c->ctor) c->ctor(obj);
+        *free_link(c, obj) = s->free;
+        s->free = obj;
+    }
+
+    c->num_slabs++;
+    return s;
+}
+
+static void slab_destroy(kmem_cache_t* c, kmem_slab_t* s) {
+    c->num_slabs--;
+    pmm_free_pages((void*)VIRT_TO_PHYS(s), (size_t)1 << c->order);
+}
+
+static uint64_t slab_count_reclaimable(void);
+static uint64_t slab_shrink_all(uint64_t max);
+
+static shrinker_t slab_shrinker = {
+    .name   = "slab",
+    .count  = slab_count_reclaimable,
+    .scan   = slab_shrink_all,
+    .cost   = SHRINKER_COST_SLAB,
+    .atomic = true,
+};
+
+static void slab_init(void) {
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+    cache_cache.next = NULL;
+    cache_list = &cache_cache;
+    slab_ready = true;
+    shrinker_register(&slab_shrinker);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+                                kmem_ctor_t ctor) {
+    if (!slab_ready) slab_init();
+
+    if (!name || size == 0 || (align & (align - 1))) {
+        log_err(SLAB_MODULE, "Invalid cache parameters (%s, %llu, %llu)",
+                name ? name : "?", (uint64_t)size, (uint64_t)align);
+        return NULL;
+    }
+
+    if (size + ALIGN_UP(sizeof(kmem_slab_t), align ? align : sizeof(void*)) >
+        ((size_t)PAGE_SIZE << SLAB_MAX_ORDER)) {
+        log_err(SLAB_MODULE, "Object size %llu too large for cache %s",
+                (uint64_t)size, name);
+        return NULL;
+    }
+
+    kmem_cache_t* c = kmem_cache_alloc(&cache_cache);
+    if (!c) return NULL;
+
+    cache_setup(c, name, size, align, ctor);
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    c->next = cache_list;
+    cache_list = c;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    log_debug(SLAB_MODULE, "Created cache %s: %llu byte objects, %u per %llu page slab",
+              c->name, (uint64_t)size, c->objs_per_slab, (uint64_t)1 << c->order);
+    return c;
+}
+
+int kmem_cache_destroy(kmem_cache_t* cache) {
+    if (!cache || cache == &cache_cache) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    if (cache->active_objs) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        log_err(SLAB_MODULE, "Cannot destroy cache %s: %llu objects still in use",
+                cache->name, cache->active_objs);
+        return -1;
+    }
+    while (cache->partial) {
+        kmem_slab_t* s = cache->partial;
+        list_del(&cache->partial, s);
+        slab_destroy(cache, s);
+    }
+    if (cache->empty) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t** pp = &cache_list; *pp; pp = &(*pp)->next) {
+        if (*pp == cache) {
+            *pp = cache->next;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    kmem_cache_free(&cache_cache, cache);
+    return 0;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    kmem_slab_t* s = cache->partial;
+    if (!s) {
+        if (cache->empty) {
+            s = cache->empty;
+            cache->empty = NULL;
+        } else {
+            s = slab_create(cache);
+            if (!s) {
+                cache->failed++;
+                spin_unlock_irqrestore(&cache->lock, flags);
+                log_err(SLAB_MODULE, "Out of memory growing cache %s", cache->name);
+                return NULL;
+            }
+        }
+        list_add(&cache->partial, s);
+    }
+
+    void* obj = s->free;
+    s->free = *free_link(cache, obj);
+    s->in_use++;
+
+    if (!s->free) {
+        list_del(&cache->partial, s);
+        list_add(&cache->full, s);
+    }
+
+    cache->active_objs++;
+    cache->allocs++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (!cache->ctor)
+        memset(obj, 0, cache->obj_size);
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) return;
+
+    kmem_slab_t* s = (kmem_slab_t*)((uint64_t)obj & ~((uint64_t)slab_bytes(cache) - 1));
+    uint64_t off = (uint64_t)obj - (uint64_t)s;
+
+    if (s->cache != cache || off < cache->first_off ||
+        (off - cache->first_off) % cache->stride != 0) {
+        log_err(SLAB_MODULE, "Invalid free of %p to cache %s", obj, cache->name);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    bool was_full = (s->free == NULL);
+
+    *free_link(cache, obj) = s->free;
+    s->free = obj;
+    s->in_use--;
+
+    if (was_full) {
+        list_del(&cache->full, s);
+        list_add(&cache->partial, s);
+    }
+
+    if (s->in_use == 0) {
+        list_del(&cache->partial, s);
+        if (cache->empty) {
+            slab_destroy(cache, s);
+        } else {
+            cache->empty = s;
+        }
+    }
+
+    cache->active_objs--;
+    cache->frees++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+uint64_t kmem_cache_shrink(kmem_cache_t* cache) {
+    if (!cache) return 0;
+
+    uint64_t freed = 0;
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    if (cache->empty) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+        freed = (uint64_t)1 << cache->order;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return freed;
+}
+
+// Pages held by the spare empty slabs of all caches
+static uint64_t slab_count_reclaimable(void) {
+    uint64_t pages = 0;
+    for (kmem_cache_t* c = cache_list; c; c = c->next) {
+        if (c->empty)
+            pages += (uint64_t)1 << c->order;
+    }
+    return pages;
+}
+
+// Shrinker scan. It can run from an allocation made inside any cache, so
+// caches whose lock is taken are skipped rather than waited on
+static uint64_t slab_shrink_all(uint64_t max) {
+    uint64_t freed = 0;
+    uint64_t list_flags;
+    if (!spin_trylock_irqsave(&cache_list_lock, &list_flags))
+        return 0;
+
+    for (kmem_cache_t* c = cache_list; c && freed < max; c = c->next) {
+        uint64_t flags;
+        if (!c->empty || !spin_trylock_irqsave(&c->lock, &flags))
+            continue;
+        if (c->empty) {
+            slab_destroy(c, c->empty);
+            c->empty = NULL;
+            freed += (uint64_t)1 << c->order;
+        }
+        spin_unlock_irqrestore(&c->lock, flags);
+    }
+
+    spin_unlock_irqrestore(&cache_list_lock, list_flags);
+    return freed;
+}
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    if (!cache || !stats) return;
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    stats->name = cache->name;
+    stats->obj_size = cache->obj_size;
+    stats->slab_pages = (uint64_t)1 << cache->order;
+    stats->num_slabs = cache->num_slabs;
+    stats->total_objs = cache->num_slabs * cache->objs_per_slab;
+    stats->active_objs = cache->active_objs;
+    stats->allocs = cache->allocs;
+    stats->frees = cache->frees;
+    stats->failed = cache->failed;
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_dump_caches(void) {
+    if (!slab_ready) return;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t* c = cache_list; c; c = c->next) {
+        kmem_cache_stats_t st;
+        kmem_cache_get_stats(c, &st);
+        log_info(SLAB_MODULE, "%s: %llu/%llu objs (%llu B), %llu slabs, %llu allocs, %llu frees",
+                 st.name, st.active_objs, st.total_objs, st.obj_size,
+                 st.num_slabs, st.allocs, st.frees);
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
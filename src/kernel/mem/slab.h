@@ -0,0 +1,49 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KMEM_CACHE_NAME_LEN 24
+
+typedef struct kmem_cache kmem_cache_t;
+
+// Called once per object when its slab is created, not on every alloc.
+// Objects must be handed back to kmem_cache_free() in constructed state.
+typedef void (*kmem_ctor_t)(void* obj);
+
+typedef struct {
+    const char* name;
+    uint64_t obj_size;      // Object size as requested
+    uint64_t slab_pages;    // Pages backing each slab
+    uint64_t num_slabs;
+    uint64_t total_objs;    // Capacity across all slabs
+    uint64_t active_objs;   // Currently allocated
+    uint64_t allocs;        // Lifetime kmem_cache_alloc() calls that succeeded
+    uint64_t frees;         // Lifetime kmem_cache_free() calls
+    uint64_t failed;        // Allocations that could not get a new slab
+} kmem_cache_stats_t;
+
+// Create a cache for objects of `size` bytes aligned to `align`
+// (0 means pointer alignment). `ctor` may be NULL.
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+                                kmem_ctor_t ctor);
+
+// Destroy a cache; fails (returns -1) while objects are still allocated
+int kmem_cache_destroy(kmem_cache_t* cache);
+
+// Allocate an object; zeroed unless the cache has a constructor
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Release cached empty slabs back to the PMM; returns pages freed
+uint64_t kmem_cache_shrink(kmem_cache_t* cache);
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+
+// Log statistics for every cache
+void kmem_dump_caches(void);
+
+#endif // SLAB_H
@@ -0,0 +1,141 @@
+#include "swap.h"
+#include "pmm.h"
+#include "vmalloc.h"
+#include <memory.h>
+#include <debug.h>
+#include <util/spinlock.h>
+
+#define SWAP_MODULE "SWAP"
+
+// References per slot are bounded by the process count
+#define SWAP_COUNT_MAX 0xFF
+
+static block_device_t* swap_dev = NULL;
+static uint8_t*        slot_count = NULL;
+static uint64_t        total_slots = 0;
+static uint64_t        used_slots = 0;
+static uint64_t        next_slot = 1;
+static uint32_t        sectors_per_slot = 0;
+static spinlock_t      swap_lock = { 0 };
+
+bool swap_add_device(block_device_t* dev) {
+    if (!dev || swap_dev)
+        return false;
+
+    if (!dev->sector_size || PAGE_SIZE % dev->sector_size) {
+        log_err(SWAP_MODULE, "%s: unsupported sector size %u", dev->name, dev->sector_size);
+        return false;
+    }
+
+    uint32_t per_slot = PAGE_SIZE / dev->sector_size;
+    uint64_t slots = dev->sector_count / per_slot;
+    if (slots < 2) {
+        log_err(SWAP_MODULE, "%s is too small for swap", dev->name);
+        return false;
+    }
+
+    uint8_t* counts = kvmalloc(slots);
+    if (!counts) {
+        log_err(SWAP_MODULE, "No memory for the slot map of %s", dev->name);
+        return false;
+    }
+    memset(counts, 0, slots);
+
+    // Keep the header
+    counts[0] = SWAP_COUNT_MAX;
+
+    uint64_t flags = spin_lock_irqsave(&swap_lock);
+    slot_count = counts;
+    total_slots = slots;
+    used_slots = 0;
+    next_slot = 1;
+    sectors_per_slot = per_slot;
+    swap_dev = dev;
+    spin_unlock_irqrestore(&swap_lock, flags);
+
+    log_ok(SWAP_MODULE, "Swapping to %s (%llu KB)", dev->name,
+           (unsigned long long)((slots - 1) * (PAGE_SIZE / 1024)));
+    return true;
+}
+
+bool swap_enabled(void) {
+    return swap_dev != NULL;
+}
+
+uint64_t swap_alloc(void) {
+    if (!swap_dev)
+        return 0;
+
+    uint64_t flags = spin_lock_irqsave(&swap_lock);
+    uint64_t slot = 0;
+
+    // Next fit from where the last search stopped
+    for (uint64_t n = 0; n < total_slots; n++) {
+        uint64_t s = next_slot + n;
+        if (s >= total_slots)
+            s -= total_slots;
+        if (!slot_count[s]) {
+            slot = s;
+            break;
+        }
+    }
+
+    if (slot) {
+        slot_count[slot] = 1;
+        used_slots++;
+        next_slot = slot + 1 < total_slots ? slot + 1 : 1;
+    }
+
+    spin_unlock_irqrestore(&swap_lock, flags);
+    return slot;
+}
+
+void swap_dup(uint64_t slot) {
+    if (!slot || slot >= total_slots)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&swap_lock);
+    if (slot_count[slot] && slot_count[slot] < SWAP_COUNT_MAX)
+        slot_count[slot]++;
+    spin_unlock_irqrestore(&swap_lock, flags);
+}
+
+void swap_free(uint64_t slot) {
+    if (!slot || slot >= total_slots)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&swap_lock);
+    if (slot_count[slot] && --slot_count[slot] == 0)
+        used_slots--;
+    spin_unlock_irqrestore(&swap_lock, flags);
+}
+
+bool swap_write(uint64_t slot, void* page) {
+    if (!swap_dev || !slot || slot >= total_slots)
+        return false;
+
+    if (!swap_dev->write(swap_dev, slot * sectors_per_slot, sectors_per_slot, kmap_phys(page))) {
+        log_err(SWAP_MODULE, "Write of slot %llu failed", (unsigned long long)slot);
+        return false;
+    }
+    return true;
+}
+
+bool swap_read(uint64_t slot, void* page) {
+    if (!swap_dev || !slot || slot >= total_slots)
+        return false;
+
+    if (!swap_dev->read(swap_dev, slot * sectors_per_slot, sectors_per_slot, kmap_phys(page))) {
+        log_err(SWAP_MODULE, "Read of slot %llu failed", (unsigned long long)slot);
+        return false;
+    }
+    return true;
+}
+
+uint64_t swap_get_total_slots(void) {
+    return total_slots ? total_slots - 1 : 0;
+}
+
+uint64_t swap_get_used_slots(void) {
+    return used_slots;
+}
@@ -0,0 +1,34 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <block/block.h>
+
+// Swap area for anonymous user pages on a block device. Slot n holds the
+// page at byte offset n * 4096 of the device. Slot 0 is where mkswap puts
+// its header and is never handed out, so 0 doubles as "no slot".
+//
+// Each slot counts the swap entries (see PAGE_SWAPPED in vmm.h) pointing
+// at it; fork duplicates them and the slot is freed with the last one.
+
+// Use a block device as the swap area. Only one area is supported
+bool swap_add_device(block_device_t* dev);
+
+bool swap_enabled(void);
+
+// Reserve a free slot with one reference; 0 when the area is full
+uint64_t swap_alloc(void);
+
+// Take another reference on a slot / drop one
+void swap_dup(uint64_t slot);
+void swap_free(uint64_t slot);
+
+// Copy a physical page to or from a slot
+bool swap_write(uint64_t slot, void* page);
+bool swap_read(uint64_t slot, void* page);
+
+uint64_t swap_get_total_slots(void);
+uint64_t swap_get_used_slots(void);
+
+#endif // SWAP_H
@@ -0,0 +1,183 @@
+#include "vmalloc.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "slab.h"
+#include "vrange.h"
+#include <heap.h>
+#include <debug.h>
+#include <util/spinlock.h>
+
+#define VMALLOC_MODULE "VMALLOC"
+
+#define VMALLOC_GUARD_PAGES  1
+#define VMALLOC_HASH_BUCKETS 256
+
+#define VMALLOC_MAP_FLAGS    (PAGE_PRESENT | PAGE_WRITE)
+
+typedef struct vm_area {
+    void           *addr;
+    size_t          pages;      // Mapped pages, not counting the guard
+    struct vm_area *next;
+} vm_area_t;
+
+static uint64_t virt_bitmap[VMALLOC_PAGE_COUNT / 64];
+static vrange_t virt_space = VRANGE_INIT(VMALLOC_BASE, VMALLOC_PAGE_COUNT, virt_bitmap);
+
+static vm_area_t    *area_hash[VMALLOC_HASH_BUCKETS];
+static kmem_cache_t *area_cache = NULL;
+static spinlock_t    area_lock = { 0 };
+
+static uint64_t used_pages = 0;
+static bool vmalloc_ready = false;
+
+static inline size_t area_hash_idx(void *addr) {
+    return ((uintptr_t)addr >> 12) & (VMALLOC_HASH_BUCKETS - 1);
+}
+
+static void area_insert(vm_area_t *a) {
+    size_t idx = area_hash_idx(a->addr);
+    uint64_t flags = spin_lock_irqsave(&area_lock);
+    a->next = area_hash[idx];
+    area_hash[idx] = a;
+    used_pages += a->pages;
+    spin_unlock_irqrestore(&area_lock, flags);
+}
+
+static vm_area_t *area_take(void *addr) {
+    size_t idx = area_hash_idx(addr);
+    uint64_t flags = spin_lock_irqsave(&area_lock);
+    for (vm_area_t **pp = &area_hash[idx]; *pp; pp = &(*pp)->next) {
+        if ((*pp)->addr == addr) {
+            vm_area_t *a = *pp;
+            *pp = a->next;
+            used_pages -= a->pages;
+            spin_unlock_irqrestore(&area_lock, flags);
+            return a;
+        }
+    }
+    spin_unlock_irqrestore(&area_lock, flags);
+    return NULL;
+}
+
+// Unmap `pages` pages at `virt`, return them to the PMM and flush once
+static void unmap_and_free(void *virt, size_t pages) {
+    address_space_t *ks = vmm_get_kernel_space();
+
+    for (size_t i = 0; i < pages; i++) {
+        void *phys = vmm_unmap_noflush(ks, (uint8_t *)virt + i * PAGE_SIZE);
+        if (phys)
+            pmm_free(phys);
+    }
+
+    vmm_flush_tlb_range(ks, virt, pages);
+}
+
+void vmalloc_init(void) {
+    if (vmalloc_ready)
+        return;
+
+    // Every process shares the kernel half of the PML4, so the entries
+    // for the window must exist before the first address space is created
+    if (!vmm_prepare_kernel_range((void *)VMALLOC_BASE, VMALLOC_PAGE_COUNT * PAGE_SIZE)) {
+        log_crit(VMALLOC_MODULE, "Failed to set up page tables for vmalloc window");
+        return;
+    }
+
+    area_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    if (!area_cache) {
+        log_crit(VMALLOC_MODULE, "Failed to create vm_area cache");
+        return;
+    }
+
+    // Page 0 stays reserved so the first area has a guard below it too
+    vrange_reserve(&virt_space, 0, 1);
+
+    vmalloc_ready = true;
+    log_ok(VMALLOC_MODULE, "vmalloc window at 0x%llx (%llu MB)",
+           VMALLOC_BASE, (VMALLOC_PAGE_COUNT * PAGE_SIZE) / (1024 * 1024));
+}
+
+void *vmalloc(size_t size) {
+    if (!vmalloc_ready) {
+        log_err(VMALLOC_MODULE, "vmalloc called before vmalloc_init");
+        return NULL;
+    }
+
+    if (size == 0)
+        return NULL;
+
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    vm_area_t *area = kmem_cache_alloc(area_cache);
+    if (!area)
+        return NULL;
+
+    void *virt = vrange_alloc(&virt_space, pages + VMALLOC_GUARD_PAGES, 1);
+    if (!virt) {
+        kmem_cache_free(area_cache, area);
+        log_err(VMALLOC_MODULE, "Out of virtual space for %llu pages", (uint64_t)pages);
+        return NULL;
+    }
+
+    address_space_t *ks = vmm_get_kernel_space();
+
+    for (size_t i = 0; i < pages; i++) {
+        void *phys = pmm_alloc();
+        uint8_t *va = (uint8_t *)virt + i * PAGE_SIZE;
+
+        if (!phys || !vmm_map(ks, va, phys, VMALLOC_MAP_FLAGS)) {
+            if (phys)
+                pmm_free(phys);
+            unmap_and_free(virt, i);
+            vrange_free(&virt_space, virt, pages + VMALLOC_GUARD_PAGES);
+            kmem_cache_free(area_cache, area);
+            log_err(VMALLOC_MODULE, "Out of memory allocating %llu pages", (uint64_t)pages);
+            return NULL;
+        }
+    }
+
+    area->addr = virt;
+    area->pages = pages;
+    area_insert(area);
+
+    return virt;
+}
+
+void vfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    vm_area_t *area = area_take(ptr);
+    if (!area) {
+        log_err(VMALLOC_MODULE, "vfree of unknown address %p", ptr);
+        return;
+    }
+
+    unmap_and_free(area->addr, area->pages);
+    vrange_free(&virt_space, area->addr, area->pages + VMALLOC_GUARD_PAGES);
+    kmem_cache_free(area_cache, area);
+}
+
+bool is_vmalloc_addr(const void *ptr) {
+    uint64_t addr = (uint64_t)ptr;
+    return addr >= VMALLOC_BASE && addr < VMALLOC_BASE + VMALLOC_PAGE_COUNT * PAGE_SIZE;
+}
+
+void *kvmalloc(size_t size) {
+    if (size <= KVMALLOC_HEAP_MAX)
+        return kmalloc(size);
+
+    void *p = vmalloc(size);
+    return p ? p : kmalloc(size);
+}
+
+void kvfree(void *ptr) {
+    if (is_vmalloc_addr(ptr))
+        vfree(ptr);
+    else
+        kfree(ptr);
+}
+
+uint64_t vmalloc_get_used_pages(void) {
+    return used_pages;
+}
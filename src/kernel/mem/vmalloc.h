@@ -0,0 +1,32 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Virtually contiguous kernel allocations backed by individual physical
+// pages. Each area is followed by an unmapped guard page.
+#define VMALLOC_BASE        0xFFFFD00000000000ULL
+#define VMALLOC_PAGE_COUNT  (1024UL * 1024)     // 4GB window
+
+void vmalloc_init(void);
+
+// Allocate `size` bytes of zeroed, page-granular memory
+void *vmalloc(size_t size);
+
+// Free memory returned by vmalloc
+void vfree(void *ptr);
+
+bool is_vmalloc_addr(const void *ptr);
+
+// Use the heap for small sizes and vmalloc for large ones; kvfree() takes
+// either kind of pointer
+#define KVMALLOC_HEAP_MAX   (4 * 4096)
+void *kvmalloc(size_t size);
+void kvfree(void *ptr);
+
+// Pages currently mapped by vmalloc
+uint64_t vmalloc_get_used_pages(void);
+
+#endif // VMALLOC_H
@@ -1,8 +1,13 @@
 #include "vmm.h"
 #include "pmm.h"
+#include "swap.h"
 #include <debug.h>
 #include <string.h>
 #include <memory.h>
+#include <util/spinlock.h>
+#include <panic/panic.h>
+#include <arch/x86_64/cpu.h>
+#include <arch/x86_64/smp.h>
 
 extern uint64_t hhdm_offset;
 
@@ -21,13 +26,170 @@ extern uint64_t hhdm_offset;
 #define PTE_GET_FLAGS(entry) ((entry) & ~PAGE_MASK)
 #define PTE_CREATE(addr, flags) (((uint64_t)(addr) & PAGE_MASK) | (flags))
 
+// Huge leaf entries: the frame address is aligned to the page size and
+// the PAT bit moves from bit 7 to bit 12
+#define PTE_ADDR_MASK       0x000FFFFFFFFFF000ULL
+#define PTE_HUGE_PAT        (1ULL << 12)
+#define PTE_PAT             (1ULL << 7)
+#define PTE_HUGE_ADDR(entry, size) ((entry) & PTE_ADDR_MASK & ~((size) - 1))
+
+// Swap entries keep the slot number where the frame address would be
+#define PTE_SWAP_SLOT(entry) (((entry) & PTE_ADDR_MASK) >> 12)
+#define PTE_SWAP_ENTRY(slot) ((((uint64_t)(slot) << 12) & PTE_ADDR_MASK) | PAGE_SWAPPED)
+
+// Table levels, named by the table being walked
+#define LEVEL_PML4 4
+#define LEVEL_PDPT 3
+#define LEVEL_PD   2
+
+// vmm_get_next_level() modes
+#define WALK_LOOKUP 0   // Stop at missing tables and huge leaves
+#define WALK_CREATE 1   // Create missing tables, split huge leaves
+#define WALK_SPLIT  2   // Split huge leaves, but do not create tables
+
 // Kernel address space
 static address_space_t kernel_space = {0};
 
+// Set when CPUID reports 1GB page support
+static bool huge_1g_supported = false;
+
+// Space whose PML4 is loaded in CR3 on this CPU
+#define current_space (cpu_self()->space)
+
+// PCID 0 belongs to the kernel space and is also the fallback when the
+// bitmap runs out; spaces on PCID 0 are flushed on every switch
+static bool pcid_enabled = false;
+static uint64_t pcid_bitmap[VMM_PCID_COUNT / 64] = { 1 };
+static size_t pcid_hint = 1;
+static spinlock_t pcid_lock = { 0 };
+
+static uint16_t pcid_alloc(void) {
+    if (!pcid_enabled) return 0;
+    
+    uint16_t pcid = 0;
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (size_t n = 0; n < VMM_PCID_COUNT; n++) {
+        size_t i = (pcid_hint + n) % VMM_PCID_COUNT;
+        if (!(pcid_bitmap[i / 64] & (1ULL << (i % 64)))) {
+            pcid_bitmap[i / 64] |= 1ULL << (i % 64);
+            pcid_hint = i + 1;
+            pcid = (uint16_t)i;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return pcid;
+}
+
+static void pcid_free(uint16_t pcid) {
+    if (!pcid) return;
+    
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+// Existing mappings changed; the caller invalidates them on this CPU.
+// Kernel mappings are global, so every other CPU drops them right away.
+// For user mappings only CPUs running the space are interrupted; the
+// others keep whatever their PCID cached and flush on their next switch
+static void vmm_note_range_change(address_space_t* space, uint64_t virt_addr, size_t pages) {
+    uint64_t self = 1ULL << cpu_id();
+    
+    if (virt_addr >= KERNEL_HALF) {
+        smp_tlb_shootdown_range(~self, virt_addr, pages);
+        return;
+    }
+    
+    uint64_t active = space->active_cpus;
+    __atomic_or_fetch(&space->stale_cpus, ~active, __ATOMIC_RELAXED);
+    if (active & ~self) {
+        smp_tlb_shootdown_range(active & ~self, virt_addr, pages);
+    }
+}
+
+static void vmm_note_change(address_space_t* space, uint64_t virt_addr) {
+    vmm_note_range_change(space, virt_addr, 1);
+}
+
+// Like vmm_note_change, for changes all over the space. Flushes this
+// CPU too
+static void vmm_note_space_change(address_space_t* space) {
+    uint64_t self = 1ULL << cpu_id();
+    uint64_t active = space->active_cpus;
+    
+    __atomic_or_fetch(&space->stale_cpus, ~active, __ATOMIC_RELAXED);
+    if (active & ~self) {
+        smp_tlb_shootdown(active & ~self, SMP_TLB_FLUSH_ALL);
+    }
+    if (active & self) {
+        vmm_set_cr3(vmm_get_cr3());
+    }
+}
+
+// Kernel mappings are the same in every address space, so keep them in
+// the TLB across CR3 writes
+static inline uint64_t vmm_global_flag(uint64_t virt_addr) {
+    return virt_addr >= KERNEL_HALF ? PAGE_GLOBAL : 0;
+}
+
+static inline uint64_t level_page_size(int level) {
+    return level == LEVEL_PDPT ? VMM_HUGE_1G_SIZE : VMM_HUGE_2M_SIZE;
+}
+
+// Replace the huge leaf at current[index] with a table of smaller pages
+// covering the same memory with the same attributes
+static page_table_t* vmm_split_huge(page_table_t* current, int level, size_t index) {
+    uint64_t entry = current->entries[index];
+    uint64_t size = level_page_size(level);
+    uint64_t child_size = size / 512;
+    uint64_t base = PTE_HUGE_ADDR(entry, size);
+    
+    void* phys = pmm_alloc_nozero();
+    if (!phys) {
+        log_crit("VMM", "Failed to allocate page table for huge page split");
+        return NULL;
+    }
+    page_table_t* table = (page_table_t*)PHYS_TO_VIRT(phys);
+    
+    uint64_t child_flags = entry & ~PTE_ADDR_MASK;
+    if (level == LEVEL_PD) {
+        // 4KB entries have no PS bit and keep PAT in bit 7
+        child_flags &= ~(PAGE_HUGE | PTE_HUGE_PAT);
+        if (entry & PTE_HUGE_PAT) {
+            child_flags |= PTE_PAT;
+        }
+    } else {
+        child_flags |= entry & PTE_HUGE_PAT;
+    }
+    
+    for (size_t i = 0; i < 512; i++) {
+        table->entries[i] = (base + i * child_size) | child_flags;
+    }
+    
+    // The translation does not change, so no TLB flush is needed here
+    current->entries[index] = (uint64_t)phys |
+        (entry & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER));
+    
+    return table;
+}
+
 // Get or create a page table at the next level
-static page_table_t* vmm_get_next_level(page_table_t* current, size_t index, bool create, uint64_t flags) {
+static page_table_t* vmm_get_next_level(page_table_t* current, int level, size_t index, int mode, uint64_t flags) {
     uint64_t entry = current->entries[index];
     
+    // Huge leaf: there is no lower table unless we split it
+    if ((entry & PAGE_PRESENT) && (entry & PAGE_HUGE) && level != LEVEL_PML4) {
+        if (mode == WALK_LOOKUP) {
+            return NULL;
+        }
+        page_table_t* table = vmm_split_huge(current, level, index);
+        if (table) {
+            current->entries[index] |= (flags & (PAGE_USER | PAGE_WRITE));
+        }
+        return table;
+    }
+    
     // If entry exists, update flags and return it
     if (entry & PAGE_PRESENT) {
         // Update the entry to include new flags (important for USER bit propagation)
@@ -38,7 +200,7 @@ static page_table_t* vmm_get_next_level(page_table_t* current, size_t index, boo
     }
     
     // If not creating, return NULL
-    if (!create) {
+    if (mode != WALK_CREATE) {
         return NULL;
     }
     
@@ -49,9 +211,8 @@ static page_table_t* vmm_get_next_level(page_table_t* current, size_t index, boo
         return NULL;
     }
     
-    // Clear the new page table
+    // pmm_alloc() returns a zeroed page, so the new table is already empty
     page_table_t* table = (page_table_t*)PHYS_TO_VIRT(phys);
-    memset(table, 0, PAGE_SIZE);
     
     // Set the entry with all required flags
     current->entries[index] = PTE_CREATE(phys, flags | PAGE_PRESENT);
@@ -59,18 +220,153 @@ static page_table_t* vmm_get_next_level(page_table_t* current, size_t index, boo
     return table;
 }
 
+// Find the leaf entry mapping virt without modifying anything; *size is
+// set to the size of the page it maps
+static uint64_t* vmm_lookup_leaf(address_space_t* space, uint64_t virt_addr, uint64_t* size) {
+    page_table_t* pml4 = (page_table_t*)space->pml4_virt;
+    
+    uint64_t* entry = &pml4->entries[PML4_INDEX(virt_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    
+    page_table_t* pdpt = (page_table_t*)PHYS_TO_VIRT(*entry & PTE_ADDR_MASK);
+    entry = &pdpt->entries[PDPT_INDEX(virt_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    if (*entry & PAGE_HUGE) {
+        *size = VMM_HUGE_1G_SIZE;
+        return entry;
+    }
+    
+    page_table_t* pd = (page_table_t*)PHYS_TO_VIRT(*entry & PTE_ADDR_MASK);
+    entry = &pd->entries[PD_INDEX(virt_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    if (*entry & PAGE_HUGE) {
+        *size = VMM_HUGE_2M_SIZE;
+        return entry;
+    }
+    
+    page_table_t* pt = (page_table_t*)PHYS_TO_VIRT(*entry & PTE_ADDR_MASK);
+    entry = &pt->entries[PT_INDEX(virt_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    
+    *size = PAGE_SIZE;
+    return entry;
+}
+
+// The 4KB entry for a user address whether or not it is present; NULL
+// when no page table covers it or a huge page does
+static uint64_t* vmm_lookup_pte(address_space_t* space, uint64_t virt_addr) {
+    page_table_t* pml4 = (page_table_t*)space->pml4_virt;
+    
+    uint64_t entry = pml4->entries[PML4_INDEX(virt_addr)];
+    if (!(entry & PAGE_PRESENT)) return NULL;
+    
+    page_table_t* pdpt = (page_table_t*)PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+    entry = pdpt->entries[PDPT_INDEX(virt_addr)];
+    if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE)) return NULL;
+    
+    page_table_t* pd = (page_table_t*)PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+    entry = pd->entries[PD_INDEX(virt_addr)];
+    if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE)) return NULL;
+    
+    page_table_t* pt = (page_table_t*)PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+    return &pt->entries[PT_INDEX(virt_addr)];
+}
+
+// Set the global bit on every leaf below a kernel-half table entry
+static void vmm_mark_global(page_table_t* table, int level) {
+    for (size_t i = 0; i < 512; i++) {
+        uint64_t entry = table->entries[i];
+        if (!(entry & PAGE_PRESENT)) continue;
+        
+        if (level == 1 || (entry & PAGE_HUGE)) {
+            table->entries[i] = entry | PAGE_GLOBAL;
+        } else {
+            vmm_mark_global((page_table_t*)PHYS_TO_VIRT(entry & PTE_ADDR_MASK), level - 1);
+        }
+    }
+}
+
+// Copy a page table and every table below it into PMM pages; leaves
+// are shared. Returns the physical address of the copy, 0 when out of memory
+static uint64_t vmm_copy_table(uint64_t phys, int level) {
+    uint64_t copy = (uint64_t)pmm_alloc_nozero();
+    if (!copy) return 0;
+    
+    page_table_t* src = (page_table_t*)PHYS_TO_VIRT(phys);
+    page_table_t* dst = (page_table_t*)PHYS_TO_VIRT(copy);
+    memcpy(dst, src, PAGE_SIZE);
+    
+    if (level == 1) return copy;
+    
+    for (size_t i = 0; i < 512; i++) {
+        uint64_t entry = src->entries[i];
+        if (!(entry & PAGE_PRESENT) || (level != LEVEL_PML4 && (entry & PAGE_HUGE))) continue;
+        
+        uint64_t child = vmm_copy_table(entry & PTE_ADDR_MASK, level - 1);
+        if (!child) return 0;
+        dst->entries[i] = (entry & ~PTE_ADDR_MASK) | child;
+    }
+    return copy;
+}
+
 void vmm_init(void) {
     log_info("VMM", "Initializing virtual memory manager...");
     
     // Get current CR3 (Limine has already set up paging)
     uint64_t current_cr3 = vmm_get_cr3();
-    void* pml4_phys = (void*)(current_cr3 & PAGE_MASK);
     
-    log_info("VMM", "Current PML4 at physical: 0x%llx", (uint64_t)pml4_phys);
+    log_info("VMM", "Limine PML4 at physical: 0x%llx", current_cr3 & PAGE_MASK);
+    
+    // Limine's tables live in bootloader-reclaimable memory, which is
+    // handed back to the PMM after boot. Move onto our own copy first
+    void* pml4_phys = (void*)vmm_copy_table(current_cr3 & PAGE_MASK, LEVEL_PML4);
+    if (!pml4_phys) {
+        panic("VMM", "Out of memory copying the boot page tables");
+    }
+    vmm_set_cr3((uint64_t)pml4_phys);
     
-    // Use Limine's page tables as kernel space initially
     kernel_space.pml4 = (page_table_t*)pml4_phys;
     kernel_space.pml4_virt = PHYS_TO_VIRT(pml4_phys);
+    kernel_space.active_cpus = 1ULL << cpu_id();
+    current_space = &kernel_space;
+    
+    // CPUID 0x80000001 EDX bit 26: 1GB pages
+    uint32_t eax = 0x80000000, edx;
+    __asm__ volatile("cpuid" : "+a"(eax) :: "ebx", "ecx", "edx");
+    if (eax >= 0x80000001) {
+        eax = 0x80000001;
+        __asm__ volatile("cpuid" : "+a"(eax), "=d"(edx) :: "ebx", "ecx");
+        huge_1g_supported = (edx >> 26) & 1;
+    }
+    log_info("VMM", "Huge pages: 2MB%s", huge_1g_supported ? ", 1GB" : "");
+    
+    // Global kernel pages survive CR3 writes
+    page_table_t* pml4 = (page_table_t*)kernel_space.pml4_virt;
+    for (size_t i = 256; i < 512; i++) {
+        if (pml4->entries[i] & PAGE_PRESENT) {
+            vmm_mark_global((page_table_t*)PHYS_TO_VIRT(pml4->entries[i] & PTE_ADDR_MASK), LEVEL_PDPT);
+        }
+    }
+    
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= VMM_CR4_PGE;
+    
+    // CPUID 1 ECX bit 17: PCID. CR3 must carry PCID 0 when PCIDE is set
+    uint32_t ecx;
+    eax = 1;
+    __asm__ volatile("cpuid" : "+a"(eax), "=c"(ecx) :: "ebx", "edx");
+    if ((ecx >> 17) & 1) {
+        vmm_set_cr3((uint64_t)pml4_phys);
+        cr4 |= VMM_CR4_PCIDE;
+        pcid_enabled = true;
+    }
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    
+    // Flush once so the new global bits take effect
+    vmm_flush_tlb_all();
+    log_info("VMM", "Global kernel pages enabled, PCID %s",
+             pcid_enabled ? "enabled" : "not supported");
     
     log_ok("VMM", "Virtual memory manager initialized");
     log_info("VMM", "Kernel space PML4: 0x%llx (phys: 0x%llx)", 
@@ -78,6 +374,22 @@ void vmm_init(void) {
     //setup_user_space();
 }
 
+void vmm_init_cpu(void) {
+    // PCID 0, as PCIDE requires when it is turned on
+    vmm_set_cr3((uint64_t)kernel_space.pml4);
+    __atomic_or_fetch(&kernel_space.active_cpus, 1ULL << cpu_id(), __ATOMIC_RELAXED);
+    current_space = &kernel_space;
+    
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= VMM_CR4_PGE;
+    if (pcid_enabled) {
+        cr4 |= VMM_CR4_PCIDE;
+    }
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    vmm_flush_tlb_all();
+}
+
 void setup_user_space(void) {
     log_info("VMM", "Mapping user space at 0x400000...");
     
@@ -146,6 +458,12 @@ address_space_t* vmm_create_address_space(void) {
     space->pml4 = (page_table_t*)pml4_phys;
     space->pml4_virt = PHYS_TO_VIRT(pml4_phys);
     
+    // The PCID may have been used by a destroyed space, so every CPU
+    // starts with a flush
+    space->pcid = pcid_alloc();
+    space->active_cpus = 0;
+    space->stale_cpus = ~0ULL;
+    
     // Clear PML4
     memset(space->pml4_virt, 0, PAGE_SIZE);
     
@@ -170,7 +488,8 @@ void vmm_destroy_address_space(address_space_t* space) {
     
     page_table_t* pml4 = (page_table_t*)space->pml4_virt;
     
-    // Free user space page tables (entries 0-255)
+    // Free user pages, which may be shared copy-on-write, and their tables
+    // (entries 0-255)
     for (int pml4e = 0; pml4e < 256; pml4e++) {
         if (!(pml4->entries[pml4e] & PAGE_PRESENT)) continue;
         
@@ -178,14 +497,25 @@ void vmm_destroy_address_space(address_space_t* space) {
         
         for (int pdpte = 0; pdpte < 512; pdpte++) {
             if (!(pdpt->entries[pdpte] & PAGE_PRESENT)) continue;
+            if (pdpt->entries[pdpte] & PAGE_HUGE) continue;
             
             page_table_t* pd = (page_table_t*)PHYS_TO_VIRT(PTE_GET_ADDR(pdpt->entries[pdpte]));
             
             for (int pde = 0; pde < 512; pde++) {
                 if (!(pd->entries[pde] & PAGE_PRESENT)) continue;
+                if (pd->entries[pde] & PAGE_HUGE) continue;
                 
                 page_table_t* pt = (page_table_t*)PHYS_TO_VIRT(PTE_GET_ADDR(pd->entries[pde]));
                 
+                for (int pte = 0; pte < 512; pte++) {
+                    uint64_t entry = pt->entries[pte];
+                    if (entry & PAGE_PRESENT) {
+                        pmm_page_put((void*)(entry & PTE_ADDR_MASK));
+                    } else if (entry & PAGE_SWAPPED) {
+                        swap_free(PTE_SWAP_SLOT(entry));
+                    }
+                }
+                
                 // Free the page table
                 pmm_free(VIRT_TO_PHYS(pt));
             }
@@ -201,13 +531,39 @@ void vmm_destroy_address_space(address_space_t* space) {
     // Free PML4
     pmm_free(space->pml4);
     
+    pcid_free(space->pcid);
+    
     // Free address space structure
     pmm_free(VIRT_TO_PHYS(space));
 }
 
 void vmm_switch_space(address_space_t* space) {
     if (!space) return;
-    vmm_set_cr3((uint64_t)space->pml4);
+    
+    uint64_t self = 1ULL << cpu_id();
+    bool stale = __atomic_fetch_and(&space->stale_cpus, ~self, __ATOMIC_RELAXED) & self;
+    
+    // Threads of the same space keep everything, no CR3 write at all
+    if (space == current_space && !stale) return;
+    
+    uint64_t cr3 = (uint64_t)space->pml4;
+    if (pcid_enabled) {
+        cr3 |= space->pcid & VMM_PCID_MASK;
+        if (space->pcid && !stale) {
+            cr3 |= VMM_CR3_NOFLUSH;
+        }
+    }
+    
+    if (space != current_space) {
+        __atomic_and_fetch(&current_space->active_cpus, ~self, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&space->active_cpus, self, __ATOMIC_RELAXED);
+        current_space = space;
+    }
+    vmm_set_cr3(cr3);
+}
+
+address_space_t* vmm_get_current_space(void) {
+    return current_space;
 }
 
 bool vmm_map(address_space_t* space, void* virt, void* phys, uint64_t flags) {
@@ -228,17 +584,71 @@ bool vmm_map(address_space_t* space, void* virt, void* phys, uint64_t flags) {
     // Walk page tables
     page_table_t* pml4 = (page_table_t*)space->pml4_virt;
     
-    page_table_t* pdpt = vmm_get_next_level(pml4, pml4_idx, true, PAGE_WRITE | PAGE_USER);
+    page_table_t* pdpt = vmm_get_next_level(pml4, LEVEL_PML4, pml4_idx, WALK_CREATE, PAGE_WRITE | PAGE_USER);
     if (!pdpt) return false;
     
-    page_table_t* pd = vmm_get_next_level(pdpt, pdpt_idx, true, PAGE_WRITE | PAGE_USER);
+    page_table_t* pd = vmm_get_next_level(pdpt, LEVEL_PDPT, pdpt_idx, WALK_CREATE, PAGE_WRITE | PAGE_USER);
     if (!pd) return false;
     
-    page_table_t* pt = vmm_get_next_level(pd, pd_idx, true, PAGE_WRITE | PAGE_USER);
+    page_table_t* pt = vmm_get_next_level(pd, LEVEL_PD, pd_idx, WALK_CREATE, PAGE_WRITE | PAGE_USER);
     if (!pt) return false;
     
-    // Set the page table entry
-    pt->entries[pt_idx] = PTE_CREATE(phys_addr, flags | PAGE_PRESENT);
+    // Set the page table entry; other CPUs drop the old translation only
+    // once the new one is in place, or they could load the old one again
+    uint64_t old = pt->entries[pt_idx];
+    pt->entries[pt_idx] = PTE_CREATE(phys_addr, flags | PAGE_PRESENT | vmm_global_flag(virt_addr));
+    
+    if (old & PAGE_PRESENT) {
+        vmm_note_change(space, virt_addr);
+    }
+    
+    // Invalidate TLB
+    vmm_invlpg((void*)virt_addr);
+    
+    return true;
+}
+
+bool vmm_map_huge(address_space_t* space, void* virt, void* phys, uint64_t size, uint64_t flags) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
+    uint64_t virt_addr = (uint64_t)virt;
+    uint64_t phys_addr = (uint64_t)phys;
+    
+    if ((size != VMM_HUGE_2M_SIZE && size != VMM_HUGE_1G_SIZE) ||
+        (size == VMM_HUGE_1G_SIZE && !huge_1g_supported) ||
+        (virt_addr | phys_addr) & (size - 1)) {
+        return false;
+    }
+    
+    page_table_t* pml4 = (page_table_t*)space->pml4_virt;
+    
+    page_table_t* pdpt = vmm_get_next_level(pml4, LEVEL_PML4, PML4_INDEX(virt_addr), WALK_CREATE, PAGE_WRITE | PAGE_USER);
+    if (!pdpt) return false;
+    
+    page_table_t* table = pdpt;
+    size_t index = PDPT_INDEX(virt_addr);
+    
+    if (size == VMM_HUGE_2M_SIZE) {
+        table = vmm_get_next_level(pdpt, LEVEL_PDPT, index, WALK_CREATE, PAGE_WRITE | PAGE_USER);
+        if (!table) return false;
+        index = PD_INDEX(virt_addr);
+    }
+    
+    // Never drop an existing lower-level table; the caller falls back to
+    // 4KB pages instead
+    uint64_t old = table->entries[index];
+    if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) {
+        return false;
+    }
+    
+    table->entries[index] = (phys_addr & PTE_ADDR_MASK) | flags | PAGE_PRESENT | PAGE_HUGE |
+        vmm_global_flag(virt_addr);
+    
+    if (old & PAGE_PRESENT) {
+        vmm_note_change(space, virt_addr);
+    }
     
     // Invalidate TLB
     vmm_invlpg((void*)virt_addr);
@@ -250,22 +660,35 @@ bool vmm_map_range(address_space_t* space, void* virt, void* phys, size_t pages,
     uint64_t virt_addr = (uint64_t)virt;
     uint64_t phys_addr = (uint64_t)phys;
     
-    for (size_t i = 0; i < pages; i++) {
-        if (!vmm_map(space, (void*)virt_addr, (void*)phys_addr, flags)) {
+    for (size_t i = 0; i < pages;) {
+        // Use the largest page both addresses are aligned for
+        uint64_t huge = 0;
+        if (huge_1g_supported && pages - i >= VMM_HUGE_1G_SIZE / PAGE_SIZE &&
+            !((virt_addr | phys_addr) & (VMM_HUGE_1G_SIZE - 1))) {
+            huge = VMM_HUGE_1G_SIZE;
+        } else if (pages - i >= VMM_HUGE_2M_SIZE / PAGE_SIZE &&
+                   !((virt_addr | phys_addr) & (VMM_HUGE_2M_SIZE - 1))) {
+            huge = VMM_HUGE_2M_SIZE;
+        }
+        
+        uint64_t step = PAGE_SIZE;
+        if (huge && vmm_map_huge(space, (void*)virt_addr, (void*)phys_addr, huge, flags)) {
+            step = huge;
+        } else if (!vmm_map(space, (void*)virt_addr, (void*)phys_addr, flags)) {
             // Rollback mappings on failure
-            for (size_t j = 0; j < i; j++) {
-                vmm_unmap(space, (void*)((uint64_t)virt + j * PAGE_SIZE));
-            }
+            vmm_unmap_range(space, virt, i);
             return false;
         }
-        virt_addr += PAGE_SIZE;
-        phys_addr += PAGE_SIZE;
+        
+        virt_addr += step;
+        phys_addr += step;
+        i += step / PAGE_SIZE;
     }
     
     return true;
 }
 
-void vmm_unmap(address_space_t* space, void* virt) {
+void* vmm_unmap_noflush(address_space_t* space, void* virt) {
     if (!space) {
         space = &kernel_space;
     }
@@ -281,64 +704,361 @@ void vmm_unmap(address_space_t* space, void* virt) {
     // Walk page tables
     page_table_t* pml4 = (page_table_t*)space->pml4_virt;
     
-    page_table_t* pdpt = vmm_get_next_level(pml4, pml4_idx, false, 0);
-    if (!pdpt) return;
+    page_table_t* pdpt = vmm_get_next_level(pml4, LEVEL_PML4, pml4_idx, WALK_LOOKUP, 0);
+    if (!pdpt) return NULL;
     
-    page_table_t* pd = vmm_get_next_level(pdpt, pdpt_idx, false, 0);
-    if (!pd) return;
+    page_table_t* pd = vmm_get_next_level(pdpt, LEVEL_PDPT, pdpt_idx, WALK_SPLIT, 0);
+    if (!pd) return NULL;
     
-    page_table_t* pt = vmm_get_next_level(pd, pd_idx, false, 0);
-    if (!pt) return;
+    page_table_t* pt = vmm_get_next_level(pd, LEVEL_PD, pd_idx, WALK_SPLIT, 0);
+    if (!pt) return NULL;
     
     // Clear the entry
+    uint64_t entry = pt->entries[pt_idx];
     pt->entries[pt_idx] = 0;
     
-    // Invalidate TLB
-    vmm_invlpg((void*)virt_addr);
+    if (!(entry & PAGE_PRESENT)) {
+        if (entry & PAGE_SWAPPED) {
+            swap_free(PTE_SWAP_SLOT(entry));
+        }
+        return NULL;
+    }
+    return (void*)(entry & PTE_ADDR_MASK);
+}
+
+void vmm_unmap(address_space_t* space, void* virt) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
+    if (vmm_unmap_noflush(space, virt)) {
+        vmm_flush_tlb_range(space, virt, 1);
+    } else {
+        vmm_invlpg((void*)((uint64_t)virt & PAGE_MASK));
+    }
 }
 
 void vmm_unmap_range(address_space_t* space, void* virt, size_t pages) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
     uint64_t virt_addr = (uint64_t)virt;
+    uint64_t end = virt_addr + pages * PAGE_SIZE;
+    
+    while (virt_addr < end) {
+        // Drop whole huge leaves the range covers instead of splitting them
+        uint64_t size;
+        uint64_t* entry = vmm_lookup_leaf(space, virt_addr, &size);
+        if (entry && size > PAGE_SIZE && !(virt_addr & (size - 1)) && end - virt_addr >= size) {
+            *entry = 0;
+            virt_addr += size;
+            continue;
+        }
+        
+        vmm_unmap_noflush(space, (void*)virt_addr);
+        virt_addr += PAGE_SIZE;
+    }
+    
+    vmm_flush_tlb_range(space, virt, pages);
+}
+
+void vmm_flush_tlb_all(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    
+    if (cr4 & VMM_CR4_PGE) {
+        // Toggling PGE drops global entries as well
+        __asm__ volatile("mov %0, %%cr4" :: "r"(cr4 & ~VMM_CR4_PGE) : "memory");
+        __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    } else {
+        vmm_set_cr3(vmm_get_cr3());
+    }
+}
+
+void vmm_flush_tlb_range(address_space_t* space, void* virt, size_t pages) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
+    uint64_t virt_addr = (uint64_t)virt & PAGE_MASK;
+    vmm_note_range_change(space, virt_addr, pages);
+    
+    if (virt_addr < KERNEL_HALF && space != current_space) {
+        return;
+    }
+    
+    if (pages > VMM_FLUSH_ALL_THRESHOLD) {
+        vmm_flush_tlb_all();
+        return;
+    }
     
     for (size_t i = 0; i < pages; i++) {
-        vmm_unmap(space, (void*)virt_addr);
+        vmm_invlpg((void*)virt_addr);
         virt_addr += PAGE_SIZE;
     }
 }
 
-void* vmm_get_physical(address_space_t* space, void* virt) {
+bool vmm_prepare_kernel_range(void* virt, size_t size) {
+    page_table_t* pml4 = (page_table_t*)kernel_space.pml4_virt;
+    uint64_t start = (uint64_t)virt;
+    uint64_t end = start + size - 1;
+    
+    for (size_t i = PML4_INDEX(start); i <= PML4_INDEX(end); i++) {
+        if (!vmm_get_next_level(pml4, LEVEL_PML4, i, WALK_CREATE, PAGE_WRITE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool vmm_cow_clone_range(address_space_t* dst, address_space_t* src, void* start, void* end, bool shared) {
+    page_table_t* src_pml4 = (page_table_t*)src->pml4_virt;
+    page_table_t* dst_pml4 = (page_table_t*)dst->pml4_virt;
+    
+    uint64_t virt_addr = (uint64_t)start & PAGE_MASK;
+    uint64_t end_addr = (uint64_t)end;
+    bool write_protected = false;
+    
+    while (virt_addr < end_addr) {
+        // Skip whole ranges that have no page table in the source
+        page_table_t* pdpt = vmm_get_next_level(src_pml4, LEVEL_PML4, PML4_INDEX(virt_addr), WALK_LOOKUP, 0);
+        if (!pdpt) {
+            virt_addr = (virt_addr + 512 * VMM_HUGE_1G_SIZE) & ~(512 * VMM_HUGE_1G_SIZE - 1);
+            continue;
+        }
+        page_table_t* pd = vmm_get_next_level(pdpt, LEVEL_PDPT, PDPT_INDEX(virt_addr), WALK_LOOKUP, 0);
+        if (!pd) {
+            virt_addr = (virt_addr + VMM_HUGE_1G_SIZE) & ~(VMM_HUGE_1G_SIZE - 1);
+            continue;
+        }
+        page_table_t* pt = vmm_get_next_level(pd, LEVEL_PD, PD_INDEX(virt_addr), WALK_LOOKUP, 0);
+        
+        uint64_t table_end = (virt_addr + VMM_HUGE_2M_SIZE) & ~(VMM_HUGE_2M_SIZE - 1);
+        if (table_end > end_addr) {
+            table_end = end_addr;
+        }
+        if (!pt) {
+            virt_addr = table_end;
+            continue;
+        }
+        
+        page_table_t* dst_pdpt = vmm_get_next_level(dst_pml4, LEVEL_PML4, PML4_INDEX(virt_addr), WALK_CREATE, PAGE_WRITE | PAGE_USER);
+        page_table_t* dst_pd = dst_pdpt ? vmm_get_next_level(dst_pdpt, LEVEL_PDPT, PDPT_INDEX(virt_addr), WALK_CREATE, PAGE_WRITE | PAGE_USER) : NULL;
+        page_table_t* dst_pt = dst_pd ? vmm_get_next_level(dst_pd, LEVEL_PD, PD_INDEX(virt_addr), WALK_CREATE, PAGE_WRITE | PAGE_USER) : NULL;
+        if (!dst_pt) {
+            return false;
+        }
+        
+        for (; virt_addr < table_end; virt_addr += PAGE_SIZE) {
+            size_t idx = PT_INDEX(virt_addr);
+            uint64_t entry = pt->entries[idx];
+            if (!(entry & PAGE_PRESENT)) {
+                if (entry & PAGE_SWAPPED) {
+                    swap_dup(PTE_SWAP_SLOT(entry));
+                    dst_pt->entries[idx] = entry;
+                }
+                continue;
+            }
+            
+            if ((entry & PAGE_WRITE) && !shared) {
+                entry = (entry & ~PAGE_WRITE) | PAGE_COW;
+                pt->entries[idx] = entry;
+                write_protected = true;
+            }
+            
+            pmm_page_get((void*)(entry & PTE_ADDR_MASK));
+            dst_pt->entries[idx] = entry;
+        }
+    }
+    
+    // The source lost write access, drop its cached translations
+    if (write_protected) {
+        vmm_note_space_change(src);
+    }
+    
+    return true;
+}
+
+void vmm_protect_range(address_space_t* space, void* virt, size_t pages, uint64_t flags, bool shared) {
     if (!space) {
         space = &kernel_space;
     }
     
-    uint64_t virt_addr = (uint64_t)virt;
+    uint64_t virt_addr = (uint64_t)virt & PAGE_MASK;
+    bool changed = false;
     
-    // Get indices
-    size_t pml4_idx = PML4_INDEX(virt_addr);
-    size_t pdpt_idx = PDPT_INDEX(virt_addr);
-    size_t pd_idx = PD_INDEX(virt_addr);
-    size_t pt_idx = PT_INDEX(virt_addr);
+    for (size_t i = 0; i < pages; i++, virt_addr += PAGE_SIZE) {
+        uint64_t size;
+        uint64_t* entry = vmm_lookup_leaf(space, virt_addr, &size);
+        if (!entry || size != PAGE_SIZE) continue;
+        
+        uint64_t updated = *entry & ~(PAGE_WRITE | PAGE_USER | PAGE_COW);
+        if (flags & PAGE_USER) {
+            updated |= PAGE_USER;
+        }
+        if (flags & PAGE_WRITE) {
+            bool cow = !shared && pmm_page_refcount((void*)(*entry & PTE_ADDR_MASK)) > 1;
+            updated |= cow ? PAGE_COW : PAGE_WRITE;
+        }
+        
+        if (updated != *entry) {
+            *entry = updated;
+            changed = true;
+        }
+    }
     
-    // Walk page tables
-    page_table_t* pml4 = (page_table_t*)space->pml4_virt;
+    if (changed) {
+        vmm_flush_tlb_range(space, virt, pages);
+    }
+}
+
+bool vmm_clear_dirty(address_space_t* space, void* virt) {
+    if (!space) {
+        space = &kernel_space;
+    }
     
-    page_table_t* pdpt = vmm_get_next_level(pml4, pml4_idx, false, 0);
-    if (!pdpt) return NULL;
+    uint64_t virt_addr = (uint64_t)virt & PAGE_MASK;
+    uint64_t size;
+    uint64_t* entry = vmm_lookup_leaf(space, virt_addr, &size);
+    if (!entry || size != PAGE_SIZE || !(*entry & PAGE_DIRTY)) {
+        return false;
+    }
     
-    page_table_t* pd = vmm_get_next_level(pdpt, pdpt_idx, false, 0);
-    if (!pd) return NULL;
+    // The TLB caches the dirty state too, so the next write has to walk
+    // the tables again to set it
+    *entry &= ~PAGE_DIRTY;
+    vmm_note_change(space, virt_addr);
+    if (space == current_space) {
+        vmm_invlpg((void*)virt_addr);
+    }
+    return true;
+}
+
+void* vmm_age_page(address_space_t* space, void* virt) {
+    uint64_t virt_addr = (uint64_t)virt & PAGE_MASK;
+    uint64_t* entry = vmm_lookup_pte(space, virt_addr);
+    if (!entry || !(*entry & PAGE_PRESENT) || !(*entry & PAGE_USER)) {
+        return NULL;
+    }
     
-    page_table_t* pt = vmm_get_next_level(pd, pd_idx, false, 0);
-    if (!pt) return NULL;
+    if (!(*entry & PAGE_ACCESSED)) {
+        return (void*)(*entry & PTE_ADDR_MASK);
+    }
     
-    uint64_t entry = pt->entries[pt_idx];
-    if (!(entry & PAGE_PRESENT)) {
+    // Second chance; the TLB has to forget the entry or the CPU never
+    // sets the bit again
+    *entry &= ~PAGE_ACCESSED;
+    vmm_note_change(space, virt_addr);
+    if (space == current_space) {
+        vmm_invlpg((void*)virt_addr);
+    }
+    return NULL;
+}
+
+void* vmm_swap_out_page(address_space_t* space, void* virt, uint64_t slot, uint64_t* old_entry) {
+    uint64_t virt_addr = (uint64_t)virt & PAGE_MASK;
+    uint64_t* entry = vmm_lookup_pte(space, virt_addr);
+    if (!entry || !(*entry & PAGE_PRESENT)) {
+        return NULL;
+    }
+    
+    void* phys = (void*)(*entry & PTE_ADDR_MASK);
+    if (old_entry) {
+        *old_entry = *entry;
+    }
+    *entry = PTE_SWAP_ENTRY(slot);
+    vmm_note_change(space, virt_addr);
+    if (space == current_space) {
+        vmm_invlpg((void*)virt_addr);
+    }
+    return phys;
+}
+
+bool vmm_swap_out_undo(address_space_t* space, void* virt, uint64_t slot, uint64_t old_entry) {
+    uint64_t* entry = vmm_lookup_pte(space, (uint64_t)virt & PAGE_MASK);
+    if (!entry || *entry != PTE_SWAP_ENTRY(slot)) {
+        return false;
+    }
+    
+    // Going from not present to present needs no flush
+    *entry = old_entry;
+    return true;
+}
+
+uint64_t vmm_get_swap_slot(address_space_t* space, void* virt) {
+    uint64_t* entry = vmm_lookup_pte(space, (uint64_t)virt & PAGE_MASK);
+    if (!entry || (*entry & PAGE_PRESENT) || !(*entry & PAGE_SWAPPED)) {
+        return 0;
+    }
+    return PTE_SWAP_SLOT(*entry);
+}
+
+bool vmm_resolve_cow(address_space_t* space, void* virt) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
+    uint64_t virt_addr = (uint64_t)virt & PAGE_MASK;
+    uint64_t size;
+    uint64_t* entry = vmm_lookup_leaf(space, virt_addr, &size);
+    if (!entry || size != PAGE_SIZE || !(*entry & PAGE_COW)) {
+        return false;
+    }
+    
+    void* phys = (void*)(*entry & PTE_ADDR_MASK);
+    uint64_t flags = (*entry & ~PTE_ADDR_MASK & ~PAGE_COW) | PAGE_WRITE;
+    
+    // Last owner: just take the page back
+    if (pmm_page_refcount(phys) == 1) {
+        *entry = (uint64_t)phys | flags;
+    } else {
+        // Nothing to copy out of the zero page; the pre-zeroed pool
+        // usually has a page ready
+        bool zero = phys == pmm_zero_page();
+        void* copy = zero ? pmm_alloc() : pmm_alloc_nozero();
+        if (!copy) {
+            log_err("VMM", "Out of memory breaking copy-on-write at 0x%llx", virt_addr);
+            return false;
+        }
+        if (!zero) {
+            memcpy(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(phys), PAGE_SIZE);
+        }
+        *entry = (uint64_t)copy | flags;
+        pmm_page_put(phys);
+    }
+    
+    vmm_note_change(space, virt_addr);
+    vmm_invlpg((void*)virt_addr);
+    return true;
+}
+
+uint64_t vmm_get_entry(address_space_t* space, void* virt) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
+    uint64_t size;
+    uint64_t* entry = vmm_lookup_leaf(space, (uint64_t)virt, &size);
+    return entry ? *entry : 0;
+}
+
+void* vmm_get_physical(address_space_t* space, void* virt) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
+    uint64_t virt_addr = (uint64_t)virt;
+    uint64_t size;
+    
+    uint64_t* entry = vmm_lookup_leaf(space, virt_addr, &size);
+    if (!entry) {
         return NULL;
     }
     
     // Return physical address with offset
-    uint64_t phys = PTE_GET_ADDR(entry);
-    uint64_t offset = virt_addr & ~PAGE_MASK;
+    uint64_t phys = PTE_HUGE_ADDR(*entry, size);
+    uint64_t offset = virt_addr & (size - 1);
     return (void*)(phys | offset);
 }
 
@@ -385,14 +1105,34 @@ void vmm_free_page(address_space_t* space, void* virt) {
 }
 
 void vmm_free_pages(address_space_t* space, void* virt, size_t count) {
+    if (!space) {
+        space = &kernel_space;
+    }
+    
     uint64_t virt_addr = (uint64_t)virt;
+    uint64_t end = virt_addr + count * PAGE_SIZE;
     
-    for (size_t i = 0; i < count; i++) {
-        void* phys = vmm_get_physical(space, (void*)virt_addr);
-        if (phys) {
-            vmm_unmap(space, (void*)virt_addr);
+    while (virt_addr < end) {
+        uint64_t size;
+        uint64_t* entry = vmm_lookup_leaf(space, virt_addr, &size);
+        
+        if (entry && size > PAGE_SIZE && !(virt_addr & (size - 1)) && end - virt_addr >= size) {
+            void* phys = (void*)PTE_HUGE_ADDR(*entry, size);
+            *entry = 0;
+            pmm_free_pages(phys, size / PAGE_SIZE);
+            virt_addr += size;
+            continue;
+        }
+        
+        if (entry) {
+            void* phys = (void*)(PTE_HUGE_ADDR(*entry, size) | (virt_addr & (size - 1)));
+            vmm_unmap_noflush(space, (void*)virt_addr);
             pmm_free(phys);
         }
         virt_addr += PAGE_SIZE;
     }
-}
\ No newline at end of file
+    
+    // Nothing uses the range any more, so the pages can go back before
+    // the one flush for all of them
+    vmm_flush_tlb_range(space, virt, count);
+}
@@ -15,6 +15,8 @@
 #define PAGE_DIRTY      (1ULL << 6)
 #define PAGE_HUGE       (1ULL << 7)
 #define PAGE_GLOBAL     (1ULL << 8)
+#define PAGE_COW        (1ULL << 9)     // Software bit: read-only until copied
+#define PAGE_SWAPPED    (1ULL << 10)    // Software bit: not present, address holds a swap slot
 #define PAGE_NX         (1ULL << 63)
 #define DEFAULT_PRIV_PAGE_FLAGS (PAGE_PRESENT | PAGE_WRITE)
 
@@ -23,11 +25,23 @@
 
 // Page size
 #define PAGE_SIZE       4096
+#define VMM_HUGE_2M_SIZE  (2ULL * 1024 * 1024)
+#define VMM_HUGE_1G_SIZE  (1024ULL * 1024 * 1024)
 #define PAGE_MASK       0xFFFFFFFFFFFFF000ULL
 
+#define VMM_CR4_PGE     (1ULL << 7)
+#define VMM_CR4_PCIDE   (1ULL << 17)
+
+// PCIDs live in the low 12 bits of CR3; bit 63 keeps the TLB entries
+// tagged with the new PCID on a CR3 write
+#define VMM_PCID_COUNT    4096
+#define VMM_PCID_MASK     0xFFFULL
+#define VMM_CR3_NOFLUSH   (1ULL << 63)
+
 // Virtual memory layout
 #define KERNEL_BASE     0xFFFFFFFF80000000ULL
 #define USER_MAX        0x00007FFFFFFFFFFFULL
+#define KERNEL_HALF     0xFFFF800000000000ULL
 
 // Page table structure (all 4 levels use same structure)
 typedef struct {
@@ -35,14 +49,20 @@ typedef struct {
 } __attribute__((aligned(PAGE_SIZE))) page_table_t;
 
 // Address space structure
-typedef struct {
+typedef struct address_space {
     page_table_t* pml4;           // Top-level page table (physical address)
     void* pml4_virt;              // Virtual address for accessing PML4
+    uint16_t pcid;                // 0 for the kernel space or when PCIDs are off
+    volatile uint64_t active_cpus;  // CPUs that have it loaded
+    volatile uint64_t stale_cpus;   // CPUs whose PCID still caches old user mappings
 } address_space_t;
 
 // Initialize the VMM (sets up kernel page tables)
 void vmm_init(void);
 
+// Bring an AP onto the kernel page tables with the BSP's paging features
+void vmm_init_cpu(void);
+
 // Maps the userspace
 void setup_user_space(void);
 
@@ -55,13 +75,20 @@ address_space_t* vmm_create_address_space(void);
 // Destroy an address space
 void vmm_destroy_address_space(address_space_t* space);
 
-// Switch to an address space (loads CR3)
+// Switch to an address space (loads CR3 unless it is already active)
 void vmm_switch_space(address_space_t* space);
 
+// The address space currently loaded in CR3
+address_space_t* vmm_get_current_space(void);
+
 // Map a virtual address to a physical address
 bool vmm_map(address_space_t* space, void* virt, void* phys, uint64_t flags);
 
-// Map multiple pages
+// Map one 2MB or 1GB page; both addresses must be aligned to `size`.
+// Fails if a lower-level table already covers the range
+bool vmm_map_huge(address_space_t* space, void* virt, void* phys, uint64_t size, uint64_t flags);
+
+// Map multiple pages, using huge pages wherever virt and phys line up
 bool vmm_map_range(address_space_t* space, void* virt, void* phys, size_t pages, uint64_t flags);
 
 // Unmap a virtual address
@@ -70,6 +97,60 @@ void vmm_unmap(address_space_t* space, void* virt);
 // Unmap multiple pages
 void vmm_unmap_range(address_space_t* space, void* virt, size_t pages);
 
+// Unmap a page without invalidating the TLB on any CPU; returns the
+// physical page that was mapped (or NULL), a swap entry is dropped with its
+// slot. The caller must flush with vmm_flush_tlb_range
+void* vmm_unmap_noflush(address_space_t* space, void* virt);
+
+// Flush a range of a space's TLB entries here and on the other CPUs that
+// may cache them, with one round of IPIs; large ranges flush everything
+// at once
+#define VMM_FLUSH_ALL_THRESHOLD 32
+void vmm_flush_tlb_range(address_space_t* space, void* virt, size_t pages);
+void vmm_flush_tlb_all(void);
+
+// Create the top-level kernel entries covering [virt, virt + size) up
+// front, so address spaces created afterwards share the lower tables
+bool vmm_prepare_kernel_range(void* virt, size_t size);
+
+// Share the user pages in [start, end) of src with dst copy-on-write:
+// writable pages become read-only in both spaces and the frames gain a
+// reference. With `shared` set (MAP_SHARED ranges) the pages stay
+// writable in both. Swap entries are copied and their slot gains a
+// reference. Only page tables are allocated
+bool vmm_cow_clone_range(address_space_t* dst, address_space_t* src, void* start, void* end, bool shared);
+
+// Change the access bits of the mapped 4KB pages in a range. `flags` may
+// hold PAGE_WRITE and PAGE_USER; unless `shared` is set, pages mapped
+// elsewhere too get PAGE_COW instead of write
+void vmm_protect_range(address_space_t* space, void* virt, size_t pages, uint64_t flags, bool shared);
+
+// Clear the dirty bit of a mapped 4KB page; returns whether it was set
+bool vmm_clear_dirty(address_space_t* space, void* virt);
+
+// Clock aging for page-out. Returns the physical page of a 4KB user
+// mapping that has not been accessed since the previous call, and NULL
+// (clearing the accessed bit) when it has or nothing is mapped
+void* vmm_age_page(address_space_t* space, void* virt);
+
+// Replace the 4KB mapping at virt with a swap entry for `slot` and flush it
+// from every CPU; returns the physical page that was mapped, with its
+// reference now the caller's. The old entry goes to *old_entry if given
+void* vmm_swap_out_page(address_space_t* space, void* virt, uint64_t slot, uint64_t* old_entry);
+
+// Put back the entry vmm_swap_out_page() replaced, as long as the swap
+// entry for `slot` is still there
+bool vmm_swap_out_undo(address_space_t* space, void* virt, uint64_t slot, uint64_t old_entry);
+
+// Swap slot behind a swapped-out page, or 0 if virt is not one
+uint64_t vmm_get_swap_slot(address_space_t* space, void* virt);
+
+// Handle a write to a copy-on-write page; returns false if virt is not one
+bool vmm_resolve_cow(address_space_t* space, void* virt);
+
+// The page table entry mapping virt, 0 if there is none
+uint64_t vmm_get_entry(address_space_t* space, void* virt);
+
 // Get physical address for a virtual address
 void* vmm_get_physical(address_space_t* space, void* virt);
 
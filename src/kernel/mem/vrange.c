@@ -0,0 +1,77 @@
+#include "vrange.h"
+#include "pmm.h"
+
+static inline bool bit_test(const vrange_t *r, size_t i) {
+    return r->bitmap[i >> 6] & (1ULL << (i & 63));
+}
+
+static void mark(vrange_t *r, size_t first, size_t pages, bool used) {
+    for (size_t i = first; i < first + pages; i++) {
+        if (used) r->bitmap[i >> 6] |= 1ULL << (i & 63);
+        else      r->bitmap[i >> 6] &= ~(1ULL << (i & 63));
+    }
+}
+
+static size_t search(const vrange_t *r, size_t from, size_t to,
+                     size_t pages, size_t align) {
+    size_t run = 0, start = 0;
+    for (size_t i = from; i < to; i++) {
+        // Skip fully used words quickly
+        if ((i & 63) == 0 && r->bitmap[i >> 6] == ~0ULL) {
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if (!bit_test(r, i)) {
+            if (!run) {
+                if (i & (align - 1))
+                    continue;
+                start = i;
+            }
+            if (++run == pages)
+                return start;
+        } else {
+            run = 0;
+        }
+    }
+    return (size_t)-1;
+}
+
+void *vrange_alloc(vrange_t *r, size_t pages, size_t align) {
+    if (!pages || pages > r->pages)
+        return NULL;
+    if (!align)
+        align = 1;
+
+    uint64_t flags = spin_lock_irqsave(&r->lock);
+
+    size_t start = search(r, r->hint, r->pages, pages, align);
+    if (start == (size_t)-1)
+        start = search(r, 0, r->pages, pages, align);
+
+    if (start == (size_t)-1) {
+        spin_unlock_irqrestore(&r->lock, flags);
+        return NULL;
+    }
+
+    mark(r, start, pages, true);
+    r->hint = start + pages;
+
+    spin_unlock_irqrestore(&r->lock, flags);
+    return (void *)(r->base + start * PAGE_SIZE);
+}
+
+void vrange_free(vrange_t *r, void *virt, size_t pages) {
+    size_t start = ((uintptr_t)virt - r->base) / PAGE_SIZE;
+    uint64_t flags = spin_lock_irqsave(&r->lock);
+    mark(r, start, pages, false);
+    spin_unlock_irqrestore(&r->lock, flags);
+}
+
+void vrange_reserve(vrange_t *r, size_t first, size_t pages) {
+    uint64_t flags = spin_lock_irqsave(&r->lock);
+    mark(r, first, pages, true);
+    if (r->hint >= first && r->hint < first + pages)
+        r->hint = first + pages;
+    spin_unlock_irqrestore(&r->lock, flags);
+}
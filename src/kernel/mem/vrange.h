@@ -0,0 +1,29 @@
+#ifndef VRANGE_H
+#define VRANGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <util/spinlock.h>
+
+// First-fit page allocator for a fixed window of kernel virtual space,
+// one bit per page. The search starts where the last allocation ended.
+// Users own the backing bitmap, which needs `pages / 64` words
+typedef struct vrange {
+    uint64_t   base;
+    size_t     pages;
+    uint64_t  *bitmap;
+    size_t     hint;
+    spinlock_t lock;
+} vrange_t;
+
+#define VRANGE_INIT(base, pages, bitmap) { (base), (pages), (bitmap), 0, { 0 } }
+
+// Allocate `pages` pages whose first page index is a multiple of `align`
+// pages (0 or 1 for no alignment); NULL when the window is full
+void *vrange_alloc(vrange_t *r, size_t pages, size_t align);
+void vrange_free(vrange_t *r, void *virt, size_t pages);
+
+// Mark pages as used without allocating them
+void vrange_reserve(vrange_t *r, size_t first, size_t pages);
+
+#endif
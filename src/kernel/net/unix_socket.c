@@ -10,8 +10,7 @@ void unix_sock_init(void)
 {
     memset(sock_table, 0, sizeof(sock_table));
     for (int i = 0; i < MAX_UNIX_SOCKETS; i++) {
-        sock_table[i].peer_id            = -1;
-        sock_table[i].blocked_reader_pid = -1;
+        sock_table[i].peer_id = -1;
     }
     log_ok("UNIX", "socket subsystem initialised (%d slots)", MAX_UNIX_SOCKETS);
 }
@@ -51,10 +50,49 @@ static unix_socket_t *find_bound(const char *path)
 
 static void wake_reader(unix_socket_t *s)
 {
-    if (s->blocked_reader_pid >= 0) {
-        proc_unblock(s->blocked_reader_pid);
-        s->blocked_reader_pid = -1;
-    }
+    wake_up_all(&s->rx_wait);
+}
+
+// A connect() is over once accept() took it off the backlog or the
+// listener went away
+static void finish_connect(int client_id)
+{
+    unix_socket_t *client = unix_sock_get(client_id);
+    if (!client)
+        return;
+    client->connecting = false;
+    wake_reader(client);
+}
+
+static bool connect_done(int id)
+{
+    unix_socket_t *s = unix_sock_get(id);
+    return !s || !s->connecting;
+}
+
+static bool accept_ready(int id)
+{
+    unix_socket_t *s = unix_sock_get(id);
+    return !s || s->state != US_LISTENING || s->backlog_count > 0;
+}
+
+static bool peer_gone(const unix_socket_t *s)
+{
+    return s->peer_id < 0 ||
+           !sock_table[s->peer_id].in_use ||
+           sock_table[s->peer_id].state == US_CLOSED;
+}
+
+static bool read_ready(int id)
+{
+    unix_socket_t *s = unix_sock_get(id);
+    return !s || s->rx.count > 0 || (s->type == SOCK_STREAM && peer_gone(s));
+}
+
+static bool write_ready(int id)
+{
+    unix_socket_t *s = unix_sock_get(id);
+    return !s || peer_gone(s) || sock_table[s->peer_id].rx.count < UNIX_BUF_SIZE;
 }
 
 
@@ -94,12 +132,11 @@ int unix_sock_create(int type)
     for (int i = 0; i < MAX_UNIX_SOCKETS; i++) {
         if (!sock_table[i].in_use) {
             memset(&sock_table[i], 0, sizeof(unix_socket_t));
-            sock_table[i].in_use             = true;
-            sock_table[i].state              = US_CREATED;
-            sock_table[i].type               = type;
-            sock_table[i].peer_id            = -1;
-            sock_table[i].blocked_reader_pid = -1;
-            sock_table[i].owner_pid          = proc_get_current_pid();
+            sock_table[i].in_use    = true;
+            sock_table[i].state     = US_CREATED;
+            sock_table[i].type      = type;
+            sock_table[i].peer_id   = -1;
+            sock_table[i].owner_pid = proc_get_current_pid();
             log_info("UNIX", "created socket %d (type=%s)",
                      i, type == SOCK_STREAM ? "STREAM" : "DGRAM");
             return i;
@@ -120,6 +157,7 @@ void unix_sock_destroy(int id)
 
     
     wake_reader(s);
+    wake_up_all(&s->tx_wait);
 
     
     if (s->peer_id >= 0) {
@@ -128,6 +166,7 @@ void unix_sock_destroy(int id)
             peer->state   = US_CLOSED;
             peer->peer_id = -1;
             wake_reader(peer);
+            wake_up_all(&peer->tx_wait);
         }
         s->peer_id = -1;
     }
@@ -140,8 +179,7 @@ void unix_sock_destroy(int id)
         unix_pending_t *e = &s->backlog[s->backlog_head];
         s->backlog_head  = (s->backlog_head + 1) % UNIX_BACKLOG_MAX;
         s->backlog_count--;
-        if (e->client_pid >= 0)
-            proc_unblock(e->client_pid);
+        finish_connect(e->client_sock_id);
     }
 
     s->state  = US_CLOSED;
@@ -217,17 +255,13 @@ int unix_sock_accept(int id)
     }
 
     
-    while (server->backlog_count == 0) {
-        server->blocked_reader_pid = proc_get_current_pid();
-        proc_block(proc_get_current_pid());
-        proc_yield();
+    wait_event(&server->rx_wait, accept_ready(id));
 
-        
-        server = unix_sock_get(id);
-        if (!server || server->state != US_LISTENING) {
-            log_err("UNIX", "accept: listener %d gone while blocked", id);
-            return -1;
-        }
+    
+    server = unix_sock_get(id);
+    if (!server || server->state != US_LISTENING) {
+        log_err("UNIX", "accept: listener %d gone while blocked", id);
+        return -1;
     }
 
     
@@ -235,20 +269,18 @@ int unix_sock_accept(int id)
     server->backlog_head  = (server->backlog_head + 1) % UNIX_BACKLOG_MAX;
     server->backlog_count--;
 
-    int client_id  = entry.client_sock_id;
-    int client_pid = entry.client_pid;
+    int client_id = entry.client_sock_id;
 
     
     int new_id = -1;
     for (int i = 0; i < MAX_UNIX_SOCKETS; i++) {
         if (!sock_table[i].in_use) {
             memset(&sock_table[i], 0, sizeof(unix_socket_t));
-            sock_table[i].in_use             = true;
-            sock_table[i].state              = US_CONNECTED;
-            sock_table[i].type               = server->type;
-            sock_table[i].peer_id            = client_id;
-            sock_table[i].blocked_reader_pid = -1;
-            sock_table[i].owner_pid          = proc_get_current_pid();
+            sock_table[i].in_use    = true;
+            sock_table[i].state     = US_CONNECTED;
+            sock_table[i].type      = server->type;
+            sock_table[i].peer_id   = client_id;
+            sock_table[i].owner_pid = proc_get_current_pid();
             strncpy(sock_table[i].path, server->path, UNIX_PATH_MAX - 1);
             new_id = i;
             break;
@@ -258,8 +290,7 @@ int unix_sock_accept(int id)
     if (new_id < 0) {
         log_err("UNIX", "accept: no free socket slot for new connection");
         
-        if (client_pid >= 0)
-            proc_unblock(client_pid);
+        finish_connect(client_id);
         return -1;
     }
 
@@ -271,8 +302,7 @@ int unix_sock_accept(int id)
     }
 
     
-    if (client_pid >= 0)
-        proc_unblock(client_pid);
+    finish_connect(client_id);
 
     log_ok("UNIX", "accept: listener=%d  client_sock=%d  server_conn=%d",
            id, client_id, new_id);
@@ -317,13 +347,13 @@ int unix_sock_connect(int id, const char *path)
     e->peer_sock_id   = -1;
     server->backlog_tail  = (server->backlog_tail + 1) % UNIX_BACKLOG_MAX;
     server->backlog_count++;
+    client->connecting = true;
 
     
     wake_reader(server);
 
     
-    proc_block(proc_get_current_pid());
-    proc_yield();
+    wait_event(&client->rx_wait, connect_done(id));
 
     
 
@@ -366,7 +396,10 @@ int unix_sock_write(int id, const void *buf, size_t count)
         uint32_t space = UNIX_BUF_SIZE - peer->rx.count;
         if (space == 0) {
             
-            proc_yield();
+            wait_event(&peer->tx_wait, write_ready(id));
+            s = unix_sock_get(id);
+            if (!s)
+                return -1;
             continue;
         }
 
@@ -394,23 +427,16 @@ int unix_sock_read(int id, void *buf, size_t count)
     }
 
     
-    while (s->rx.count == 0) {
-        
-        if (s->peer_id < 0 ||
-            !sock_table[s->peer_id].in_use ||
-            sock_table[s->peer_id].state == US_CLOSED) {
-            return 0; 
-        }
-        s->blocked_reader_pid = proc_get_current_pid();
-        proc_block(proc_get_current_pid());
-        proc_yield();
+    wait_event(&s->rx_wait, read_ready(id));
 
-        s = unix_sock_get(id);
-        if (!s)
-            return -1;
-    }
+    s = unix_sock_get(id);
+    if (!s)
+        return -1;
+    if (s->rx.count == 0)
+        return 0; 
 
     uint32_t n = rb_read(&s->rx, (uint8_t *)buf, (uint32_t)count);
+    wake_up_all(&s->tx_wait);
     return (int)n;
 }
 
@@ -459,15 +485,11 @@ int unix_sock_recvfrom(int id, void *buf, size_t count, char *src_path_out)
     }
 
     
-    while (s->rx.count == 0) {
-        s->blocked_reader_pid = proc_get_current_pid();
-        proc_block(proc_get_current_pid());
-        proc_yield();
+    wait_event(&s->rx_wait, read_ready(id));
 
-        s = unix_sock_get(id);
-        if (!s)
-            return -1;
-    }
+    s = unix_sock_get(id);
+    if (!s)
+        return -1;
 
     uint32_t n = rb_read(&s->rx, (uint8_t *)buf, (uint32_t)count);
 
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <proc/wait.h>
 
 #define AF_UNIX         1
 
@@ -56,7 +57,9 @@ typedef struct {
     int                backlog_tail;
     int                backlog_count;
 
-    int                blocked_reader_pid;
+    wait_queue_t       rx_wait;     // Readers, accepters and a connecting client
+    wait_queue_t       tx_wait;     // Writers waiting for room in rx
+    bool               connecting;  // Queued in a listener's backlog
 
     int                owner_pid;   
 } unix_socket_t;
@@ -1,11 +1,21 @@
 #include "proc.h"
+#include "vma.h"
+#include "wait.h"
 #include <user/user.h>
 #include <string.h>
 #include <arch/x86_64/isr.h>
 #include <arch/x86_64/gdt.h>
+#include <arch/x86_64/cpu.h>
+#include <arch/x86_64/smp.h>
 #include <memory.h>
 #include <mem/vmm.h>
 #include <mem/pmm.h>
+#include <mem/swap.h>
+#include <mem/shrinker.h>
+#include <timer/timer.h>
+#include <timer/timer_wheel.h>
+#include <util/spinlock.h>
+#include <drivers/fs/ext/ext2_pcache.h>
 #include <heap.h>
 #include <debug.h>
 
@@ -15,6 +25,28 @@ typedef struct {
     Registers context;
 
     address_space_t *address_space;
+    vma_tree_t      *vmas;
+
+    // Fault-around state for anonymous memory: where the next fault of a
+    // sequential walk is expected and how many pages the last one mapped
+    uint64_t fault_next;
+    uint32_t fault_window;
+
+    // Scheduling: the CPU whose run queue holds it, or that ran it last,
+    // and its links in that queue
+    int  cpu;
+    int  rq_next, rq_prev;
+    uint8_t  level;         // Current feedback level; see PROC_PRIO_LEVELS
+    uint32_t slice;         // Microseconds left of its timeslice
+    uint64_t slice_end;     // While running: clock time its slice runs out
+    uint64_t run_start;     // While running: when it was switched in
+    bool idle;
+    bool kernel_locked;     // Runs holding the kernel lock
+    bool detached;          // Freed by the CPU that switches away from it
+
+    wait_entry_t wait;      // Its place in the wait queue it sleeps on
+    ktimer_t     timeout;   // Wakes it if still blocked; see proc_set_timeout()
+    wait_queue_t child_exit;
 
     uint8_t  kernel_stack[PROC_STACK_SIZE];
     uint64_t kernel_stack_top;
@@ -31,17 +63,35 @@ typedef struct {
     char cwd[256];
 } PCB;
 
-static PCB       proc_table[MAX_PROCESSES];
-static int       current_proc           = -1;
+// Per-CPU multilevel queue of READY processes: one FIFO per feedback
+// level, linked through the PCBs, and a bitmap of the non-empty ones.
+// A process is on a run queue exactly while it is READY; idle
+// processes never are
+typedef struct {
+    int      head[PROC_PRIO_LEVELS];
+    int      tail[PROC_PRIO_LEVELS];
+    uint32_t bitmap;
+    uint32_t nr;
+} runqueue_t;
+
+static PCB        proc_table[MAX_PROCESSES];
+static runqueue_t runqueues[MAX_CPUS];
+
+#define current_proc          (cpu_self()->proc)
+#define current_syscall_frame (cpu_self()->syscall_frame)
+
+// Page-out clock hand: the process slot and address the scan resumes at
+static int       swap_hand_proc         = 0;
+static uint64_t  swap_hand_addr         = 0;
+static bool      swap_hand_busy         = false;
 static uint32_t  next_pid               = 1;
 static int       scheduling_enabled     = 0;
 static uint64_t  next_user_code_addr    = USER_CODE_BASE;
-static Registers *current_syscall_frame = NULL;
 
 extern void enter_usermode(uint64_t entry, uint64_t stack);
 extern void resume_kernel_context(Registers *ctx);
+extern void resume_context_on(Registers *ctx, uint64_t stack, int unlock);
 
-#define VMM_SCRATCH_VA  ((void *)0xFFFFFFFF80F00000ULL)
 
 static inline address_space_t *pcb_space(const PCB *pcb)
 {
@@ -56,6 +106,159 @@ static int proc_find_index(int pid)
     return -1;
 }
 
+// Level a process starts at and returns to: higher Priority runs first
+static uint8_t proc_base_level(const PCB *pcb)
+{
+    uint32_t prio = pcb->proc.Priority;
+    if (prio > PROC_PRIO_MAX)
+        prio = PROC_PRIO_MAX;
+    return (uint8_t)(PROC_PRIO_BOOST + PROC_PRIO_MAX - prio);
+}
+
+// Lower levels run less often but for longer at a time
+static uint32_t proc_slice_us(uint8_t level)
+{
+    return PROC_SLICE_US * (1 + level / PROC_SLICE_LEVELS_PER_STEP);
+}
+
+static void rq_push(uint32_t cpu, int idx)
+{
+    runqueue_t *rq = &runqueues[cpu];
+    PCB *pcb = &proc_table[idx];
+    int level = pcb->level;
+
+    pcb->cpu     = (int)cpu;
+    pcb->rq_next = -1;
+    pcb->rq_prev = rq->tail[level];
+    if (rq->tail[level] >= 0)
+        proc_table[rq->tail[level]].rq_next = idx;
+    else
+        rq->head[level] = idx;
+    rq->tail[level] = idx;
+    rq->bitmap |= 1u << level;
+    rq->nr++;
+}
+
+static void rq_remove(int idx)
+{
+    PCB *pcb = &proc_table[idx];
+    runqueue_t *rq = &runqueues[pcb->cpu];
+    int level = pcb->level;
+
+    if (pcb->rq_prev >= 0)
+        proc_table[pcb->rq_prev].rq_next = pcb->rq_next;
+    else
+        rq->head[level] = pcb->rq_next;
+    if (pcb->rq_next >= 0)
+        proc_table[pcb->rq_next].rq_prev = pcb->rq_prev;
+    else
+        rq->tail[level] = pcb->rq_prev;
+    if (rq->head[level] < 0)
+        rq->bitmap &= ~(1u << level);
+    pcb->rq_next = pcb->rq_prev = -1;
+    rq->nr--;
+}
+
+// Head of the best non-empty level, or -1
+static int rq_pop(uint32_t cpu)
+{
+    runqueue_t *rq = &runqueues[cpu];
+    if (!rq->bitmap)
+        return -1;
+
+    int idx = rq->head[__builtin_ctz(rq->bitmap)];
+    rq_remove(idx);
+    return idx;
+}
+
+static bool cpu_is_idle(uint32_t cpu)
+{
+    return cpus[cpu].proc == cpus[cpu].idle_proc;
+}
+
+// The CPU running the process other than this one, or -1
+static int proc_running_elsewhere(int idx)
+{
+    uint32_t self = cpu_id();
+    for (uint32_t c = 0; c < cpu_count; c++)
+        if (c != self && cpus[c].proc == idx)
+            return (int)c;
+    return -1;
+}
+
+// Where a process that just became READY should wait: its last CPU if
+// that is idle, else some idle CPU, else the shortest queue
+static uint32_t pick_cpu(int idx)
+{
+    uint32_t home = (uint32_t)proc_table[idx].cpu;
+    if (home >= cpu_count || !cpus[home].online)
+        home = cpu_id();
+
+    if (cpu_is_idle(home) && runqueues[home].nr == 0)
+        return home;
+
+    uint32_t best = home;
+    for (uint32_t c = 0; c < cpu_count; c++) {
+        if (!cpus[c].online)
+            continue;
+        if (cpu_is_idle(c) && runqueues[c].nr == 0)
+            return c;
+        if (runqueues[c].nr < runqueues[best].nr)
+            best = c;
+    }
+    return best;
+}
+
+static void proc_make_ready(int idx)
+{
+    PCB *pcb = &proc_table[idx];
+    if (pcb->idle) {
+        pcb->state = PROC_READY;
+        return;
+    }
+
+    // Woken before it got to switch away; it is still on its CPU
+    if (proc_running_elsewhere(idx) >= 0 || idx == current_proc) {
+        pcb->state = PROC_RUNNING;
+        return;
+    }
+
+    uint32_t cpu = pick_cpu(idx);
+    pcb->state = PROC_READY;
+    rq_push(cpu, idx);
+
+    // Preempt whatever runs there if this one ranks above it; the IPI
+    // also reaches this CPU and is taken once interrupts are back on
+    int running = cpus[cpu].proc;
+    if (running < 0 ||
+        (!proc_table[running].idle && pcb->level >= proc_table[running].level))
+        return;
+
+    cpus[cpu].need_resched = true;
+    smp_send_resched(cpu);
+}
+
+// Every state change goes through here so the run queues stay in step
+static void proc_set_state(int idx, ProcState state)
+{
+    PCB *pcb = &proc_table[idx];
+    if (pcb->state == state)
+        return;
+
+    if (pcb->state == PROC_READY && !pcb->idle)
+        rq_remove(idx);
+
+    if (state == PROC_ZOMBIE || state == PROC_UNUSED) {
+        wait_entry_cancel(&pcb->wait);
+        ktimer_cancel(&pcb->timeout);
+    }
+
+    if (state == PROC_READY)
+        proc_make_ready(idx);
+    else
+        pcb->state = state;
+}
+
 bool proc_is_blocked(int pid)
 {
     int index = proc_find_index(pid);
@@ -67,14 +270,80 @@ void proc_block(int pid)
 {
     int index = proc_find_index(pid);
     if (index < 0) { log_err("PROC", "Unable to get index from pid: %d", pid); return; }
-    proc_table[index].state = PROC_BLOCKED;
+    proc_set_state(index, PROC_BLOCKED);
 }
 
-void proc_unblock(int pid)
+// Waking up earns back a level lost to using whole timeslices; an
+// interactive wakeup jumps above the process's base level
+static void proc_wake(int pid, bool interactive)
 {
     int index = proc_find_index(pid);
     if (index < 0) { log_err("PROC", "Unable to get index from pid: %d", pid); return; }
-    proc_table[index].state = PROC_READY;
+
+    PCB *pcb = &proc_table[index];
+    if (pcb->state != PROC_BLOCKED)
+        return;
+
+    uint8_t base = proc_base_level(pcb);
+    if (interactive)
+        pcb->level = base - PROC_PRIO_BOOST;
+    else if (pcb->level > base)
+        pcb->level--;
+    pcb->slice = proc_slice_us(pcb->level);
+
+    proc_set_state(index, PROC_READY);
+}
+
+void proc_unblock(int pid)
+{
+    proc_wake(pid, false);
+}
+
+void proc_unblock_interactive(int pid)
+{
+    proc_wake(pid, true);
+}
+
+// Write the dirty pages of a MAP_SHARED file area in [start, end) back
+static void vma_sync_range(address_space_t *space, vma_t *vma, uint64_t start, uint64_t end)
+{
+    if (!vma->shared || !vma->file.fs || !space)
+        return;
+
+    for (uint64_t va = start; va < end; va += PAGE_SIZE) {
+        if (!vmm_clear_dirty(space, (void *)va))
+            continue;
+
+        uint64_t index = (vma->file.offset + (va - vma->start)) / PAGE_SIZE;
+        void *phys = vmm_get_physical(space, (void *)va);
+        if (ext2_pcache_writeback(vma->file.fs, vma->file.inode, index, phys) != 0)
+            log_err("PROC", "Writeback of mapped page 0x%lx failed", va);
+    }
+}
+
+static void proc_sync_mappings(PCB *pcb)
+{
+    if (!pcb->address_space)
+        return;
+
+    for (vma_t *v = vma_first(pcb->vmas); v; v = vma_next(v))
+        vma_sync_range(pcb->address_space, v, v->start, v->end);
+}
+
+static void pcb_free(int index)
+{
+    PCB *pcb = &proc_table[index];
+
+    if (pcb->address_space) {
+        vmm_destroy_address_space(pcb->address_space);
+        pcb->address_space = NULL;
+    }
+    vma_tree_put(pcb->vmas);
+
+    wait_entry_cancel(&pcb->wait);
+    ktimer_cancel(&pcb->timeout);
+    memset(pcb, 0, offsetof(PCB, kernel_stack));
+    pcb->state = PROC_UNUSED;
 }
 
 static void proc_kill_children(uint32_t parent_pid)
@@ -93,13 +362,17 @@ static void proc_kill_children(uint32_t parent_pid)
         log_info("PROC", "Killing child PID %d (parent PID %d)",
                  child->proc.PID, parent_pid);
 
-        if (child->address_space) {
-            vmm_destroy_address_space(child->address_space);
-            child->address_space = NULL;
+        proc_sync_mappings(child);
+
+        // Its address space is still loaded over there
+        if (proc_running_elsewhere(i) >= 0) {
+            proc_set_state(i, PROC_ZOMBIE);
+            child->detached = true;
+            continue;
         }
 
-        memset(child, 0, offsetof(PCB, kernel_stack));
-        child->state = PROC_UNUSED;
+        proc_set_state(i, PROC_UNUSED);
+        pcb_free(i);
     }
 }
 
@@ -111,28 +384,26 @@ static void proc_terminate(int index, uint64_t exit_code)
     log_info("PROC", "Terminating PID %d", pid);
 
     pcb->proc.ExitCode = (uint32_t)exit_code;
-    pcb->state = PROC_ZOMBIE;
+    proc_set_state(index, PROC_ZOMBIE);
 
     proc_kill_children(pid);
+    proc_sync_mappings(pcb);
 
     if (pcb->vfork_parent > 0) {
         int vidx = proc_find_index(pcb->vfork_parent);
         if (vidx >= 0 && proc_table[vidx].state == PROC_BLOCKED) {
             proc_table[vidx].proc.WaitingFor = (uint32_t)-1;
-            proc_table[vidx].state = PROC_READY;
+            proc_set_state(vidx, PROC_READY);
         }
         pcb->address_space = NULL;
         pcb->vfork_parent  = -1;
+        vma_tree_put(pcb->vmas);
+        pcb->vmas = NULL;
     }
 
     int parent_idx = proc_find_index(pcb->proc.PPID);
-    if (parent_idx >= 0) {
-        PCB *parent = &proc_table[parent_idx];
-        if (parent->proc.WaitingFor == (uint32_t)pid) {
-            parent->proc.WaitingFor = (uint32_t)-1;
-            proc_unblock(parent->proc.PID);
-        }
-    }
+    if (parent_idx >= 0)
+        wake_up_all(&proc_table[parent_idx].child_exit);
 }
 
 static void proc_reap(int index)
@@ -141,80 +412,424 @@ static void proc_reap(int index)
 
     log_info("PROC", "Reaping PID %d", pcb->proc.PID);
 
-    if (pcb->address_space) {
-        vmm_destroy_address_space(pcb->address_space);
-        pcb->address_space = NULL;
+    // Killed while running on another CPU, which frees it on its way out
+    if (proc_running_elsewhere(index) >= 0) {
+        pcb->detached = true;
+        return;
     }
 
-    memset(pcb, 0, offsetof(PCB, kernel_stack));
-    pcb->state = PROC_UNUSED;
+    pcb_free(index);
 }
 
-bool proc_is_valid_demand_addr(uint64_t vaddr)
+static uint64_t vma_page_flags(const vma_t *vma)
 {
-    if (current_proc < 0)
+    if (vma->prot == VMA_PROT_NONE)
+        return PAGE_PRESENT;
+    return PAGE_PRESENT | PAGE_USER | ((vma->prot & VMA_PROT_WRITE) ? PAGE_WRITE : 0);
+}
+
+// Anonymous page for a fault: reads of private memory share the zero
+// page read-only until the first write, everything else gets its own page
+static bool demand_anon_page(address_space_t *space, vma_t *vma, uint64_t page,
+                             uint64_t flags, bool write)
+{
+    void *zero = pmm_zero_page();
+    if (write || vma->shared || !zero)
+        return vmm_alloc_page(space, (void *)page, flags) != NULL;
+
+    if (flags & PAGE_WRITE)
+        flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+    return vmm_map(space, (void *)page, zero, flags);
+}
+
+// Page of a file area: shared areas map the cached page itself, private
+// ones map it copy-on-write and copy it on the first write
+static bool demand_file_page(address_space_t *space, vma_t *vma, uint64_t page,
+                             uint64_t flags, bool write)
+{
+    uint64_t pos = vma->file.offset + (page - vma->start);
+    if (pos >= vma->file.end)
+        return demand_anon_page(space, vma, page, flags, write);
+
+    void *phys = ext2_pcache_get_page(vma->file.fs, vma->file.inode, pos / PAGE_SIZE);
+    if (!phys)
         return false;
 
-    PCB *pcb = &proc_table[current_proc];
+    // The page the file data ends in gets a private copy with a zeroed tail
+    if (vma->file.end - pos < PAGE_SIZE) {
+        void *copy = pmm_alloc_nozero();
+        if (!copy) {
+            pmm_page_put(phys);
+            return false;
+        }
+        size_t data = (size_t)(vma->file.end - pos);
+        memcpy(kmap_phys(copy), kmap_phys(phys), data);
+        memset((uint8_t *)kmap_phys(copy) + data, 0, PAGE_SIZE - data);
+        pmm_page_put(phys);
+        phys = copy;
+    } else if (!vma->shared && (flags & PAGE_WRITE)) {
+        if (write) {
+            void *copy = pmm_alloc_nozero();
+            if (!copy) {
+                pmm_page_put(phys);
+                return false;
+            }
+            memcpy(kmap_phys(copy), kmap_phys(phys), PAGE_SIZE);
+            pmm_page_put(phys);
+            phys = copy;
+        } else {
+            flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+        }
+    }
+
+    if (!vmm_map(space, (void *)page, phys, flags)) {
+        pmm_page_put(phys);
+        return false;
+    }
+    return true;
+}
+
+// Read a swapped-out page of pcb back in; false if page is not swapped
+// out or it cannot be brought back
+static bool swap_in_page(PCB *pcb, uint64_t page)
+{
+    address_space_t *space = pcb_space(pcb);
+    uint64_t slot = vmm_get_swap_slot(space, (void *)page);
+    vma_t   *vma  = vma_find(pcb->vmas, page);
+    if (!slot || !vma)
+        return false;
+
+    void *phys = pmm_alloc_nozero();
+    if (!phys)
+        return false;
+
+    // Just used, so the clock passes over it once before it can go again
+    if (!swap_read(slot, phys) ||
+        !vmm_map(space, (void *)page, phys, vma_page_flags(vma) | PAGE_ACCESSED)) {
+        pmm_free(phys);
+        return false;
+    }
+
+    swap_free(slot);
+    return true;
+}
 
-    if (vaddr >= pcb->stack_vaddr_base && vaddr < pcb->stack_vaddr_top)
+// Whether the page-out clock may take pages of this area: only private
+// anonymous memory, file pages are dropped by the page cache instead
+static bool vma_swappable(const vma_t *vma)
+{
+    return !vma->file.fs && !vma->shared && vma->prot != VMA_PROT_NONE;
+}
+
+// Write one page out if the clock finds it cold; false once nothing more
+// can be swapped out
+static bool swap_out_page(address_space_t *space, uint64_t va, uint64_t *freed)
+{
+    void *phys = vmm_age_page(space, (void *)va);
+
+    // Pages shared with another process (or the zero page) stay put
+    if (!phys || pmm_page_refcount(phys) != 1)
         return true;
 
-    uint64_t code_fence = (pcb->code_vaddr_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    if (vaddr >= pcb->code_vaddr_start && vaddr < code_fence)
+    uint64_t slot = swap_alloc();
+    if (!slot)
+        return false;
+
+    // Unmap it everywhere first: a thread of the process may be running
+    // on another CPU, and a write after the page went to swap would be
+    // lost. A fault on it now waits for the kernel lock, so until then
+    // the swap entry is never read
+    uint64_t old;
+    void *mapped = vmm_swap_out_page(space, (void *)va, slot, &old);
+    if (mapped != phys) {
+        if (mapped)
+            vmm_swap_out_undo(space, (void *)va, slot, old);
+        swap_free(slot);
         return true;
+    }
+
+    if (!swap_write(slot, phys)) {
+        vmm_swap_out_undo(space, (void *)va, slot, old);
+        swap_free(slot);
+        return false;
+    }
+
+    if (pmm_page_put(phys))
+        (*freed)++;
+    return true;
+}
+
+uint64_t proc_reclaim_pages(uint64_t max)
+{
+    if (!swap_enabled() || !max)
+        return 0;
+
+    // One pass at a time moves the clock hand. Interrupts stay on, the
+    // pass writes to disk
+    if (__atomic_exchange_n(&swap_hand_busy, true, __ATOMIC_ACQUIRE))
+        return 0;
+
+    uint64_t freed = 0;
+    uint64_t scan  = PROC_SWAP_SCAN_MAX;
+    int      procs = 0;
+    bool     full  = false;
+
+    // Two turns over every process: the first may only clear accessed bits
+    while (freed < max && scan && !full && procs <= 2 * MAX_PROCESSES) {
+        PCB *pcb = &proc_table[swap_hand_proc];
+        vma_t *vma = NULL;
+
+        if (pcb->state != PROC_UNUSED && pcb->state != PROC_ZOMBIE &&
+            pcb->address_space && pcb->vmas) {
+            for (vma = vma_first(pcb->vmas); vma; vma = vma_next(vma)) {
+                if (vma->end > swap_hand_addr && vma_swappable(vma))
+                    break;
+            }
+        }
+
+        if (!vma) {
+            swap_hand_proc = (swap_hand_proc + 1) % MAX_PROCESSES;
+            swap_hand_addr = 0;
+            procs++;
+            continue;
+        }
 
-    if (vaddr >= pcb->heap_start && vaddr < pcb->heap_end)
+        uint64_t va = swap_hand_addr > vma->start ? swap_hand_addr : vma->start;
+        for (; va < vma->end && freed < max && scan; va += PAGE_SIZE, scan--) {
+            if (!swap_out_page(pcb->address_space, va, &freed)) {
+                full = true;
+                break;
+            }
+        }
+        swap_hand_addr = va;
+    }
+
+    __atomic_store_n(&swap_hand_busy, false, __ATOMIC_RELEASE);
+
+    if (freed)
+        log_debug("PROC", "Swapped out %llu pages", freed);
+    return freed;
+}
+
+// Resident pages only this process maps, which a reclaim pass could
+// write out; no more than there are free slots for. An estimate: it stops
+// after PROC_SWAP_COUNT_MAX pages, as it runs with interrupts off
+static uint64_t swap_count_reclaimable(void)
+{
+    if (!swap_enabled())
+        return 0;
+
+    uint64_t free  = swap_get_total_slots() - swap_get_used_slots();
+    uint64_t count = 0;
+    uint64_t scan  = PROC_SWAP_COUNT_MAX;
+
+    for (int i = 0; i < MAX_PROCESSES && count < free && scan; i++) {
+        PCB *pcb = &proc_table[i];
+        if (pcb->state == PROC_UNUSED || pcb->state == PROC_ZOMBIE ||
+            !pcb->address_space || !pcb->vmas)
+            continue;
+
+        for (vma_t *vma = vma_first(pcb->vmas); vma && count < free && scan; vma = vma_next(vma)) {
+            if (!vma_swappable(vma))
+                continue;
+            for (uint64_t va = vma->start; va < vma->end && count < free && scan;
+                 va += PAGE_SIZE, scan--) {
+                void *phys = vmm_get_physical(pcb->address_space, (void *)va);
+                if (phys && pmm_page_refcount(phys) == 1)
+                    count++;
+            }
+        }
+    }
+    return count;
+}
+
+// Last resort: writing pages out costs disk I/O, so it never runs from
+// an allocation that may hold locks
+static shrinker_t swap_shrinker = {
+    .name   = "swap",
+    .count  = swap_count_reclaimable,
+    .scan   = proc_reclaim_pages,
+    .cost   = SHRINKER_COST_SWAP,
+    .atomic = false,
+};
+
+// Map up to `pages` more pages next to a fault at page, moving up the
+// area (down for stacks). Stops at the area edge or a mapped page
+static uint32_t fault_around(address_space_t *space, vma_t *vma, uint64_t page,
+                             uint64_t flags, bool write, uint32_t pages)
+{
+    bool     down   = vma->type == VMA_STACK;
+    uint32_t mapped = 0;
+
+    for (uint32_t i = 1; i <= pages; i++) {
+        uint64_t va = down ? page - (uint64_t)i * PAGE_SIZE : page + (uint64_t)i * PAGE_SIZE;
+        if (va < vma->start || va >= vma->end || vmm_is_mapped(space, (void *)va) ||
+            vmm_get_swap_slot(space, (void *)va))
+            break;
+        if (!demand_anon_page(space, vma, va, flags, write))
+            break;
+        mapped++;
+    }
+    return mapped;
+}
+
+// Resolve a fault by pcb at vaddr from its areas, whether it is the
+// running process or the kernel is copying to or from it
+static bool pcb_demand_fault(PCB *pcb, uint64_t vaddr, bool write)
+{
+    vma_t *vma = vma_find(pcb->vmas, vaddr);
+    if (!vma || vma->prot == VMA_PROT_NONE)
+        return false;
+
+    if (write && !(vma->prot & VMA_PROT_WRITE))
+        return false;
+
+    address_space_t *space = pcb_space(pcb);
+    uint64_t page  = vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t flags = vma_page_flags(vma);
+
+    if (vmm_get_swap_slot(space, (void *)page)) {
+        if (swap_in_page(pcb, page))
+            return true;
+    } else if (vma->file.fs) {
+        if (demand_file_page(space, vma, page, flags, write))
+            return true;
+    } else if (demand_anon_page(space, vma, page, flags, write)) {
+        // A fault right where the previous window ended is a sequential
+        // walk; grow the window, otherwise start over with single pages
+        if (page == pcb->fault_next && pcb->fault_window)
+            pcb->fault_window = pcb->fault_window * 2 > PROC_FAULT_AROUND_MAX
+                                    ? PROC_FAULT_AROUND_MAX : pcb->fault_window * 2;
+        else
+            pcb->fault_window = 1;
+
+        uint32_t extra = fault_around(space, vma, page, flags, write, pcb->fault_window - 1);
+        uint64_t span  = (uint64_t)(extra + 1) * PAGE_SIZE;
+        pcb->fault_next = vma->type == VMA_STACK ? page - span : page + span;
         return true;
+    }
 
+    log_err("PROC", "Cannot satisfy demand page at 0x%lx for PID %d",
+            vaddr, pcb->proc.PID);
     return false;
 }
 
-static void idle(void)
+bool proc_demand_fault(uint64_t vaddr, bool write)
 {
-    while (1)
-        __asm__ volatile("hlt");
+    if (current_proc < 0)
+        return false;
+    return pcb_demand_fault(&proc_table[current_proc], vaddr, write);
+}
+
+static bool runqueues_empty(void)
+{
+    for (uint32_t c = 0; c < cpu_count; c++)
+        if (runqueues[c].nr)
+            return false;
+    return true;
 }
 
-static int find_next(void)
+// Runs without the kernel lock, so other CPUs can get into the kernel
+// while this one has nothing to do
+static void idle(void)
 {
-    int start = current_proc;
-    for (int i = 1; i <= MAX_PROCESSES; i++) {
-        int idx = (start + i) % MAX_PROCESSES;
-        if (proc_table[idx].state == PROC_READY)
-            return idx;
+    while (1) {
+        // Spend idle time reclaiming memory when it ran low, then on
+        // pre-zeroing pages; sleep once neither has work left
+        bool busy = false;
+        if (kernel_trylock()) {
+            busy = pmm_balance() || pmm_refill_zero_pool(PMM_ZERO_REFILL_BATCH);
+            kernel_unlock();
+        }
+
+        // A wakeup between the check and hlt is held off by cli and
+        // taken right after sti
+        __asm__ volatile("cli");
+        if (!runqueues_empty()) {
+            __asm__ volatile("sti");
+            proc_yield();
+        } else if (busy) {
+            __asm__ volatile("sti");
+        } else {
+            __asm__ volatile("sti; hlt");
+        }
     }
-    return -1;
+}
+
+// Next process for a CPU: its own queue first, then the head of the
+// longest queue elsewhere
+static int find_next(uint32_t cpu)
+{
+    int idx = rq_pop(cpu);
+    if (idx >= 0)
+        return idx;
+
+    uint32_t busiest = cpu;
+    for (uint32_t c = 0; c < cpu_count; c++)
+        if (runqueues[c].nr > runqueues[busiest].nr)
+            busiest = c;
+    return rq_pop(busiest);
 }
 
 static bool map_user_page(address_space_t *proc_space, uint64_t user_va,
                            const uint8_t *src, size_t copy_len)
 {
-    address_space_t *kspace = vmm_get_kernel_space();
-
-    void *kptr = vmm_alloc_page(kspace, VMM_SCRATCH_VA, VMM_KERNEL_PAGE);
-    if (!kptr) {
-        log_err("PROC", "map_user_page: scratch alloc failed (user_va=0x%lx)", user_va);
+    // Pages that get filled from src only need their tail cleared
+    bool  fill = copy_len > 0 && src;
+    void *phys = fill ? pmm_alloc_nozero() : pmm_alloc();
+    if (!phys) {
+        log_err("PROC", "map_user_page: page alloc failed (user_va=0x%lx)", user_va);
         return false;
     }
 
-    if (copy_len > 0 && src)
+    if (fill) {
+        uint8_t *kptr = kmap_phys(phys);
         memcpy(kptr, src, copy_len);
-    if (copy_len < PAGE_SIZE)
-        memset((uint8_t *)kptr + copy_len, 0, PAGE_SIZE - copy_len);
-
-    void *phys = vmm_get_physical(kspace, VMM_SCRATCH_VA);
-    vmm_unmap(kspace, VMM_SCRATCH_VA);
-    vmm_invlpg(VMM_SCRATCH_VA);
+        if (copy_len < PAGE_SIZE)
+            memset(kptr + copy_len, 0, PAGE_SIZE - copy_len);
+    }
 
     if (!vmm_map(proc_space, (void *)user_va, phys, VMM_USER_PAGE)) {
         log_err("PROC", "map_user_page: vmm_map failed (user_va=0x%lx)", user_va);
+        pmm_free(phys);
         return false;
     }
 
     return true;
 }
 
+// Physical page behind a user VA that the kernel is about to write to;
+// a copy-on-write page is made private first. NULL unless the process
+// could write the page itself, so the kernel never writes into the
+// shared zero page or a cached text page
+static void *user_page_for_write(address_space_t *proc_space, uint64_t page_va)
+{
+    uint64_t entry = vmm_get_entry(proc_space, (void *)page_va);
+    if (!(entry & (PAGE_WRITE | PAGE_COW)))
+        return NULL;
+    if ((entry & PAGE_COW) && !vmm_resolve_cow(proc_space, (void *)page_va))
+        return NULL;
+
+    void *phys = vmm_get_physical(proc_space, (void *)page_va);
+    return phys == pmm_zero_page() ? NULL : phys;
+}
+
+// Physical page behind a user VA of pcb that the kernel copies to or
+// from, brought in the way a fault by the process itself would: swapped
+// in, demand-paged or made private. NULL if the process could not access it
+static void *user_copy_page(PCB *pcb, uint64_t page_va, bool write)
+{
+    address_space_t *space = pcb_space(pcb);
+
+    if (!vmm_is_mapped(space, (void *)page_va) &&
+        !pcb_demand_fault(pcb, page_va, write))
+        return NULL;
+
+    if (write)
+        return user_page_for_write(space, page_va);
+    return vmm_get_physical(space, (void *)page_va);
+}
+
 bool proc_write_to_user(int pid, void *user_dst, const void *src, size_t n)
 {
     if (!user_dst || !src || n == 0)
@@ -232,7 +847,6 @@ bool proc_write_to_user(int pid, void *user_dst, const void *src, size_t n)
         return true;
     }
 
-    address_space_t *kspace    = vmm_get_kernel_space();
     const uint8_t   *ksrc      = (const uint8_t *)src;
     uint8_t         *udst      = (uint8_t *)user_dst;
     size_t           remaining = n;
@@ -245,22 +859,14 @@ bool proc_write_to_user(int pid, void *user_dst, const void *src, size_t n)
 
         void *page_va = (void *)((uintptr_t)udst & ~(uintptr_t)(PAGE_SIZE - 1));
 
-        void *phys = vmm_get_physical(proc_space, page_va);
+        void *phys = user_copy_page(&proc_table[idx], (uint64_t)page_va, true);
         if (!phys) {
             log_err("PROC", "proc_write_to_user: pid %d VA 0x%lx not mapped",
                     pid, (uint64_t)page_va);
             return false;
         }
 
-        if (!vmm_map(kspace, VMM_SCRATCH_VA, phys, VMM_KERNEL_PAGE)) {
-            log_err("PROC", "proc_write_to_user: scratch map failed");
-            return false;
-        }
-
-        memcpy((uint8_t *)VMM_SCRATCH_VA + page_off, ksrc, chunk);
-
-        vmm_unmap(kspace, VMM_SCRATCH_VA);
-        vmm_invlpg(VMM_SCRATCH_VA);
+        memcpy((uint8_t *)kmap_phys(phys) + page_off, ksrc, chunk);
 
         ksrc      += chunk;
         udst      += chunk;
@@ -309,14 +915,16 @@ static int proc_create_internal(uint64_t entry, uint32_t priority, uint32_t pare
                                 ProcType type, uint64_t code_start, uint64_t code_end,
                                 uint64_t stack_base, uint64_t stack_top,
                                 uint64_t initial_rsp, address_space_t *address_space,
-                                uid_t owner)
+                                uid_t owner, vma_tree_t *image_vmas)
 {
     int slot = -1;
     for (int i = 0; i < MAX_PROCESSES; i++) {
         if (proc_table[i].state == PROC_UNUSED) { slot = i; break; }
     }
-    if (slot < 0)
+    if (slot < 0) {
+        vma_tree_put(image_vmas);
         return -1;
+    }
 
     PCB *pcb = &proc_table[slot];
     memset(pcb, 0, sizeof(PCB));
@@ -332,9 +940,12 @@ static int proc_create_internal(uint64_t entry, uint32_t priority, uint32_t pare
     pcb->proc.Group      = user_get_gid(owner);
     pcb->proc.EGroup     = pcb->proc.Group;
     pcb->proc.SavedGID   = pcb->proc.Group;
-    pcb->state           = PROC_READY;
     pcb->address_space   = address_space;
     pcb->vfork_parent    = -1;
+    pcb->cpu             = (int)cpu_id();
+    pcb->kernel_locked   = type == PROC_TYPE_KERNEL;
+    pcb->level           = proc_base_level(pcb);
+    pcb->slice           = proc_slice_us(pcb->level);
     pcb->cwd[0] = '/';
     pcb->cwd[1] = '\0';
 
@@ -363,16 +974,98 @@ static int proc_create_internal(uint64_t entry, uint32_t priority, uint32_t pare
         pcb->stack_vaddr_top  = stack_top;
         pcb->heap_start = (code_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
         pcb->heap_end   = pcb->heap_start;
+
+        // Demand-loaded images bring their segment areas along; flat
+        // images are one eagerly mapped code area
+        uint32_t rwx = VMA_PROT_READ | VMA_PROT_WRITE | VMA_PROT_EXEC;
+        pcb->vmas = image_vmas ? image_vmas : vma_tree_create();
+        if (!pcb->vmas ||
+            (!image_vmas &&
+             !vma_insert(pcb->vmas, code_start, pcb->heap_start, rwx, VMA_CODE)) ||
+            !vma_insert(pcb->vmas, stack_base, stack_top,
+                        VMA_PROT_READ | VMA_PROT_WRITE, VMA_STACK)) {
+            log_err("PROC", "Failed to set up memory areas");
+            vma_tree_put(pcb->vmas);
+            memset(pcb, 0, offsetof(PCB, kernel_stack));
+            pcb->state = PROC_UNUSED;
+            return -1;
+        }
     }
 
-    return (int)pcb->proc.PID;
+    proc_make_ready(slot);
+    return (int)pcb->proc.PID;
+}
+
+void proc_yield(void)
+{
+    if (!scheduling_enabled || current_proc < 0)
+        return;
+    cpu_self()->need_resched = true;
+    __asm__ volatile("int %0" :: "i"(SMP_RESCHED_VECTOR));
+}
+
+bool proc_can_sleep(void)
+{
+    return scheduling_enabled && current_proc >= 0 && !proc_table[current_proc].idle &&
+           !cpu_self()->lock_depth;
+}
+
+wait_entry_t *proc_wait_entry(void)
+{
+    return &proc_table[current_proc].wait;
+}
+
+static void proc_timeout_expired(void *arg)
+{
+    int pid = (int)(uintptr_t)arg;
+    if (proc_is_blocked(pid))
+        proc_unblock(pid);
+}
+
+void proc_set_timeout(uint64_t deadline_us)
+{
+    if (current_proc < 0)
+        return;
+
+    PCB *pcb = &proc_table[current_proc];
+    if (!deadline_us) {
+        ktimer_cancel(&pcb->timeout);
+        return;
+    }
+    if (!ktimer_pending(&pcb->timeout))
+        ktimer_init(&pcb->timeout, proc_timeout_expired, (void *)(uintptr_t)pcb->proc.PID);
+    ktimer_add(&pcb->timeout, deadline_us);
+}
+
+// Program this CPU's one-shot timer for the first thing due: the end of
+// the running slice or a timer. An idle CPU with neither gets no
+// interrupts until another CPU sends it work
+static void proc_arm_timer(void)
+{
+    uint64_t next = timer_wheel_next();
+
+    if (current_proc >= 0) {
+        PCB *pcb = &proc_table[current_proc];
+        if (!pcb->idle && (!next || pcb->slice_end < next))
+            next = pcb->slice_end;
+    }
+
+    timer_arm(next);
+}
+
+// Account for the process a CPU switches to, and the one it leaves
+static void proc_run_begin(int idx, uint64_t now)
+{
+    PCB *pcb = &proc_table[idx];
+    pcb->run_start = now;
+    pcb->slice_end = now + pcb->slice;
 }
 
-void proc_yield(void)
+static void proc_run_end(int idx, uint64_t now)
 {
-    if (!scheduling_enabled || current_proc < 0)
-        return;
-    __asm__ volatile("int $0xEF");
+    PCB *pcb = &proc_table[idx];
+    pcb->proc.CPUTime += now - pcb->run_start;
+    pcb->slice = pcb->slice_end > now ? (uint32_t)(pcb->slice_end - now) : 0;
 }
 
 void proc_enter_syscall(void) { proc_table[current_proc].proc.Type = PROC_TYPE_KERNEL; }
@@ -381,47 +1074,86 @@ void proc_exit_syscall(void)  { proc_table[current_proc].proc.Type = PROC_TYPE_U
 void proc_init(void)
 {
     memset(proc_table, 0, sizeof(proc_table));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        for (int l = 0; l < PROC_PRIO_LEVELS; l++)
+            runqueues[i].head[l] = runqueues[i].tail[l] = -1;
+        runqueues[i].bitmap = 0;
+        runqueues[i].nr     = 0;
+    }
     current_proc            = -1;
     next_pid                = 1;
     scheduling_enabled      = 0;
     next_user_code_addr     = USER_CODE_BASE;
     current_syscall_frame   = NULL;
-    proc_create_kernel(idle, 0, 0);
+    cpus[0].idle_proc = proc_create_idle(0);
+
+    shrinker_register(&swap_shrinker);
+}
+
+int proc_create_idle(uint32_t cpu)
+{
+    int pid = proc_create_kernel(idle, 0, 0);
+    int idx = pid < 0 ? -1 : proc_find_index(pid);
+    if (idx < 0)
+        return -1;
+
+    PCB *pcb = &proc_table[idx];
+    rq_remove(idx);
+    pcb->idle          = true;
+    pcb->cpu           = (int)cpu;
+    pcb->kernel_locked = false;
+    return idx;
+}
+
+void __attribute__((noreturn)) proc_run_idle(void)
+{
+    cpu_t *cpu = cpu_self();
+    PCB   *pcb = &proc_table[cpu->idle_proc];
+
+    current_proc = cpu->idle_proc;
+    pcb->state   = PROC_RUNNING;
+    x86_64_TSS_SetKernelStack(pcb->kernel_stack_top);
+    proc_run_begin(cpu->idle_proc, timer_now_us());
+    proc_arm_timer();
+
+    // Off the boot stack, which doubles as the scheduler's IST stack
+    resume_context_on(&pcb->context, cpu->stack_top, 1);
+    __builtin_unreachable();
 }
 
 void proc_start_scheduling(void)
 {
+    __asm__ volatile("cli");
     scheduling_enabled = 1;
 
     for (int i = 0; i < MAX_PROCESSES; i++) {
         if (proc_table[i].state == PROC_READY &&
             proc_table[i].proc.Type == PROC_TYPE_USER) {
+            proc_set_state(i, PROC_RUNNING);
             current_proc = i;
-            proc_table[i].state = PROC_RUNNING;
+            proc_table[i].cpu = (int)cpu_id();
             x86_64_TSS_SetKernelStack(proc_table[i].kernel_stack_top);
             vmm_switch_space(pcb_space(&proc_table[i]));
+            proc_run_begin(i, timer_now_us());
+            proc_arm_timer();
             log_info("PROC", "Starting user task PID %d rip=0x%lx rsp=0x%lx",
                      proc_table[i].proc.PID,
                      proc_table[i].context.rip,
                      proc_table[i].context.rsp);
+            // Held since kmain; the APs have been waiting on it
+            kernel_unlock();
             enter_usermode(proc_table[i].context.rip, proc_table[i].context.rsp);
             return;
         }
     }
 
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].state == PROC_READY) {
-            current_proc = i;
-            proc_table[i].state = PROC_RUNNING;
-            break;
-        }
-    }
+    proc_run_idle();
 }
 
 int proc_create_kernel(void (*entry)(void), uint32_t priority, uint32_t parent)
 {
     return proc_create_internal((uint64_t)entry, priority, parent,
-                                PROC_TYPE_KERNEL, 0, 0, 0, 0, 0, NULL, UID_ROOT);
+                                PROC_TYPE_KERNEL, 0, 0, 0, 0, 0, NULL, UID_ROOT, NULL);
 }
 
 int proc_create_user(void (*entry)(void), void (*end_marker)(void),
@@ -478,7 +1210,7 @@ int proc_create_user(void (*entry)(void), void (*end_marker)(void),
     int pid = proc_create_internal(
         user_code_va, priority, parent, PROC_TYPE_USER,
         user_code_va, user_code_va + code_size,
-        stack_base, stack_top, initial_rsp, NULL, UID_ROOT);
+        stack_base, stack_top, initial_rsp, NULL, UID_ROOT, NULL);
 
     if (pid < 0) {
         __asm__ volatile("sti");
@@ -496,7 +1228,6 @@ int proc_create_user(void (*entry)(void), void (*end_marker)(void),
 static bool write_bytes_to_user(address_space_t *proc_space,
                                  uint64_t dst, const void *src, size_t len)
 {
-    address_space_t *kspace = vmm_get_kernel_space();
     const uint8_t   *s      = (const uint8_t *)src;
 
     while (len > 0) {
@@ -505,19 +1236,17 @@ static bool write_bytes_to_user(address_space_t *proc_space,
         size_t   chunk    = PAGE_SIZE - page_off;
         if (chunk > len) chunk = len;
 
-        void *phys = vmm_get_physical(proc_space, (void *)page_va);
+        void *phys = user_page_for_write(proc_space, page_va);
         if (!phys) {
-            if (!map_user_page(proc_space, page_va, NULL, 0))
+            if (vmm_is_mapped(proc_space, (void *)page_va) ||
+                !map_user_page(proc_space, page_va, NULL, 0))
                 return false;
             phys = vmm_get_physical(proc_space, (void *)page_va);
             if (!phys)
                 return false;
         }
 
-        vmm_map(kspace, VMM_SCRATCH_VA, phys, VMM_KERNEL_PAGE);
-        memcpy((uint8_t *)VMM_SCRATCH_VA + page_off, s, chunk);
-        vmm_unmap(kspace, VMM_SCRATCH_VA);
-        vmm_invlpg(VMM_SCRATCH_VA);
+        memcpy((uint8_t *)kmap_phys(phys) + page_off, s, chunk);
 
         dst += chunk;
         s   += chunk;
@@ -691,7 +1420,7 @@ int proc_create_user_image(const uint8_t *image, size_t image_size,
         entry_vaddr, priority, parent, PROC_TYPE_USER,
         load_vaddr, load_vaddr + image_size,
         stack_base, stack_top, initial_rsp,
-        proc_space, UID_ROOT);
+        proc_space, UID_ROOT, NULL);
 
     if (pid < 0) {
         vmm_destroy_address_space(proc_space);
@@ -708,37 +1437,48 @@ int proc_create_user_image(const uint8_t *image, size_t image_size,
     return pid;
 }
 
+static bool proc_has_exited(int pid)
+{
+    int idx = proc_find_index(pid);
+    return idx < 0 || proc_table[idx].state == PROC_ZOMBIE;
+}
+
 uint64_t proc_wait_pid(uint64_t pid)
 {
     int child_idx = proc_find_index((int)pid);
     if (child_idx < 0)
         return (uint64_t)-1;
 
-    PCB *child = &proc_table[child_idx];
-
-    if (child->state != PROC_ZOMBIE) {
-        int parent_pid = proc_get_current_pid();
-        int parent_idx = proc_find_index(parent_pid);
-        if (parent_idx < 0)
+    if (proc_table[child_idx].state != PROC_ZOMBIE) {
+        if (current_proc < 0)
             return (uint64_t)-1;
 
-        PCB *parent = &proc_table[parent_idx];
-        parent->proc.WaitingFor = (uint32_t)pid;
-        parent->state = PROC_BLOCKED;
-
-        proc_yield();
+        wait_event(&proc_table[current_proc].child_exit, proc_has_exited((int)pid));
 
         child_idx = proc_find_index((int)pid);
         if (child_idx < 0)
             return (uint64_t)-1;
-        child = &proc_table[child_idx];
     }
 
+    PCB *child = &proc_table[child_idx];
     uint64_t exit_code = child->proc.ExitCode;
     proc_reap(child_idx);
     return exit_code;
 }
 
+// Give up a process this CPU just switched away from, if nobody else
+// is going to reap it
+static void proc_drop_detached(int index, int next)
+{
+    PCB *pcb = &proc_table[index];
+    if (!pcb->detached)
+        return;
+
+    if (pcb->address_space == proc_table[next].address_space)
+        pcb->address_space = NULL;
+    pcb_free(index);
+}
+
 void __attribute__((noreturn)) proc_exit(uint64_t exit_code)
 {
     __asm__ volatile("cli");
@@ -746,27 +1486,42 @@ void __attribute__((noreturn)) proc_exit(uint64_t exit_code)
     if (current_proc < 0)
         goto halt;
 
-    int exiting = current_proc;
+    cpu_t *cpu     = cpu_self();
+    int    exiting = current_proc;
 
-    proc_terminate(exiting, exit_code);
+    // Already a zombie if it was killed while it ran here
+    if (proc_table[exiting].state != PROC_ZOMBIE)
+        proc_terminate(exiting, exit_code);
 
     address_space_t *old_space = proc_table[exiting].address_space;
 
-    int next = find_next();
+    int next = find_next(cpu->id);
+    if (next < 0)
+        next = cpu->idle_proc;
 
     if (next < 0)
         goto halt;
 
     current_proc = next;
     proc_table[next].state = PROC_RUNNING;
+    proc_table[next].cpu   = (int)cpu->id;
+    proc_run_begin(next, timer_now_us());
+    proc_arm_timer();
 
     x86_64_TSS_SetKernelStack(proc_table[next].kernel_stack_top);
     vmm_switch_space(pcb_space(&proc_table[next]));
 
-    if (old_space && old_space != proc_table[next].address_space)
+    // Cleared so proc_reap does not destroy it a second time
+    if (old_space && old_space != proc_table[next].address_space) {
         vmm_destroy_address_space(old_space);
+        proc_table[exiting].address_space = NULL;
+    }
+    proc_drop_detached(exiting, next);
 
-    resume_kernel_context(&proc_table[next].context);
+    // Off the dying process's stack before the lock goes: once it does,
+    // its slot can be reaped and reused
+    resume_context_on(&proc_table[next].context, cpu->stack_top,
+                      !proc_table[next].kernel_locked);
 
     __builtin_unreachable();
 
@@ -775,43 +1530,91 @@ halt:
         address_space_t *dying = proc_table[current_proc].address_space;
         vmm_switch_space(vmm_get_kernel_space());
         vmm_destroy_address_space(dying);
+        proc_table[current_proc].address_space = NULL;
     }
     log_info("PROC", "All tasks exited, idling");
     current_proc = -1;
+    if (kernel_lock_held())
+        kernel_unlock();
     __asm__ volatile("sti");
     while (1) __asm__ volatile("hlt");
     __builtin_unreachable();
 }
 
-void proc_schedule_interrupt(Registers *frame)
+static void proc_switch(Registers *frame)
 {
-    if (!scheduling_enabled)
-        return;
+    cpu_t   *cpu = cpu_self();
+    int      old = current_proc;
+    uint64_t now = timer_now_us();
+    cpu->need_resched = false;
 
-    int old = current_proc;
     if (old >= 0 && proc_table[old].state != PROC_UNUSED) {
-        proc_table[old].context = *frame;
-        if (proc_table[old].state == PROC_RUNNING)
-            proc_table[old].state = PROC_READY;
+        PCB *pcb = &proc_table[old];
+        proc_run_end(old, now);
+        pcb->context       = *frame;
+        pcb->kernel_locked = cpu->switch_locked;
+        if (pcb->state == PROC_RUNNING) {
+            pcb->state = PROC_READY;
+            if (!pcb->idle)
+                rq_push(cpu->id, old);
+        }
     }
 
-    int next = find_next();
+    int next = find_next(cpu->id);
+    if (next < 0)
+        next = cpu->idle_proc;
     if (next < 0)
         return;
 
     current_proc = next;
     proc_table[next].state = PROC_RUNNING;
+    proc_table[next].cpu   = (int)cpu->id;
+    proc_run_begin(next, now);
+    proc_arm_timer();
 
     x86_64_TSS_SetKernelStack(proc_table[next].kernel_stack_top);
     vmm_switch_space(pcb_space(&proc_table[next]));
 
     *frame = proc_table[next].context;
+    cpu->switch_locked = proc_table[next].kernel_locked;
+
+    if (old >= 0 && old != next)
+        proc_drop_detached(old, next);
 }
 
-void proc_update_time(uint32_t ticks)
+void proc_schedule_interrupt(Registers *frame)
+{
+    if (!scheduling_enabled || current_proc < 0)
+        return;
+
+    uint64_t now = timer_now_us();
+    PCB     *pcb = &proc_table[current_proc];
+    if (pcb->idle) {
+        if (runqueues_empty()) {
+            proc_arm_timer();
+            return;
+        }
+    } else if (pcb->state == PROC_RUNNING && now < pcb->slice_end) {
+        // Here for a timeout, or early
+        if (!cpu_self()->need_resched) {
+            proc_arm_timer();
+            return;
+        }
+    } else if (pcb->state == PROC_RUNNING) {
+        // Used the whole slice: sink a level and get a longer one
+        if (pcb->level < proc_base_level(pcb) + PROC_PRIO_SINK)
+            pcb->level++;
+        pcb->slice_end = now + proc_slice_us(pcb->level);
+    }
+
+    proc_switch(frame);
+}
+
+void proc_resched_interrupt(Registers *frame)
 {
-    if (current_proc >= 0)
-        proc_table[current_proc].proc.CPUTime += ticks;
+    if (!scheduling_enabled || current_proc < 0 || !cpu_self()->need_resched)
+        return;
+    proc_switch(frame);
 }
 
 int proc_get_current_pid(void)
@@ -821,6 +1624,67 @@ int proc_get_current_pid(void)
     return (int)proc_table[current_proc].proc.PID;
 }
 
+// Keep the heap area in step with the break; growth must not run into
+// another mapping
+static bool proc_resize_heap_vma(PCB *pcb, uint64_t old_page, uint64_t new_page)
+{
+    if (!pcb->vmas || old_page == new_page)
+        return true;
+
+    vma_t *heap = (old_page > pcb->heap_start) ? vma_find(pcb->vmas, old_page - 1) : NULL;
+    if (heap && heap->type != VMA_HEAP)
+        heap = NULL;
+
+    if (new_page > old_page) {
+        if (vma_find_overlap(pcb->vmas, old_page, new_page))
+            return false;
+        if (heap) {
+            heap->end = new_page;
+            return true;
+        }
+        return vma_insert(pcb->vmas, old_page, new_page,
+                          VMA_PROT_READ | VMA_PROT_WRITE, VMA_HEAP) != NULL;
+    }
+
+    if (heap) {
+        if (new_page <= heap->start)
+            vma_remove(pcb->vmas, heap);
+        else
+            heap->end = new_page;
+    }
+    return true;
+}
+
+// Drop the pages mapped in [start, end). Each batch is flushed from every
+// CPU running the space before its pages are released, as a thread there
+// could otherwise still write to them
+#define UNMAP_BATCH VMM_FLUSH_ALL_THRESHOLD
+
+static void unmap_user_range(address_space_t *space, uint64_t start, uint64_t end)
+{
+    void *batch[UNMAP_BATCH];
+
+    while (start < end) {
+        size_t pages = (end - start) / PAGE_SIZE;
+        if (pages > UNMAP_BATCH)
+            pages = UNMAP_BATCH;
+
+        size_t n = 0;
+        for (size_t i = 0; i < pages; i++) {
+            void *phys = vmm_unmap_noflush(space, (void *)(start + i * PAGE_SIZE));
+            if (phys)
+                batch[n++] = phys;
+        }
+
+        if (n) {
+            vmm_flush_tlb_range(space, (void *)start, pages);
+            while (n)
+                pmm_page_put(batch[--n]);
+        }
+        start += pages * PAGE_SIZE;
+    }
+}
+
 uint64_t proc_brk(uint64_t new_brk)
 {
     if (current_proc < 0)
@@ -840,23 +1704,12 @@ uint64_t proc_brk(uint64_t new_brk)
     uint64_t old_page = (old_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
     uint64_t new_page = (new_brk + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
 
-    if (new_brk > old_end) {
-        for (uint64_t va = old_page; va < new_page; va += PAGE_SIZE) {
-            if (pcb->address_space) {
-                if (!map_user_page(pcb->address_space, va, NULL, 0))
-                    return (uint64_t)-1;
-            } else {
-                if (!vmm_alloc_page(vmm_get_kernel_space(), (void *)va, VMM_USER_PAGE))
-                    return (uint64_t)-1;
-            }
-        }
-    } else if (new_brk < old_end) {
-        address_space_t *space = pcb_space(pcb);
-        for (uint64_t va = new_page; va < old_page; va += PAGE_SIZE) {
-            vmm_unmap(space, (void *)va);
-            vmm_invlpg((void *)va);
-        }
-    }
+    // Growing only reserves the range; pages are faulted in on first use
+    if (!proc_resize_heap_vma(pcb, old_page, new_page))
+        return (uint64_t)-1;
+
+    if (new_brk < old_end)
+        unmap_user_range(pcb_space(pcb), new_page, old_page);
 
     pcb->heap_end = new_brk;
     return old_end;
@@ -891,6 +1744,173 @@ int64_t proc_sbrk(int64_t increment)
     return (int64_t)old_brk;
 }
 
+
+// Make [start, end) start and end on area boundaries
+static bool vma_isolate(vma_tree_t *tree, uint64_t start, uint64_t end)
+{
+    vma_t *v = vma_find(tree, start);
+    if (v && v->start < start && !vma_split(tree, v, start))
+        return false;
+
+    v = vma_find(tree, end - 1);
+    if (v && v->end > end && !vma_split(tree, v, end))
+        return false;
+
+    return true;
+}
+
+// Whether every page of [start, end) belongs to some area
+static bool vma_range_covered(vma_tree_t *tree, uint64_t start, uint64_t end)
+{
+    uint64_t covered = start;
+    for (vma_t *v = vma_find_overlap(tree, start, end); v && v->start < end; v = vma_next(v)) {
+        if (v->start > covered)
+            return false;
+        covered = v->end;
+    }
+    return covered >= end;
+}
+
+uint64_t proc_mmap(uint64_t addr, uint64_t length, uint32_t prot, uint32_t flags,
+                   struct ext2_filesystem *fs, uint32_t inode, uint64_t offset)
+{
+    if (current_proc < 0)
+        return (uint64_t)-1;
+
+    PCB *pcb = &proc_table[current_proc];
+    if (!pcb->vmas)
+        return (uint64_t)-1;
+
+    uint64_t len = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (len == 0 || len < length)
+        return (uint64_t)-1;
+    if (fs && (offset & (PAGE_SIZE - 1) || offset + len < offset))
+        return (uint64_t)-1;
+
+    uint64_t start = 0;
+
+    if (flags & PROC_MAP_FIXED) {
+        if (addr & (PAGE_SIZE - 1) || addr < USER_CODE_BASE ||
+            addr + len > USER_SPACE_END || addr + len < addr)
+            return (uint64_t)-1;
+        if (proc_munmap(addr, len) < 0)
+            return (uint64_t)-1;
+        start = addr;
+    } else {
+        // Honour the hint when the range is free
+        addr &= ~(uint64_t)(PAGE_SIZE - 1);
+        if (addr >= USER_MMAP_BASE && addr + len <= USER_MMAP_END && addr + len > addr &&
+            !vma_find_overlap(pcb->vmas, addr, addr + len))
+            start = addr;
+        else
+            start = vma_find_gap(pcb->vmas, len, USER_MMAP_BASE, USER_MMAP_END);
+        if (!start)
+            return (uint64_t)-1;
+    }
+
+    vma_t *vma = vma_insert(pcb->vmas, start, start + len, prot, fs ? VMA_FILE : VMA_ANON);
+    if (!vma)
+        return (uint64_t)-1;
+
+    vma->shared = (flags & PROC_MAP_SHARED) != 0;
+    if (fs) {
+        vma->file.fs     = fs;
+        vma->file.inode  = inode;
+        vma->file.offset = offset;
+        vma->file.end    = UINT64_MAX;
+    }
+
+    // Pages are faulted in on first touch
+    return start;
+}
+
+int proc_munmap(uint64_t addr, uint64_t length)
+{
+    if (current_proc < 0)
+        return -1;
+
+    PCB *pcb = &proc_table[current_proc];
+    uint64_t end = (addr + length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if (!pcb->vmas || addr & (PAGE_SIZE - 1) || length == 0 ||
+        end <= addr || end > USER_SPACE_END)
+        return -1;
+
+    if (!vma_isolate(pcb->vmas, addr, end))
+        return -1;
+
+    address_space_t *space = pcb_space(pcb);
+    vma_t *v = vma_find_overlap(pcb->vmas, addr, end);
+    while (v && v->start < end) {
+        vma_t *next = vma_next(v);
+        vma_sync_range(space, v, v->start, v->end);
+        unmap_user_range(space, v->start, v->end);
+        if (v->type == VMA_HEAP && v->end >= pcb->heap_end)
+            pcb->heap_end = v->start > pcb->heap_start ? v->start : pcb->heap_start;
+        vma_remove(pcb->vmas, v);
+        v = next;
+    }
+
+    return 0;
+}
+
+int proc_mprotect(uint64_t addr, uint64_t length, uint32_t prot)
+{
+    if (current_proc < 0)
+        return -1;
+
+    PCB *pcb = &proc_table[current_proc];
+    uint64_t end = (addr + length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if (!pcb->vmas || addr & (PAGE_SIZE - 1) || end < addr)
+        return -1;
+    if (end == addr)
+        return 0;
+
+    // The whole range must be mapped
+    if (!vma_range_covered(pcb->vmas, addr, end))
+        return -1;
+
+    if (!vma_isolate(pcb->vmas, addr, end))
+        return -1;
+
+    address_space_t *space = pcb_space(pcb);
+    for (vma_t *v = vma_find_overlap(pcb->vmas, addr, end); v && v->start < end; v = vma_next(v)) {
+        v->prot = prot;
+        vmm_protect_range(space, (void *)v->start, (v->end - v->start) / PAGE_SIZE,
+                          vma_page_flags(v), v->shared);
+    }
+
+    return 0;
+}
+
+int proc_msync(uint64_t addr, uint64_t length)
+{
+    if (current_proc < 0)
+        return -1;
+
+    PCB *pcb = &proc_table[current_proc];
+    uint64_t end = (addr + length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if (!pcb->vmas || addr & (PAGE_SIZE - 1) || end < addr)
+        return -1;
+    if (end == addr)
+        return 0;
+
+    if (!vma_range_covered(pcb->vmas, addr, end))
+        return -1;
+
+    // Writeback is synchronous, so MS_ASYNC and MS_SYNC behave the same
+    address_space_t *space = pcb_space(pcb);
+    for (vma_t *v = vma_find_overlap(pcb->vmas, addr, end); v && v->start < end; v = vma_next(v)) {
+        uint64_t from = v->start > addr ? v->start : addr;
+        uint64_t to   = v->end < end ? v->end : end;
+        vma_sync_range(space, v, from, to);
+    }
+
+    return 0;
+}
+
 int proc_create_user_image_argv(const uint8_t *image, size_t image_size,
                                  uint64_t load_vaddr, uint64_t entry_vaddr,
                                  uint32_t priority, uint32_t parent,
@@ -945,7 +1965,7 @@ int proc_create_user_image_argv(const uint8_t *image, size_t image_size,
         entry_vaddr, priority, parent, PROC_TYPE_USER,
         load_vaddr, load_vaddr + image_size,
         stack_base, stack_top, initial_rsp,
-        proc_space, UID_ROOT);
+        proc_space, UID_ROOT, NULL);
 
     if (pid < 0) {
         vmm_destroy_address_space(proc_space);
@@ -959,6 +1979,114 @@ int proc_create_user_image_argv(const uint8_t *image, size_t image_size,
     return pid;
 }
 
+// One area per segment; nothing of the image is read until it is touched
+static vma_tree_t *segments_to_vmas(struct ext2_filesystem *fs, uint32_t inode,
+                                    const proc_segment_t *segs, int nsegs,
+                                    uint64_t *out_end)
+{
+    vma_tree_t *vmas = vma_tree_create();
+    if (!vmas)
+        return NULL;
+
+    uint64_t image_end = 0;
+
+    for (int i = 0; i < nsegs; i++) {
+        const proc_segment_t *seg = &segs[i];
+        uint64_t start = seg->vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end   = (seg->vaddr + seg->memsz + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+        if (start < USER_CODE_BASE || end > USER_CODE_LIMIT || end <= start ||
+            ((seg->vaddr ^ seg->offset) & (PAGE_SIZE - 1)) || seg->filesz > seg->memsz) {
+            log_err("PROC", "Segment %d at 0x%lx cannot be demand loaded", i, seg->vaddr);
+            goto fail;
+        }
+
+        vma_t *vma = vma_insert(vmas, start, end, seg->prot, VMA_CODE);
+        if (!vma) {
+            log_err("PROC", "Segment %d at 0x%lx overlaps another", i, seg->vaddr);
+            goto fail;
+        }
+
+        // Pure BSS needs no file at all
+        if (seg->filesz) {
+            vma->file.fs     = fs;
+            vma->file.inode  = inode;
+            vma->file.offset = seg->offset & ~(uint64_t)(PAGE_SIZE - 1);
+            vma->file.end    = seg->offset + seg->filesz;
+        }
+
+        if (seg->vaddr + seg->memsz > image_end)
+            image_end = seg->vaddr + seg->memsz;
+    }
+
+    *out_end = image_end;
+    return vmas;
+
+fail:
+    vma_tree_put(vmas);
+    return NULL;
+}
+
+int proc_create_user_elf_argv(struct ext2_filesystem *fs, uint32_t inode,
+                              const proc_segment_t *segs, int nsegs,
+                              uint64_t entry_vaddr,
+                              uint32_t priority, uint32_t parent,
+                              int argc, const char **argv,
+                              int envc, const char **envp)
+{
+    __asm__ volatile("cli");
+
+    if (!fs || !segs || nsegs <= 0) { __asm__ volatile("sti"); return -1; }
+
+    uint64_t image_end = 0;
+    vma_tree_t *vmas = segments_to_vmas(fs, inode, segs, nsegs, &image_end);
+    if (!vmas) { __asm__ volatile("sti"); return -1; }
+
+    vma_t *entry_vma = vma_find(vmas, entry_vaddr);
+    if (!entry_vma || !(entry_vma->prot & VMA_PROT_EXEC)) {
+        vma_tree_put(vmas);
+        __asm__ volatile("sti");
+        log_err("PROC", "entry_vaddr 0x%lx is not in an executable segment", entry_vaddr);
+        return -1;
+    }
+
+    address_space_t *proc_space = vmm_create_address_space();
+    if (!proc_space) {
+        vma_tree_put(vmas);
+        __asm__ volatile("sti");
+        return -1;
+    }
+
+    uint64_t stack_top, stack_base, initial_rsp;
+    if (user_map_stack(proc_space, &stack_top, &stack_base, &initial_rsp) < 0) {
+        vmm_destroy_address_space(proc_space);
+        vma_tree_put(vmas);
+        __asm__ volatile("sti");
+        return -1;
+    }
+
+    initial_rsp = setup_user_stack_argv(proc_space, stack_top,
+                                         argc, argv ? argv : (const char **)0,
+                                         envc, envp ? envp : (const char **)0);
+
+    int pid = proc_create_internal(
+        entry_vaddr, priority, parent, PROC_TYPE_USER,
+        vma_first(vmas)->start, image_end,
+        stack_base, stack_top, initial_rsp,
+        proc_space, UID_ROOT, vmas);
+
+    if (pid < 0) {
+        vmm_destroy_address_space(proc_space);
+        __asm__ volatile("sti");
+        return -1;
+    }
+
+    __asm__ volatile("sti");
+    log_ok("PROC", "Created demand-loaded user task PID %d | entry=0x%lx segments=%d",
+           pid, entry_vaddr, nsegs);
+    return pid;
+}
+
 static bool proc_can_act(uid_t actor, int pid)
 {
     if (!user_exists(actor))
@@ -1039,7 +2167,7 @@ int proc_create_kernel_as(uid_t owner, void (*entry)(void),
     if (!user_exists(owner))
         return -1;
     return proc_create_internal((uint64_t)entry, priority, parent,
-                                PROC_TYPE_KERNEL, 0, 0, 0, 0, 0, NULL, owner);
+                                PROC_TYPE_KERNEL, 0, 0, 0, 0, 0, NULL, owner, NULL);
 }
 
 int proc_create_user_as(uid_t owner, void (*entry)(void), void (*end_marker)(void),
@@ -1095,7 +2223,7 @@ int proc_create_user_as(uid_t owner, void (*entry)(void), void (*end_marker)(voi
     int pid = proc_create_internal(
         user_code_va, priority, parent, PROC_TYPE_USER,
         user_code_va, user_code_va + code_size,
-        stack_base, stack_top, initial_rsp, NULL, owner);
+        stack_base, stack_top, initial_rsp, NULL, owner, NULL);
 
     if (pid < 0) {
         __asm__ volatile("sti");
@@ -1162,7 +2290,7 @@ int proc_create_user_image_as(uid_t owner, const uint8_t *image, size_t image_si
         entry_vaddr, priority, parent, PROC_TYPE_USER,
         load_vaddr, load_vaddr + image_size,
         stack_base, stack_top, initial_rsp,
-        proc_space, owner);
+        proc_space, owner, NULL);
 
     if (pid < 0) {
         vmm_destroy_address_space(proc_space);
@@ -1176,37 +2304,13 @@ int proc_create_user_image_as(uid_t owner, const uint8_t *image, size_t image_si
     return pid;
 }
 
+// Pages are shared copy-on-write; the first write fault in either
+// process gives it a private copy. MAP_SHARED areas stay shared
 static bool clone_user_region(address_space_t *dst, address_space_t *src,
-                               uint64_t va_start, uint64_t va_end)
+                               const vma_t *vma)
 {
-    address_space_t *kspace = vmm_get_kernel_space();
-
-    uint8_t *page_buf = (uint8_t *)kmalloc(PAGE_SIZE);
-    if (!page_buf)
-        return false;
-
-    for (uint64_t va = va_start; va < va_end; va += PAGE_SIZE) {
-        void *phys_src = vmm_get_physical(src, (void *)va);
-        if (!phys_src)
-            continue;
-
-        if (!vmm_map(kspace, VMM_SCRATCH_VA, phys_src, VMM_KERNEL_PAGE)) {
-            kfree(page_buf);
-            return false;
-        }
-
-        memcpy(page_buf, VMM_SCRATCH_VA, PAGE_SIZE);
-        vmm_unmap(kspace, VMM_SCRATCH_VA);
-        vmm_invlpg(VMM_SCRATCH_VA);
-
-        if (!map_user_page(dst, va, page_buf, PAGE_SIZE)) {
-            kfree(page_buf);
-            return false;
-        }
-    }
-
-    kfree(page_buf);
-    return true;
+    return vmm_cow_clone_range(dst, src, (void *)vma->start, (void *)vma->end,
+                               vma->shared);
 }
 
 static void pcb_copy_layout(PCB *dst, const PCB *src)
@@ -1244,9 +2348,12 @@ static void pcb_init_child(PCB *child, const PCB *parent,
     child->proc.Group      = parent->proc.Group;
     child->proc.EGroup     = parent->proc.EGroup;
     child->proc.SavedGID   = parent->proc.SavedGID;
-    child->state           = PROC_READY;
     child->address_space   = space;
     child->vfork_parent    = -1;
+    child->cpu             = parent->cpu;
+    child->kernel_locked   = (frame->cs & 3) == 0;
+    child->level           = proc_base_level(child);
+    child->slice           = proc_slice_us(child->level);
 
     child->kernel_stack_top =
         (uint64_t)(child->kernel_stack + PROC_STACK_SIZE) & ~0xFULL;
@@ -1256,6 +2363,10 @@ static void pcb_init_child(PCB *child, const PCB *parent,
 
     memcpy(child->cwd, parent->cwd, sizeof(child->cwd));
     pcb_copy_layout(child, parent);
+
+    // Nothing can run it before the caller is done: that needs the
+    // kernel lock
+    proc_make_ready((int)(child - proc_table));
 }
 
 int proc_fork(Registers *frame)
@@ -1271,31 +2382,28 @@ int proc_fork(Registers *frame)
 
     address_space_t *child_space = NULL;
 
+    vma_tree_t *child_vmas = NULL;
+    if (parent->vmas) {
+        child_vmas = vma_tree_clone(parent->vmas);
+        if (!child_vmas) { __asm__ volatile("sti"); return -1; }
+    }
+
     if (parent->address_space) {
         child_space = vmm_create_address_space();
-        if (!child_space) { __asm__ volatile("sti"); return -1; }
-
-        uint64_t code_end_pg =
-            (parent->code_vaddr_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
-        uint64_t heap_end_pg =
-            (parent->heap_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (!child_space) {
+            vma_tree_put(child_vmas);
+            __asm__ volatile("sti");
+            return -1;
+        }
 
         bool ok = true;
 
-        if (parent->code_vaddr_start < code_end_pg)
-            ok &= clone_user_region(child_space, parent->address_space,
-                                    parent->code_vaddr_start, code_end_pg);
-
-        if (ok && parent->stack_vaddr_base < parent->stack_vaddr_top)
-            ok &= clone_user_region(child_space, parent->address_space,
-                                    parent->stack_vaddr_base, parent->stack_vaddr_top);
-
-        if (ok && parent->heap_start < heap_end_pg)
-            ok &= clone_user_region(child_space, parent->address_space,
-                                    parent->heap_start, heap_end_pg);
+        for (vma_t *v = vma_first(parent->vmas); v && ok; v = vma_next(v))
+            ok = clone_user_region(child_space, parent->address_space, v);
 
         if (!ok) {
             vmm_destroy_address_space(child_space);
+            vma_tree_put(child_vmas);
             __asm__ volatile("sti");
             return -1;
         }
@@ -1303,6 +2411,7 @@ int proc_fork(Registers *frame)
 
     PCB *child = &proc_table[slot];
     pcb_init_child(child, parent, child_space, frame);
+    child->vmas = child_vmas;
 
     int child_pid = (int)child->proc.PID;
     __asm__ volatile("sti");
@@ -1324,10 +2433,12 @@ int proc_vfork(Registers *frame)
     PCB *child = &proc_table[slot];
     pcb_init_child(child, parent, parent->address_space, frame);
     child->vfork_parent = (int)parent->proc.PID;
+    child->vmas         = parent->vmas;
+    vma_tree_get(child->vmas);
 
     parent->context         = *frame;
     parent->context.rax     = (uint64_t)child->proc.PID;
-    parent->state           = PROC_BLOCKED;
+    proc_set_state(current_proc, PROC_BLOCKED);
     parent->proc.WaitingFor = child->proc.PID;
 
     int child_pid = (int)child->proc.PID;
@@ -1361,6 +2472,8 @@ int proc_clone(Registers *frame, uint64_t flags, uint64_t child_stack)
 
         PCB *child = &proc_table[slot];
         pcb_init_child(child, parent, parent->address_space, frame);
+        child->vmas = parent->vmas;
+        vma_tree_get(child->vmas);
 
         if (child_stack)
             child->context.rsp = child_stack;
@@ -1608,7 +2721,6 @@ bool proc_read_from_user(int pid, void *dst, const void *user_src, size_t n)
         return true;
     }
 
-    address_space_t *kspace = vmm_get_kernel_space();
     uint8_t         *kdst   = (uint8_t *)dst;
     const uint8_t   *usrc   = (const uint8_t *)user_src;
     size_t           remaining = n;
@@ -1620,16 +2732,13 @@ bool proc_read_from_user(int pid, void *dst, const void *user_src, size_t n)
 
         uint64_t page_va = (uintptr_t)usrc & ~(uintptr_t)(PAGE_SIZE - 1);
 
-        void *phys = vmm_get_physical(proc_space, (void *)page_va);
+        void *phys = user_copy_page(&proc_table[idx], page_va, false);
         if (!phys) {
             log_err("PROC", "read_from_user: no phys for VA=0x%lx", page_va);
             return false;
         }
 
-        vmm_map(kspace, VMM_SCRATCH_VA, phys, VMM_KERNEL_PAGE);
-        memcpy(kdst, (uint8_t *)VMM_SCRATCH_VA + page_off, chunk);
-        vmm_unmap(kspace, VMM_SCRATCH_VA);
-        vmm_invlpg(VMM_SCRATCH_VA);
+        memcpy(kdst, (uint8_t *)kmap_phys(phys) + page_off, chunk);
 
         kdst      += chunk;
         usrc      += chunk;
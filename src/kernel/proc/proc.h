@@ -12,6 +12,36 @@
 #define USER_STACK_ARENA  0x20000000ULL
 #define USER_STACK_VSIZE  0x01000000ULL
 #define USER_SPACE_END    0x0000800000000000ULL
+#define USER_MMAP_BASE    0x0000100000000000ULL
+#define USER_MMAP_END     0x00007F0000000000ULL
+
+// Scheduler feedback levels, 0 runs first. A process starts at the level
+// its Priority (0..PROC_PRIO_MAX, higher is more urgent) maps to, sinks
+// up to PROC_PRIO_SINK levels while it uses whole timeslices, and rises
+// PROC_PRIO_BOOST levels above it when woken by console input
+#define PROC_PRIO_LEVELS      32
+#define PROC_PRIO_BOOST       2
+#define PROC_PRIO_SINK        4
+#define PROC_PRIO_MAX         (PROC_PRIO_LEVELS - 1 - PROC_PRIO_BOOST - PROC_PRIO_SINK)
+
+// A timeslice is PROC_SLICE_US plus as much again per this many levels
+// down. The LAPIC timer is one-shot, so slices need not be whole ticks
+#define PROC_SLICE_US              10000
+#define PROC_SLICE_LEVELS_PER_STEP 8
+
+// Most extra pages one anonymous fault maps for a sequential walk
+#define PROC_FAULT_AROUND_MAX 16
+
+// Most user pages one reclaim pass looks at
+#define PROC_SWAP_SCAN_MAX    (1u << 20)
+
+// Most user pages the swap shrinker's count looks at
+#define PROC_SWAP_COUNT_MAX   (1u << 14)
+
+#define PROC_MAP_SHARED   0x01
+#define PROC_MAP_FIXED    0x10
+
+struct ext2_filesystem;
 
 typedef enum { PROC_TYPE_KERNEL = 0, PROC_TYPE_USER = 1 } ProcType;
 
@@ -19,7 +49,7 @@ typedef struct {
     uint32_t PID;
     uint32_t PPID;
     uint32_t Priority;
-    uint64_t CPUTime;
+    uint64_t CPUTime;       // Microseconds spent running
     uint32_t WaitingFor;
     uint32_t ExitCode;
     ProcType Type;
@@ -46,6 +76,13 @@ typedef enum {
 void proc_init(void);
 void proc_start_scheduling(void);
 
+// Create the idle process of a CPU; returns its slot. Idle processes
+// never sit on a run queue and run whenever their CPU has nothing else
+int  proc_create_idle(uint32_t cpu);
+
+// Switch the calling CPU to its idle process and drop the kernel lock
+__attribute__((noreturn)) void proc_run_idle(void);
+
 int  proc_create_kernel(void (*entry)(void), uint32_t priority, uint32_t parent);
 int  proc_create_user(void (*entry)(void), void (*end_marker)(void),
                       uint32_t priority, uint32_t parent);
@@ -53,25 +90,77 @@ int  proc_create_user(void (*entry)(void), void (*end_marker)(void),
 int  proc_create_user_image(const uint8_t *image, size_t image_size,
                             uint64_t load_vaddr, uint64_t entry_vaddr,
                             uint32_t priority, uint32_t parent);
+int  proc_create_user_image_argv(const uint8_t *image, size_t image_size,
+                                 uint64_t load_vaddr, uint64_t entry_vaddr,
+                                 uint32_t priority, uint32_t parent,
+                                 int argc, const char **argv,
+                                 int envc, const char **envp);
+
+// A loadable ELF segment backed by an ext2 inode. The file bytes
+// [offset, offset + filesz) appear at vaddr, the rest up to memsz reads
+// as zero. vaddr and offset must be congruent modulo the page size
+typedef struct {
+    uint64_t vaddr;
+    uint64_t memsz;
+    uint64_t offset;
+    uint64_t filesz;
+    uint32_t prot;      // VMA_PROT_* bits
+} proc_segment_t;
+
+// Like proc_create_user_image_argv, but pages are read from the file on
+// first access instead of being copied in up front
+int  proc_create_user_elf_argv(struct ext2_filesystem *fs, uint32_t inode,
+                               const proc_segment_t *segs, int nsegs,
+                               uint64_t entry_vaddr,
+                               uint32_t priority, uint32_t parent,
+                               int argc, const char **argv,
+                               int envc, const char **envp);
 
 bool proc_write_to_user(int pid, void *user_dst, const void *src, size_t n);
 
 void proc_exit(uint64_t exit_code);
+// Timer expiry: switch if the running slice is used up, then program
+// the next expiry
 void proc_schedule_interrupt(Registers *frame);
-void proc_update_time(uint32_t ticks);
+// SMP_RESCHED_VECTOR: switch if this CPU was asked to
+void proc_resched_interrupt(Registers *frame);
 int  proc_get_current_pid(void);
 void proc_block(int pid);
 void proc_unblock(int pid);
+// proc_unblock for a process that waited on the user; see PROC_PRIO_BOOST
+void proc_unblock_interactive(int pid);
 void proc_yield(void);
+
+// Support for proc/wait.h. A process that cannot sleep (before
+// scheduling starts, an idle one, or one holding a spinlock) has to poll
+// instead
+bool proc_can_sleep(void);
+struct wait_entry *proc_wait_entry(void);
+// Wake the calling process at timer_now_us() time `deadline_us` if it
+// is still blocked; 0 clears it
+void proc_set_timeout(uint64_t deadline_us);
+
 void proc_enter_syscall(void);
 void proc_exit_syscall(void);
 bool proc_is_blocked(int pid);
-bool proc_is_valid_demand_addr(uint64_t vaddr);
+bool proc_demand_fault(uint64_t vaddr, bool write);
+
+// Swap out up to max cold anonymous pages, chosen by a clock over the
+// accessed bits of every process; returns how many pages were freed
+uint64_t proc_reclaim_pages(uint64_t max);
 
 uint64_t proc_wait_pid(uint64_t pid);
 uint64_t proc_brk(uint64_t new_brk);
 int64_t  proc_sbrk(int64_t increment);
 
+// fs == NULL maps anonymous memory, otherwise the given ext2 inode
+// starting at the page-aligned file offset
+uint64_t proc_mmap(uint64_t addr, uint64_t length, uint32_t prot, uint32_t flags,
+                   struct ext2_filesystem *fs, uint32_t inode, uint64_t offset);
+int      proc_munmap(uint64_t addr, uint64_t length);
+int      proc_mprotect(uint64_t addr, uint64_t length, uint32_t prot);
+int      proc_msync(uint64_t addr, uint64_t length);
+
 uid_t proc_get_owner(int pid);
 int   proc_set_owner(int pid, uid_t new_owner);
 
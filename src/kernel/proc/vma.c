@@ -0,0 +1,384 @@
+#include "vma.h"
+#include <mem/slab.h>
+#include <heap.h>
+#include <debug.h>
+
+static kmem_cache_t *vma_cache;
+
+static vma_t *vma_alloc(void)
+{
+    if (!vma_cache) {
+        vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0, NULL);
+        if (!vma_cache)
+            return NULL;
+    }
+    return kmem_cache_alloc(vma_cache);
+}
+
+static void vma_free(vma_t *vma)
+{
+    kmem_cache_free(vma_cache, vma);
+}
+
+/* ---- red-black tree ----------------------------------------------------- */
+
+static void rb_rotate_left(vma_tree_t *tree, vma_t *x)
+{
+    vma_t *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        tree->root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+    y->left   = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(vma_tree_t *tree, vma_t *x)
+{
+    vma_t *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        tree->root = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+    y->right  = x;
+    x->parent = y;
+}
+
+static void rb_insert_fixup(vma_tree_t *tree, vma_t *z)
+{
+    while (z->parent && z->parent->red) {
+        vma_t *gp = z->parent->parent;
+        if (z->parent == gp->left) {
+            vma_t *uncle = gp->right;
+            if (uncle && uncle->red) {
+                z->parent->red = false;
+                uncle->red     = false;
+                gp->red        = true;
+                z = gp;
+            } else {
+                if (z == z->parent->right) {
+                    z = z->parent;
+                    rb_rotate_left(tree, z);
+                }
+                z->parent->red = false;
+                gp->red        = true;
+                rb_rotate_right(tree, gp);
+            }
+        } else {
+            vma_t *uncle = gp->left;
+            if (uncle && uncle->red) {
+                z->parent->red = false;
+                uncle->red     = false;
+                gp->red        = true;
+                z = gp;
+            } else {
+                if (z == z->parent->left) {
+                    z = z->parent;
+                    rb_rotate_right(tree, z);
+                }
+                z->parent->red = false;
+                gp->red        = true;
+                rb_rotate_left(tree, gp);
+            }
+        }
+    }
+    tree->root->red = false;
+}
+
+static void rb_transplant(vma_tree_t *tree, vma_t *u, vma_t *v)
+{
+    if (!u->parent)
+        tree->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v)
+        v->parent = u->parent;
+}
+
+static vma_t *rb_min(vma_t *n)
+{
+    while (n && n->left)
+        n = n->left;
+    return n;
+}
+
+// x may be NULL, so its parent is passed separately
+static void rb_delete_fixup(vma_tree_t *tree, vma_t *x, vma_t *parent)
+{
+    while (x != tree->root && (!x || !x->red)) {
+        if (x == parent->left) {
+            vma_t *w = parent->right;
+            if (w->red) {
+                w->red      = false;
+                parent->red = true;
+                rb_rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x      = parent;
+                parent = x->parent;
+            } else {
+                if (!w->right || !w->right->red) {
+                    w->left->red = false;
+                    w->red       = true;
+                    rb_rotate_right(tree, w);
+                    w = parent->right;
+                }
+                w->red      = parent->red;
+                parent->red = false;
+                if (w->right)
+                    w->right->red = false;
+                rb_rotate_left(tree, parent);
+                x = tree->root;
+                break;
+            }
+        } else {
+            vma_t *w = parent->left;
+            if (w->red) {
+                w->red      = false;
+                parent->red = true;
+                rb_rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if ((!w->right || !w->right->red) && (!w->left || !w->left->red)) {
+                w->red = true;
+                x      = parent;
+                parent = x->parent;
+            } else {
+                if (!w->left || !w->left->red) {
+                    w->right->red = false;
+                    w->red        = true;
+                    rb_rotate_left(tree, w);
+                    w = parent->left;
+                }
+                w->red      = parent->red;
+                parent->red = false;
+                if (w->left)
+                    w->left->red = false;
+                rb_rotate_right(tree, parent);
+                x = tree->root;
+                break;
+            }
+        }
+    }
+    if (x)
+        x->red = false;
+}
+
+static void rb_erase(vma_tree_t *tree, vma_t *z)
+{
+    vma_t *x, *x_parent;
+    bool   removed_red = z->red;
+
+    if (!z->left) {
+        x        = z->right;
+        x_parent = z->parent;
+        rb_transplant(tree, z, z->right);
+    } else if (!z->right) {
+        x        = z->left;
+        x_parent = z->parent;
+        rb_transplant(tree, z, z->left);
+    } else {
+        vma_t *y    = rb_min(z->right);
+        removed_red = y->red;
+        x           = y->right;
+        if (y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            rb_transplant(tree, y, y->right);
+            y->right         = z->right;
+            y->right->parent = y;
+        }
+        rb_transplant(tree, z, y);
+        y->left         = z->left;
+        y->left->parent = y;
+        y->red          = z->red;
+    }
+
+    if (!removed_red && tree->root)
+        rb_delete_fixup(tree, x, x_parent);
+}
+
+/* ---- areas -------------------------------------------------------------- */
+
+vma_tree_t *vma_tree_create(void)
+{
+    vma_tree_t *tree = (vma_tree_t *)kmalloc(sizeof(vma_tree_t));
+    if (!tree)
+        return NULL;
+    tree->root  = NULL;
+    tree->count = 0;
+    tree->refs  = 1;
+    return tree;
+}
+
+vma_tree_t *vma_tree_clone(const vma_tree_t *tree)
+{
+    vma_tree_t *copy = vma_tree_create();
+    if (!copy)
+        return NULL;
+
+    for (vma_t *v = rb_min(tree->root); v; v = vma_next(v)) {
+        vma_t *c = vma_insert(copy, v->start, v->end, v->prot, v->type);
+        if (!c) {
+            vma_tree_put(copy);
+            return NULL;
+        }
+        c->shared = v->shared;
+        c->file   = v->file;
+    }
+    return copy;
+}
+
+void vma_tree_get(vma_tree_t *tree)
+{
+    if (tree)
+        tree->refs++;
+}
+
+void vma_tree_put(vma_tree_t *tree)
+{
+    if (!tree || --tree->refs)
+        return;
+
+    while (tree->root)
+        vma_remove(tree, tree->root);
+    kfree(tree);
+}
+
+vma_t *vma_find(vma_tree_t *tree, uint64_t addr)
+{
+    vma_t *n = tree ? tree->root : NULL;
+    while (n) {
+        if (addr < n->start)
+            n = n->left;
+        else if (addr >= n->end)
+            n = n->right;
+        else
+            return n;
+    }
+    return NULL;
+}
+
+vma_t *vma_find_overlap(vma_tree_t *tree, uint64_t start, uint64_t end)
+{
+    vma_t *n    = tree ? tree->root : NULL;
+    vma_t *best = NULL;
+
+    // Lowest area ending above start
+    while (n) {
+        if (n->end > start) {
+            best = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return (best && best->start < end) ? best : NULL;
+}
+
+vma_t *vma_first(vma_tree_t *tree)
+{
+    return tree ? rb_min(tree->root) : NULL;
+}
+
+vma_t *vma_next(vma_t *vma)
+{
+    if (vma->right)
+        return rb_min(vma->right);
+
+    vma_t *p = vma->parent;
+    while (p && vma == p->right) {
+        vma = p;
+        p   = p->parent;
+    }
+    return p;
+}
+
+vma_t *vma_insert(vma_tree_t *tree, uint64_t start, uint64_t end,
+                  uint32_t prot, VmaType type)
+{
+    if (start >= end || vma_find_overlap(tree, start, end))
+        return NULL;
+
+    vma_t *vma = vma_alloc();
+    if (!vma) {
+        log_err("VMA", "Out of memory for area [0x%lx, 0x%lx)", start, end);
+        return NULL;
+    }
+    vma->start = start;
+    vma->end   = end;
+    vma->prot  = prot;
+    vma->type  = type;
+    vma->red   = true;
+
+    vma_t  *parent = NULL;
+    vma_t **link   = &tree->root;
+    while (*link) {
+        parent = *link;
+        link   = (start < parent->start) ? &parent->left : &parent->right;
+    }
+    vma->parent = parent;
+    *link = vma;
+
+    rb_insert_fixup(tree, vma);
+    tree->count++;
+    return vma;
+}
+
+void vma_remove(vma_tree_t *tree, vma_t *vma)
+{
+    rb_erase(tree, vma);
+    tree->count--;
+    vma_free(vma);
+}
+
+vma_t *vma_split(vma_tree_t *tree, vma_t *vma, uint64_t addr)
+{
+    if (addr <= vma->start || addr >= vma->end)
+        return NULL;
+
+    uint64_t old_end = vma->end;
+    vma->end = addr;
+
+    vma_t *upper = vma_insert(tree, addr, old_end, vma->prot, vma->type);
+    if (!upper) {
+        vma->end = old_end;
+        return NULL;
+    }
+    upper->shared = vma->shared;
+    upper->file   = vma->file;
+    if (upper->file.fs)
+        upper->file.offset += addr - vma->start;
+    return upper;
+}
+
+uint64_t vma_find_gap(vma_tree_t *tree, uint64_t len, uint64_t lo, uint64_t hi)
+{
+    uint64_t cand = lo;
+
+    for (vma_t *v = vma_find_overlap(tree, lo, hi); v && v->start < hi; v = vma_next(v)) {
+        if (v->start >= cand + len)
+            break;
+        if (v->end > cand)
+            cand = v->end;
+    }
+
+    return (cand + len <= hi && cand + len > cand) ? cand : 0;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Access rights, same values as the mmap PROT_* flags
+#define VMA_PROT_NONE   0x0
+#define VMA_PROT_READ   0x1
+#define VMA_PROT_WRITE  0x2
+#define VMA_PROT_EXEC   0x4
+
+typedef enum {
+    VMA_CODE = 0,
+    VMA_STACK,
+    VMA_HEAP,
+    VMA_ANON,
+    VMA_FILE,
+} VmaType;
+
+struct ext2_filesystem;
+
+// Backing file of an area; offset is the file position of start. Pages
+// at or past file position end (an ELF segment's BSS) are zero-filled
+typedef struct {
+    struct ext2_filesystem *fs;
+    uint32_t                inode;
+    uint64_t                offset;
+    uint64_t                end;
+} vma_file_t;
+
+// One contiguous, page-aligned range [start, end) of a process' address
+// space with uniform access rights. Pages inside it are faulted in lazily
+typedef struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t prot;
+    VmaType  type;
+    bool     shared;    // MAP_SHARED: writes go to the backing pages
+    vma_file_t file;
+
+    struct vma *parent;
+    struct vma *left;
+    struct vma *right;
+    bool        red;
+} vma_t;
+
+// Red-black tree of non-overlapping areas ordered by start address.
+// Processes sharing an address space (vfork, CLONE_VM) share the tree
+typedef struct {
+    vma_t   *root;
+    uint64_t count;
+    uint32_t refs;
+} vma_tree_t;
+
+vma_tree_t *vma_tree_create(void);
+vma_tree_t *vma_tree_clone(const vma_tree_t *tree);
+void        vma_tree_get(vma_tree_t *tree);
+void        vma_tree_put(vma_tree_t *tree);
+
+// Area containing addr, or NULL
+vma_t *vma_find(vma_tree_t *tree, uint64_t addr);
+
+// Lowest area overlapping [start, end), or NULL
+vma_t *vma_find_overlap(vma_tree_t *tree, uint64_t start, uint64_t end);
+
+vma_t *vma_first(vma_tree_t *tree);
+vma_t *vma_next(vma_t *vma);
+
+// Add an area; fails if it would overlap an existing one
+vma_t *vma_insert(vma_tree_t *tree, uint64_t start, uint64_t end,
+                  uint32_t prot, VmaType type);
+void   vma_remove(vma_tree_t *tree, vma_t *vma);
+
+// Cut vma in two at addr (start < addr < end); returns the upper half,
+// which inherits the rest of the area's attributes
+vma_t *vma_split(vma_tree_t *tree, vma_t *vma, uint64_t addr);
+
+// Lowest free range of len bytes inside [lo, hi), or 0
+uint64_t vma_find_gap(vma_tree_t *tree, uint64_t len, uint64_t lo, uint64_t hi);
@@ -0,0 +1,177 @@
+#include "wait.h"
+#include "proc.h"
+#include <timer/timer.h>
+#include <memory.h>
+
+void wait_queue_init(wait_queue_t *wq)
+{
+    memset(wq, 0, sizeof(*wq));
+}
+
+static void wq_unlink(wait_queue_t *wq, wait_entry_t *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else         wq->head      = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else         wq->tail      = e->prev;
+
+    e->next = e->prev = NULL;
+    e->queue = NULL;
+}
+
+// Pop the head and return its PID, or -1 when the queue is empty
+static int wq_pop(wait_queue_t *wq)
+{
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    wait_entry_t *e = wq->head;
+    int pid = -1;
+    if (e) {
+        pid = e->pid;
+        wq_unlink(wq, e);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return pid;
+}
+
+static void wake_pid(wait_queue_t *wq, int pid)
+{
+    if (wq->interactive)
+        proc_unblock_interactive(pid);
+    else
+        proc_unblock(pid);
+}
+
+void wake_up(wait_queue_t *wq)
+{
+    int pid = wq_pop(wq);
+    if (pid >= 0)
+        wake_pid(wq, pid);
+}
+
+void wake_up_all(wait_queue_t *wq)
+{
+    int pid;
+    while ((pid = wq_pop(wq)) >= 0)
+        wake_pid(wq, pid);
+}
+
+bool wait_queue_active(wait_queue_t *wq)
+{
+    return wq->head != NULL;
+}
+
+void wait_entry_cancel(wait_entry_t *entry)
+{
+    wait_queue_t *wq = entry->queue;
+    if (!wq)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (entry->queue == wq)
+        wq_unlink(wq, entry);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Queue the calling process and mark it blocked; it keeps running until
+// it yields, and a wakeup before then just leaves it running
+static void wait_prepare(wait_queue_t *wq)
+{
+    wait_entry_t *e = proc_wait_entry();
+    wait_entry_cancel(e);
+
+    e->pid = proc_get_current_pid();
+
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    e->queue = wq;
+    e->next  = NULL;
+    e->prev  = wq->tail;
+    if (wq->tail) wq->tail->next = e;
+    else          wq->head       = e;
+    wq->tail = e;
+    spin_unlock_irqrestore(&wq->lock, flags);
+
+    proc_block(e->pid);
+}
+
+// Undo wait_prepare() when the process did not need to sleep after all,
+// or was woken by its timeout rather than the queue
+static void wait_finish(void)
+{
+    wait_entry_t *e = proc_wait_entry();
+    wait_entry_cancel(e);
+    if (proc_is_blocked(e->pid))
+        proc_unblock(e->pid);
+}
+
+void wait_timeout_start(wait_timeout_t *t, uint32_t timeout_ms)
+{
+    t->sleep        = proc_can_sleep();
+    t->forever      = timeout_ms == 0;
+    t->poll_left_us = (uint64_t)timeout_ms * 1000;
+    t->deadline     = t->forever ? 0 : timer_now_us() + t->poll_left_us;
+}
+
+bool wait_timeout_prepare(wait_timeout_t *t, wait_queue_t *wq)
+{
+    if (!t->sleep)
+        return t->forever || t->poll_left_us;
+
+    if (!t->forever && timer_now_us() >= t->deadline)
+        return false;
+
+    wait_prepare(wq);
+    return true;
+}
+
+void wait_timeout_sleep(wait_timeout_t *t)
+{
+    if (!t->sleep) {
+        uint64_t us = WAIT_POLL_US;
+        if (!t->forever && us > t->poll_left_us)
+            us = t->poll_left_us;
+        timer_delay_us((uint32_t)us);
+        if (!t->forever)
+            t->poll_left_us -= us;
+        return;
+    }
+
+    proc_set_timeout(t->deadline);
+    proc_yield();
+    proc_set_timeout(0);
+    wait_finish();
+}
+
+void wait_timeout_cancel(wait_timeout_t *t)
+{
+    if (t->sleep)
+        wait_finish();
+}
+
+uint64_t schedule_timeout(uint64_t us)
+{
+    // Spin in steps timer_delay_us() can take
+    if (!proc_can_sleep()) {
+        while (us) {
+            uint32_t step = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+            timer_delay_us(step);
+            us -= step;
+        }
+        return 0;
+    }
+
+    uint64_t deadline = timer_now_us() + us;
+    int pid = proc_get_current_pid();
+
+    proc_set_timeout(deadline);
+    proc_block(pid);
+    proc_yield();
+    proc_set_timeout(0);
+
+    uint64_t now = timer_now_us();
+    return deadline > now ? deadline - now : 0;
+}
+
+void msleep(uint32_t ms)
+{
+    timer_sleep_ms(ms);
+}
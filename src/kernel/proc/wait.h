@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/spinlock.h>
+
+// How often a waiter that cannot sleep rechecks its condition
+#define WAIT_POLL_US 100
+
+struct wait_queue;
+
+// A process's place in a wait queue. Each process has exactly one, in its
+// PCB, so a process killed while waiting is taken off the queue with it
+typedef struct wait_entry {
+    struct wait_queue *queue;   // NULL while not queued
+    struct wait_entry *next, *prev;
+    int                pid;
+} wait_entry_t;
+
+// Processes sleeping until some condition holds, woken in FIFO order.
+// All-zero is a valid empty queue, so one embedded in a zeroed struct
+// needs no wait_queue_init()
+typedef struct wait_queue {
+    spinlock_t    lock;
+    wait_entry_t *head, *tail;
+    bool          interactive;  // Waiters wait on the user; see proc_unblock_interactive
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { { 0 }, NULL, NULL, false }
+
+void wait_queue_init(wait_queue_t *wq);
+
+// Wake the longest waiter, or all of them. Safe from interrupt handlers
+void wake_up(wait_queue_t *wq);
+void wake_up_all(wait_queue_t *wq);
+
+bool wait_queue_active(wait_queue_t *wq);
+
+// Take a queued process off whatever queue it is on
+void wait_entry_cancel(wait_entry_t *entry);
+
+// State of one wait_event_timeout(). Where the caller cannot sleep
+// (before scheduling starts, or in an idle process) it polls instead,
+// every WAIT_POLL_US
+typedef struct {
+    uint64_t deadline;      // timer_now_us() time to give up at; 0 waits forever
+    uint64_t poll_left_us;
+    bool     forever;
+    bool     sleep;
+} wait_timeout_t;
+
+void wait_timeout_start(wait_timeout_t *t, uint32_t timeout_ms);
+bool wait_timeout_prepare(wait_timeout_t *t, wait_queue_t *wq);
+void wait_timeout_sleep(wait_timeout_t *t);
+void wait_timeout_cancel(wait_timeout_t *t);
+
+// Sleep on wq until cond is true or timeout_ms (0 for no limit) pass;
+// evaluates to the last value of cond. The waiter is queued before cond
+// is checked the last time, so a wake_up() after the condition changed
+// cannot be lost. cond is evaluated with the kernel lock held
+#define wait_event_timeout(wq, cond, timeout_ms)                            \
+    ({                                                                      \
+        wait_timeout_t __wt;                                                \
+        bool __done;                                                        \
+        wait_timeout_start(&__wt, (timeout_ms));                            \
+        while (!(__done = (cond)) && wait_timeout_prepare(&__wt, (wq))) {   \
+            if ((__done = (cond))) {                                        \
+                wait_timeout_cancel(&__wt);                                 \
+                break;                                                      \
+            }                                                               \
+            wait_timeout_sleep(&__wt);                                      \
+        }                                                                   \
+        __done;                                                             \
+    })
+
+#define wait_event(wq, cond) ((void)wait_event_timeout((wq), (cond), 0))
+
+// Block the caller for up to `us`, or less if something wakes it; returns
+// the time left. Spins for the whole time where the caller cannot block
+uint64_t schedule_timeout(uint64_t us);
+
+// Block the caller for at least `ms`
+void msleep(uint32_t ms);
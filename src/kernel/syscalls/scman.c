@@ -35,6 +35,7 @@ void register_syscalls(void)
     x86_64_Syscall_RegisterHandler(19,  (SyscallHandler)sys_readv);
     x86_64_Syscall_RegisterHandler(20,  (SyscallHandler)sys_writev);
     x86_64_Syscall_RegisterHandler(21,  (SyscallHandler)sys_access);
+    x86_64_Syscall_RegisterHandler(26,  (SyscallHandler)sys_msync);
     x86_64_Syscall_RegisterHandler(32,  (SyscallHandler)sys_dup);
     x86_64_Syscall_RegisterHandler(33,  (SyscallHandler)sys_dup2);
     x86_64_Syscall_RegisterHandler(72,  (SyscallHandler)sys_fcntl);
@@ -49,7 +50,9 @@ void register_syscalls(void)
     x86_64_Syscall_RegisterHandler(217, (SyscallHandler)sys_getdents64);
 
     x86_64_Syscall_RegisterHandler(24,  (SyscallHandler)proc_yield);
-    x86_64_Syscall_RegisterHandler(35,  (SyscallHandler)proc_brk);
+    x86_64_Syscall_RegisterHandler(35,  (SyscallHandler)sys_nanosleep);
+    x86_64_Syscall_RegisterHandler(228, (SyscallHandler)sys_clock_gettime);
+    x86_64_Syscall_RegisterHandler(230, (SyscallHandler)sys_clock_nanosleep);
 
     x86_64_Syscall_RegisterHandler(41,  (SyscallHandler)sys_socket);
     x86_64_Syscall_RegisterHandler(42,  (SyscallHandler)connect);
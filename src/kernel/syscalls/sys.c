@@ -5,11 +5,15 @@
 #include <user/user.h>
 #include <string.h>
 #include <heap.h>
+#include <mem/slab.h>
+#include <mem/pmm.h>
 #include <memory.h>
 #include <debug.h>
 #include <errno/errno.h>
 #include <arch/x86_64/io.h>
 #include <console/console.h>
+#include <proc/wait.h>
+#include <timer/timer.h>
 #include <hal/vfs.h>
 
 #define TCGETS 0x5401
@@ -21,6 +25,18 @@
 #define O_TRUNC   512
 #define O_APPEND  1024
 
+#define PROT_WRITE     0x2
+#define PROT_MASK      0x7
+
+#define MAP_SHARED     0x01
+#define MAP_PRIVATE    0x02
+#define MAP_FIXED      0x10
+#define MAP_ANONYMOUS  0x20
+
+#define MS_ASYNC       0x1
+#define MS_INVALIDATE  0x2
+#define MS_SYNC        0x4
+
 #define ARCH_SET_GS  0x1001
 #define ARCH_SET_FS  0x1002
 #define ARCH_GET_FS  0x1003
@@ -29,6 +45,14 @@
 #define MSR_FS_BASE  0xC0000100
 #define MSR_GS_BASE  0xC0000101
 
+// There is no RTC yet, so both clocks count from boot
+#define CLOCK_REALTIME   0
+#define CLOCK_MONOTONIC  1
+
+#define TIMER_ABSTIME  1
+
+#define NSEC_PER_SEC  1000000000LL
+
 extern ext2_fs_t *rootfs;
 
 struct kernel_stat {
@@ -61,11 +85,59 @@ struct kernel_utsname {
     char domainname[65];
 };
 
+struct kernel_timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
 struct iovec {
     void   *iov_base;
     size_t  iov_len;
 };
 
+// Small iovec arrays and page-sized bounce buffers are the common writev
+// case; serve them from a slab cache and straight from the PMM instead of
+// the general heap
+#define UIO_FASTIOV 8
+
+static kmem_cache_t *iov_cache = NULL;
+
+static void *iov_alloc(size_t bytes)
+{
+    if (bytes <= UIO_FASTIOV * sizeof(struct iovec)) {
+        if (!iov_cache)
+            iov_cache = kmem_cache_create("iovec", UIO_FASTIOV * sizeof(struct iovec), 0, NULL);
+        return kmem_cache_alloc(iov_cache);
+    }
+    return kmalloc(bytes);
+}
+
+static void iov_free(void *p, size_t bytes)
+{
+    if (bytes <= UIO_FASTIOV * sizeof(struct iovec))
+        kmem_cache_free(iov_cache, p);
+    else
+        kfree(p);
+}
+
+// The buffer is filled from user memory before use, so it is not zeroed
+static void *iobuf_alloc(size_t bytes)
+{
+    if (bytes <= PAGE_SIZE) {
+        void *page = pmm_alloc_nozero();
+        return page ? kmap_phys(page) : NULL;
+    }
+    return kmalloc(bytes);
+}
+
+static void iobuf_free(void *p, size_t bytes)
+{
+    if (bytes <= PAGE_SIZE)
+        pmm_free((void *)virt_to_phys(p));
+    else
+        kfree(p);
+}
+
 static void wrmsr(uint32_t msr, uint64_t val)
 {
     uint32_t lo = (uint32_t)(val & 0xFFFFFFFF);
@@ -290,6 +362,83 @@ uint64_t sys_uname(uint64_t buf_ptr)
     return 0;
 }
 
+// Check a user timespec and convert it to microseconds, rounding up so a
+// sleep is never shorter than asked. Returns false if it is malformed
+static bool timespec_to_us(const struct kernel_timespec *ts, uint64_t *us)
+{
+    if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= NSEC_PER_SEC)
+        return false;
+
+    // Anything past a few hundred thousand years is forever anyway
+    uint64_t sec = (uint64_t)ts->tv_sec;
+    if (sec > UINT64_MAX / 2000000)
+        sec = UINT64_MAX / 2000000;
+
+    *us = sec * 1000000 + ((uint64_t)ts->tv_nsec + 999) / 1000;
+    return true;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    uint64_t now;
+    while ((now = timer_now_us()) < deadline)
+        schedule_timeout(deadline - now);
+}
+
+uint64_t sys_nanosleep(uint64_t req_ptr, uint64_t rem_ptr)
+{
+    if (!req_ptr)
+        return serror(EFAULT);
+
+    uint64_t us;
+    if (!timespec_to_us((const struct kernel_timespec *)req_ptr, &us))
+        return serror(EINVAL);
+
+    sleep_until(timer_now_us() + us);
+
+    // Nothing interrupts a sleep yet, so none of it is ever left over
+    if (rem_ptr)
+        memset((void *)rem_ptr, 0, sizeof(struct kernel_timespec));
+    return 0;
+}
+
+uint64_t sys_clock_nanosleep(uint64_t clockid, uint64_t flags,
+                             uint64_t req_ptr, uint64_t rem_ptr)
+{
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)
+        return serror(EINVAL);
+    if (!req_ptr)
+        return serror(EFAULT);
+
+    uint64_t us;
+    if (!timespec_to_us((const struct kernel_timespec *)req_ptr, &us))
+        return serror(EINVAL);
+
+    if (flags & TIMER_ABSTIME) {
+        sleep_until(us);
+        return 0;
+    }
+
+    sleep_until(timer_now_us() + us);
+    if (rem_ptr)
+        memset((void *)rem_ptr, 0, sizeof(struct kernel_timespec));
+    return 0;
+}
+
+uint64_t sys_clock_gettime(uint64_t clockid, uint64_t tp_ptr)
+{
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)
+        return serror(EINVAL);
+    if (!tp_ptr)
+        return serror(EFAULT);
+
+    uint64_t now = timer_now_us();
+    struct kernel_timespec *tp = (struct kernel_timespec *)tp_ptr;
+    tp->tv_sec  = (int64_t)(now / 1000000);
+    tp->tv_nsec = (int64_t)(now % 1000000) * 1000;
+    return 0;
+}
+
 uint64_t sys_authu(uint64_t username, uint64_t password)
 {
     if (!username || !password)
@@ -608,12 +757,12 @@ uint64_t sys_writev(uint64_t fd, uint64_t iov_ptr, uint64_t iovcnt)
 
     int pid = proc_get_current_pid();
     size_t iov_bytes = iovcnt * sizeof(struct iovec);
-    struct iovec *kiov = (struct iovec *)kmalloc(iov_bytes);
+    struct iovec *kiov = (struct iovec *)iov_alloc(iov_bytes);
     if (!kiov)
         return serror(ENOMEM);
 
     if (!proc_read_from_user(pid, kiov, (const void *)iov_ptr, iov_bytes)) {
-        kfree(kiov);
+        iov_free(kiov, iov_bytes);
         return serror(EFAULT);
     }
 
@@ -624,34 +773,34 @@ uint64_t sys_writev(uint64_t fd, uint64_t iov_ptr, uint64_t iovcnt)
             continue;
 
         if (kiov[i].iov_len > 0x100000) {
-            kfree(kiov);
+            iov_free(kiov, iov_bytes);
             return total > 0 ? total : serror(EINVAL);
         }
 
-        uint8_t *kbuf = (uint8_t *)kmalloc(kiov[i].iov_len);
+        uint8_t *kbuf = (uint8_t *)iobuf_alloc(kiov[i].iov_len);
         if (!kbuf) {
-            kfree(kiov);
+            iov_free(kiov, iov_bytes);
             return total > 0 ? total : serror(ENOMEM);
         }
 
         if (!proc_read_from_user(pid, kbuf, kiov[i].iov_base, kiov[i].iov_len)) {
-            kfree(kbuf);
-            kfree(kiov);
+            iobuf_free(kbuf, kiov[i].iov_len);
+            iov_free(kiov, iov_bytes);
             return total > 0 ? total : serror(EFAULT);
         }
 
         int r = VFS_Write((int)fd, kiov[i].iov_len, kbuf, false);
 
-        kfree(kbuf);
+        iobuf_free(kbuf, kiov[i].iov_len);
 
         if (r < 0) {
-            kfree(kiov);
+            iov_free(kiov, iov_bytes);
             return total > 0 ? total : serror(EIO);
         }
         total += (uint64_t)r;
     }
 
-    kfree(kiov);
+    iov_free(kiov, iov_bytes);
     return total;
 }
 
@@ -672,32 +821,74 @@ uint64_t sys_fcntl(uint64_t fd, uint64_t cmd, uint64_t arg)
 uint64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot,
                   uint64_t flags, uint64_t fd, uint64_t offset)
 {
-    (void)addr; (void)prot; (void)flags; (void)fd; (void)offset;
+    if (length == 0 || (prot & ~(uint64_t)PROT_MASK))
+        return serror(EINVAL);
 
-    if (length == 0)
+    uint64_t type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (type != MAP_SHARED && type != MAP_PRIVATE)
         return serror(EINVAL);
 
-    uint64_t result = proc_brk(0);
-    if (result == (uint64_t)-1)
-        return serror(ENOMEM);
+    if ((flags & MAP_FIXED) && (addr & 4095))
+        return serror(EINVAL);
 
-    uint64_t aligned = (length + 4095) & ~(uint64_t)4095;
-    uint64_t new_brk = proc_sbrk((int64_t)aligned);
-    if (new_brk == (uint64_t)-1)
+    ext2_fs_t *fs    = NULL;
+    uint32_t   inode = 0;
+
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (offset & 4095)
+            return serror(EINVAL);
+
+        bool shared_write = type == MAP_SHARED && (prot & PROT_WRITE);
+        int err = VFS_Mmap((int)fd, shared_write, &fs, &inode, false);
+        if (err < 0)
+            return (uint64_t)(int64_t)err;
+    } else {
+        offset = 0;
+    }
+
+    uint32_t pflags = 0;
+    if (flags & MAP_FIXED)
+        pflags |= PROC_MAP_FIXED;
+    if (type == MAP_SHARED)
+        pflags |= PROC_MAP_SHARED;
+
+    uint64_t result = proc_mmap(addr, length, (uint32_t)prot, pflags, fs, inode, offset);
+    if (result == (uint64_t)-1)
         return serror(ENOMEM);
 
-    return new_brk;
+    return result;
 }
 
 uint64_t sys_munmap(uint64_t addr, uint64_t length)
 {
-    (void)addr; (void)length;
+    if (length == 0 || (addr & 4095))
+        return serror(EINVAL);
+
+    if (proc_munmap(addr, length) < 0)
+        return serror(EINVAL);
     return 0;
 }
 
 uint64_t sys_mprotect(uint64_t addr, uint64_t length, uint64_t prot)
 {
-    (void)addr; (void)length; (void)prot;
+    if ((addr & 4095) || (prot & ~(uint64_t)PROT_MASK))
+        return serror(EINVAL);
+
+    if (proc_mprotect(addr, length, (uint32_t)prot) < 0)
+        return serror(ENOMEM);
+    return 0;
+}
+
+uint64_t sys_msync(uint64_t addr, uint64_t length, uint64_t flags)
+{
+    if ((addr & 4095) || (flags & ~(uint64_t)(MS_ASYNC | MS_INVALIDATE | MS_SYNC)))
+        return serror(EINVAL);
+
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC))
+        return serror(EINVAL);
+
+    if (proc_msync(addr, length) < 0)
+        return serror(ENOMEM);
     return 0;
 }
 
@@ -29,6 +29,10 @@ uint64_t sys_kill(uint64_t pid, uint64_t sig);
 uint64_t sys_tgkill(uint64_t tgid, uint64_t tid, uint64_t sig);
 
 uint64_t sys_uname(uint64_t buf_ptr);
+uint64_t sys_nanosleep(uint64_t req_ptr, uint64_t rem_ptr);
+uint64_t sys_clock_nanosleep(uint64_t clockid, uint64_t flags,
+                             uint64_t req_ptr, uint64_t rem_ptr);
+uint64_t sys_clock_gettime(uint64_t clockid, uint64_t tp_ptr);
 uint64_t sys_getcwd(uint64_t buf_ptr, uint64_t size);
 uint64_t sys_chdir(uint64_t path_ptr);
 
@@ -58,6 +62,7 @@ uint64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot,
                   uint64_t flags, uint64_t fd, uint64_t offset);
 uint64_t sys_munmap(uint64_t addr, uint64_t length);
 uint64_t sys_mprotect(uint64_t addr, uint64_t length, uint64_t prot);
+uint64_t sys_msync(uint64_t addr, uint64_t length, uint64_t flags);
 
 uint64_t sys_authu(uint64_t username, uint64_t password);
 uint64_t sys_write(uint64_t fd, uint64_t buf, uint64_t count,
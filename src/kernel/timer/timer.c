@@ -1,23 +1,59 @@
+#include "timer.h"
+#include "timer_wheel.h"
 #include <stdint.h>
 #include <arch/x86_64/irq.h>
 #include <arch/x86_64/io.h>
+#include <arch/x86_64/cpu.h>
 #include <debug.h>
 #include <proc/proc.h>
+#include <proc/wait.h>
 #include <drivers/disk/floppy.h>
 #include <drivers/driverman.h>
 #include <drivers/apic/lapic.h>
 
 #define PIT_FREQUENCY    1193182
-#define TARGET_FREQUENCY 100
 #define LAPIC_TIMER_VECTOR 0xEF
 
-volatile uint32_t g_pit_ticks = 0;
+// Length of the PIT window the TSC is measured over
+#define TSC_CALIB_MS 50
 
+static uint64_t tsc_base   = 0;
+static uint64_t tsc_per_ms = 0;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// One-shot expiry, programmed for whatever comes first of the running
+// timeslice's end and the earliest timer on the wheel
 void timer_irq_handler(Registers* regs) {
-    g_pit_ticks++;
+    cpu_self()->timer_deadline = 0;
 
-    proc_update_time(1);
+    timer_wheel_run(timer_now_us());
     proc_schedule_interrupt(regs);
+
+    // Nothing scheduled yet on this CPU; keep the wheel going anyway
+    if (!cpu_self()->timer_deadline) {
+        uint64_t next = timer_wheel_next();
+        if (next)
+            timer_arm(next);
+    }
+}
+
+void timer_arm(uint64_t deadline_us) {
+    cpu_self()->timer_deadline = deadline_us;
+    if (deadline_us)
+        lapic_timer_arm(deadline_us);
+    else
+        lapic_timer_disarm();
+}
+
+void timer_arm_before(uint64_t deadline_us) {
+    uint64_t armed = cpu_self()->timer_deadline;
+    if (!armed || deadline_us < armed)
+        timer_arm(deadline_us);
 }
 
 void timer_init() {
@@ -31,17 +67,46 @@ void timer_init() {
     //x86_64_IRQ_Unmask(207);
 
     x86_64_IRQ_RegisterVector(LAPIC_TIMER_VECTOR, timer_irq_handler);
-    
-    log_ok("TIMER", "PIT initialized at %d Hz", TARGET_FREQUENCY);
+
+    // The clock runs off the TSC, measured against the PIT once here
+    uint64_t start = rdtsc();
+    timer_delay_us(TSC_CALIB_MS * 1000);
+    tsc_per_ms = (rdtsc() - start) / TSC_CALIB_MS;
+    tsc_base   = rdtsc();
+
+    log_ok("TIMER", "TSC clock at %llu kHz", tsc_per_ms);
 }
 
-uint32_t timer_get_ticks() 
+uint64_t timer_now_us(void)
 {
-    return g_pit_ticks;
+    if (!tsc_per_ms)
+        return 0;
+    uint64_t delta = rdtsc() - tsc_base;
+    // Split so the multiplication cannot overflow
+    return delta / tsc_per_ms * 1000 + delta % tsc_per_ms * 1000 / tsc_per_ms;
 }
 
-void timer_sleep_us(uint32_t us) {
+uint64_t timer_now_ms(void)
+{
+    return timer_now_us() / 1000;
+}
+
+uint64_t timer_us_to_tsc(uint64_t us)
+{
+    return tsc_base + us / 1000 * tsc_per_ms + us % 1000 * tsc_per_ms / 1000;
+}
+
+void timer_delay_us(uint32_t us) {
     if (!us) return;
+
+    if (tsc_per_ms) {
+        uint64_t end = rdtsc() + (uint64_t)us * tsc_per_ms / 1000;
+        while (rdtsc() < end)
+            __asm__ volatile("pause" ::: "memory");
+        return;
+    }
+
+    // Not calibrated yet: count down PIT channel 2
     while (us > 0) {
         uint32_t chunk = (us > 54000) ? 54000 : us;
         uint32_t ticks = (uint32_t)((uint64_t)chunk * PIT_FREQUENCY / 1000000UL);
@@ -62,10 +127,23 @@ void timer_sleep_us(uint32_t us) {
     }
 }
 
+void timer_sleep_us(uint32_t us) {
+    if (us < TIMER_SLEEP_MIN_US || !proc_can_sleep()) {
+        timer_delay_us(us);
+        return;
+    }
+
+    uint64_t end = timer_now_us() + us;
+    uint64_t now;
+    while ((now = timer_now_us()) < end)
+        schedule_timeout(end - now);
+}
+
 void timer_sleep_ms(uint32_t ms) {
     timer_sleep_us(ms * 1000);
 }
 
 void timer_sleep_s(uint32_t s) {
-    timer_sleep_us(s * 1000000);
+    while (s--)
+        timer_sleep_ms(1000);
 }
\ No newline at end of file
@@ -4,12 +4,31 @@
 
 #include <stdint.h>
 
-extern volatile uint32_t g_pit_ticks;
-
 void timer_init();
 void timer_irq_handler(Registers* regs);
-uint32_t timer_get_ticks();
 
+// Monotonic clock since timer_init(), kept by the TSC. There is no
+// periodic tick: each CPU's LAPIC timer is one-shot and only programmed
+// when something is due
+uint64_t timer_now_us(void);
+uint64_t timer_now_ms(void);
+
+// TSC value at which the clock reads `us`, for TSC-deadline mode
+uint64_t timer_us_to_tsc(uint64_t us);
+
+// Set this CPU's one-shot timer; 0 disarms it. timer_arm_before() only
+// moves it earlier
+void timer_arm(uint64_t deadline_us);
+void timer_arm_before(uint64_t deadline_us);
+
+// Shorter sleeps spin, as blocking would cost more than it saves
+#define TIMER_SLEEP_MIN_US 200
+
+// Spin for `us`
+void timer_delay_us(uint32_t us);
+
+// Block the caller for at least the given time, or spin where it
+// cannot block (before scheduling starts, in an idle process)
 void timer_sleep_us(uint32_t us);
 void timer_sleep_ms(uint32_t ms);
 void timer_sleep_s(uint32_t s);
@@ -0,0 +1,167 @@
+#include "timer_wheel.h"
+#include "timer.h"
+#include <util/spinlock.h>
+#include <stddef.h>
+
+#define TW_MASK (TW_SIZE - 1)
+
+static ktimer_t  *wheel[TW_LEVELS * TW_SIZE];
+static uint64_t   wheel_pending[TW_LEVELS];   // Bit per non-empty slot
+static uint64_t   wheel_clk = 0;              // Next granule to process
+static spinlock_t wheel_lock = { 0 };
+
+static inline unsigned level_shift(int level)
+{
+    return TW_BITS * level;
+}
+
+static void wheel_link(ktimer_t *t)
+{
+    uint64_t g = (t->expires + TW_GRAN_US - 1) / TW_GRAN_US;
+    if (g < wheel_clk)
+        g = wheel_clk;
+
+    // Lowest level where the expiry is less than a full turn ahead
+    int level = 0;
+    while (level < TW_LEVELS - 1 &&
+           (g >> level_shift(level)) - (wheel_clk >> level_shift(level)) >= TW_SIZE)
+        level++;
+
+    // Beyond the top level: wait in its farthest slot and get placed
+    // again from there
+    unsigned shift = level_shift(level);
+    if ((g >> shift) - (wheel_clk >> shift) >= TW_SIZE)
+        g = ((wheel_clk >> shift) + TW_SIZE - 1) << shift;
+
+    uint16_t slot = (uint16_t)(level * TW_SIZE + ((g >> shift) & TW_MASK));
+    t->slot    = slot;
+    t->pending = true;
+    t->prev    = NULL;
+    t->next    = wheel[slot];
+    if (t->next)
+        t->next->prev = t;
+    wheel[slot] = t;
+    wheel_pending[level] |= 1ULL << (slot & TW_MASK);
+}
+
+static void wheel_unlink(ktimer_t *t)
+{
+    if (t->prev) t->prev->next = t->next;
+    else         wheel[t->slot] = t->next;
+    if (t->next) t->next->prev = t->prev;
+
+    if (!wheel[t->slot])
+        wheel_pending[t->slot / TW_SIZE] &= ~(1ULL << (t->slot & TW_MASK));
+
+    t->next = t->prev = NULL;
+    t->pending = false;
+}
+
+// Granule of the first non-empty slot at any level, UINT64_MAX if none
+static uint64_t wheel_next_granule(void)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int level = 0; level < TW_LEVELS; level++) {
+        uint64_t mask = wheel_pending[level];
+        if (!mask)
+            continue;
+
+        unsigned shift = level_shift(level);
+        uint64_t pos   = wheel_clk >> shift;
+        unsigned rot   = pos & TW_MASK;
+        if (rot)
+            mask = (mask >> rot) | (mask << (TW_SIZE - rot));
+
+        uint64_t start = (pos + __builtin_ctzll(mask)) << shift;
+        if (start < wheel_clk)
+            start = wheel_clk;
+        if (start < best)
+            best = start;
+    }
+    return best;
+}
+
+void ktimer_init(ktimer_t *t, void (*fn)(void *arg), void *arg)
+{
+    t->fn      = fn;
+    t->arg     = arg;
+    t->next    = t->prev = NULL;
+    t->slot    = 0;
+    t->pending = false;
+}
+
+void ktimer_add(ktimer_t *t, uint64_t expires_us)
+{
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    if (t->pending)
+        wheel_unlink(t);
+    t->expires = expires_us;
+    wheel_link(t);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+
+    timer_arm_before(expires_us);
+}
+
+void ktimer_cancel(ktimer_t *t)
+{
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    if (t->pending)
+        wheel_unlink(t);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+void timer_wheel_run(uint64_t now_us)
+{
+    uint64_t now   = now_us / TW_GRAN_US;
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+
+    while (wheel_clk <= now) {
+        // Skip straight over empty stretches, as after a long idle
+        uint64_t next = wheel_next_granule();
+        if (next > now) {
+            wheel_clk = now + 1;
+            break;
+        }
+        wheel_clk = next;
+
+        // Move the higher-level slots starting here down, top first
+        for (int level = TW_LEVELS - 1; level > 0; level--) {
+            unsigned shift = level_shift(level);
+            if (wheel_clk & ((1ULL << shift) - 1))
+                continue;
+
+            ktimer_t **head = &wheel[level * TW_SIZE + ((wheel_clk >> shift) & TW_MASK)];
+            ktimer_t *t;
+            while ((t = *head)) {
+                wheel_unlink(t);
+                wheel_link(t);
+            }
+        }
+
+        // Timers added by a callback for now land here too
+        ktimer_t **head = &wheel[wheel_clk & TW_MASK];
+        ktimer_t *t;
+        while ((t = *head)) {
+            wheel_unlink(t);
+            spin_unlock_irqrestore(&wheel_lock, flags);
+            t->fn(t->arg);
+            flags = spin_lock_irqsave(&wheel_lock);
+        }
+
+        wheel_clk++;
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+uint64_t timer_wheel_next(void)
+{
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    uint64_t next  = wheel_next_granule();
+    spin_unlock_irqrestore(&wheel_lock, flags);
+
+    if (next == UINT64_MAX)
+        return 0;
+    return next ? next * TW_GRAN_US : 1;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Hierarchical timer wheel. Level 0 has TW_SIZE slots of TW_GRAN_US
+// each, and every level above has slots TW_SIZE times as wide. A timer
+// sits in the lowest level that reaches its expiry and moves down as
+// that expiry comes near, so adding, cancelling and expiring are all
+// constant time whatever the number of timers
+#define TW_GRAN_US  100
+#define TW_BITS     6
+#define TW_SIZE     (1 << TW_BITS)
+#define TW_LEVELS   5
+
+typedef struct ktimer {
+    uint64_t        expires;    // timer_now_us() time
+    void          (*fn)(void *arg);
+    void           *arg;
+    struct ktimer  *next, *prev;
+    uint16_t        slot;
+    bool            pending;
+} ktimer_t;
+
+// fn runs from the timer interrupt, with the kernel lock held, some time
+// after expires has passed
+void ktimer_init(ktimer_t *t, void (*fn)(void *arg), void *arg);
+
+// Arm or re-arm a timer
+void ktimer_add(ktimer_t *t, uint64_t expires_us);
+void ktimer_cancel(ktimer_t *t);
+
+static inline bool ktimer_pending(const ktimer_t *t) { return t->pending; }
+
+// Run the timers that are due by `now_us`
+void timer_wheel_run(uint64_t now_us);
+
+// Earliest time timer_wheel_run() has work, 0 when no timer is pending.
+// This can be a little before a timer expires, when a higher level has
+// to be moved down
+uint64_t timer_wheel_next(void);
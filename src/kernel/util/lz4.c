@@ -0,0 +1,165 @@
+#include "lz4.h"
+#include <memory.h>
+#include <stdbool.h>
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5       // The block always ends in literals
+#define LZ4_MFLIMIT         12      // No match may start closer to the end
+#define LZ4_MAX_OFFSET      65535
+#define LZ4_RUN_MASK        15
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Bytes a length field takes beyond the token nibble
+static inline size_t length_bytes(size_t len) {
+    return len >= LZ4_RUN_MASK ? (len - LZ4_RUN_MASK) / 255 + 1 : 0;
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    if (len < LZ4_RUN_MASK)
+        return op;
+    len -= LZ4_RUN_MASK;
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emit one sequence: literals [anchor, anchor + lit), then a match of
+// match_len bytes at `offset` back (match_len 0 for the final literals)
+static uint8_t* put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* anchor,
+                             size_t lit, size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+    size_t need = 1 + length_bytes(lit) + lit + (match_len ? 2 + length_bytes(ml) : 0);
+    if ((size_t)(oend - op) < need)
+        return NULL;
+
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit < LZ4_RUN_MASK ? lit : LZ4_RUN_MASK) << 4);
+    op = put_length(op, lit);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (match_len) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        *token |= (uint8_t)(ml < LZ4_RUN_MASK ? ml : LZ4_RUN_MASK);
+        op = put_length(op, ml);
+    }
+    return op;
+}
+
+size_t lz4_compress(const void* src, size_t src_len, void* dst, size_t dst_cap,
+                    uint16_t* table) {
+    if (src_len > LZ4_MAX_INPUT)
+        return 0;
+
+    const uint8_t* base   = (const uint8_t*)src;
+    const uint8_t* ip     = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end    = base + src_len;
+    uint8_t*       op     = (uint8_t*)dst;
+    uint8_t*       oend   = op + dst_cap;
+
+    memset(table, 0, LZ4_TABLE_SIZE);
+
+    if (src_len > LZ4_MFLIMIT) {
+        const uint8_t* mflimit    = end - LZ4_MFLIMIT;
+        const uint8_t* matchlimit = end - LZ4_LAST_LITERALS;
+
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            size_t len = LZ4_MIN_MATCH;
+            while (ip + len < matchlimit && ref[len] == ip[len])
+                len++;
+
+            op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), len);
+            if (!op)
+                return 0;
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    if (!op)
+        return 0;
+    return (size_t)(op - (uint8_t*)dst);
+}
+
+// Read a length continuation; false if the input runs out
+static bool get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+int lz4_decompress(const void* src, size_t src_len, void* dst, size_t dst_cap) {
+    const uint8_t* ip   = (const uint8_t*)src;
+    const uint8_t* iend = ip + src_len;
+    uint8_t*       op   = (uint8_t*)dst;
+    uint8_t*       oend = op + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == LZ4_RUN_MASK && !get_length(&ip, iend, &lit))
+            return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst))
+            return -1;
+
+        size_t len = token & LZ4_RUN_MASK;
+        if (len == LZ4_RUN_MASK && !get_length(&ip, iend, &len))
+            return -1;
+        len += LZ4_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+
+        // Byte by byte: the match may overlap what it produces
+        const uint8_t* ref = op - offset;
+        while (len--)
+            *op++ = *ref++;
+    }
+
+    return (int)(op - (uint8_t*)dst);
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// LZ4 block format (no frame header), for inputs up to 64KB
+
+#define LZ4_MAX_INPUT   65536
+#define LZ4_HASH_BITS   12
+
+// Scratch table lz4_compress() needs, in bytes
+#define LZ4_TABLE_SIZE  (sizeof(uint16_t) << LZ4_HASH_BITS)
+
+// Worst case output size for an incompressible input
+#define LZ4_BOUND(n)    ((n) + (n) / 255 + 16)
+
+// Compress src into dst; returns the compressed size, or 0 if it does not
+// fit in dst_cap bytes. `table` must hold LZ4_TABLE_SIZE bytes
+size_t lz4_compress(const void* src, size_t src_len, void* dst, size_t dst_cap,
+                    uint16_t* table);
+
+// Decompress into dst; returns the decompressed size, or -1 when the
+// input is malformed or would overrun dst_cap
+int lz4_decompress(const void* src, size_t src_len, void* dst, size_t dst_cap);
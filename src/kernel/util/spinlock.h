@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+#include <arch/x86_64/cpu.h>
 
 typedef struct {
     volatile uint32_t lock;
@@ -21,4 +23,45 @@ static inline void spin_lock(spinlock_t *l) {
 
 static inline void spin_unlock(spinlock_t *l) {
     __atomic_store_n(&l->lock, 0, __ATOMIC_RELEASE);
-}
\ No newline at end of file
+}
+
+static inline bool irqs_enabled(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0" : "=r"(flags));
+    return flags & 0x200;
+}
+
+// Interrupt-safe variants: disable IF while the lock is held so an interrupt
+// (or a preemption from the timer) can never spin on a lock its own CPU owns.
+// They also count the locks this CPU holds, as syscalls run with IF clear
+// whether or not a lock is held and proc_can_sleep() needs to know
+static inline uint64_t spin_lock_irqsave(spinlock_t *l) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    spin_lock(l);
+    cpu_self()->lock_depth++;
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint64_t flags) {
+    cpu_self()->lock_depth--;
+    spin_unlock(l);
+    if (flags & 0x200)
+        __asm__ volatile("sti" ::: "memory");
+}
+
+// Take the lock only if it is free. On success interrupts stay disabled
+// until spin_unlock_irqrestore(l, *flags), as with spin_lock_irqsave
+static inline bool spin_trylock_irqsave(spinlock_t *l, uint64_t *flags) {
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(*flags) :: "memory");
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&l->lock, &expected, 1, 0,
+                                    __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        cpu_self()->lock_depth++;
+        return true;
+    }
+    if (*flags & 0x200)
+        __asm__ volatile("sti" ::: "memory");
+    return false;
+}